@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "../../bin/bench"
+  "../../bin/bench.pdb"
+  "CMakeFiles/bench.dir/main.cpp.o"
+  "CMakeFiles/bench.dir/main.cpp.o.d"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/bench.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
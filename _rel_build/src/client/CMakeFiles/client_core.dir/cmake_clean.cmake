@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "../../lib/libclient_core.a"
+  "../../lib/libclient_core.pdb"
+  "CMakeFiles/client_core.dir/client.cpp.o"
+  "CMakeFiles/client_core.dir/client.cpp.o.d"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/client_core.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "../../bin/loadgen"
+  "../../bin/loadgen.pdb"
+  "CMakeFiles/loadgen.dir/main.cpp.o"
+  "CMakeFiles/loadgen.dir/main.cpp.o.d"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/loadgen.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "../../bin/migrate"
+  "../../bin/migrate.pdb"
+  "CMakeFiles/migrate.dir/main.cpp.o"
+  "CMakeFiles/migrate.dir/main.cpp.o.d"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/migrate.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
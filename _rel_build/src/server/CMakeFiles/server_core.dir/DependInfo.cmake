@@ -0,0 +1,31 @@
+
+# Consider dependencies only in project.
+set(CMAKE_DEPENDS_IN_PROJECT_ONLY OFF)
+
+# The set of languages for which implicit dependencies are needed:
+set(CMAKE_DEPENDS_LANGUAGES
+  )
+
+# The set of dependency files which are needed:
+set(CMAKE_DEPENDS_DEPENDENCY_FILES
+  "/root/repo/src/server/chunk_index.cpp" "src/server/CMakeFiles/server_core.dir/chunk_index.cpp.o" "gcc" "src/server/CMakeFiles/server_core.dir/chunk_index.cpp.o.d"
+  "/root/repo/src/server/content_cache.cpp" "src/server/CMakeFiles/server_core.dir/content_cache.cpp.o" "gcc" "src/server/CMakeFiles/server_core.dir/content_cache.cpp.o.d"
+  "/root/repo/src/server/dir_watcher.cpp" "src/server/CMakeFiles/server_core.dir/dir_watcher.cpp.o" "gcc" "src/server/CMakeFiles/server_core.dir/dir_watcher.cpp.o.d"
+  "/root/repo/src/server/file_index.cpp" "src/server/CMakeFiles/server_core.dir/file_index.cpp.o" "gcc" "src/server/CMakeFiles/server_core.dir/file_index.cpp.o.d"
+  "/root/repo/src/server/group_commit.cpp" "src/server/CMakeFiles/server_core.dir/group_commit.cpp.o" "gcc" "src/server/CMakeFiles/server_core.dir/group_commit.cpp.o.d"
+  "/root/repo/src/server/open_file_cache.cpp" "src/server/CMakeFiles/server_core.dir/open_file_cache.cpp.o" "gcc" "src/server/CMakeFiles/server_core.dir/open_file_cache.cpp.o.d"
+  "/root/repo/src/server/pack_store.cpp" "src/server/CMakeFiles/server_core.dir/pack_store.cpp.o" "gcc" "src/server/CMakeFiles/server_core.dir/pack_store.cpp.o.d"
+  "/root/repo/src/server/pending_file.cpp" "src/server/CMakeFiles/server_core.dir/pending_file.cpp.o" "gcc" "src/server/CMakeFiles/server_core.dir/pending_file.cpp.o.d"
+  "/root/repo/src/server/persistent_index.cpp" "src/server/CMakeFiles/server_core.dir/persistent_index.cpp.o" "gcc" "src/server/CMakeFiles/server_core.dir/persistent_index.cpp.o.d"
+  "/root/repo/src/server/read_coalescer.cpp" "src/server/CMakeFiles/server_core.dir/read_coalescer.cpp.o" "gcc" "src/server/CMakeFiles/server_core.dir/read_coalescer.cpp.o.d"
+  "/root/repo/src/server/server.cpp" "src/server/CMakeFiles/server_core.dir/server.cpp.o" "gcc" "src/server/CMakeFiles/server_core.dir/server.cpp.o.d"
+  "/root/repo/src/server/storage_layout.cpp" "src/server/CMakeFiles/server_core.dir/storage_layout.cpp.o" "gcc" "src/server/CMakeFiles/server_core.dir/storage_layout.cpp.o.d"
+  "/root/repo/src/server/stored_frames.cpp" "src/server/CMakeFiles/server_core.dir/stored_frames.cpp.o" "gcc" "src/server/CMakeFiles/server_core.dir/stored_frames.cpp.o.d"
+  )
+
+# Targets to which this target links.
+set(CMAKE_TARGET_LINKED_INFO_FILES
+  )
+
+# Fortran module output directory.
+set(CMAKE_Fortran_TARGET_MODULE_DIR "")
@@ -0,0 +1,35 @@
+file(REMOVE_RECURSE
+  "../../lib/libserver_core.a"
+  "../../lib/libserver_core.pdb"
+  "CMakeFiles/server_core.dir/chunk_index.cpp.o"
+  "CMakeFiles/server_core.dir/chunk_index.cpp.o.d"
+  "CMakeFiles/server_core.dir/content_cache.cpp.o"
+  "CMakeFiles/server_core.dir/content_cache.cpp.o.d"
+  "CMakeFiles/server_core.dir/dir_watcher.cpp.o"
+  "CMakeFiles/server_core.dir/dir_watcher.cpp.o.d"
+  "CMakeFiles/server_core.dir/file_index.cpp.o"
+  "CMakeFiles/server_core.dir/file_index.cpp.o.d"
+  "CMakeFiles/server_core.dir/group_commit.cpp.o"
+  "CMakeFiles/server_core.dir/group_commit.cpp.o.d"
+  "CMakeFiles/server_core.dir/open_file_cache.cpp.o"
+  "CMakeFiles/server_core.dir/open_file_cache.cpp.o.d"
+  "CMakeFiles/server_core.dir/pack_store.cpp.o"
+  "CMakeFiles/server_core.dir/pack_store.cpp.o.d"
+  "CMakeFiles/server_core.dir/pending_file.cpp.o"
+  "CMakeFiles/server_core.dir/pending_file.cpp.o.d"
+  "CMakeFiles/server_core.dir/persistent_index.cpp.o"
+  "CMakeFiles/server_core.dir/persistent_index.cpp.o.d"
+  "CMakeFiles/server_core.dir/read_coalescer.cpp.o"
+  "CMakeFiles/server_core.dir/read_coalescer.cpp.o.d"
+  "CMakeFiles/server_core.dir/server.cpp.o"
+  "CMakeFiles/server_core.dir/server.cpp.o.d"
+  "CMakeFiles/server_core.dir/storage_layout.cpp.o"
+  "CMakeFiles/server_core.dir/storage_layout.cpp.o.d"
+  "CMakeFiles/server_core.dir/stored_frames.cpp.o"
+  "CMakeFiles/server_core.dir/stored_frames.cpp.o.d"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/server_core.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -10,29 +10,60 @@
    ======================================================================== */
 #pragma once
 
+#include <memory>
 #include <string>
+#include <vector>
 #include <boost/asio.hpp>
 #include <boost/filesystem.hpp>
 #include <util/boost_net_interface.hpp>
+#include <util/compression.hpp>
+#include <util/packet.hpp>
 
 class client {
 
 public:
-    client(boost::asio::io_service& service, std::string& host, std::string& storage_path);
+    /**
+     * Connects to the server's control port.
+     *
+     * @param local_address If not empty, the local IPv4 address to connect from and to
+     *                      accept data connections on (e.g. one of 127.0.0.0/8, so that
+     *                      many clients can share a host). Otherwise any address is used.
+     */
+    client(boost::asio::io_service& service, std::string& host, std::string& storage_path,
+           std::string const& local_address = "");
 
     /**
-     * Requests a file with the given name from the server.
+     * Requests a file with the given name, or a range of it, from the server.
      *
      * @param file_name The name of the remote file.
+     * @param offset    Where in the file to start.
+     * @param length    How many bytes to get; get_packet::GET_TO_END for the rest of the file.
+     * @return true if the whole file (or range) was retrieved.
      */
-    void get(std::string& file_name);
+    bool get(std::string& file_name, std::uint64_t offset = 0, std::uint64_t length = get_packet::GET_TO_END);
 
     /**
      * Sends a file with the given path to the server. Note that file paths are relative to storage_path.
      *
      * @param file_path The path to the file to send.
+     * @return true if the whole file was sent.
+     */
+    bool send(std::string& file_path);
+
+    /**
+     * Asks the server for its metrics and prints them.
      */
-    void send(std::string& file_path);
+    void stats();
+
+    /**
+     * Asks the server to compress file contents on data channels from now on,
+     * fetching its shared dictionary for small files if it has one.
+     *
+     * @param c     The codec to use.
+     * @param level Its level, for CODEC_DEFLATE.
+     * @return false if the server refused, in which case contents are sent as they are.
+     */
+    bool compress(codec c, int level);
 
 private:
     // Never thought I'd actually rely on construction order... We need the sockets to be constructed first
@@ -40,7 +71,28 @@ private:
     boost::asio::ip::tcp::socket control_socket_;
     boost_net_interface control_interface_;
     boost::filesystem::path storage_path_;
+    boost::asio::ip::address_v4 local_address_;
+
+    // How file contents are compressed on data channels, as agreed with the server
+    codec compression_;
+    int compression_level_;
+    dictionary_set dictionaries_;
+    std::shared_ptr<dictionary const> dictionary_;
+
+    // Wraps a data channel in compression if it was agreed on; otherwise returns null
+    std::unique_ptr<compressed_net_interface> compress_channel(net_interface& data);
+
+    // Opens an acceptor on the data port; throws on failure. Call this before making a request.
+    void listen_for_data_channel(boost::asio::ip::tcp::acceptor& a);
 
     // Attempts to accept an incoming data port connection on out. Throws on failure.
-    void accept_data_channel_conn(boost::asio::ip::tcp::socket& out);
+    void accept_data_channel_conn(boost::asio::ip::tcp::acceptor& a, boost::asio::ip::tcp::socket& out);
+
+    // Uploads file as the differences from the server's version of it
+    upload_status send_delta(std::string const& name, std::uint64_t size, unsigned char const* hash,
+                             std::ifstream& file);
+
+    // Uploads file as the given chunks, sending only the ones the server asks for
+    bool send_chunks(std::string const& name, std::uint64_t size, unsigned char const* hash, std::ifstream& file,
+                     std::vector<chunk_ref> const& chunks);
 };
@@ -0,0 +1,105 @@
+/* ========================================================================
+   $HEADER FILE
+   $File: chunk_index.h $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/18 $
+   $Description: $
+   $    Where the server already has each content-defined chunk (see
+   $    fastcdc.hpp) of the files that were uploaded in chunks: a stored
+   $    file, which version of it and the offset. Chunks aren't stored
+   $    apart from the files they're in, so this costs no disk space beyond
+   $    the index itself, and a chunk is only usable while its file is
+   $    still the version it was recorded with, which callers check.
+   $    Entries are appended to a log as files are stored; loading the log
+   $    drops the files that have changed since and rewrites it.
+   $Revisions: $
+   ======================================================================== */
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <server/persistent_index.h>
+#include <util/metrics.hpp>
+#include <util/packet.hpp>
+
+class chunk_index {
+public:
+    /**
+     * Where one chunk can be read from.
+     */
+    struct location {
+        std::string name;
+        file_meta meta;             // The version of name that has the chunk
+        std::uint64_t offset;
+    };
+
+    /**
+     * @param path Where the log is kept. Nothing is read or written until load().
+     */
+    explicit chunk_index(std::string const& path);
+
+    ~chunk_index();
+
+    chunk_index(chunk_index& other) = delete;
+
+    /**
+     * Reads the log, keeping the files for which current(name, meta) is true,
+     * and rewrites it with just those.
+     */
+    void load(std::function<bool(std::string const&, file_meta const&)> const& current);
+
+    /**
+     * Finds a file that had the chunk with the given size and hash.
+     *
+     * @return false if there's none.
+     */
+    bool find(chunk_ref const& chunk, location& out) const;
+
+    /**
+     * Records that the stored file name, as of meta, is made of chunks in that order.
+     */
+    void add(std::string const& name, file_meta const& meta, std::vector<chunk_ref> const& chunks);
+
+private:
+    typedef std::array<unsigned char, 32> key;
+
+    // The hash is already uniformly distributed, so any eight bytes of it will do
+    struct key_hash {
+        std::size_t operator()(key const& k) const {
+            std::uint64_t h;
+            std::memcpy(&h, k.data(), sizeof(h));
+            return h;
+        }
+    };
+
+    struct place {
+        std::uint32_t file;         // Into files_
+        std::uint32_t size;
+        std::uint64_t offset;
+    };
+
+    std::string path_;
+    std::FILE* log_;
+
+    mutable std::mutex mutex_;
+    std::vector<std::pair<std::string, file_meta>> files_;
+    std::unordered_map<key, place, key_hash> chunks_;
+
+    gauge& indexed_chunks_;
+
+    // Adds a file's chunks to the maps; a chunk that's already known moves to the newer file
+    void insert(std::string const& name, file_meta const& meta, std::vector<chunk_ref> const& chunks);
+
+    // Appends one file's record to f
+    static bool write_record(std::FILE* f, std::string const& name, file_meta const& meta,
+                             std::vector<chunk_ref> const& chunks);
+};
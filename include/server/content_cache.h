@@ -0,0 +1,111 @@
+/* ========================================================================
+   $HEADER FILE
+   $File: content_cache.h $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/14 $
+   $Description: $
+   $    A bounded in-memory cache of whole file contents, so that GETs of
+   $    the handful of files that get most of the requests are served
+   $    straight from memory. Entries are tied to a version of the file, so
+   $    a changed file is never served stale.
+   $
+   $    Admission and eviction follow W-TinyLFU: new files land in a small
+   $    LRU window, and when one falls out of it, it only displaces files
+   $    in the main cache if a frequency sketch says it's been requested
+   $    more often than they have. A scan of many one-off files therefore
+   $    churns the window but can't flush out the popular ones.
+   $Revisions: $
+   ======================================================================== */
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <server/persistent_index.h>
+#include <util/frequency_sketch.hpp>
+#include <util/metrics.hpp>
+#include <util/open_table.hpp>
+
+class content_cache {
+public:
+    // A file's contents as of one version; it stays valid as long as anyone holds it
+    struct contents {
+        file_meta meta;
+        std::unique_ptr<char[]> data;
+
+        contents(file_meta const& meta) : meta(meta), data(new char[meta.size ? meta.size : 1]) {}
+    };
+
+    typedef std::shared_ptr<contents const> ptr;
+
+    /**
+     * @param capacity  The most file bytes to hold. 0 turns the cache off.
+     * @param max_entry Files bigger than this are never cached.
+     */
+    content_cache(std::uint64_t capacity, std::uint64_t max_entry);
+
+    content_cache(content_cache& other) = delete;
+
+    /**
+     * Returns the cached contents of the given version of name, or null. Either
+     * way, this counts as a request for name when deciding what to keep.
+     */
+    ptr get(std::string const& name, file_meta const& expected);
+
+    /**
+     * Whether a file of this size could be cached at all.
+     */
+    bool cacheable(std::uint64_t size) const { return capacity_ && size <= max_entry_; }
+
+    /**
+     * Offers the contents of a file that missed. They may be turned away if the
+     * cache is full of files that have been more popular.
+     */
+    void put(std::string const& name, ptr const& file);
+
+    /**
+     * Forgets any contents cached for name.
+     */
+    void invalidate(std::string const& name);
+
+private:
+    enum segment { WINDOW, PROBATION, PROTECTED };
+
+    struct node {
+        std::string name;
+        ptr file;
+        segment where;
+    };
+
+    typedef std::list<node> lru;        // Most recently used first
+
+    std::uint64_t capacity_;
+    std::uint64_t max_entry_;
+    std::uint64_t window_capacity_;
+    std::uint64_t protected_capacity_;
+
+    std::mutex mutex_;
+    frequency_sketch sketch_;
+    open_table<std::string, lru::iterator> table_;
+    lru window_;
+    lru probation_;
+    lru protected_;
+    std::uint64_t window_bytes_;
+    std::uint64_t main_bytes_;          // Probation and protected together
+    std::uint64_t protected_bytes_;
+
+    counter& hits_;
+    counter& misses_;
+    counter& admitted_;
+    counter& rejected_;
+    gauge& bytes_;
+    gauge& entries_;
+
+    lru& list_of(segment where);
+    void erase(lru::iterator it);
+    void admit_from_window();
+    void update_gauges();
+};
@@ -0,0 +1,77 @@
+/* ========================================================================
+   $HEADER FILE
+   $File: dir_watcher.h $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/10 $
+   $Description: $
+   $    Watches a directory (and optionally some of its subdirectories) with
+   $    inotify and reports files appearing in and disappearing from it on a
+   $    background thread.
+   $Revisions: $
+   ======================================================================== */
+#pragma once
+
+#include <functional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <server/file_index.h>
+
+class dir_watcher {
+public:
+    // Changes name files by their path relative to the watched directory
+    typedef std::function<void(std::vector<file_index::change> const&)> change_handler;
+    typedef std::function<void()> rescan_handler;
+    typedef std::function<bool(std::string const&)> subdir_filter;
+
+    /**
+     * Starts watching path. Nothing is reported until start() is called, but
+     * events from this point on are queued, so a caller can scan the directory
+     * in between without missing anything.
+     *
+     * @param on_change    Called with each batch of changes, in the order they happened.
+     * @param on_rescan    Called when events were lost (the kernel queue overflowed) and
+     *                     the directory has to be scanned again.
+     * @param watch_subdir Given a subdirectory's path relative to path, says whether to
+     *                     watch it too (and consider its own subdirectories). By default
+     *                     no subdirectories are watched.
+     *
+     * @throws std::system_error if the watch can't be set up.
+     */
+    dir_watcher(std::string const& path, change_handler on_change, rescan_handler on_rescan,
+                subdir_filter watch_subdir = nullptr);
+
+    ~dir_watcher();
+
+    dir_watcher(dir_watcher& other) = delete;
+
+    /**
+     * Starts delivering events on the background thread.
+     *
+     * @param first If given, runs on the background thread before any events are
+     *              delivered (e.g. to bring an index loaded from disk up to date).
+     */
+    void start(std::function<void()> first = nullptr);
+
+private:
+    std::string path_;
+    change_handler on_change_;
+    rescan_handler on_rescan_;
+    subdir_filter watch_subdir_;
+    int inotify_fd_;
+    int stop_fd_;
+    int root_wd_;
+    std::thread thread_;
+
+    // Watched directories by watch descriptor, relative to path_ ("" for path_ itself)
+    std::unordered_map<int, std::string> dirs_;
+
+    void run(std::function<void()> first);
+    bool read_events(std::vector<file_index::change>& changes, bool& overflowed);
+
+    // Watches relative (and its subdirectories that pass the filter). If found is given, adds
+    // the files already in them to it, since they may have appeared before the watch did.
+    int watch(std::string const& relative, std::vector<file_index::change>* found);
+};
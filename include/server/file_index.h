@@ -0,0 +1,101 @@
+/* ========================================================================
+   $HEADER FILE
+   $File: file_index.h $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/10 $
+   $Description: $
+   $    The server's index of the files in its storage directory. Most of
+   $    it is a memory-mapped persistent_index (the base); changes since the
+   $    base was written live in a small in-memory overlay of open-addressing
+   $    tables. Lookups are lock-free reads of immutable snapshots of both;
+   $    updates copy and republish one overlay shard at a time.
+   $Revisions: $
+   ======================================================================== */
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <server/persistent_index.h>
+#include <util/open_table.hpp>
+#include <util/rcu.hpp>
+
+class file_index {
+public:
+    struct change {
+        enum kind { ADD, REMOVE };
+
+        kind type;
+        std::string name;
+        file_meta meta;             // Only used by ADD
+    };
+
+    file_index();
+
+    file_index(file_index& other) = delete;
+
+    /**
+     * Looks a file up by name.
+     *
+     * @param meta If not null, receives the file's metadata.
+     * @return Whether the file is in the index.
+     */
+    bool lookup(std::string const& name, file_meta* meta) const;
+
+    bool contains(std::string const& name) const { return lookup(name, nullptr); }
+
+    /**
+     * Returns the number of files in the index.
+     */
+    std::size_t size() const;
+
+    /**
+     * Returns the number of changes held in memory since the base was last saved.
+     */
+    std::size_t overlay_size() const;
+
+    void add(std::string const& name, file_meta const& meta);
+    void remove(std::string const& name);
+
+    /**
+     * Applies a batch of changes in order, republishing each affected shard once.
+     */
+    void apply(std::vector<change> const& changes);
+
+    /**
+     * Calls f(name, meta) for every file in the index.
+     */
+    void for_each(std::function<void(std::string const&, file_meta const&)> const& f) const;
+
+    /**
+     * Maps a saved index as the base. Call before making any changes.
+     *
+     * @return false if there was no usable index at path.
+     */
+    bool load(std::string const& path);
+
+    /**
+     * Writes the whole index to path and makes that the new base, shrinking the overlay.
+     * Changes made while saving are kept.
+     *
+     * @return false if the index couldn't be written.
+     */
+    bool save(std::string const& path);
+
+private:
+    static const unsigned SHARDS = 64;
+
+    struct overlay_entry {
+        bool present;               // false if the file was removed
+        file_meta meta;
+    };
+
+    typedef open_table<std::string, overlay_entry> shard;
+
+    rcu_cell<shard> shards_[SHARDS];
+    rcu_cell<persistent_index> base_;
+    std::mutex save_mutex_;
+
+    static unsigned shard_of(std::string const& name);
+};
@@ -0,0 +1,61 @@
+/* ========================================================================
+   $HEADER FILE
+   $File: group_commit.h $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/16 $
+   $Description: $
+   $    Makes uploads durable in batches. Each upload that wants to be on
+   $    disk waits for a sync of the whole filesystem; uploads that finish
+   $    while one sync is running all wait for the next one, so however
+   $    many finish at once, they cost about two sync latencies between
+   $    them rather than one each.
+   $Revisions: $
+   ======================================================================== */
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <util/metrics.hpp>
+
+class group_commit {
+public:
+    /**
+     * @param dir Any directory on the filesystem to sync.
+     *
+     * @throws std::system_error if dir can't be opened.
+     */
+    explicit group_commit(std::string const& dir);
+
+    ~group_commit();
+
+    group_commit(group_commit& other) = delete;
+
+    /**
+     * Returns once everything written to the filesystem before the call
+     * (data, and names from link/rename) is on disk.
+     *
+     * @return false if the sync failed.
+     */
+    bool wait();
+
+private:
+    // The uploads waiting on one sync
+    struct batch {
+        bool done = false;
+        bool ok = false;
+    };
+
+    int dir_fd_;
+
+    std::mutex mutex_;
+    std::condition_variable synced_;
+    std::shared_ptr<batch> open_;       // Joined by new waiters; synced once the current sync is done
+    bool syncing_;
+
+    counter& rounds_;
+    counter& uploads_;
+    histogram& duration_;
+};
@@ -0,0 +1,102 @@
+/* ========================================================================
+   $HEADER FILE
+   $File: open_file_cache.h $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/12 $
+   $Description: $
+   $    A bounded cache of open file descriptors for stored files, so that
+   $    GETs of popular files don't resolve a path or open anything.
+   $Revisions: $
+   ======================================================================== */
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <server/persistent_index.h>
+#include <server/stored_frames.h>
+#include <util/metrics.hpp>
+#include <util/open_table.hpp>
+
+class open_file_cache {
+public:
+    /**
+     * An open, read-only file. The descriptor stays open as long as anyone holds
+     * the handle, even after it's evicted; read it with pread so that it can be shared.
+     * The file's contents start at meta.offset (which is only non-zero for packed files),
+     * unless the file is stored compressed, in which case they're read through frames.
+     */
+    struct handle {
+        int fd;
+        file_meta meta;
+        std::shared_ptr<stored_frames const> frames;       // Null unless the file is stored compressed
+
+        handle(int fd, file_meta const& meta, std::shared_ptr<stored_frames const> frames = nullptr)
+        : fd(fd), meta(meta), frames(frames) {}
+        ~handle();
+
+        // The size of the contents, which for a compressed file isn't meta.size
+        std::uint64_t size() const { return frames ? frames->size() : meta.size; }
+
+        /**
+         * Reads size bytes of the contents, starting at offset, into buf.
+         *
+         * @return false if they can't be read.
+         */
+        bool read(char* buf, std::uint64_t size, std::uint64_t offset) const;
+
+        handle(handle& other) = delete;
+    };
+
+    typedef std::shared_ptr<handle const> ptr;
+
+    /**
+     * @param dir      The storage directory.
+     * @param capacity How many descriptors to keep open at most.
+     *
+     * @throws std::system_error if dir can't be opened.
+     */
+    open_file_cache(std::string const& dir, std::size_t capacity);
+
+    ~open_file_cache();
+
+    open_file_cache(open_file_cache& other) = delete;
+
+    /**
+     * Returns an open handle to the version of name described by expected (as
+     * recorded in the file index). A cached handle is used if it's for that same
+     * version; otherwise the file is opened and checked with fstat.
+     *
+     * @return null if the file can't be opened or isn't the expected version.
+     */
+    ptr open(std::string const& name, file_meta const& expected);
+
+    /**
+     * Forgets any handle for name (e.g. because the file changed or went away).
+     */
+    void invalidate(std::string const& name);
+
+    void clear();
+
+private:
+    struct entry {
+        ptr file;
+        bool referenced;            // Set on each hit; cleared as the clock hand passes
+    };
+
+    int dir_fd_;
+    std::size_t capacity_;
+    std::mutex mutex_;
+    open_table<std::string, entry> table_;
+    std::size_t hand_;
+
+    counter& hits_;
+    counter& misses_;
+    gauge& open_;
+
+    void evict_one();
+
+    // Caches file as name's handle and returns it
+    ptr insert(std::string const& name, ptr const& file);
+};
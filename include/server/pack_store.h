@@ -0,0 +1,119 @@
+/* ========================================================================
+   $HEADER FILE
+   $File: pack_store.h $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/16 $
+   $Description: $
+   $    Append-only segment files that hold many small stored files each,
+   $    so that a tiny upload costs a few bytes of a big file rather than
+   $    an inode, a directory entry and a block of its own. Each record is
+   $    a header (name length, size, mtime and content hash), the name and
+   $    then the contents; the file index records where the contents are.
+   $    A record's contents are never changed, so reading one needs no
+   $    locking, and the segments alone are enough to rebuild the index's
+   $    view of them after a crash; the only write to an old record marks it
+   $    dead once its file is stored some other way. Space from records that have been replaced is reclaimed by
+   $    copying the live ones out of a mostly-dead segment and deleting it.
+   $Revisions: $
+   ======================================================================== */
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <server/persistent_index.h>
+#include <util/metrics.hpp>
+
+class pack_store {
+public:
+    /**
+     * @param dir          The storage directory; segments are kept in its
+     *                     storage_layout::PACK_DIR, which is created when the
+     *                     first record is written.
+     * @param segment_size A segment is sealed and a new one started once the
+     *                     next record would take it past this size.
+     */
+    pack_store(std::string const& dir, std::uint64_t segment_size);
+
+    ~pack_store();
+
+    pack_store(pack_store& other) = delete;
+
+    /**
+     * Appends a record holding a file to the active segment.
+     *
+     * @param name    The file's name.
+     * @param data    Its contents (meta.size bytes).
+     * @param meta    Its size, mtime_ns and hash. On success, the rest is filled
+     *                in to say where the contents are.
+     * @param sync    Whether to fdatasync the segment before publishing.
+     * @param publish Called with the finished meta before anyone else can append,
+     *                so that index updates made there happen in record order.
+     *
+     * @return false if the record couldn't be written.
+     */
+    bool append(std::string const& name, char const* data, file_meta& meta, bool sync,
+                std::function<void(file_meta const&)> const& publish);
+
+    /**
+     * Marks the record holding meta (a version of name that the index no longer
+     * points at) as dead, so that replay() skips it. It's still readable by
+     * anyone who already looked it up.
+     */
+    void retire(std::string const& name, file_meta const& meta);
+
+    /**
+     * fdatasyncs the active segment.
+     */
+    bool sync();
+
+    /**
+     * Calls f(name, meta) for every record in every segment, oldest first. A
+     * record left incomplete by a crash ends its segment.
+     */
+    void replay(std::function<void(std::string const&, file_meta const&)> const& f);
+
+    /**
+     * Returns the id and size of every sealed segment, oldest first.
+     */
+    std::vector<std::pair<std::uint32_t, std::uint64_t>> sealed();
+
+    /**
+     * Deletes a sealed segment. Anyone who already has it open can still read it.
+     */
+    void remove(std::uint32_t pack);
+
+    /**
+     * Returns how many bytes of a segment a record for the given file takes.
+     */
+    static std::uint64_t record_size(std::string const& name, std::uint64_t size);
+
+private:
+    struct record_header;
+
+    std::string dir_;                                   // The storage directory's PACK_DIR
+    std::uint64_t segment_size_;
+
+    std::mutex mutex_;
+    std::map<std::uint32_t, std::uint64_t> segments_;   // Id to size, including the active one
+    std::uint32_t active_;                              // 0 until the first append
+    int active_fd_;
+    std::uint64_t active_inode_;
+
+    counter& records_;
+    counter& reclaimed_;
+    gauge& segment_count_;
+    gauge& bytes_;
+
+    // Seals the active segment and starts a new one. Call with mutex_ held.
+    bool start_segment();
+
+    // Reads the records of one segment up to size
+    void replay_segment(std::uint32_t pack, std::uint64_t size,
+                        std::function<void(std::string const&, file_meta const&)> const& f);
+};
@@ -0,0 +1,65 @@
+/* ========================================================================
+   $HEADER FILE
+   $File: pending_file.h $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/14 $
+   $Description: $
+   $    A file that's being uploaded. It's written somewhere no one can see
+   $    it (an unnamed O_TMPFILE where the filesystem supports one) and only
+   $    appears under its real name, all at once, when it's committed, so
+   $    readers never see a partial upload and a failed one leaves the old
+   $    version alone.
+   $Revisions: $
+   ======================================================================== */
+#pragma once
+
+#include <string>
+
+class pending_file {
+public:
+    /**
+     * Creates the file that will become path. path's directory must exist.
+     *
+     * @throws std::system_error if it can't be created.
+     */
+    explicit pending_file(std::string const& path);
+
+    /**
+     * Throws the file away unless it was committed.
+     */
+    ~pending_file();
+
+    pending_file(pending_file& other) = delete;
+
+    // Open for reading and writing, so that what was written can be checked
+    int fd() const { return fd_; }
+
+    /**
+     * Atomically puts the file at path, replacing anything that was there.
+     *
+     * @return false (with errno set) if it couldn't be; the file is discarded
+     *         when this is destroyed.
+     */
+    bool commit();
+
+    /**
+     * Atomically puts a hard link to existing at path, replacing anything that
+     * was there.
+     *
+     * @return false (with errno set) if it couldn't be.
+     */
+    static bool link(std::string const& existing, std::string const& path);
+
+private:
+    std::string path_;
+    std::string temp_path_;     // Where the file is named until it's committed; empty for an O_TMPFILE
+    int fd_;
+    bool committed_;
+
+    // A name in path's directory that the server won't mistake for a stored file
+    static std::string temp_name(std::string const& path);
+
+    // Creates a file at a new temp_name(), setting temp_path_
+    int create_temp();
+};
@@ -0,0 +1,96 @@
+/* ========================================================================
+   $HEADER FILE
+   $File: persistent_index.h $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/11 $
+   $Description: $
+   $    A read-only, memory-mapped hash table of file metadata that the
+   $    server saves next to its files so that it doesn't have to rebuild
+   $    its index from scratch on startup.
+   $
+   $    Layout (all integers little-endian):
+   $        header        (64 bytes)
+   $        buckets       (bucket_count entries, open addressing, linear probing)
+   $        names         (the file names, packed, not NUL-terminated)
+   $Revisions: $
+   ======================================================================== */
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * What the index knows about a stored file.
+ */
+struct file_meta {
+    std::uint64_t size;
+    std::int64_t mtime_ns;
+    std::uint64_t inode;
+    std::uint32_t pack;             // The pack segment holding it (see pack_store), or 0 if it's a file of its own
+    std::uint64_t offset;           // Where its contents start within the pack segment
+    bool sharded;                   // Stored under its shard directory (see storage_layout) rather than at the top level
+    bool hashed;                    // Whether hash has been filled in yet
+    unsigned char hash[32];         // BLAKE3 of the contents
+
+    file_meta() : size(0), mtime_ns(0), inode(0), pack(0), offset(0), sharded(false), hashed(false), hash() {}
+
+    // Whether the two describe the same version of a file (ignoring where it is and its hash).
+    // A packed file's inode is its segment's, so its place in the segment counts too.
+    bool same_version(file_meta const& other) const {
+        return size == other.size && mtime_ns == other.mtime_ns && inode == other.inode
+               && pack == other.pack && offset == other.offset;
+    }
+};
+
+class persistent_index {
+public:
+    /**
+     * An empty index.
+     */
+    persistent_index();
+
+    ~persistent_index();
+
+    persistent_index(persistent_index& other) = delete;
+
+    /**
+     * Maps an index file written by write(). Returns null (and logs why) if the
+     * file is missing, truncated or from a different version.
+     */
+    static std::unique_ptr<persistent_index> open(std::string const& path);
+
+    /**
+     * Writes an index of the given files to path, atomically replacing whatever was there.
+     *
+     * @return false if the file couldn't be written.
+     */
+    static bool write(std::string const& path, std::vector<std::pair<std::string, file_meta>> const& files);
+
+    bool lookup(std::string const& name, file_meta* meta) const;
+
+    std::size_t size() const { return count_; }
+
+    /**
+     * Calls f(name, meta) for every file in the index.
+     */
+    void for_each(std::function<void(std::string const&, file_meta const&)> const& f) const;
+
+private:
+    struct header;
+    struct bucket;
+
+    void* map_;
+    std::size_t map_size_;
+    bucket const* buckets_;
+    std::uint64_t bucket_mask_;
+    const char* names_;
+    std::uint64_t names_size_;
+    std::uint64_t count_;
+
+    static std::uint64_t name_hash(const char* name, std::size_t len);
+};
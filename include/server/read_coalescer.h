@@ -0,0 +1,130 @@
+/* ========================================================================
+   $HEADER FILE
+   $File: read_coalescer.h $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/15 $
+   $Description: $
+   $    Single-flight reads for GET. Sessions sending the same version of a
+   $    file at the same time share one sequential read of it: whoever
+   $    needs a chunk that hasn't been read yet reads it, and everyone else
+   $    sends that same buffer. A session that joins late starts from the
+   $    chunks that are already in memory, so a herd of clients asking for
+   $    a newly published file reads it from disk about once. Reads run
+   $    a readahead window ahead of the reader so that big files stream
+   $    from disk without a stall at each chunk.
+   $Revisions: $
+   ======================================================================== */
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <server/open_file_cache.h>
+#include <util/metrics.hpp>
+#include <util/net_interface.h>
+#include <util/open_table.hpp>
+
+class read_coalescer {
+    struct flight;
+
+public:
+    typedef std::shared_ptr<std::vector<char> const> chunk;
+
+    /**
+     * One session's read through a shared flight. Leaving (destroying it) lets
+     * the flight go once no one else is using it.
+     */
+    class stream {
+    public:
+        ~stream();
+
+        stream(stream& other) = delete;
+
+        /**
+         * Returns the next chunk of the file, reading it if no one has yet, or
+         * null if it couldn't be read. Don't call it past the end of the file.
+         */
+        chunk next();
+
+        /**
+         * Sends the rest of the file over iface, one chunk at a time.
+         *
+         * @return true if the whole file was sent.
+         */
+        bool send(net_interface& iface);
+
+        /**
+         * Copies the whole file into out (which must hold size bytes), if every
+         * chunk is still in memory.
+         */
+        bool copy_to(char* out) const;
+
+        /**
+         * How many of the bytes this session read from the file were already in
+         * the page cache, and how many weren't. Chunks shared from another
+         * session's read count as neither.
+         */
+        std::uint64_t page_cache_hit_bytes() const { return hit_bytes_; }
+        std::uint64_t page_cache_miss_bytes() const { return miss_bytes_; }
+
+    private:
+        friend class read_coalescer;
+
+        read_coalescer& owner_;
+        std::shared_ptr<flight> flight_;
+        std::size_t next_;          // The chunk next() will return
+        std::uint64_t hit_bytes_;
+        std::uint64_t miss_bytes_;
+
+        stream(read_coalescer& owner, std::shared_ptr<flight> const& f);
+    };
+
+    /**
+     * @param chunk_size How much is read from disk at once.
+     * @param retain     Once a flight holds this many bytes, its oldest chunks
+     *                   are dropped. Sessions that haven't got to them yet
+     *                   read them again themselves.
+     */
+    read_coalescer(std::size_t chunk_size, std::uint64_t retain);
+
+    read_coalescer(read_coalescer& other) = delete;
+
+    /**
+     * Starts reading file (the version of name the caller opened), sharing a
+     * flight with anyone who's reading the same version right now.
+     */
+    std::unique_ptr<stream> join(std::string const& name, open_file_cache::ptr const& file);
+
+private:
+    struct flight {
+        std::string name;
+        open_file_cache::ptr file;
+
+        std::mutex mutex;
+        std::condition_variable chunk_read;
+        std::vector<chunk> chunks;              // Null until read, and again once dropped
+        std::size_t read_upto;                  // Chunks before this have been read
+        std::size_t dropped_upto;               // Chunks before this have been dropped
+        std::uint64_t held_bytes;
+        bool reading;                           // Someone's reading chunk read_upto
+        bool failed;
+        std::size_t readers;
+    };
+
+    std::size_t chunk_size_;
+    std::uint64_t retain_;
+
+    std::mutex mutex_;
+    open_table<std::string, std::shared_ptr<flight>> flights_;
+
+    counter& disk_chunks_;
+    counter& shared_chunks_;
+    gauge& active_;
+
+    chunk read_chunk(flight& f, std::size_t index, stream& reader);
+    void leave(stream& s);
+};
@@ -10,47 +10,299 @@
    ======================================================================== */
 #pragma once
 
+#include <atomic>
 #include <boost/asio.hpp>
 #include <boost/filesystem.hpp>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
-#include <unordered_set>
+#include <thread>
+#include <sys/stat.h>
+#include <server/chunk_index.h>
+#include <server/content_cache.h>
+#include <server/dir_watcher.h>
+#include <server/file_index.h>
+#include <server/group_commit.h>
+#include <server/open_file_cache.h>
+#include <server/pack_store.h>
+#include <server/pending_file.h>
+#include <server/read_coalescer.h>
+#include <util/compression.hpp>
 #include <util/net_interface.h>
+#include <util/metrics.hpp>
+
+/**
+ * How sure the server makes itself that an upload is on disk before telling the
+ * client it's stored.
+ */
+enum class durability {
+    none,       // Leave it to the kernel to write back
+    file,       // fdatasync each file and fsync its directory
+    group       // Sync everything uploaded at about the same time together
+};
+
+/**
+ * Settings for a server beyond where its files are.
+ */
+struct server_options {
+    // Whether to bind the control port. Turn off to only serve sessions handed to
+    // server::serve_session (e.g. over a loopback_net_interface).
+    bool listen = true;
+
+    // Whether new uploads go into hash-prefix shard directories (see storage_layout).
+    // Files are found in either layout regardless.
+    bool sharded = false;
+
+    // How many bytes of popular files to keep in memory (0 for none), and the biggest
+    // file that's worth keeping there
+    std::uint64_t cache_bytes = 64 * 1024 * 1024;
+    std::uint64_t cache_max_file = 1024 * 1024;
+
+    // Whether big uploads stay in the page cache after they're written. Off, they're
+    // evicted as they arrive so that they don't push out the files GETs are reading.
+    bool keep_uploads_cached = false;
+
+    durability sync = durability::none;
+
+    // Uploads no bigger than this are appended to pack segments (see pack_store)
+    // instead of being stored as files of their own; 0 to never pack
+    std::uint64_t pack_max_file = 0;
+
+    // Whether to store each distinct content once, with every file that has it as
+    // a hard link to it, and accept offers of contents that are already stored
+    bool dedup = false;
+
+    // Whether clients may have file contents compressed on their data channels. With it
+    // on, a shared dictionary is also trained from the small files (see dictionary.hpp).
+    bool compression = true;
+
+    // The codec to store uploaded files compressed with (see stored_frames.h), and its
+    // level for CODEC_DEFLATE; with CODEC_NONE they're stored as they are
+    codec at_rest = CODEC_NONE;
+    int at_rest_level = 0;
+};
 
 class server {
 
 public:
     /**
      * Creates a new server with the given io_service and file storage path.
-     * The server automatically tries to bind to the first available interface on creation.
+     * The server automatically binds and starts listening on the control port on creation.
      *
      * @param service      The io_service to communicate with the OS TCP/IP stack.
      * @param storage_path The path in which to retrieve and store files.
+     * @param opts         Everything else.
      *
      * @throws boost::system::error_code if binding/accept socket creation fails,
      *         std::exception if storage_path isn't a directory or doesn't have
      *         read/write access.
      */
-    server(boost::asio::io_service& service, std::string& storage_path);
+    server(boost::asio::io_service& service, std::string& storage_path, server_options const& opts = server_options());
+
+    /**
+     * Saves the file index so that the next server started on this directory can use it.
+     */
+    ~server();
     
     // No copy constructor (Note: might do a move constructor if I'm feeling ambitious, but we don't really need one)
     server(server& other) = delete;
 
     /**
-     * Causes the server to start listening for connections and serving clients.
+     * Causes the server to start accepting connections and serving clients.
+     * Returns once stop() has been called.
      */
     void start();
 
+    /**
+     * Asks start() to stop accepting clients and return once the current ones disconnect.
+     */
+    void stop();
+
+    /**
+     * One client's channels: its control channel, plus a function that opens a
+     * data channel to it (throwing on failure), and how the client asked for
+     * file contents to be compressed on them.
+     */
+    struct session {
+        net_interface& control;
+        std::function<std::unique_ptr<net_interface>()> open_data_channel;
+        codec compression;
+        int compression_level;
+        std::uint32_t dictionary;       // The version the client fetched, or 0
+
+        session(net_interface& ctrl, std::function<std::unique_ptr<net_interface>()> open)
+        : control(ctrl), open_data_channel(open), compression(CODEC_NONE), compression_level(0), dictionary(0) {}
+    };
+
+    /**
+     * Handles requests from the session until the client disconnects.
+     *
+     * @return false if the session ended on an unexpected error rather than a disconnect.
+     */
+    bool serve_session(session& sess);
+
 private:
     boost::asio::io_service& service_;
     boost::asio::ip::tcp::acceptor acceptor_;
+    std::atomic<bool> stopping_;
 
     boost::filesystem::path storage_path_;
+    server_options opts_;
+
+    // The files in the storage directory so that it doesn't have to be searched every time.
+    // It's saved to index_path_ so that startup doesn't have to rebuild it, and watcher_ keeps
+    // it up to date with changes made by other processes.
+    file_index files_;
+    std::string index_path_;
+    std::unique_ptr<dir_watcher> watcher_;
+    std::atomic<bool> closing_;
+
+    // Descriptors of recently requested files and the contents of popular ones, kept
+    // coherent with files_ by the same updates
+    open_file_cache open_files_;
+    content_cache contents_;
+
+    // Shares disk reads between concurrent GETs of the same file
+    read_coalescer reads_;
+
+    // Batches the syncs for durability::group
+    group_commit syncs_;
+
+    // Small files, packed together. compactor_ periodically reclaims space: it copies the
+    // live files out of mostly-dead segments so that they can be deleted, and deletes
+    // content objects that no stored file links to any more. It also trains new versions
+    // of the compression dictionary as small files accumulate.
+    pack_store packs_;
+    std::thread compactor_;
+    std::mutex compactor_mutex_;
+    std::condition_variable compactor_wake_;
+
+    // Counters and timings for one kind of request
+    struct request_metrics {
+        counter& requests;
+        counter& errors;
+        histogram& duration;
+
+        request_metrics(const char* op);
+    };
+
+    request_metrics get_metrics_;
+    request_metrics send_metrics_;
+    request_metrics stats_metrics_;
+    histogram& data_channel_setup_;
+    counter& sessions_;
+    gauge& active_sessions_gauge_;
+
+    // Sessions running on their own threads; start() waits for them to finish
+    std::size_t active_sessions_;
+    std::mutex sessions_mutex_;
+    std::condition_variable sessions_done_;
+
+    gauge& indexed_files_;
+
+    counter& offers_accepted_;
+    counter& offers_declined_;
+    counter& deduped_bytes_;
+
+    // Where the chunks of files uploaded in chunks are, so that later uploads can reuse them
+    chunk_index chunks_;
+    counter& reused_chunk_bytes_;
+    counter& received_chunk_bytes_;
+
+    counter& delta_copied_bytes_;
+    counter& delta_literal_bytes_;
+
+    // Contents stored compressed, what they took up on disk and what was sent as it was stored
+    counter& stored_raw_bytes_;
+    counter& stored_compressed_bytes_;
+    counter& stored_frames_passed_bytes_;
+
+    // Every version of the compression dictionary, and how many small files there were
+    // when the latest was trained
+    dictionary_set dictionaries_;
+    std::size_t dictionary_samples_;
+    gauge& dictionary_version_;
+
+    // Brings the file index up to date with a directory listing, then hashes and saves it
+    void rescan();
+
+    // Adds files that the index doesn't know about and drops ones that are gone (without hashing them)
+    void sync_index();
+
+    // Fills in content hashes for the given files, skipping any that change while being hashed
+    void hash_files(std::vector<std::string> const& names);
+
+    void save_index();
+
+    // Adds packed files that the index is missing or has older versions of
+    void replay_packs();
+
+    // Runs compact_packs every so often until the server closes
+    void run_compactor();
+
+    // Deletes sealed pack segments with nothing live in them and moves the live files out of mostly-dead ones
+    void compact_packs();
+
+    // Drops anything cached for name because it changed or went away
+    void forget_cached(std::string const& name);
+
+    // Returns the full path of the given placement of a stored file
+    boost::filesystem::path physical_path(std::string const& name, bool sharded) const;
+
+    // Finds a stored file in either layout
+    bool locate(std::string const& name, file_meta& meta) const;
+
+    // Applies a batch of changes reported by watcher_
+    void on_directory_changes(std::vector<file_index::change> const& changes);
+
+    void run_session(std::shared_ptr<boost::asio::ip::tcp::socket> control_sock);
+
+    void handle_send_request(session& sess);
+    void handle_packed_send(session& sess, std::string const& name, std::uint64_t size);
+    void handle_offer_request(session& sess);
+    void handle_chunks_request(session& sess);
+    void handle_signatures_request(session& sess);
+    void handle_delta_request(session& sess);
+
+    // With dedup on, makes the file at path share its contents' object, linking it as the
+    // object if there isn't one yet or replacing it with a link to the one there is. st is
+    // updated to describe whatever's at path afterwards.
+    void share_object(boost::filesystem::path const& path, unsigned char const* hash, struct stat& st);
+
+    // With opts_.at_rest set, or for an upload that would be mistaken for a compressed file,
+    // writes a compressed copy of it to go to path instead. compressed is left null if
+    // compression is off, the copy couldn't be made or it wouldn't save anything. Returns false
+    // only if the upload can't be stored safely at all.
+    bool compress_stored(boost::filesystem::path const& path, pending_file& file,
+                         std::unique_ptr<pending_file>& compressed);
+
+    // Commits a complete upload to path, then shares and publishes it. Returns false if it couldn't be
+    // stored or made as durable as opts_.sync asks.
+    bool store_upload(std::string const& name, boost::filesystem::path const& path, pending_file& file,
+                      unsigned char const* hash);
+
+    // Puts a file that's just been stored at path into the index, removing any copy in the
+    // other layout, then makes it durable as opts_.sync asks. Returns false if it couldn't be.
+    bool publish_stored(std::string const& name, boost::filesystem::path const& path, struct stat const& st,
+                        unsigned char const* hash);
+
+    // Deletes the content objects that no stored file links to
+    void collect_objects();
+
+    // Reads the saved dictionary versions
+    void load_dictionaries();
 
-    // A list of the files in the storage directory so that it doesn't have to be searched every time
-    std::unordered_set<std::string> files_;
+    // Trains a new dictionary version if there are enough small files, and twice as many as last time
+    void retrain_dictionary();
+    void handle_get_request(session& sess);
+    void handle_stats_request(session& sess);
+    void handle_hello_request(session& sess);
+    void handle_dictionary_request(session& sess);
 
-    void handle_send_request(net_interface& control_interface);
-    void handle_get_request(net_interface& control_interface);
+    // Wraps a data channel in compression if the session negotiated it; otherwise returns null
+    std::unique_ptr<compressed_net_interface> compress_channel(session const& sess, net_interface& data);
 
     // Attempts to connect to control_sock.remote_endpoint(); throws on failure, otherwise out will be a socket connected to port 7006
     void connect_to_data_channel(const boost::asio::ip::tcp::socket& control_sock, boost::asio::ip::tcp::socket& out);
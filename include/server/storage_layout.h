@@ -0,0 +1,88 @@
+/* ========================================================================
+   $HEADER FILE
+   $File: storage_layout.h $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/13 $
+   $Description: $
+   $    Where a stored file lives on disk. In the flat layout a file is at
+   $    <storage>/<name>; in the sharded layout it's at
+   $    <storage>/.shards/ab/cd/<name>, where abcd are the first two bytes of
+   $    the BLAKE3 hash of the name, so that no one directory ends up with
+   $    millions of entries. The shards have a reserved root of their own so
+   $    that they can't collide with flat files named like "ab". Small files
+   $    may instead be packed together into segments under <storage>/.packs
+   $    (see pack_store). With deduplication on, each distinct content is
+   $    also linked as <storage>/.objects/ab/<hash>, and stored files with
+   $    the same contents are hard links to that one inode. Each version of
+   $    the shared compression dictionary is kept as
+   $    <storage>/.dictionaries/<version>.
+   $Revisions: $
+   ======================================================================== */
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+class storage_layout {
+public:
+    // Names starting with this are uploads in progress (see pending_file)
+    static const char TEMP_PREFIX[];
+
+    // The directory that holds the pack segments
+    static const char PACK_DIR[];
+
+    // The directory that holds one link to each distinct stored content
+    static const char OBJECT_DIR[];
+
+    // The directory that holds the trained compression dictionaries
+    static const char DICTIONARY_DIR[];
+
+    /**
+     * Returns the directory (relative to the storage directory) that name goes in
+     * under the sharded layout, e.g. ".shards/3f/a0".
+     */
+    static std::string shard_dir(std::string const& name);
+
+    /**
+     * Returns the path of name relative to the storage directory.
+     */
+    static std::string relative_path(std::string const& name, bool sharded);
+
+    /**
+     * Returns the path of the given pack segment relative to the storage directory.
+     */
+    static std::string pack_path(std::uint32_t pack);
+
+    /**
+     * Returns the path of the given dictionary version relative to the storage directory.
+     */
+    static std::string dictionary_path(std::uint32_t version);
+
+    /**
+     * Returns the path of the object with the given BLAKE3 hash relative to the
+     * storage directory, e.g. ".objects/3f/3fa0...".
+     */
+    static std::string object_path(unsigned char const* hash);
+
+    /**
+     * Works out which file a path relative to the storage directory holds.
+     *
+     * @return false if the path isn't somewhere either layout would put a file
+     *         (including if it's in the wrong shard directory for its name).
+     */
+    static bool parse(std::string const& relative, std::string& name, bool& sharded);
+
+    /**
+     * Returns whether relative (e.g. ".shards/3f" or ".shards/3f/a0") is a shard
+     * directory or one of their parents.
+     */
+    static bool is_shard_dir(std::string const& relative);
+
+    /**
+     * Returns whether name is one of the server's own files (the saved file and
+     * chunk indexes and their temporary files, the shard, pack, object and
+     * dictionary roots and uploads in progress), which are never stored files.
+     */
+    static bool is_reserved(std::string const& name);
+};
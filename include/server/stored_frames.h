@@ -0,0 +1,100 @@
+/* ========================================================================
+   $HEADER FILE
+   $File: stored_frames.h $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/19 $
+   $Description: $
+   $    Files that are stored compressed. Such a file is a header (with the
+   $    size of the contents), the frames a compressed_net_interface would
+   $    send for the contents, an index of where each frame starts and the
+   $    CRC32C of what it holds, and a trailer saying where the index is.
+   $    Every frame but the last holds FRAME_SIZE bytes of the contents and
+   $    can be decompressed on its own, so any range of the contents can be
+   $    read by decompressing just the frames it's in, and a data channel
+   $    compressing with the same codec can be sent the frames as they are.
+   $    Frames are the same size as checked_net_interface's blocks, so
+   $    their CRCs can be sent along with them to prove they arrived
+   $    intact, and are checked as frames are read, which catches damage
+   $    on disk.
+   $
+   $    A stored file is taken to be compressed if it starts with the
+   $    header's magic number and ends with a trailer that agrees with it.
+   $    An upload that happens to look like that is stored compressed even
+   $    if it doesn't shrink, so it can't be mistaken for one.
+   $Revisions: $
+   ======================================================================== */
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <util/compression.hpp>
+#include <util/integrity.hpp>
+#include <util/net_interface.h>
+
+class stored_frames {
+public:
+    static const std::size_t FRAME_SIZE = compressed_net_interface::FRAME_SIZE;
+
+    /**
+     * Writes size bytes of from, compressed with codec c, to the start of to.
+     *
+     * @param stored Set to how many bytes were written.
+     * @return false if from couldn't be read or to written.
+     */
+    static bool write(int from, std::uint64_t size, int to, codec c, int level, std::uint64_t& stored);
+
+    /**
+     * Whether size bytes of contents starting as head does (at least 4 bytes of it) have to be
+     * stored compressed, even if that doesn't make them smaller, so that they're read back right.
+     */
+    static bool must_wrap(char const* head, std::size_t size);
+
+    /**
+     * Reads the index of the compressed file at fd, which is size bytes long.
+     *
+     * @return null if it isn't a compressed file.
+     */
+    static std::shared_ptr<stored_frames const> open(int fd, std::uint64_t size);
+
+    // The size of the contents
+    std::uint64_t size() const { return size_; }
+
+    codec stored_codec() const { return codec_; }
+
+    // The CRC32C of what each frame holds, as checked_net_interface would work them out
+    std::vector<std::uint32_t> const& crcs() const { return crcs_; }
+
+    /**
+     * Reads size bytes of the contents, starting at offset, into buf.
+     *
+     * @return false if the file can't be read or is corrupt.
+     */
+    bool read(int fd, char* buf, std::uint64_t size, std::uint64_t offset) const;
+
+    /**
+     * Sends size bytes of the contents, starting at offset, decompressing them a frame at a time.
+     *
+     * @return false if they couldn't all be sent.
+     */
+    bool send(int fd, std::uint64_t offset, std::uint64_t size, net_interface& out) const;
+
+    /**
+     * Sends the whole contents as the stored frames, for a channel that decompresses them itself.
+     *
+     * @return false if they couldn't all be sent.
+     */
+    bool send_frames(int fd, compressed_net_interface& out) const;
+
+private:
+    std::uint64_t size_;
+    codec codec_;
+    std::vector<std::uint64_t> offsets_;    // Where each frame starts, and then where the index does
+    std::vector<std::uint32_t> crcs_;
+
+    stored_frames() : size_(0), codec_(CODEC_NONE) {}
+
+    // Reads and decompresses frame i into out
+    bool read_frame(int fd, std::size_t i, std::vector<char>& stored, std::vector<char>& out) const;
+};
@@ -0,0 +1,431 @@
+/* ========================================================================
+   $HEADER FILE
+   $File: blake3.hpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/11 $
+   $Description: $
+   $    Portable BLAKE3 (unkeyed hash mode, 32-byte output) following the
+   $    reference implementation: 1KiB chunks are compressed in 64-byte
+   $    blocks and their chaining values merged up a binary tree. Since
+   $    chunks are independent until they're merged, runs of whole chunks
+   $    are hashed several at a time, one per vector lane: 8 with AVX2 and
+   $    4 otherwise (SSE2 on x86-64).
+   $Revisions: $
+   ======================================================================== */
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+class blake3_hasher {
+public:
+    static const std::size_t OUT_LEN = 32;
+    static const std::size_t BLOCK_LEN = 64;
+    static const std::size_t CHUNK_LEN = 1024;
+
+    blake3_hasher() {
+        std::memcpy(key_, iv(), sizeof(key_));
+        reset_chunk(0);
+        stack_len_ = 0;
+        pending_len_ = 0;
+    }
+
+    void update(const void* data, std::size_t size) {
+        const unsigned char* in = (const unsigned char*)data;
+        if(size && chunk_len() == CHUNK_LEN) {
+            finish_chunk();
+        }
+
+        // Input that comes in small pieces is gathered up so that it can be hashed in parallel too
+        if(pending_len_ || (chunk_len() == 0 && size < sizeof(pending_))) {
+            std::size_t n = std::min(size, sizeof(pending_) - pending_len_);
+            std::memcpy(pending_ + pending_len_, in, n);
+            pending_len_ += n;
+            in += n;
+            size -= n;
+            if(!size) {
+                return;
+            }
+            absorb(pending_, pending_len_, true);
+            pending_len_ = 0;
+        }
+        absorb(in, size, false);
+    }
+
+    void finalize(unsigned char out[OUT_LEN]) const {
+        if(pending_len_) {
+            blake3_hasher rest(*this);
+            rest.pending_len_ = 0;
+            rest.absorb(pending_, pending_len_, false);
+            rest.finalize(out);
+            return;
+        }
+
+        output o = chunk_output();
+        for(std::size_t i = stack_len_; i > 0; --i) {
+            std::uint32_t right[8];
+            o.chaining_value(right);
+            o = parent_output(stack_[i - 1], right);
+        }
+
+        std::uint32_t words[16];
+        compress(o.cv, o.block, 0, o.block_len, o.flags | ROOT, words);
+        for(std::size_t i = 0; i < OUT_LEN / 4; ++i) {
+            store_le(out + 4 * i, words[i]);
+        }
+    }
+
+    static std::string to_hex(const unsigned char hash[OUT_LEN]) {
+        static const char digits[] = "0123456789abcdef";
+        std::string s(OUT_LEN * 2, '0');
+        for(std::size_t i = 0; i < OUT_LEN; ++i) {
+            s[2 * i] = digits[hash[i] >> 4];
+            s[2 * i + 1] = digits[hash[i] & 15];
+        }
+        return s;
+    }
+
+private:
+    enum flag : std::uint32_t {
+        CHUNK_START = 1,
+        CHUNK_END = 2,
+        PARENT = 4,
+        ROOT = 8
+    };
+
+    struct output {
+        std::uint32_t cv[8];
+        std::uint32_t block[16];
+        std::uint64_t counter;
+        std::uint32_t block_len;
+        std::uint32_t flags;
+
+        void chaining_value(std::uint32_t out[8]) const {
+            std::uint32_t words[16];
+            compress(cv, block, counter, block_len, flags, words);
+            std::memcpy(out, words, 8 * sizeof(std::uint32_t));
+        }
+    };
+
+    std::uint32_t key_[8];
+
+    // The chunk being hashed
+    std::uint32_t cv_[8];
+    std::uint64_t chunk_counter_;
+    unsigned char block_[BLOCK_LEN];
+    std::size_t block_len_;
+    std::size_t blocks_compressed_;
+
+    // Chaining values of completed subtrees; 54 levels cover 2^64 bytes
+    std::uint32_t stack_[54][8];
+    std::size_t stack_len_;
+
+    // Whole chunks waiting to be hashed in parallel, which starts at a chunk boundary
+    unsigned char pending_[8 * CHUNK_LEN];
+    std::size_t pending_len_;
+
+    static const std::uint32_t* iv() {
+        static const std::uint32_t IV[8] = {
+            0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+        };
+        return IV;
+    }
+
+    // The message word order for each round (the permutation applied 0-6 times)
+    static const unsigned char (*schedule())[16] {
+        static const unsigned char SCHEDULE[7][16] = {
+            {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+            {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+            {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+            {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+            {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+            {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+            {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+        };
+        return SCHEDULE;
+    }
+
+    static std::uint32_t rotr(std::uint32_t x, unsigned n) { return (x >> n) | (x << (32 - n)); }
+
+    static void g(std::uint32_t* s, int a, int b, int c, int d, std::uint32_t x, std::uint32_t y) {
+        s[a] = s[a] + s[b] + x;
+        s[d] = rotr(s[d] ^ s[a], 16);
+        s[c] = s[c] + s[d];
+        s[b] = rotr(s[b] ^ s[c], 12);
+        s[a] = s[a] + s[b] + y;
+        s[d] = rotr(s[d] ^ s[a], 8);
+        s[c] = s[c] + s[d];
+        s[b] = rotr(s[b] ^ s[c], 7);
+    }
+
+    static void round(std::uint32_t* s, const std::uint32_t* m, const unsigned char* sched) {
+        g(s, 0, 4, 8, 12, m[sched[0]], m[sched[1]]);
+        g(s, 1, 5, 9, 13, m[sched[2]], m[sched[3]]);
+        g(s, 2, 6, 10, 14, m[sched[4]], m[sched[5]]);
+        g(s, 3, 7, 11, 15, m[sched[6]], m[sched[7]]);
+        g(s, 0, 5, 10, 15, m[sched[8]], m[sched[9]]);
+        g(s, 1, 6, 11, 12, m[sched[10]], m[sched[11]]);
+        g(s, 2, 7, 8, 13, m[sched[12]], m[sched[13]]);
+        g(s, 3, 4, 9, 14, m[sched[14]], m[sched[15]]);
+    }
+
+    static void compress(const std::uint32_t cv[8], const std::uint32_t block[16], std::uint64_t counter,
+                         std::uint32_t block_len, std::uint32_t flags, std::uint32_t out[16]) {
+        const unsigned char (*SCHEDULE)[16] = schedule();
+        std::uint32_t s[16] = {
+            cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+            iv()[0], iv()[1], iv()[2], iv()[3],
+            (std::uint32_t)counter, (std::uint32_t)(counter >> 32), block_len, flags
+        };
+
+        round(s, block, SCHEDULE[0]);
+        round(s, block, SCHEDULE[1]);
+        round(s, block, SCHEDULE[2]);
+        round(s, block, SCHEDULE[3]);
+        round(s, block, SCHEDULE[4]);
+        round(s, block, SCHEDULE[5]);
+        round(s, block, SCHEDULE[6]);
+
+        for(int i = 0; i < 8; ++i) {
+            out[i] = s[i] ^ s[i + 8];
+            out[i + 8] = s[i + 8] ^ cv[i];
+        }
+    }
+
+    static void load_words(const unsigned char* p, std::uint32_t words[16]) {
+        for(int i = 0; i < 16; ++i) {
+            words[i] = (std::uint32_t)p[4 * i] | ((std::uint32_t)p[4 * i + 1] << 8) |
+                       ((std::uint32_t)p[4 * i + 2] << 16) | ((std::uint32_t)p[4 * i + 3] << 24);
+        }
+    }
+
+    static void store_le(unsigned char* p, std::uint32_t w) {
+        p[0] = (unsigned char)w;
+        p[1] = (unsigned char)(w >> 8);
+        p[2] = (unsigned char)(w >> 16);
+        p[3] = (unsigned char)(w >> 24);
+    }
+
+    /**
+     * Hashes input into the chunk state, and whole chunks from a chunk boundary in parallel.
+     *
+     * @param more Whether more input is known to follow, so that the last chunk can't be the root.
+     */
+    void absorb(const unsigned char* in, std::size_t size, bool more) {
+        while(size) {
+            if(chunk_len() == CHUNK_LEN) {
+                finish_chunk();
+            }
+
+            if(chunk_len() == 0) {
+                std::size_t n = hash_chunks(in, size, more);
+                in += n;
+                size -= n;
+                if(!size) {
+                    break;
+                }
+            }
+
+            if(block_len_ == BLOCK_LEN) {
+                std::uint32_t words[16];
+                load_words(block_, words);
+                std::uint32_t out[16];
+                compress(cv_, words, chunk_counter_, BLOCK_LEN, start_flag(), out);
+                std::memcpy(cv_, out, sizeof(cv_));
+                ++blocks_compressed_;
+                block_len_ = 0;
+            }
+
+            std::size_t n = BLOCK_LEN - block_len_;
+            if(n > size) {
+                n = size;
+            }
+            std::memcpy(block_ + block_len_, in, n);
+            block_len_ += n;
+            in += n;
+            size -= n;
+        }
+    }
+
+    // Adds the full chunk in the chunk state to the tree, now that there's more input after it
+    void finish_chunk() {
+        std::uint32_t cv[8];
+        chunk_output().chaining_value(cv);
+        std::uint64_t total = chunk_counter_ + 1;
+        push_chunk_cv(cv, total);
+        reset_chunk(total);
+    }
+
+    std::size_t chunk_len() const { return BLOCK_LEN * blocks_compressed_ + block_len_; }
+    std::uint32_t start_flag() const { return blocks_compressed_ == 0 ? (std::uint32_t)CHUNK_START : 0u; }
+
+    void reset_chunk(std::uint64_t counter) {
+        std::memcpy(cv_, key_, sizeof(cv_));
+        chunk_counter_ = counter;
+        block_len_ = 0;
+        blocks_compressed_ = 0;
+    }
+
+    output chunk_output() const {
+        output o;
+        std::memcpy(o.cv, cv_, sizeof(o.cv));
+        unsigned char padded[BLOCK_LEN] = {0};
+        std::memcpy(padded, block_, block_len_);
+        load_words(padded, o.block);
+        o.counter = chunk_counter_;
+        o.block_len = (std::uint32_t)block_len_;
+        o.flags = start_flag() | CHUNK_END;
+        return o;
+    }
+
+    output parent_output(const std::uint32_t left[8], const std::uint32_t right[8]) const {
+        output o;
+        std::memcpy(o.cv, key_, sizeof(o.cv));
+        std::memcpy(o.block, left, 8 * sizeof(std::uint32_t));
+        std::memcpy(o.block + 8, right, 8 * sizeof(std::uint32_t));
+        o.counter = 0;
+        o.block_len = BLOCK_LEN;
+        o.flags = PARENT;
+        return o;
+    }
+
+    typedef std::uint32_t lanes4 __attribute__((vector_size(16)));
+    typedef std::uint32_t lanes8 __attribute__((vector_size(32)));
+
+    template<typename V>
+    __attribute__((always_inline))
+    static inline void g_wide(V* s, int a, int b, int c, int d, V const& x, V const& y) {
+        s[a] = s[a] + s[b] + x;
+        s[d] = (s[d] ^ s[a]) >> 16 | (s[d] ^ s[a]) << 16;
+        s[c] = s[c] + s[d];
+        s[b] = (s[b] ^ s[c]) >> 12 | (s[b] ^ s[c]) << 20;
+        s[a] = s[a] + s[b] + y;
+        s[d] = (s[d] ^ s[a]) >> 8 | (s[d] ^ s[a]) << 24;
+        s[c] = s[c] + s[d];
+        s[b] = (s[b] ^ s[c]) >> 7 | (s[b] ^ s[c]) << 25;
+    }
+
+    /**
+     * Works out the chaining values of LANES whole chunks at once, lane i holding chunk i, the
+     * same way compress does for one.
+     *
+     * @param in      The chunks, one after the other.
+     * @param key     The key words.
+     * @param counter The first chunk's number.
+     * @param out     Where to put each chunk's chaining value.
+     */
+    template<typename V, std::size_t LANES>
+    __attribute__((always_inline))
+    static inline void hash_chunks_wide(const unsigned char* in, const std::uint32_t key[8], std::uint64_t counter,
+                                        std::uint32_t out[][8]) {
+        const unsigned char (*sched)[16] = schedule();
+        V h[8], lo, hi;
+        for(std::size_t i = 0; i < 8; ++i) {
+            h[i] = V{} + key[i];
+        }
+        for(std::size_t lane = 0; lane < LANES; ++lane) {
+            lo[lane] = (std::uint32_t)(counter + lane);
+            hi[lane] = (std::uint32_t)((counter + lane) >> 32);
+        }
+
+        for(std::size_t b = 0; b < CHUNK_LEN / BLOCK_LEN; ++b) {
+            V m[16];
+            for(std::size_t lane = 0; lane < LANES; ++lane) {
+                std::uint32_t words[16];
+                load_words(in + lane * CHUNK_LEN + b * BLOCK_LEN, words);
+                for(std::size_t w = 0; w < 16; ++w) {
+                    m[w][lane] = words[w];
+                }
+            }
+            std::uint32_t flags = (b == 0 ? (std::uint32_t)CHUNK_START : 0u)
+                                  | (b == CHUNK_LEN / BLOCK_LEN - 1 ? (std::uint32_t)CHUNK_END : 0u);
+            V s[16] = {
+                h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7],
+                V{} + iv()[0], V{} + iv()[1], V{} + iv()[2], V{} + iv()[3],
+                lo, hi, V{} + (std::uint32_t)BLOCK_LEN, V{} + flags
+            };
+            for(int r = 0; r < 7; ++r) {
+                const unsigned char* k = sched[r];
+                g_wide(s, 0, 4, 8, 12, m[k[0]], m[k[1]]);
+                g_wide(s, 1, 5, 9, 13, m[k[2]], m[k[3]]);
+                g_wide(s, 2, 6, 10, 14, m[k[4]], m[k[5]]);
+                g_wide(s, 3, 7, 11, 15, m[k[6]], m[k[7]]);
+                g_wide(s, 0, 5, 10, 15, m[k[8]], m[k[9]]);
+                g_wide(s, 1, 6, 11, 12, m[k[10]], m[k[11]]);
+                g_wide(s, 2, 7, 8, 13, m[k[12]], m[k[13]]);
+                g_wide(s, 3, 4, 9, 14, m[k[14]], m[k[15]]);
+            }
+            for(std::size_t i = 0; i < 8; ++i) {
+                h[i] = s[i] ^ s[i + 8];
+            }
+        }
+
+        for(std::size_t lane = 0; lane < LANES; ++lane) {
+            for(std::size_t i = 0; i < 8; ++i) {
+                out[lane][i] = h[i][lane];
+            }
+        }
+    }
+
+    static void hash_chunks4(const unsigned char* in, const std::uint32_t key[8], std::uint64_t counter,
+                             std::uint32_t out[][8]) {
+        hash_chunks_wide<lanes4, 4>(in, key, counter, out);
+    }
+
+#if defined(__x86_64__)
+    __attribute__((target("avx2")))
+    static void hash_chunks8(const unsigned char* in, const std::uint32_t key[8], std::uint64_t counter,
+                             std::uint32_t out[][8]) {
+        hash_chunks_wide<lanes8, 8>(in, key, counter, out);
+    }
+
+    static bool avx2() {
+        static const bool supported = (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+        return supported;
+    }
+#endif
+
+    /**
+     * Hashes as many whole chunks from the start of in as can go in parallel, leaving at least
+     * one byte for the chunk state unless more is to come. The current chunk has to be empty.
+     *
+     * @return How many bytes of in were hashed.
+     */
+    std::size_t hash_chunks(const unsigned char* in, std::size_t size, bool more) {
+        std::uint32_t cvs[8][8];
+        std::size_t done = 0;
+        std::size_t whole = more ? size : size - 1;
+#if defined(__x86_64__)
+        if(avx2()) {
+            for(; whole - done >= 8 * CHUNK_LEN; done += 8 * CHUNK_LEN) {
+                hash_chunks8(in + done, key_, chunk_counter_, cvs);
+                push_chunk_cvs(cvs, 8);
+            }
+        }
+#endif
+        for(; whole - done >= 4 * CHUNK_LEN; done += 4 * CHUNK_LEN) {
+            hash_chunks4(in + done, key_, chunk_counter_, cvs);
+            push_chunk_cvs(cvs, 4);
+        }
+        return done;
+    }
+
+    void push_chunk_cvs(std::uint32_t cvs[][8], std::size_t n) {
+        for(std::size_t i = 0; i < n; ++i) {
+            push_chunk_cv(cvs[i], chunk_counter_ + 1);
+            reset_chunk(chunk_counter_ + 1);
+        }
+    }
+
+    // Merges completed subtrees: one merge for each trailing zero bit of the chunk count
+    void push_chunk_cv(std::uint32_t cv[8], std::uint64_t total_chunks) {
+        while((total_chunks & 1) == 0) {
+            parent_output(stack_[--stack_len_], cv).chaining_value(cv);
+            total_chunks >>= 1;
+        }
+        std::memcpy(stack_[stack_len_++], cv, 8 * sizeof(std::uint32_t));
+    }
+};
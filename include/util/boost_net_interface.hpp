@@ -46,4 +46,25 @@ private:
     boost::asio::ip::tcp::socket& sock_;
 };
 
+// Lets socket_net_interface construct its socket before its boost_net_interface base
+struct socket_holder {
+    boost::asio::ip::tcp::socket held_socket_;
+
+    socket_holder(boost::asio::io_service& service)
+    : held_socket_(service) {}
+};
+
+/**
+ * A boost_net_interface that owns its socket, so it can be handed around on its own.
+ */
+class socket_net_interface : private socket_holder, public boost_net_interface {
+public:
+    socket_net_interface(boost::asio::io_service& service)
+    : socket_holder(service), boost_net_interface(held_socket_) {}
+
+    boost::asio::ip::tcp::socket& socket() {
+        return held_socket_;
+    }
+};
+
 #endif // BOOST_NET_INTERFACE
@@ -0,0 +1,517 @@
+/* ========================================================================
+   $HEADER FILE
+   $File: compression.hpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/19 $
+   $Description: $
+   $    Compression of the data channel. A session that negotiated a codec
+   $    (see hello_packet) wraps its data channel for file contents in a
+   $    compressed_net_interface, which cuts what's sent into frames of up
+   $    to FRAME_SIZE bytes, each a frame_header and the frame's bytes,
+   $    compressed or not as the header says. A frame that doesn't shrink
+   $    is sent as it is, and after a few of those in a row the next ones
+   $    aren't even tried, so already-compressed files cost next to nothing.
+   $    Frames are compressed on a pool of worker threads, several at a
+   $    time, and sent in order. Small frames (most often whole small
+   $    files) are compressed against a shared dictionary if the session
+   $    has one (see dictionary.hpp); the header says which version.
+   $Revisions: $
+   ======================================================================== */
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <time.h>
+#include <zlib.h>
+#include <util/log.hpp>
+#include <util/dictionary.hpp>
+#include <util/lz4.hpp>
+#include <util/metrics.hpp>
+#include <util/net_interface.h>
+
+enum codec : uint8_t {
+    CODEC_NONE,
+    CODEC_LZ4,          // Fast: several hundred MB/s a core
+    CODEC_DEFLATE       // Smaller, and much slower; level 1-9 as for zlib
+};
+
+/**
+ * Parses a codec name as given on the command line: "none", "lz4", "deflate"
+ * or "deflate:level".
+ *
+ * @return false if it isn't one.
+ */
+inline bool parse_codec(std::string const& text, codec& out, int& level) {
+    level = 0;
+    if(text == "none" || text == "lz4") {
+        out = text == "lz4" ? CODEC_LZ4 : CODEC_NONE;
+        return true;
+    } else if(text.compare(0, 7, "deflate") != 0) {
+        return false;
+    }
+    out = CODEC_DEFLATE;
+    level = Z_DEFAULT_COMPRESSION;
+    if(text.size() == 7) {
+        return true;
+    }
+    if(text.size() != 9 || text[7] != ':' || text[8] < '1' || text[8] > '9') {
+        return false;
+    }
+    level = text[8] - '0';
+    return true;
+}
+
+inline char const* codec_name(codec c) {
+    return c == CODEC_LZ4 ? "lz4" : c == CODEC_DEFLATE ? "deflate" : "none";
+}
+
+/**
+ * Compresses size bytes from in into out (replacing its contents) with the given
+ * codec, against dict if there is one.
+ *
+ * @return false if the result wouldn't be smaller than the input.
+ */
+inline bool compress_frame(codec c, int level, void const* in, std::size_t size, std::vector<char>& out,
+                           dictionary const* dict = nullptr) {
+    if(c == CODEC_LZ4) {
+        out.resize(lz4::bound(size));
+        std::size_t n = lz4::compress(in, size, out.data(), size - 1, dict ? &dict->lz4_table : nullptr);
+        out.resize(n);
+        return n != 0;
+    } else if(c != CODEC_DEFLATE) {
+        return false;
+    }
+
+    out.resize(compressBound(size));
+    z_stream zs;
+    std::memset(&zs, 0, sizeof(zs));
+    if(deflateInit(&zs, level) != Z_OK) {
+        return false;
+    }
+    bool ok = !dict || deflateSetDictionary(&zs, (Bytef const*)dict->data.data(), dict->data.size()) == Z_OK;
+    zs.next_in = (Bytef*)in;
+    zs.avail_in = size;
+    zs.next_out = (Bytef*)out.data();
+    zs.avail_out = out.size();
+    ok = ok && deflate(&zs, Z_FINISH) == Z_STREAM_END && zs.total_out < size;
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return ok;
+}
+
+/**
+ * Decompresses a frame that comes to exactly out_size bytes.
+ *
+ * @param dict The dictionary it was compressed with, if any.
+ * @return false if it's corrupt.
+ */
+inline bool decompress_frame(codec c, void const* in, std::size_t size, void* out, std::size_t out_size,
+                             dictionary const* dict = nullptr) {
+    if(c == CODEC_LZ4) {
+        return lz4::decompress(in, size, out, out_size, dict ? &dict->lz4_table : nullptr);
+    } else if(c != CODEC_DEFLATE) {
+        return false;
+    }
+
+    z_stream zs;
+    std::memset(&zs, 0, sizeof(zs));
+    if(inflateInit(&zs) != Z_OK) {
+        return false;
+    }
+    zs.next_in = (Bytef*)in;
+    zs.avail_in = size;
+    zs.next_out = (Bytef*)out;
+    zs.avail_out = out_size;
+    int ret = inflate(&zs, Z_FINISH);
+    if(ret == Z_NEED_DICT && dict
+       && inflateSetDictionary(&zs, (Bytef const*)dict->data.data(), dict->data.size()) == Z_OK) {
+        ret = inflate(&zs, Z_FINISH);
+    }
+    bool ok = ret == Z_STREAM_END && zs.total_out == out_size;
+    inflateEnd(&zs);
+    return ok;
+}
+
+/**
+ * What compression achieves and what it costs, across every compressed_net_interface.
+ */
+struct compression_metrics {
+    counter& input_bytes;
+    counter& output_bytes;
+    counter& frames;
+    counter& bypassed_frames;
+    histogram& compress_cpu;
+    histogram& decompress_cpu;
+
+    static compression_metrics& get() {
+        static compression_metrics m;
+        return m;
+    }
+
+private:
+    compression_metrics()
+    : input_bytes(metrics::instance().get_counter("compression_input_bytes_total", "",
+                                                  "Bytes given to compressed data channels to send.")),
+      output_bytes(metrics::instance().get_counter("compression_output_bytes_total", "",
+                                                   "Bytes compressed data channels sent for them, frame headers included.")),
+      frames(metrics::instance().get_counter("compression_frames_total", "", "Frames sent on compressed data channels.")),
+      bypassed_frames(metrics::instance().get_counter("compression_bypassed_frames_total", "",
+                                                      "Frames sent uncompressed because they didn't shrink or weren't tried.")),
+      compress_cpu(metrics::instance().get_histogram("compression_cpu_seconds", "op=\"compress\"",
+                                                     "CPU time spent compressing or decompressing each frame.")),
+      decompress_cpu(metrics::instance().get_histogram("compression_cpu_seconds", "op=\"decompress\"",
+                                                       "CPU time spent compressing or decompressing each frame.")) {}
+};
+
+// CPU time used by the calling thread, in ns
+inline std::uint64_t thread_cpu_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (std::uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Threads that compress frames for every compressed_net_interface. There are
+ * none on a single core, where frames are compressed by the sending thread.
+ */
+class compression_pool {
+public:
+    static compression_pool& instance() {
+        static compression_pool pool;
+        return pool;
+    }
+
+    std::size_t size() const { return threads_.size(); }
+
+    void run(std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            jobs_.push_back(std::move(job));
+        }
+        wake_.notify_one();
+    }
+
+    ~compression_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        for(std::thread& t : threads_) {
+            t.join();
+        }
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::deque<std::function<void()>> jobs_;
+    bool stopping_;
+    std::vector<std::thread> threads_;
+
+    compression_pool() : stopping_(false) {
+        unsigned cores = std::thread::hardware_concurrency();
+        std::size_t count = cores > 1 ? std::min(cores, 4u) : 0;
+        for(std::size_t i = 0; i < count; ++i) {
+            threads_.emplace_back([this] {
+                std::unique_lock<std::mutex> lock(mutex_);
+                for(;;) {
+                    wake_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+                    if(jobs_.empty()) {
+                        return;
+                    }
+                    std::function<void()> job = std::move(jobs_.front());
+                    jobs_.pop_front();
+                    lock.unlock();
+                    job();
+                    lock.lock();
+                }
+            });
+        }
+    }
+};
+
+/**
+ * A data channel whose contents are compressed in frames. What's sent is held
+ * back until a frame fills up, so the sender must flush() once it's done.
+ * Anything sent outside the compressed contents (e.g. an upload's status byte)
+ * goes on the underlying interface.
+ */
+class compressed_net_interface : public net_interface {
+public:
+    static const std::size_t FRAME_SIZE = 64 * 1024;
+
+    // Frames no bigger than this are compressed against the dictionary
+    static const std::size_t DICTIONARY_FRAME_MAX = 16 * 1024;
+
+    struct frame_header {
+        std::uint8_t codec;         // How the frame's bytes are stored; CODEC_NONE if they're as they were
+        std::uint8_t reserved[3];
+        std::uint32_t raw_size;
+        std::uint32_t stored_size;
+        std::uint32_t dictionary;   // The version it was compressed against, or 0
+    };
+
+    /**
+     * @param inner The data channel.
+     * @param c     The codec to compress what's sent with.
+     * @param level Its level, for CODEC_DEFLATE.
+     * @param dict  The dictionary to compress small frames against, if any.
+     * @param known The dictionaries received frames may have been compressed against, if any.
+     */
+    compressed_net_interface(net_interface& inner, codec c, int level,
+                             std::shared_ptr<dictionary const> dict = nullptr, dictionary_set const* known = nullptr)
+    : inner_(inner), codec_(c), level_(level), dict_(dict), known_(known), misses_(0), skip_(0),
+      raw_bytes_(0), wire_bytes_(0), cpu_ns_(0), read_pos_(0) {}
+
+    // Waits for frames still being compressed, which refer to this
+    ~compressed_net_interface() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for(std::shared_ptr<frame> const& f : in_flight_) {
+            done_.wait(lock, [&f] { return f->done; });
+        }
+    }
+
+    compressed_net_interface(compressed_net_interface& other) = delete;
+
+    virtual void send(void* buf, size_t size) {
+        char const* in = (char const*)buf;
+        while(size) {
+            if(!filling_) {
+                filling_.reset(new frame());
+                filling_->raw.reserve(FRAME_SIZE);
+            }
+            std::size_t n = std::min(size, FRAME_SIZE - filling_->raw.size());
+            filling_->raw.insert(filling_->raw.end(), in, in + n);
+            in += n;
+            size -= n;
+            if(filling_->raw.size() == FRAME_SIZE) {
+                submit();
+            }
+        }
+    }
+
+    /**
+     * Sends everything that's been given to send().
+     *
+     * @return false if it couldn't be sent.
+     */
+    bool flush() {
+        try {
+            if(filling_ && !filling_->raw.empty()) {
+                submit();
+            }
+            while(!in_flight_.empty()) {
+                write_oldest();
+            }
+        } catch(net_interface::error& e) {
+            LOG_ERROR("Network error while sending file: " << e.what());
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Sends a frame that was made earlier (e.g. one of a file stored compressed) as it is,
+     * after everything that's been given to send().
+     *
+     * @param data The frame_header and the frame's bytes.
+     * @throws net_interface::error if it couldn't be sent.
+     */
+    void send_stored(void const* data, std::size_t size) {
+        if(filling_ && !filling_->raw.empty()) {
+            submit();
+        }
+        while(!in_flight_.empty()) {
+            write_oldest();
+        }
+
+        frame_header h;
+        std::memcpy(&h, data, sizeof(h));
+        compression_metrics& m = compression_metrics::get();
+        if(h.codec == CODEC_NONE) {
+            m.bypassed_frames.add();
+        }
+        m.frames.add();
+        m.input_bytes.add(h.raw_size);
+        m.output_bytes.add(size);
+        raw_bytes_ += h.raw_size;
+        wire_bytes_ += size;
+        inner_.send(const_cast<void*>(data), size);
+    }
+
+    virtual void receive(void* buf, size_t size) {
+        char* out = (char*)buf;
+        while(size) {
+            if(read_pos_ == read_buf_.size()) {
+                read_frame();
+            }
+            std::size_t n = std::min(size, read_buf_.size() - read_pos_);
+            std::memcpy(out, read_buf_.data() + read_pos_, n);
+            read_pos_ += n;
+            out += n;
+            size -= n;
+        }
+    }
+
+    // Bytes of contents sent or received so far, the bytes that went over the wire for them and
+    // the CPU time spent compressing or decompressing them
+    std::uint64_t raw_bytes() const { return raw_bytes_; }
+    std::uint64_t wire_bytes() const { return wire_bytes_; }
+    std::uint64_t cpu_ns() const { return cpu_ns_; }
+
+private:
+    struct frame {
+        std::vector<char> raw;
+        std::vector<char> out;      // The header and stored bytes, once done
+        bool attempt = true;
+        bool compressed = false;
+        bool done = false;
+        std::uint64_t cpu_ns = 0;
+    };
+
+    // After this many frames in a row don't shrink, the next SKIP_FRAMES aren't tried
+    static const unsigned MISS_LIMIT = 4;
+    static const unsigned SKIP_FRAMES = 16;
+
+    net_interface& inner_;
+    codec codec_;
+    int level_;
+    std::shared_ptr<dictionary const> dict_;
+    dictionary_set const* known_;
+
+    std::shared_ptr<frame> filling_;
+    std::deque<std::shared_ptr<frame>> in_flight_;
+    std::mutex mutex_;
+    std::condition_variable done_;
+    unsigned misses_;
+    unsigned skip_;
+
+    std::uint64_t raw_bytes_;
+    std::uint64_t wire_bytes_;
+    std::uint64_t cpu_ns_;
+
+    std::vector<char> read_buf_;
+    std::size_t read_pos_;
+    std::vector<char> stored_;
+
+    void encode(frame& f) const {
+        std::uint64_t start = thread_cpu_ns();
+        std::vector<char> packed;
+        dictionary const* dict = dict_ && f.raw.size() <= DICTIONARY_FRAME_MAX ? dict_.get() : nullptr;
+        f.compressed = f.attempt && compress_frame(codec_, level_, f.raw.data(), f.raw.size(), packed, dict);
+        if(f.attempt) {
+            f.cpu_ns = thread_cpu_ns() - start;
+        }
+        std::vector<char> const& body = f.compressed ? packed : f.raw;
+
+        frame_header h;
+        std::memset(&h, 0, sizeof(h));
+        h.codec = f.compressed ? codec_ : CODEC_NONE;
+        h.raw_size = f.raw.size();
+        h.stored_size = body.size();
+        h.dictionary = f.compressed && dict ? dict->version : 0;
+        f.out.resize(sizeof(h) + body.size());
+        std::memcpy(f.out.data(), &h, sizeof(h));
+        std::memcpy(f.out.data() + sizeof(h), body.data(), body.size());
+    }
+
+    // Hands the filling frame to the pool (or compresses it here) and sends the oldest ones
+    // once enough are in flight
+    void submit() {
+        std::shared_ptr<frame> f = std::move(filling_);
+        if(skip_) {
+            f->attempt = false;
+            --skip_;
+        }
+
+        compression_pool& pool = compression_pool::instance();
+        in_flight_.push_back(f);
+        if(pool.size() && f->attempt) {
+            pool.run([this, f] {
+                encode(*f);
+                std::lock_guard<std::mutex> lock(mutex_);
+                f->done = true;
+                done_.notify_all();
+            });
+        } else {
+            encode(*f);
+            std::lock_guard<std::mutex> lock(mutex_);
+            f->done = true;
+        }
+        while(in_flight_.size() > 2 * std::max<std::size_t>(pool.size(), 1)) {
+            write_oldest();
+        }
+    }
+
+    void write_oldest() {
+        std::shared_ptr<frame> f = in_flight_.front();
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            done_.wait(lock, [&f] { return f->done; });
+        }
+        in_flight_.pop_front();
+
+        compression_metrics& m = compression_metrics::get();
+        if(f->attempt) {
+            m.compress_cpu.record(f->cpu_ns);
+            cpu_ns_ += f->cpu_ns;
+            if(f->compressed) {
+                misses_ = 0;
+            } else if(++misses_ == MISS_LIMIT) {
+                misses_ = 0;
+                skip_ = SKIP_FRAMES;
+            }
+        }
+        if(!f->compressed) {
+            m.bypassed_frames.add();
+        }
+        m.frames.add();
+        m.input_bytes.add(f->raw.size());
+        m.output_bytes.add(f->out.size());
+        raw_bytes_ += f->raw.size();
+        wire_bytes_ += f->out.size();
+        inner_.send(f->out.data(), f->out.size());
+    }
+
+    void read_frame() {
+        frame_header h;
+        inner_.receive(&h, sizeof(h));
+        if(h.raw_size > FRAME_SIZE || h.stored_size > lz4::bound(FRAME_SIZE) || (h.codec == CODEC_NONE && h.stored_size != h.raw_size)) {
+            throw net_interface::error("Received a malformed compressed frame", net_interface::error_code::other);
+        }
+        read_buf_.resize(h.raw_size);
+        read_pos_ = 0;
+        raw_bytes_ += h.raw_size;
+        wire_bytes_ += sizeof(h) + h.stored_size;
+        if(h.codec == CODEC_NONE) {
+            inner_.receive(read_buf_.data(), h.raw_size);
+            return;
+        }
+
+        stored_.resize(h.stored_size);
+        inner_.receive(stored_.data(), h.stored_size);
+        std::shared_ptr<dictionary const> dict;
+        if(h.dictionary && !(known_ && (dict = known_->find(h.dictionary)))) {
+            throw net_interface::error("Received a frame compressed against an unknown dictionary",
+                                       net_interface::error_code::other);
+        }
+        std::uint64_t start = thread_cpu_ns();
+        if(!decompress_frame((codec)h.codec, stored_.data(), h.stored_size, read_buf_.data(), h.raw_size, dict.get())) {
+            throw net_interface::error("Received a corrupt compressed frame", net_interface::error_code::other);
+        }
+        std::uint64_t spent = thread_cpu_ns() - start;
+        compression_metrics::get().decompress_cpu.record(spent);
+        cpu_ns_ += spent;
+    }
+};
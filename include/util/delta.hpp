@@ -0,0 +1,258 @@
+/* ========================================================================
+   $HEADER FILE
+   $File: delta.hpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/18 $
+   $Description: $
+   $    rsync-style deltas. The side with the old version of a file cuts it
+   $    into fixed-size blocks and sends a signature of each: a weak checksum
+   $    that can be rolled along a byte at a time and a strong hash. The
+   $    side with the new version slides a block-sized window over it,
+   $    looking the window's weak checksum up at every offset and confirming
+   $    hits with the strong hash, and describes the new version as a series
+   $    of copies of old blocks and literal bytes in between.
+   $
+   $    On the wire, the delta is a series of ops, each a delta_op byte
+   $    followed by its arguments: DELTA_LITERAL a uint32 length and that
+   $    many bytes, DELTA_COPY a uint32 first block and uint32 block count,
+   $    and DELTA_END nothing.
+   $Revisions: $
+   ======================================================================== */
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+#include <util/blake3.hpp>
+#include <util/packet.hpp>
+
+enum delta_op : uint8_t {
+    DELTA_LITERAL,
+    DELTA_COPY,
+    DELTA_END
+};
+
+// Literals are sent in pieces no bigger than this
+const std::uint32_t DELTA_MAX_LITERAL = 64 * 1024;
+
+/**
+ * Returns the block size to use for signatures of a file of the given size:
+ * about its square root (which balances the size of the signatures against
+ * how much around each change has to be sent), between 1 KiB and 128 KiB.
+ */
+inline std::uint32_t delta_block_size(std::uint64_t file_size) {
+    std::uint64_t size = (std::uint64_t)std::sqrt((double)file_size) & ~std::uint64_t(63);
+    return (std::uint32_t)std::min<std::uint64_t>(std::max<std::uint64_t>(size, 1024), 128 * 1024);
+}
+
+/**
+ * The strong half of a block's signature: the first 16 bytes of its BLAKE3 hash.
+ */
+inline void delta_strong_hash(void const* data, std::size_t size, unsigned char* out) {
+    blake3_hasher h;
+    h.update(data, size);
+    unsigned char full[blake3_hasher::OUT_LEN];
+    h.finalize(full);
+    std::memcpy(out, full, sizeof(block_signature::strong));
+}
+
+/**
+ * rsync's weak checksum: two 16-bit sums of a window's bytes, one of them
+ * weighted by position, which can be updated as the window moves along by a
+ * byte without looking at the bytes in between.
+ */
+class rolling_checksum {
+public:
+    rolling_checksum() : a_(0), b_(0), size_(0) {}
+
+    void reset(unsigned char const* data, std::size_t size) {
+        a_ = b_ = 0;
+        size_ = size;
+        for(std::size_t i = 0; i < size; ++i) {
+            a_ += data[i];
+            b_ += (std::uint32_t)(size - i) * data[i];
+        }
+    }
+
+    // Moves the window along by one byte: out leaves it and in joins it
+    void roll(unsigned char out, unsigned char in) {
+        a_ += in - out;
+        b_ += a_ - (std::uint32_t)size_ * out;
+    }
+
+    std::uint32_t value() const {
+        return (a_ & 0xffff) | (b_ << 16);
+    }
+
+private:
+    std::uint32_t a_;
+    std::uint32_t b_;
+    std::size_t size_;
+};
+
+/**
+ * Works out a delta from the file the signatures describe to a new version
+ * that's pushed in as it's read, passing each op to on_literal(data, size) or
+ * on_copy(first_block, count) in order. Neighbouring copies are merged.
+ */
+template<typename OnLiteral, typename OnCopy>
+class delta_encoder {
+public:
+    /**
+     * @param sigs       The signatures of the old version's blocks.
+     * @param block_size The size they were made with; only the last block may be shorter.
+     * @param base_size  The old version's size.
+     */
+    delta_encoder(std::vector<block_signature> const& sigs, std::uint32_t block_size, std::uint64_t base_size,
+                  OnLiteral on_literal, OnCopy on_copy)
+    : sigs_(sigs), block_size_(block_size), on_literal_(on_literal), on_copy_(on_copy),
+      pos_(0), literal_(0), rolling_(false), tested_(false), copy_first_(0), copy_count_(0) {
+        last_block_ = base_size % block_size ? base_size % block_size : block_size;
+        for(std::uint32_t i = 0; i < sigs.size(); ++i) {
+            // Only whole blocks can match a sliding window; a short last block is tried at the end
+            if(i + 1 < sigs.size() || last_block_ == block_size) {
+                by_weak_[sigs[i].weak].push_back(i);
+            }
+        }
+    }
+
+    void update(void const* data, std::size_t size) {
+        buf_.insert(buf_.end(), (unsigned char const*)data, (unsigned char const*)data + size);
+        scan();
+
+        // Drop what's been dealt with once there's a fair amount of it
+        if(literal_ >= 1024 * 1024) {
+            buf_.erase(buf_.begin(), buf_.begin() + literal_);
+            pos_ -= literal_;
+            literal_ = 0;
+        }
+    }
+
+    void finish() {
+        // What's left is shorter than a block; it can still be the old version's short last block
+        std::size_t left = buf_.size() - pos_;
+        std::uint32_t last = sigs_.size() - 1;
+        if(!sigs_.empty() && left == last_block_ && last_block_ < block_size_) {
+            rolling_checksum sum;
+            sum.reset(&buf_[pos_], left);
+            unsigned char strong[sizeof(block_signature::strong)];
+            delta_strong_hash(&buf_[pos_], left, strong);
+            if(sum.value() == sigs_[last].weak && !std::memcmp(strong, sigs_[last].strong, sizeof(strong))) {
+                copy(last);
+                pos_ += left;
+                literal_ = pos_;
+            }
+        }
+        flush_literal(buf_.size());
+        flush_copy();
+        buf_.clear();
+        pos_ = literal_ = 0;
+    }
+
+private:
+    std::vector<block_signature> const& sigs_;
+    std::uint32_t block_size_;
+    std::uint32_t last_block_;
+    std::unordered_map<std::uint32_t, std::vector<std::uint32_t>> by_weak_;
+    OnLiteral on_literal_;
+    OnCopy on_copy_;
+
+    std::vector<unsigned char> buf_;
+    std::size_t pos_;               // Start of the window in buf_
+    std::size_t literal_;           // Start of the bytes before the window that no block matched
+    rolling_checksum sum_;
+    bool rolling_;                  // Whether sum_ is for the window at pos_
+    bool tested_;                   // Whether that window has been looked up already
+    std::uint32_t copy_first_;      // The run of copies that hasn't been passed on yet
+    std::uint32_t copy_count_;
+
+    void scan() {
+        while(buf_.size() - pos_ >= block_size_) {
+            if(!rolling_) {
+                sum_.reset(&buf_[pos_], block_size_);
+                rolling_ = true;
+                tested_ = false;
+            }
+
+            if(!tested_) {
+                std::uint32_t block = 0;
+                if(match(block)) {
+                    flush_literal(pos_);
+                    copy(block);
+                    pos_ += block_size_;
+                    literal_ = pos_;
+                    rolling_ = false;
+                    continue;
+                }
+                tested_ = true;
+                if(pos_ - literal_ >= DELTA_MAX_LITERAL) {
+                    flush_literal(pos_);
+                }
+            }
+
+            // The window can't move along until the next byte arrives
+            if(pos_ + block_size_ == buf_.size()) {
+                break;
+            }
+            sum_.roll(buf_[pos_], buf_[pos_ + block_size_]);
+            ++pos_;
+            tested_ = false;
+        }
+    }
+
+    // Looks for an old block matching the window, preferring the one after the last copy
+    bool match(std::uint32_t& block) {
+        auto it = by_weak_.find(sum_.value());
+        if(it == by_weak_.end()) {
+            return false;
+        }
+        unsigned char strong[sizeof(block_signature::strong)];
+        delta_strong_hash(&buf_[pos_], block_size_, strong);
+        bool found = false;
+        for(std::uint32_t i : it->second) {
+            if(!std::memcmp(strong, sigs_[i].strong, sizeof(strong))) {
+                if(!found || i == copy_first_ + copy_count_) {
+                    block = i;
+                }
+                found = true;
+            }
+        }
+        return found;
+    }
+
+    void copy(std::uint32_t block) {
+        if(copy_count_ && block == copy_first_ + copy_count_) {
+            ++copy_count_;
+            return;
+        }
+        flush_copy();
+        copy_first_ = block;
+        copy_count_ = 1;
+    }
+
+    void flush_copy() {
+        if(copy_count_) {
+            on_copy_(copy_first_, copy_count_);
+            copy_count_ = 0;
+        }
+    }
+
+    // Passes on the unmatched bytes up to end
+    void flush_literal(std::size_t end) {
+        if(end > literal_) {
+            flush_copy();
+            on_literal_(&buf_[literal_], end - literal_);
+            literal_ = end;
+        }
+    }
+};
+
+template<typename OnLiteral, typename OnCopy>
+delta_encoder<OnLiteral, OnCopy> make_delta_encoder(std::vector<block_signature> const& sigs, std::uint32_t block_size,
+                                                    std::uint64_t base_size, OnLiteral on_literal, OnCopy on_copy) {
+    return delta_encoder<OnLiteral, OnCopy>(sigs, block_size, base_size, on_literal, on_copy);
+}
@@ -0,0 +1,191 @@
+/* ========================================================================
+   $HEADER FILE
+   $File: dictionary.hpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/19 $
+   $Description: $
+   $    Shared dictionaries for compressing small files. A 2 KiB JSON file
+   $    compressed on its own has too little history to find matches in;
+   $    compressed against a dictionary of what such files usually hold,
+   $    its keys and boilerplate become references into the dictionary.
+   $    The server trains one from a sample of the small files it stores
+   $    and numbers each new one, so that data compressed with an older
+   $    version can still be read as long as that version is kept.
+   $
+   $    Training is a simplified version of zstd's COVER: the samples are
+   $    cut into as many stretches as there are segments to pick, and from
+   $    each stretch the segment whose 8-byte substrings turn up in the
+   $    most samples is taken. Substrings that have been taken count for
+   $    nothing afterwards, so that the same text isn't picked twice, and
+   $    if there's still room, the stretches are gone through again.
+   $Revisions: $
+   ======================================================================== */
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <util/lz4.hpp>
+
+/**
+ * One version of a trained dictionary.
+ */
+struct dictionary {
+    std::uint32_t version;          // 0 is never used, so that it can mean "none"
+    std::vector<char> data;
+    lz4::dictionary lz4_table;      // The same, ready for lz4::compress
+
+    dictionary(std::uint32_t v, std::vector<char> const& d)
+    : version(v), data(d), lz4_table(d.data(), d.size()) {}
+};
+
+/**
+ * The dictionary versions one side knows, which may be looked up from any thread.
+ */
+class dictionary_set {
+public:
+    void add(std::shared_ptr<dictionary const> const& dict) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        versions_[dict->version] = dict;
+    }
+
+    // Returns null if the version isn't known
+    std::shared_ptr<dictionary const> find(std::uint32_t version) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = versions_.find(version);
+        return it == versions_.end() ? nullptr : it->second;
+    }
+
+    // Returns the highest version, or null if there are none
+    std::shared_ptr<dictionary const> latest() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return versions_.empty() ? nullptr : versions_.rbegin()->second;
+    }
+
+private:
+    mutable std::mutex mutex_;
+    std::map<std::uint32_t, std::shared_ptr<dictionary const>> versions_;
+};
+
+// The biggest dictionary worth training: deflate can't see further back than this
+const std::size_t DICTIONARY_SIZE = 32 * 1024;
+
+/**
+ * Builds a dictionary of at most capacity bytes from samples of the files it's for.
+ * The most useful segments go last, nearest the data, where they're cheapest to refer to.
+ *
+ * @return an empty dictionary if the samples have nothing in common.
+ */
+inline std::vector<char> train_dictionary(std::vector<std::vector<char>> const& samples, std::size_t capacity) {
+    const std::size_t K = 8;            // Length of the substrings that are counted
+    const std::size_t SEGMENT = 128;
+    const std::size_t STEP = 4;         // Segments are considered at every STEP bytes
+
+    // How many samples each substring occurs in
+    struct seen {
+        std::uint32_t samples;
+        std::uint32_t last;
+    };
+    std::unordered_map<std::uint64_t, seen> counts;
+    std::size_t total = 0;
+    for(std::uint32_t s = 0; s < samples.size(); ++s) {
+        std::vector<char> const& sample = samples[s];
+        for(std::size_t p = 0; p + K <= sample.size(); ++p) {
+            std::uint64_t key;
+            std::memcpy(&key, &sample[p], K);
+            seen& c = counts[key];
+            if(!c.samples || c.last != s) {
+                ++c.samples;
+                c.last = s;
+            }
+        }
+        total += sample.size();
+    }
+
+    // Each stretch is a run of whole samples, so that segments never straddle two
+    std::size_t wanted = std::max<std::size_t>(capacity / SEGMENT, 1);
+    std::size_t stretch = std::max<std::size_t>(total / wanted, SEGMENT);
+    std::vector<std::pair<std::uint64_t, std::vector<char>>> picked;       // Score, segment
+    std::size_t picked_bytes = 0;
+    std::vector<std::uint32_t> score;
+
+    // With fewer stretches than segments wanted, go round again for the next best ones
+    for(bool progress = true; progress && picked_bytes < capacity;) {
+        progress = false;
+        for(std::size_t first = 0; first < samples.size() && picked_bytes < capacity;) {
+            std::size_t last = first, bytes = 0;
+            while(last < samples.size() && bytes < stretch) {
+                bytes += samples[last++].size();
+            }
+
+            // The best segment in the stretch is the one whose substrings are in the most samples
+            std::uint64_t best = 0;
+            std::size_t best_sample = 0, best_pos = 0, best_len = 0;
+            for(std::size_t s = first; s < last; ++s) {
+                std::vector<char> const& sample = samples[s];
+                if(sample.size() < K) {
+                    continue;
+                }
+                std::size_t positions = sample.size() - K + 1;
+                score.resize(positions);
+                for(std::size_t p = 0; p < positions; ++p) {
+                    std::uint64_t key;
+                    std::memcpy(&key, &sample[p], K);
+                    std::uint32_t n = counts[key].samples;
+                    score[p] = n > 1 ? n : 0;
+                }
+
+                std::size_t window = std::min(SEGMENT - K + 1, positions);
+                std::uint64_t sum = 0;
+                for(std::size_t p = 0; p < window; ++p) {
+                    sum += score[p];
+                }
+                for(std::size_t start = 0;; ++start) {
+                    if(start % STEP == 0 && sum > best) {
+                        best = sum;
+                        best_sample = s;
+                        best_pos = start;
+                        best_len = std::min(SEGMENT, sample.size() - start);
+                    }
+                    if(start + window >= positions) {
+                        break;
+                    }
+                    sum += score[start + window];
+                    sum -= score[start];
+                }
+            }
+            first = last;
+            if(!best) {
+                continue;
+            }
+            progress = true;
+
+            std::vector<char> const& sample = samples[best_sample];
+            for(std::size_t p = best_pos; p + K <= best_pos + best_len; ++p) {
+                std::uint64_t key;
+                std::memcpy(&key, &sample[p], K);
+                counts[key].samples = 0;
+            }
+            best_len = std::min(best_len, capacity - picked_bytes);
+            picked.emplace_back(best, std::vector<char>(sample.begin() + best_pos, sample.begin() + best_pos + best_len));
+            picked_bytes += best_len;
+        }
+    }
+
+    std::stable_sort(picked.begin(), picked.end(),
+                     [](std::pair<std::uint64_t, std::vector<char>> const& a,
+                        std::pair<std::uint64_t, std::vector<char>> const& b) { return a.first < b.first; });
+    std::vector<char> dict;
+    dict.reserve(picked_bytes);
+    for(auto const& p : picked) {
+        dict.insert(dict.end(), p.second.begin(), p.second.end());
+    }
+    return dict;
+}
@@ -0,0 +1,282 @@
+/* ========================================================================
+   $HEADER FILE
+   $File: fastcdc.hpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/18 $
+   $Description: $
+   $    Content-defined chunking in the style of FastCDC: a gear hash rolls
+   $    over the data and a chunk ends where its top bits are all zero, so
+   $    boundaries depend only on the bytes around them and an insertion
+   $    near the start of a file moves just the chunks it touches. Cut
+   $    points below the average size need more zero bits than ones above
+   $    it (normalized chunking), which keeps chunk sizes close to average.
+   $    Nothing is hashed in the first MIN_SIZE bytes of a chunk, since no
+   $    cut can go there; past that it's a shift, an add and a test a byte.
+   $
+   $    Each byte's contribution is shifted out of the 64-bit hash after 64
+   $    more, so once a chunk is WINDOW bytes past its minimum the hash at
+   $    any point only depends on the WINDOW bytes before it. With AVX2,
+   $    stretches of SEGMENT bytes are then hashed LANES at a time, each
+   $    lane starting WINDOW bytes early to build up its hash, and the
+   $    first cut in the earliest lane that has one wins; the cuts are
+   $    exactly the ones hashing a byte at a time finds.
+   $Revisions: $
+   ======================================================================== */
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+class fastcdc {
+public:
+    static const std::size_t MIN_SIZE = 16 * 1024;
+    static const std::size_t AVG_SIZE = 64 * 1024;
+    static const std::size_t MAX_SIZE = 256 * 1024;
+
+    /**
+     * Returns the length of the chunk at the start of data.
+     *
+     * @param size How many bytes there are. If there are fewer than MAX_SIZE,
+     *             they must be the end of the input, since the last chunk ends
+     *             wherever the input does.
+     */
+    static std::size_t cut(unsigned char const* data, std::size_t size) {
+#if defined(__x86_64__)
+        if(avx2()) {
+            return cut_avx2(data, size);
+        }
+#endif
+        return cut_portable(data, size);
+    }
+
+    // The same a byte at a time, e.g. to compare against it
+    static std::size_t cut_portable(unsigned char const* data, std::size_t size) {
+        if(size <= MIN_SIZE) {
+            return size;
+        }
+        std::size_t end = size < MAX_SIZE ? size : MAX_SIZE;
+        std::size_t found = scan(data, MIN_SIZE, 0, end < AVG_SIZE ? end : AVG_SIZE, end);
+        return found ? found : end;
+    }
+
+private:
+    // Two bits either side of log2(AVG_SIZE). The top bits are used since they've
+    // mixed in the most bytes.
+    static const std::uint64_t MASK_SMALL = ~0ULL << (64 - 18);
+    static const std::uint64_t MASK_LARGE = ~0ULL << (64 - 14);
+
+    // How many bytes the hash depends on
+    static const std::size_t WINDOW = 64;
+
+    // Stretches hashed side by side, and how long each is
+    static const std::size_t LANES = 4;
+    static const std::size_t SEGMENT = 1024;
+
+    /**
+     * Rolls h on over data from i, testing the hash after each byte against the mask for where
+     * it is, up to end.
+     *
+     * @return Where the first cut is (just after the byte it's at), or 0 if there isn't one.
+     */
+    static std::size_t scan(unsigned char const* data, std::size_t i, std::uint64_t h, std::size_t normal,
+                            std::size_t end) {
+        std::uint64_t const* gear = table().values;
+        for(; i < normal && i < end; ++i) {
+            h = (h << 1) + gear[data[i]];
+            if(!(h & MASK_SMALL)) {
+                return i + 1;
+            }
+        }
+        for(; i < end; ++i) {
+            h = (h << 1) + gear[data[i]];
+            if(!(h & MASK_LARGE)) {
+                return i + 1;
+            }
+        }
+        return 0;
+    }
+
+#if defined(__x86_64__)
+    static bool avx2() {
+        static const bool supported = (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+        return supported;
+    }
+
+    static std::size_t cut_avx2(unsigned char const* data, std::size_t size) {
+        if(size <= MIN_SIZE) {
+            return size;
+        }
+        std::size_t end = size < MAX_SIZE ? size : MAX_SIZE;
+        std::size_t normal = end < AVG_SIZE ? end : AVG_SIZE;
+
+        // Until a window's worth has been hashed, the hash depends on where the chunk started
+        std::size_t i = MIN_SIZE + WINDOW < end ? MIN_SIZE + WINDOW : end;
+        std::size_t found = scan(data, MIN_SIZE, 0, normal, i);
+        for(; !found && end - i >= LANES * SEGMENT; i += LANES * SEGMENT) {
+            found = find_avx2(data, i, normal);
+        }
+        if(found) {
+            return found;
+        }
+
+        // The rest a byte at a time, starting from the hash of the window before it
+        std::uint64_t const* gear = table().values;
+        std::uint64_t h = 0;
+        for(std::size_t j = i - WINDOW; j < i; ++j) {
+            h = (h << 1) + gear[data[j]];
+        }
+        found = scan(data, i, h, normal, end);
+        return found ? found : end;
+    }
+
+    /**
+     * Looks for the first cut in the LANES * SEGMENT bytes from base, which has to be at least
+     * WINDOW bytes past where hashing started.
+     *
+     * @return Where the cut is (just after the byte it's at), or 0 if there isn't one.
+     */
+    __attribute__((target("avx2")))
+    static std::size_t find_avx2(unsigned char const* data, std::size_t base, std::size_t normal) {
+        long long const* gear = (long long const*)table().values;
+        __m256i const bytes = _mm256_set1_epi64x(0xff);
+        __m256i const large = _mm256_set1_epi64x((long long)MASK_LARGE);
+        __m256i const zero = _mm256_setzero_si256();
+
+        // Each lane reads its bytes eight at a time, starting a window early
+        __m256i at = _mm256_set_epi64x(base + 3 * SEGMENT - WINDOW, base + 2 * SEGMENT - WINDOW,
+                                       base + SEGMENT - WINDOW, base - WINDOW);
+        __m256i const step = _mm256_set1_epi64x(8);
+        __m256i h = zero;
+        for(std::size_t s = 0; s < WINDOW; s += 8, at = _mm256_add_epi64(at, step)) {
+            __m256i w = _mm256_i64gather_epi64((long long const*)data, at, 1);
+            for(int b = 0; b < 8; ++b, w = _mm256_srli_epi64(w, 8)) {
+                __m256i g = _mm256_i64gather_epi64(gear, _mm256_and_si256(w, bytes), 8);
+                h = _mm256_add_epi64(_mm256_slli_epi64(h, 1), g);
+            }
+        }
+
+        // Candidates are tested against the large mask, which is a subset of the small one, and
+        // then checked against the one for where they are. Eight bytes go by between tests, and
+        // the rare eight with a candidate are gone over again a byte at a time.
+        std::size_t first[LANES] = {0, 0, 0, 0};
+        for(std::size_t s = 0; s < SEGMENT; s += 8, at = _mm256_add_epi64(at, step)) {
+            __m256i const w = _mm256_i64gather_epi64((long long const*)data, at, 1);
+            __m256i const start = h;
+            __m256i any = zero;
+            __m256i v = w;
+            for(int b = 0; b < 8; ++b, v = _mm256_srli_epi64(v, 8)) {
+                __m256i g = _mm256_i64gather_epi64(gear, _mm256_and_si256(v, bytes), 8);
+                h = _mm256_add_epi64(_mm256_slli_epi64(h, 1), g);
+                any = _mm256_or_si256(any, _mm256_cmpeq_epi64(_mm256_and_si256(h, large), zero));
+            }
+            if(_mm256_testz_si256(any, any)) {
+                continue;
+            }
+
+            std::uint64_t lanes[LANES], words[LANES];
+            _mm256_storeu_si256((__m256i*)lanes, start);
+            _mm256_storeu_si256((__m256i*)words, w);
+            for(std::size_t l = 0; l < LANES; ++l) {
+                std::uint64_t x = lanes[l];
+                for(std::size_t b = 0; b < 8 && !first[l]; ++b) {
+                    x = (x << 1) + (std::uint64_t)gear[(words[l] >> (8 * b)) & 0xff];
+                    std::size_t pos = base + l * SEGMENT + s + b;
+                    if(!(x & (pos < normal ? MASK_SMALL : MASK_LARGE))) {
+                        first[l] = pos + 1;
+                    }
+                }
+            }
+            if(first[0]) {
+                return first[0];
+            }
+        }
+        for(std::size_t l = 1; l < LANES; ++l) {
+            if(first[l]) {
+                return first[l];
+            }
+        }
+        return 0;
+    }
+#endif
+
+    struct gear_table {
+        std::uint64_t values[256];
+
+        gear_table() {
+            // splitmix64 from a fixed seed, so that every build cuts the same chunks
+            std::uint64_t state = 0x6a09e667f3bcc908ULL;
+            for(int i = 0; i < 256; ++i) {
+                std::uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+                values[i] = z ^ (z >> 31);
+            }
+        }
+    };
+
+    static gear_table const& table() {
+        static const gear_table t;
+        return t;
+    }
+};
+
+/**
+ * Cuts a stream into chunks. Data is pushed in as it's read, in pieces of any
+ * size; every complete chunk is passed to on_chunk(data, size), and finish()
+ * passes the last one.
+ */
+template<typename OnChunk>
+class chunker {
+public:
+    explicit chunker(OnChunk on_chunk) : on_chunk_(on_chunk) {}
+
+    void update(void const* data, std::size_t size) {
+        unsigned char const* in = (unsigned char const*)data;
+
+        // Cut straight from the caller's buffer where a whole chunk is there
+        // to be found, only copying what's left over between calls
+        while(size) {
+            if(pending_.empty() && size >= fastcdc::MAX_SIZE) {
+                std::size_t n = fastcdc::cut(in, size);
+                on_chunk_(in, n);
+                in += n;
+                size -= n;
+                continue;
+            }
+            std::size_t n = std::min(size, fastcdc::MAX_SIZE - pending_.size());
+            pending_.insert(pending_.end(), in, in + n);
+            in += n;
+            size -= n;
+            if(pending_.size() == fastcdc::MAX_SIZE) {
+                std::size_t cut = fastcdc::cut(pending_.data(), pending_.size());
+                on_chunk_(pending_.data(), cut);
+                pending_.erase(pending_.begin(), pending_.begin() + cut);
+            }
+        }
+    }
+
+    void finish() {
+        std::size_t done = 0;
+        while(done < pending_.size()) {
+            std::size_t n = fastcdc::cut(pending_.data() + done, pending_.size() - done);
+            on_chunk_(pending_.data() + done, n);
+            done += n;
+        }
+        pending_.clear();
+    }
+
+private:
+    OnChunk on_chunk_;
+    std::vector<unsigned char> pending_;
+};
+
+template<typename OnChunk>
+chunker<OnChunk> make_chunker(OnChunk on_chunk) {
+    return chunker<OnChunk>(on_chunk);
+}
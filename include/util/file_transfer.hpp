@@ -1,14 +1,66 @@
 #pragma once
 
+#include <algorithm>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <boost/asio.hpp>
 #include <boost/filesystem.hpp>
 #include <fstream>
+#include <memory>
 #include <string>
 #include <stdexcept>
+#include <util/blake3.hpp>
 #include <util/net_interface.h>
+#include <util/page_cache.hpp>
+#include <util/sparse.hpp>
+#include <util/log.hpp>
+#include <util/metrics.hpp>
+#include <util/trace.hpp>
 
 const std::size_t BUF_SIZE = 1024;
 
+// How much send_file(int, ...) reads from disk at once
+const std::size_t FILE_READ_SIZE = 64 * 1024;
+
+// How much receive_file(int, ...) writes to disk at once
+const std::size_t FILE_WRITE_SIZE = 64 * 1024;
+
+/**
+ * Time spent in each phase of a transfer (per chunk) and the bytes moved.
+ */
+struct transfer_metrics {
+    histogram& disk_read;
+    histogram& disk_write;
+    histogram& net_send;
+    histogram& net_receive;
+    counter& bytes_sent;
+    counter& bytes_received;
+    counter& corrupt_blocks;
+    counter& hash_mismatches;
+
+    static transfer_metrics& get() {
+        static transfer_metrics m;
+        return m;
+    }
+
+private:
+    transfer_metrics()
+    : disk_read(io_histogram("disk_read")), disk_write(io_histogram("disk_write")),
+      net_send(io_histogram("net_send")), net_receive(io_histogram("net_receive")),
+      bytes_sent(metrics::instance().get_counter("transfer_bytes_total", "direction=\"sent\"", "File bytes moved over data channels.")),
+      bytes_received(metrics::instance().get_counter("transfer_bytes_total", "direction=\"received\"", "File bytes moved over data channels.")),
+      corrupt_blocks(metrics::instance().get_counter("transfer_corrupt_blocks_total", "",
+                                                     "Blocks of file contents that arrived with the wrong CRC32C and were asked for again.")),
+      hash_mismatches(metrics::instance().get_counter("transfer_hash_mismatches_total", "",
+                                                      "Transfers whose contents didn't match the sender's BLAKE3 hash in the end.")) {}
+
+    static histogram& io_histogram(const char* phase) {
+        return metrics::instance().get_histogram("transfer_io_seconds", std::string("phase=\"") + phase + '"',
+                                                 "Time taken by each chunk-sized disk or network operation.");
+    }
+};
+
 /**
  * Sends the given file to the remote host.
  *
@@ -17,65 +69,269 @@ const std::size_t BUF_SIZE = 1024;
  *
  * @return true if the file was successfully sent; false if not.
  */
-bool send_file(std::ifstream& file, net_interface& iface) {
+inline bool send_file(std::ifstream& file, net_interface& iface) {
     char buf[BUF_SIZE];
     boost::system::error_code error;
+    transfer_metrics& m = transfer_metrics::get();
+    std::uint64_t chunk = 0;
+    std::uint64_t sent = 0;
+
+    TRACE_SPAN(span, "send_file", "transfer");
 
     // Read the file in 1KB chunks and send them to the other host
     while(!file.eof()) {
-        file.read(buf, BUF_SIZE);
+        bool sampled = tracer::sample_chunk(chunk++);
+        {
+            trace_span chunk_span("disk_read", "chunk", sampled);
+            scoped_timer t(m.disk_read);
+            file.read(buf, BUF_SIZE);
+        }
         if (file.gcount() < 0) {
-            std::cerr << "Error while reading file" << std::endl;
+            LOG_ERROR("Error while reading file");
             return false;
         } else if(file.gcount() == 0) {
             break;
         }
 
         try {
+            trace_span chunk_span("net_send", "chunk", sampled);
+            scoped_timer t(m.net_send);
             iface.send(buf, file.gcount());
         } catch(net_interface::error& e) {
-            std::cerr << "Network error while sending file: " << e.what() << std::endl;
+            LOG_ERROR("Network error while sending file: " << e.what());
+            return false;
+        }
+        m.bytes_sent.add(file.gcount());
+        sent += file.gcount();
+    }
+    span.arg("bytes", sent);
+    return true;
+}
+
+/**
+ * Sends size bytes of an open file to the remote host. The file is read with
+ * pread, so the descriptor's offset isn't used and it can be shared between
+ * concurrent senders. Reads are FILE_READ_SIZE bytes at a time to keep the
+ * syscall count down. Holes in the file (found with SEEK_DATA and SEEK_HOLE)
+ * aren't read at all; zeros are sent in their place, which a
+ * sparse_net_interface sends as holes again.
+ *
+ * @param fd     A descriptor open for reading.
+ * @param size   How many bytes to send (the receiver has been told to expect exactly this many).
+ * @param iface  The connection over which to send the file.
+ * @param offset Where in the file to start.
+ *
+ * @return true if the file was successfully sent; false if not (including if it got shorter).
+ */
+inline bool send_file(int fd, std::uint64_t size, net_interface& iface, std::uint64_t offset = 0) {
+    std::size_t buf_size = (std::size_t)std::min<std::uint64_t>(FILE_READ_SIZE, size);
+    std::unique_ptr<char[]> buf(new char[buf_size ? buf_size : 1]);
+    transfer_metrics& m = transfer_metrics::get();
+    std::uint64_t chunk = 0;
+    std::uint64_t sent = 0;
+
+    TRACE_SPAN(span, "send_file", "transfer");
+    span.arg("bytes", size);
+
+    // Where the data or hole the next read starts in ends
+    std::uint64_t data_end = 0, hole_end = 0;
+    std::size_t zeros_size;
+    char const* zeros = zero_block(zeros_size);
+
+    while(sent < size) {
+        bool sampled = tracer::sample_chunk(chunk++);
+        std::uint64_t pos = offset + sent;
+        if(pos >= data_end && pos >= hole_end) {
+            off_t data = lseek(fd, pos, SEEK_DATA);
+            if(data < 0 && errno == ENXIO) {
+                hole_end = offset + size;
+            } else if(data > (off_t)pos) {
+                hole_end = data;
+            } else {
+                // Anything but a hole (including a filesystem that can't say) is read
+                off_t hole = data < 0 ? -1 : lseek(fd, pos, SEEK_HOLE);
+                data_end = hole > (off_t)pos ? hole : offset + size;
+            }
+        }
+
+        ssize_t n;
+        char const* out = buf.get();
+        if(pos < hole_end) {
+            n = std::min<std::uint64_t>(std::min<std::uint64_t>(zeros_size, hole_end - pos), size - sent);
+            out = zeros;
+        } else {
+            trace_span chunk_span("disk_read", "chunk", sampled);
+            scoped_timer t(m.disk_read);
+            n = pread(fd, buf.get(), std::min<std::uint64_t>(std::min<std::uint64_t>(buf_size, data_end - pos), size - sent), pos);
+        }
+        if(n < 0 && errno == EINTR) {
+            continue;
+        } else if(n <= 0) {
+            LOG_ERROR("Error while reading file");
+            return false;
+        }
+
+        try {
+            trace_span chunk_span("net_send", "chunk", sampled);
+            scoped_timer t(m.net_send);
+            iface.send(const_cast<char*>(out), n);
+        } catch(net_interface::error& e) {
+            LOG_ERROR("Network error while sending file: " << e.what());
+            return false;
+        }
+        m.bytes_sent.add(n);
+        sent += n;
+    }
+    return true;
+}
+
+/**
+ * Sends a file that's already in memory to the remote host.
+ *
+ * @param data  The file's contents.
+ * @param size  How many bytes to send.
+ * @param iface The connection over which to send the file.
+ *
+ * @return true if the file was successfully sent; false if not.
+ */
+inline bool send_memory(void const* data, std::uint64_t size, net_interface& iface) {
+    transfer_metrics& m = transfer_metrics::get();
+
+    TRACE_SPAN(span, "send_memory", "transfer");
+    span.arg("bytes", size);
+
+    try {
+        scoped_timer t(m.net_send);
+        iface.send(const_cast<void*>(data), size);
+    } catch(net_interface::error& e) {
+        LOG_ERROR("Network error while sending file: " << e.what());
+        return false;
+    }
+    m.bytes_sent.add(size);
+    return true;
+}
+
+/**
+ * Reads size bytes from an open file into buf with pread, starting at offset.
+ *
+ * @return false if the file couldn't be read or is shorter than offset + size.
+ */
+inline bool read_file(int fd, char* buf, std::uint64_t size, std::uint64_t offset = 0) {
+    transfer_metrics& m = transfer_metrics::get();
+    scoped_timer t(m.disk_read);
+
+    for(std::uint64_t done = 0; done < size;) {
+        ssize_t n = pread(fd, buf + done, size - done, offset + done);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        } else if(n <= 0) {
+            LOG_ERROR("Error while reading file");
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+/**
+ * Writes size bytes from buf to an open file with pwrite, starting at offset.
+ *
+ * @return false if they couldn't all be written.
+ */
+inline bool write_file(int fd, char const* buf, std::uint64_t size, std::uint64_t offset) {
+    transfer_metrics& m = transfer_metrics::get();
+    scoped_timer t(m.disk_write);
+
+    for(std::uint64_t done = 0; done < size;) {
+        ssize_t n = pwrite(fd, buf + done, size - done, offset + done);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        } else if(n <= 0) {
+            LOG_ERROR("Error while writing file");
             return false;
         }
+        done += n;
     }
     return true;
 }
 
+/**
+ * Writes size bytes from buf to an open file like write_file, except that
+ * blocks of zeros (HOLE_BLOCK-sized and aligned in the file, or the part of
+ * one at either end) are skipped so that they're left as holes. What's
+ * skipped has to read as zeros already, as it does past the end of the file
+ * or in a file that's been extended with ftruncate.
+ *
+ * @return false if the rest couldn't all be written.
+ */
+inline bool write_sparse(int fd, char const* buf, std::uint64_t size, std::uint64_t offset) {
+    std::uint64_t start = 0;        // Of the data not yet written
+    for(std::uint64_t done = 0; done < size;) {
+        std::uint64_t n = std::min<std::uint64_t>(size - done, HOLE_BLOCK - (offset + done) % HOLE_BLOCK);
+        if(all_zero(buf + done, n)) {
+            if(done > start && !write_file(fd, buf + start, done - start, offset + start)) {
+                return false;
+            }
+            start = done + n;
+        }
+        done += n;
+    }
+    return size == start || write_file(fd, buf + start, size - start, offset + start);
+}
+
 /**
  * Receives a file from the remote host, writing it to out_path.
  *
  * @param file      The file to store the contents.
  * @param file_size The size (in bytes) of the file being transmitted.
  * @param sock      The socket over which to receive the file.
+ * @param hasher    If given, everything received is also fed to it.
  */
-bool receive_file(std::ofstream& file, unsigned int file_size, net_interface& iface) {
-    char buf[BUF_SIZE];
-
-    // Figure out how many full BUF_SIZE chunks we'll read and
-    // how many bytes will be left over
-    size_t chunks = file_size / BUF_SIZE;
-    size_t last_bytes = file_size % BUF_SIZE;
-    size_t num_reads = chunks + (last_bytes ? 1 : 0);
+inline bool receive_file(std::ofstream& file, std::uint64_t file_size, net_interface& iface, blake3_hasher* hasher = nullptr) {
+    // Received a filesystem block at a time (lined up with the file's blocks), so that a block
+    // of zeros can be skipped over and left as a hole
+    char buf[HOLE_BLOCK];
+    std::streamoff start = std::max<std::streamoff>(file.tellp(), 0);
 
     boost::system::error_code error;
     bool file_had_error = false;
+    transfer_metrics& m = transfer_metrics::get();
+    std::uint64_t chunk = 0;
 
-    for(int i = 0; i < num_reads; ++i) {
-        // Hackily check whether we need to read a whole BUF_SIZE chunk or just the last bytes
-        size_t bytes_to_read = last_bytes && (i == num_reads - 1) ? last_bytes : BUF_SIZE;
-        try {        
+    TRACE_SPAN(span, "receive_file", "transfer");
+    span.arg("bytes", file_size);
+
+    for(std::uint64_t received = 0; received < file_size;) {
+        bool sampled = tracer::sample_chunk(chunk++);
+        std::size_t bytes_to_read = std::min<std::uint64_t>(HOLE_BLOCK - (start + received) % HOLE_BLOCK,
+                                                            file_size - received);
+        try {
+            trace_span chunk_span("net_receive", "chunk", sampled);
+            scoped_timer t(m.net_receive);
             iface.receive(buf, bytes_to_read);
         } catch(net_interface::error& e) {
-            std::cerr << "Network error while receiving file: " << e.what() << std::endl;
+            LOG_ERROR("Network error while receiving file: " << e.what());
             return false;
         }
-        
+        m.bytes_received.add(bytes_to_read);
+        received += bytes_to_read;
+        if(hasher) {
+            hasher->update(buf, bytes_to_read);
+        }
+
         // We still want to read everything from the server even if there was a file error
-        // so just don't write to the file if that happened
+        // so just don't write to the file if that happened. Whole blocks of zeros are skipped
+        // over, leaving a hole, except at the very end where they make the file the right size.
         if(!file_had_error) {
-            file.write(buf, bytes_to_read);
+            trace_span chunk_span("disk_write", "chunk", sampled);
+            scoped_timer t(m.disk_write);
+            if(bytes_to_read == HOLE_BLOCK && received != file_size && all_zero(buf, bytes_to_read)) {
+                file.seekp(bytes_to_read, std::ios::cur);
+            } else {
+                file.write(buf, bytes_to_read);
+            }
             if(!file) {
-                std::cerr << "Error while writing to file" << std::endl;
+                LOG_ERROR("Error while writing to file");
                 file_had_error = true;
             }
         }
@@ -84,13 +340,131 @@ bool receive_file(std::ofstream& file, unsigned int file_size, net_interface& if
     return !file_had_error;
 }
 
+/**
+ * Receives a file from the remote host, writing it to an open descriptor
+ * FILE_WRITE_SIZE bytes at a time.
+ *
+ * @param fd        A descriptor open for writing, positioned where the file should start.
+ * @param file_size The size (in bytes) of the file being transmitted.
+ * @param iface     The connection over which to receive the file.
+ * @param hasher    If given, everything received is also fed to it.
+ * @param behind    If given, told how much has been written after each write so
+ *                  that it can push the file out of the page cache as it goes.
+ *
+ * @return true if the whole file was received and written.
+ */
+inline bool receive_file(int fd, std::uint64_t file_size, net_interface& iface, blake3_hasher* hasher = nullptr,
+                         write_behind* behind = nullptr) {
+    std::size_t buf_size = (std::size_t)std::min<std::uint64_t>(FILE_WRITE_SIZE, file_size);
+    std::unique_ptr<char[]> buf(new char[buf_size ? buf_size : 1]);
+    bool file_had_error = false;
+    transfer_metrics& m = transfer_metrics::get();
+    std::uint64_t chunk = 0;
+
+    TRACE_SPAN(span, "receive_file", "transfer");
+    span.arg("bytes", file_size);
+
+    // Where the file starts, if it can be written with holes (because it's all past the end)
+    struct stat st;
+    off_t start = lseek(fd, 0, SEEK_CUR);
+    if(start >= 0 && (fstat(fd, &st) != 0 || st.st_size > start)) {
+        start = -1;
+    }
+
+    for(std::uint64_t received = 0; received < file_size;) {
+        bool sampled = tracer::sample_chunk(chunk++);
+        std::size_t n = (std::size_t)std::min<std::uint64_t>(buf_size, file_size - received);
+        try {
+            trace_span chunk_span("net_receive", "chunk", sampled);
+            scoped_timer t(m.net_receive);
+            iface.receive(buf.get(), n);
+        } catch(net_interface::error& e) {
+            LOG_ERROR("Network error while receiving file: " << e.what());
+            return false;
+        }
+        m.bytes_received.add(n);
+        received += n;
+        if(hasher) {
+            hasher->update(buf.get(), n);
+        }
+
+        // Keep reading everything even after a write error so that the connection stays in sync.
+        // Blocks of zeros are skipped over, leaving holes, and the file is extended over any at
+        // the end once it's all there.
+        if(!file_had_error && start >= 0) {
+            trace_span chunk_span("disk_write", "chunk", sampled);
+            file_had_error = !write_sparse(fd, buf.get(), n, start + received - n);
+            if(!file_had_error && received == file_size) {
+                file_had_error = fstat(fd, &st) != 0
+                                 || (st.st_size < start + (off_t)file_size && ftruncate(fd, start + file_size) != 0)
+                                 || lseek(fd, start + file_size, SEEK_SET) < 0;
+                if(file_had_error) {
+                    LOG_ERROR("Error while writing to file");
+                }
+            }
+            if(behind && !file_had_error) {
+                behind->wrote(received);
+            }
+        } else if(!file_had_error) {
+            trace_span chunk_span("disk_write", "chunk", sampled);
+            scoped_timer t(m.disk_write);
+            for(std::size_t written = 0; written < n;) {
+                ssize_t w = write(fd, buf.get() + written, n - written);
+                if(w < 0 && errno == EINTR) {
+                    continue;
+                } else if(w < 0) {
+                    LOG_ERROR("Error while writing to file");
+                    file_had_error = true;
+                    break;
+                }
+                written += w;
+            }
+            if(behind && !file_had_error) {
+                behind->wrote(received);
+            }
+        }
+    }
+
+    return !file_had_error;
+}
+
+/**
+ * Receives a (small) file from the remote host straight into memory.
+ *
+ * @param out       Where to put the file; must hold file_size bytes.
+ * @param file_size The size (in bytes) of the file being transmitted.
+ * @param iface     The connection over which to receive the file.
+ * @param hasher    If given, everything received is also fed to it.
+ *
+ * @return true if the whole file was received.
+ */
+inline bool receive_memory(char* out, std::uint64_t file_size, net_interface& iface, blake3_hasher* hasher = nullptr) {
+    transfer_metrics& m = transfer_metrics::get();
+
+    TRACE_SPAN(span, "receive_memory", "transfer");
+    span.arg("bytes", file_size);
+
+    try {
+        scoped_timer t(m.net_receive);
+        iface.receive(out, file_size);
+    } catch(net_interface::error& e) {
+        LOG_ERROR("Network error while receiving file: " << e.what());
+        return false;
+    }
+    m.bytes_received.add(file_size);
+    if(hasher) {
+        hasher->update(out, file_size);
+    }
+    return true;
+}
+
 /**
  * Checks whether storage_path is readable and writeable.
  *
  * @param storage_path The path to check for read/write access.
  * @throws std::invalid_argument if the path isn't readable or writeable.
  */
-bool dir_is_read_write(std::string& storage_path) {
+inline bool dir_is_read_write(std::string& storage_path) {
     // Apparently the only portable, guaranteed way to do this is to actually read/write from/to the directory        
     // Go figure
 
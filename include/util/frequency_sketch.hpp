@@ -0,0 +1,97 @@
+/* ========================================================================
+   $HEADER FILE
+   $File: frequency_sketch.hpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/14 $
+   $Description: $
+   $    A count-min sketch of 4-bit counters that estimates how often each
+   $    key has been seen recently, in a fixed amount of memory no matter
+   $    how many distinct keys there are. Every counter is halved once
+   $    enough increments have happened, so old popularity fades away.
+   $Revisions: $
+   ======================================================================== */
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class frequency_sketch {
+public:
+    static const unsigned MAX_COUNT = 15;
+
+    /**
+     * @param width Counters per row (rounded up to a power of two). Roughly the
+     *              number of distinct keys it should tell apart.
+     */
+    explicit frequency_sketch(std::size_t width) : width_(16), additions_(0) {
+        while(width_ < width) {
+            width_ <<= 1;
+        }
+        table_.assign(ROWS * width_ / COUNTERS_PER_WORD, 0);
+        sample_size_ = 10 * width_;
+    }
+
+    /**
+     * Records one occurrence of the key with the given hash. Only the counters
+     * that are at the key's current minimum are incremented (a "conservative
+     * update"), which keeps collisions from inflating other keys' estimates.
+     */
+    void increment(std::uint64_t hash) {
+        unsigned current = estimate(hash);
+        if(current == MAX_COUNT) {
+            return;
+        }
+        for(unsigned row = 0; row < ROWS; ++row) {
+            std::size_t i = index(hash, row);
+            if(get(i) == current) {
+                table_[i / COUNTERS_PER_WORD] += std::uint64_t(1) << shift(i);
+            }
+        }
+
+        if(++additions_ >= sample_size_) {
+            halve();
+        }
+    }
+
+    // How many times (up to MAX_COUNT) the key has been seen lately
+    unsigned estimate(std::uint64_t hash) const {
+        unsigned count = MAX_COUNT;
+        for(unsigned row = 0; row < ROWS; ++row) {
+            count = std::min(count, get(index(hash, row)));
+        }
+        return count;
+    }
+
+private:
+    static const unsigned ROWS = 4;
+    static const unsigned COUNTERS_PER_WORD = 16;
+
+    std::vector<std::uint64_t> table_;      // Row r's counters are at [r * width_, (r + 1) * width_)
+    std::size_t width_;
+    std::size_t additions_;
+    std::size_t sample_size_;
+
+    std::size_t index(std::uint64_t hash, unsigned row) const {
+        static const std::uint64_t SEEDS[ROWS] = {
+            0x9E3779B97F4A7C15ull, 0xC2B2AE3D27D4EB4Full, 0x165667B19E3779F9ull, 0xD6E8FEB86659FD93ull
+        };
+        std::uint64_t h = (hash + SEEDS[row]) * SEEDS[(row + 1) % ROWS];
+        h ^= h >> 32;
+        return row * width_ + (h & (width_ - 1));
+    }
+
+    static unsigned shift(std::size_t i) { return (i % COUNTERS_PER_WORD) * 4; }
+
+    unsigned get(std::size_t i) const { return (table_[i / COUNTERS_PER_WORD] >> shift(i)) & 0xF; }
+
+    // Ages every counter so that the sketch follows changes in popularity
+    void halve() {
+        for(auto& word : table_) {
+            word = (word >> 1) & 0x7777777777777777ull;
+        }
+        additions_ /= 2;
+    }
+};
@@ -0,0 +1,291 @@
+/* ========================================================================
+   $HEADER FILE
+   $File: integrity.hpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/19 $
+   $Description: $
+   $    Checking that file contents arrive intact. Both ends of a transfer
+   $    pass the contents through a checked_net_interface, which works out
+   $    the CRC32C of each BLOCK_SIZE block as it goes by without holding
+   $    anything up. Once the contents are through, the sender sends its
+   $    list of CRCs on the underlying data channel and the receiver asks
+   $    for the blocks whose CRCs differ again, by number, until they all
+   $    match or it's tried MAX_REPAIR_ROUNDS times.
+   $
+   $    On the wire, after the contents: the sender's uint32 block count
+   $    and that many uint32 CRCs, then the receiver's uint32 count of
+   $    blocks it wants again and their uint32 numbers (REPAIR_FAILED
+   $    instead if it's giving up), then the blocks it asked for through
+   $    the same channel as the contents, then another request, and so on
+   $    until the receiver asks for nothing.
+   $
+   $    The CRCs only say each block arrived as it was sent, so the sender
+   $    finishes with the BLAKE3 hash of the whole contents (a uint8 that's
+   $    1 if it knows it, and then the hash), which both ends work out as
+   $    the contents go by. The receiver checks it against its own before
+   $    it stores or accepts the file.
+   $Revisions: $
+   ======================================================================== */
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <util/blake3.hpp>
+#include <util/crc32c.hpp>
+#include <util/file_transfer.hpp>
+#include <util/log.hpp>
+#include <util/net_interface.h>
+
+/**
+ * Passes file contents through to another interface, working out the CRC32C
+ * of each block of them on the way.
+ */
+class checked_net_interface : public net_interface {
+public:
+    static const std::size_t BLOCK_SIZE = 64 * 1024;
+
+    // How many times the receiver asks for blocks again before giving up
+    static const unsigned MAX_REPAIR_ROUNDS = 3;
+
+    // Sent in place of a request when the receiver gives up
+    static const std::uint32_t REPAIR_FAILED = 0xffffffff;
+
+    /**
+     * @param inner  The interface to pass everything to.
+     * @param hasher If given, everything sent or received is also fed to it.
+     */
+    explicit checked_net_interface(net_interface& inner, blake3_hasher* hasher = nullptr)
+    : inner_(inner), hasher_(hasher), done_(0) {}
+
+    checked_net_interface(checked_net_interface& other) = delete;
+
+    virtual void send(void* buf, size_t size) {
+        inner_.send(buf, size);
+        add(buf, size);
+    }
+
+    virtual void receive(void* buf, size_t size) {
+        inner_.receive(buf, size);
+        add(buf, size);
+    }
+
+    // The CRCs of the blocks so far, the last one possibly short
+    std::vector<std::uint32_t> const& crcs() const { return crcs_; }
+
+    // How many bytes have gone through
+    std::uint64_t size() const { return done_; }
+
+private:
+    net_interface& inner_;
+    blake3_hasher* hasher_;
+    std::vector<std::uint32_t> crcs_;
+    std::uint64_t done_;
+
+    void add(void const* buf, std::size_t size) {
+        unsigned char const* p = (unsigned char const*)buf;
+        if(hasher_) {
+            hasher_->update(p, size);
+        }
+        while(size) {
+            std::size_t in_block = done_ % BLOCK_SIZE;
+            if(!in_block) {
+                crcs_.push_back(0);
+            }
+            std::size_t n = std::min(size, BLOCK_SIZE - in_block);
+            crcs_.back() = crc32c::extend(crcs_.back(), p, n);
+            p += n;
+            size -= n;
+            done_ += n;
+        }
+    }
+};
+
+/**
+ * The sender's end of checking a transfer, once all the contents have been sent (and flushed).
+ *
+ * @param crcs   The CRC32C of each block of the contents.
+ * @param size   The size of the contents.
+ * @param raw    The data channel, under any compression.
+ * @param resend Called as resend(offset, size) to send a block of the contents again through
+ *               the channel they went through (and flush it); returns false if it can't.
+ * @return false if the receiver didn't get them intact in the end or the connection failed.
+ */
+template<typename Resend>
+bool finish_checked_send(std::vector<std::uint32_t> const& crcs, std::uint64_t size, net_interface& raw, Resend resend) {
+    const std::uint64_t BLOCK = checked_net_interface::BLOCK_SIZE;
+    try {
+        std::uint32_t count = crcs.size();
+        raw.send(&count, sizeof(count));
+        raw.send(const_cast<std::uint32_t*>(crcs.data()), count * sizeof(std::uint32_t));
+
+        std::vector<std::uint32_t> wanted;
+        for(;;) {
+            std::uint32_t n;
+            raw.receive(&n, sizeof(n));
+            if(n == 0) {
+                return true;
+            } else if(n == checked_net_interface::REPAIR_FAILED || n > count) {
+                LOG_ERROR("The receiver couldn't get the file intact.");
+                return false;
+            }
+            wanted.resize(n);
+            raw.receive(wanted.data(), n * sizeof(std::uint32_t));
+            LOG_WARN("Sending " << n << " block(s) of the file again after they arrived corrupt.");
+            for(std::uint32_t block : wanted) {
+                if(block >= count || !resend(block * BLOCK, std::min<std::uint64_t>(BLOCK, size - block * BLOCK))) {
+                    return false;
+                }
+            }
+        }
+    } catch(net_interface::error& e) {
+        LOG_ERROR("Network error while checking a sent file: " << e.what());
+        return false;
+    }
+}
+
+/**
+ * Tells the sender that the contents won't be checked, for a receiver that couldn't take them.
+ *
+ * @param raw The data channel, under any compression.
+ */
+inline void refuse_checked_transfer(net_interface& raw) {
+    std::uint32_t n = checked_net_interface::REPAIR_FAILED;
+    try {
+        raw.send(&n, sizeof(n));
+    } catch(net_interface::error& e) {
+        // The connection's gone anyway
+    }
+}
+
+/**
+ * The receiver's end of checking a transfer, once all the contents have been received.
+ *
+ * @param checked The interface the contents came through.
+ * @param body    The channel to receive blocks again through (what checked wraps).
+ * @param raw     The data channel, under any compression.
+ * @param store   Called as store(offset, data, size) with each block that arrives intact the
+ *                second time, to put it where the corrupt one went; returns false if it can't.
+ * @return false if some block never arrived intact or the connection failed.
+ */
+template<typename Store>
+bool finish_checked_receive(checked_net_interface const& checked, net_interface& body, net_interface& raw, Store store) {
+    const std::uint64_t BLOCK = checked_net_interface::BLOCK_SIZE;
+    std::vector<std::uint32_t> const& ours = checked.crcs();
+    std::uint64_t size = checked.size();
+    transfer_metrics& m = transfer_metrics::get();
+    try {
+        std::uint32_t count;
+        raw.receive(&count, sizeof(count));
+        if(count != ours.size()) {
+            LOG_ERROR("The sender's CRCs are for a file of a different size.");
+            std::uint32_t n = checked_net_interface::REPAIR_FAILED;
+            raw.send(&n, sizeof(n));
+            return false;
+        }
+        std::vector<std::uint32_t> theirs(count);
+        raw.receive(theirs.data(), count * sizeof(std::uint32_t));
+
+        std::vector<std::uint32_t> wanted;
+        for(std::uint32_t i = 0; i < count; ++i) {
+            if(ours[i] != theirs[i]) {
+                wanted.push_back(i);
+            }
+        }
+
+        std::vector<char> buf;
+        for(unsigned round = 0;; ++round) {
+            std::uint32_t n = wanted.size();
+            if(n && round == checked_net_interface::MAX_REPAIR_ROUNDS) {
+                n = checked_net_interface::REPAIR_FAILED;
+                raw.send(&n, sizeof(n));
+                LOG_ERROR(wanted.size() << " block(s) of the file kept arriving corrupt.");
+                return false;
+            }
+            raw.send(&n, sizeof(n));
+            if(!n) {
+                return true;
+            }
+            m.corrupt_blocks.add(n);
+            LOG_WARN(n << " block(s) of the file arrived corrupt; asking for them again.");
+            raw.send(wanted.data(), n * sizeof(std::uint32_t));
+
+            std::vector<std::uint32_t> still;
+            for(std::uint32_t block : wanted) {
+                std::uint64_t offset = block * BLOCK;
+                std::size_t len = std::min<std::uint64_t>(BLOCK, size - offset);
+                buf.resize(len);
+                body.receive(buf.data(), len);
+                if(crc32c::compute(buf.data(), len) != theirs[block]) {
+                    still.push_back(block);
+                } else if(!store(offset, buf.data(), len)) {
+                    return false;
+                }
+            }
+            wanted.swap(still);
+        }
+    } catch(net_interface::error& e) {
+        LOG_ERROR("Network error while checking a received file: " << e.what());
+        return false;
+    }
+}
+
+/**
+ * Sends the BLAKE3 hash of the whole contents, once they've been checked.
+ *
+ * @param raw  The data channel, under any compression.
+ * @param hash The hash, or null if the sender doesn't know it.
+ * @return false if the connection failed.
+ */
+inline bool send_content_hash(net_interface& raw, unsigned char const* hash) {
+    struct {
+        std::uint8_t known;
+        unsigned char hash[blake3_hasher::OUT_LEN];
+    } msg;
+    msg.known = hash != nullptr;
+    if(hash) {
+        std::memcpy(msg.hash, hash, sizeof(msg.hash));
+    } else {
+        std::memset(msg.hash, 0, sizeof(msg.hash));
+    }
+    try {
+        raw.send(&msg, sizeof(msg));
+    } catch(net_interface::error& e) {
+        LOG_ERROR("Network error while sending a file's hash: " << e.what());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Receives the sender's BLAKE3 hash of the whole contents and checks it against the receiver's.
+ *
+ * @param raw     The data channel, under any compression.
+ * @param ours    The hash of what was received (after any blocks were repaired).
+ * @param require Whether the sender has to know the hash. Uploads always do, so that none can
+ *                skip the check; a GET of a file the server hasn't hashed doesn't.
+ * @return false if they differ, the sender didn't know and had to, or the connection failed.
+ */
+inline bool check_content_hash(net_interface& raw, unsigned char const ours[blake3_hasher::OUT_LEN], bool require) {
+    struct {
+        std::uint8_t known;
+        unsigned char hash[blake3_hasher::OUT_LEN];
+    } msg;
+    try {
+        raw.receive(&msg, sizeof(msg));
+    } catch(net_interface::error& e) {
+        LOG_ERROR("Network error while receiving a file's hash: " << e.what());
+        return false;
+    }
+    if(!msg.known && require) {
+        LOG_ERROR("The sender didn't send the file's hash.");
+        transfer_metrics::get().hash_mismatches.add();
+        return false;
+    } else if(msg.known && std::memcmp(msg.hash, ours, sizeof(msg.hash)) != 0) {
+        LOG_ERROR("The file's contents don't match the sender's hash " << blake3_hasher::to_hex(msg.hash) << '.');
+        transfer_metrics::get().hash_mismatches.add();
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,368 @@
+/* ========================================================================
+   $HEADER FILE
+   $File: log.hpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/02 $
+   $Description: $
+   $    Asynchronous logger. Each thread formats its messages into fixed-size
+   $    records and pushes them onto its own lock-free ring; a background
+   $    thread drains the rings to stderr or a log file.
+   $Revisions: $
+   ======================================================================== */
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO  1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_NONE  4
+
+// Anything below LOG_LEVEL is compiled out entirely
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+/**
+ * Logs a message built with operator<<, e.g. LOG_INFO("Sent " << n << " bytes").
+ * The condition is a compile-time constant, so disabled levels cost nothing.
+ */
+#define LOG_AT(level, expr)                     \
+    do {                                        \
+        if((level) >= LOG_LEVEL) {              \
+            log_line log_line_((level));        \
+            log_line_ << expr;                  \
+        }                                       \
+    } while(0)
+
+#define LOG_DEBUG(expr) LOG_AT(LOG_LEVEL_DEBUG, expr)
+#define LOG_INFO(expr)  LOG_AT(LOG_LEVEL_INFO, expr)
+#define LOG_WARN(expr)  LOG_AT(LOG_LEVEL_WARN, expr)
+#define LOG_ERROR(expr) LOG_AT(LOG_LEVEL_ERROR, expr)
+
+/**
+ * A single preformatted log message. Records are fixed-size so that they can
+ * live directly in the ring without any allocation.
+ */
+struct log_record {
+    static const std::size_t TEXT_SIZE = 240;
+
+    std::uint64_t timestamp_ns;
+    std::uint16_t length;
+    std::uint8_t level;
+    char text[TEXT_SIZE];
+};
+
+/**
+ * Single-producer/single-consumer ring of log records. The owning thread is
+ * the only producer; whoever holds the logger's drain lock is the consumer.
+ */
+class log_ring {
+public:
+    static const std::size_t CAPACITY = 256; // Must be a power of two
+
+    log_ring()
+    : head_(0), tail_(0), dropped_(0), retired_(false) {}
+
+    /**
+     * Creates a ring on its own cache lines. make_shared doesn't honour the
+     * alignment of the indices before C++17, so it's allocated by hand.
+     */
+    static std::shared_ptr<log_ring> make() {
+        void* mem = nullptr;
+        if(posix_memalign(&mem, alignof(log_ring), sizeof(log_ring)) != 0) {
+            throw std::bad_alloc();
+        }
+        log_ring* ring = new(mem) log_ring();
+        return std::shared_ptr<log_ring>(ring, [](log_ring* r) {
+            r->~log_ring();
+            free(r);
+        });
+    }
+
+    // Returns false (and counts the record as dropped) if the ring is full; we never block the producer
+    bool push(log_record const& rec) {
+        std::size_t head = head_.load(std::memory_order_relaxed);
+        if(head - tail_.load(std::memory_order_acquire) == CAPACITY) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        records_[head & (CAPACITY - 1)] = rec;
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(log_record& out) {
+        std::size_t tail = tail_.load(std::memory_order_relaxed);
+        if(tail == head_.load(std::memory_order_acquire)) {
+            return false;
+        }
+
+        out = records_[tail & (CAPACITY - 1)];
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const {
+        return tail_.load(std::memory_order_acquire) == head_.load(std::memory_order_acquire);
+    }
+
+    std::uint64_t take_dropped() {
+        return dropped_.exchange(0, std::memory_order_relaxed);
+    }
+
+    void retire() { retired_.store(true, std::memory_order_release); }
+    bool retired() const { return retired_.load(std::memory_order_acquire); }
+
+private:
+    // Keep the producer and consumer indices on separate cache lines
+    alignas(64) std::atomic<std::size_t> head_;
+    alignas(64) std::atomic<std::size_t> tail_;
+    alignas(64) std::atomic<std::uint64_t> dropped_;
+    std::atomic<bool> retired_;
+    log_record records_[CAPACITY];
+};
+
+class logger {
+public:
+    static logger& instance() {
+        static logger l;
+        return l;
+    }
+
+    logger(logger& other) = delete;
+
+    ~logger() {
+        {
+            std::lock_guard<std::mutex> lock(wake_mutex_);
+            running_ = false;
+        }
+        wake_.notify_one();
+        if(drain_thread_.joinable()) {
+            drain_thread_.join();
+        }
+        drain();
+        close_output();
+    }
+
+    /**
+     * Sends all future output to the file at path (appending to it).
+     *
+     * @return false if the file couldn't be opened, in which case output stays where it was.
+     */
+    bool open(std::string const& path) {
+        FILE* f = std::fopen(path.c_str(), "a");
+        if(!f) {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(drain_mutex_);
+        close_output();
+        out_ = f;
+        return true;
+    }
+
+    /**
+     * Blocks until everything logged so far by any thread has been written out.
+     */
+    void flush() {
+        drain();
+    }
+
+    /**
+     * Returns the calling thread's ring, registering it on first use.
+     */
+    log_ring& thread_ring() {
+        struct ring_holder {
+            std::shared_ptr<log_ring> ring;
+            ring_holder()
+            : ring(log_ring::make()) {
+                logger::instance().add_ring(ring);
+            }
+            ~ring_holder() { ring->retire(); }
+        };
+        static thread_local ring_holder holder;
+        return *holder.ring;
+    }
+
+private:
+    std::mutex rings_mutex_;
+    std::vector<std::shared_ptr<log_ring>> rings_;
+
+    std::mutex drain_mutex_; // Held by whoever is currently consuming from the rings
+    FILE* out_;
+
+    std::mutex wake_mutex_;
+    std::condition_variable wake_;
+    bool running_;
+    std::thread drain_thread_;
+
+    logger()
+    : out_(stderr), running_(true) {
+        drain_thread_ = std::thread([this] { run(); });
+    }
+
+    void add_ring(std::shared_ptr<log_ring> const& ring) {
+        std::lock_guard<std::mutex> lock(rings_mutex_);
+        rings_.push_back(ring);
+    }
+
+    void close_output() {
+        if(out_ && out_ != stderr) {
+            std::fclose(out_);
+        }
+        out_ = stderr;
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(wake_mutex_);
+        while(running_) {
+            lock.unlock();
+            drain();
+            lock.lock();
+            // Producers never signal us (that would cost them a syscall), so just poll
+            wake_.wait_for(lock, std::chrono::milliseconds(5));
+        }
+    }
+
+    void drain() {
+        std::vector<std::shared_ptr<log_ring>> rings;
+        {
+            std::lock_guard<std::mutex> lock(rings_mutex_);
+            rings = rings_;
+        }
+
+        std::lock_guard<std::mutex> lock(drain_mutex_);
+        log_record rec;
+        bool wrote = false;
+        for(auto& ring : rings) {
+            while(ring->pop(rec)) {
+                write(rec);
+                wrote = true;
+            }
+
+            std::uint64_t dropped = ring->take_dropped();
+            if(dropped) {
+                std::fprintf(out_, "[logger] dropped %llu messages (ring full)\n", (unsigned long long)dropped);
+                wrote = true;
+            }
+        }
+
+        if(wrote) {
+            std::fflush(out_);
+        }
+
+        // Forget about rings whose threads have exited once they've been emptied
+        std::lock_guard<std::mutex> rings_lock(rings_mutex_);
+        for(auto it = rings_.begin(); it != rings_.end();) {
+            if((*it)->retired() && (*it)->empty()) {
+                it = rings_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void write(log_record const& rec) {
+        static const char* const names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+        std::time_t secs = (std::time_t)(rec.timestamp_ns / 1000000000ull);
+        unsigned millis = (unsigned)((rec.timestamp_ns / 1000000ull) % 1000);
+        std::tm tm;
+        localtime_r(&secs, &tm);
+
+        char stamp[16];
+        std::strftime(stamp, sizeof(stamp), "%H:%M:%S", &tm);
+        std::fprintf(out_, "%s.%03u %-5s %.*s\n", stamp, millis, names[rec.level < 4 ? rec.level : 3],
+                     (int)rec.length, rec.text);
+    }
+};
+
+/**
+ * Builds a log_record on the stack and pushes it onto the thread's ring when destroyed.
+ * Messages longer than log_record::TEXT_SIZE are truncated.
+ */
+class log_line {
+public:
+    explicit log_line(int level) {
+        rec_.level = (std::uint8_t)level;
+        rec_.length = 0;
+    }
+
+    ~log_line() {
+        rec_.timestamp_ns = (std::uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+        logger::instance().thread_ring().push(rec_);
+    }
+
+    log_line(log_line& other) = delete;
+
+    log_line& operator<<(const char* s) {
+        return append(s, std::strlen(s));
+    }
+
+    log_line& operator<<(std::string const& s) {
+        return append(s.data(), s.size());
+    }
+
+    log_line& operator<<(char c) {
+        return append(&c, 1);
+    }
+
+    log_line& operator<<(bool b) {
+        return b ? append("true", 4) : append("false", 5);
+    }
+
+    log_line& operator<<(double d) {
+        char buf[32];
+        int n = std::snprintf(buf, sizeof(buf), "%g", d);
+        return append(buf, n > 0 ? (std::size_t)n : 0);
+    }
+
+    template<typename T>
+    typename std::enable_if<std::is_integral<T>::value, log_line&>::type operator<<(T v) {
+        char buf[24];
+        char* end = buf + sizeof(buf);
+        char* p = end;
+        bool negative = v < 0;
+        typename std::make_unsigned<T>::type u = negative ? 0 - (typename std::make_unsigned<T>::type)v : v;
+        do {
+            *--p = (char)('0' + u % 10);
+            u /= 10;
+        } while(u);
+        if(negative) {
+            *--p = '-';
+        }
+        return append(p, end - p);
+    }
+
+private:
+    log_record rec_;
+
+    log_line& append(const char* s, std::size_t n) {
+        std::size_t room = log_record::TEXT_SIZE - rec_.length;
+        if(n > room) {
+            n = room;
+        }
+        std::memcpy(rec_.text + rec_.length, s, n);
+        rec_.length += (std::uint16_t)n;
+        return *this;
+    }
+};
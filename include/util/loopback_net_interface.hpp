@@ -0,0 +1,185 @@
+/* ========================================================================
+   $HEADER FILE
+   $File: loopback_net_interface.hpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/09 $
+   $Description: $
+   $    In-process net_interface pairs backed by lock-free single-producer/
+   $    single-consumer byte rings, so that the client and server protocol
+   $    code can talk to each other without going through the kernel.
+   $Revisions: $
+   ======================================================================== */
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <stdlib.h>
+#include <thread>
+#include <utility>
+#include <util/net_interface.h>
+
+/**
+ * A fixed-size byte ring with one writer and one reader.
+ */
+class spsc_byte_ring {
+public:
+    // capacity is rounded up to a power of two
+    explicit spsc_byte_ring(std::size_t capacity)
+    : head_(0), tail_(0), closed_(false) {
+        capacity_ = 1;
+        while(capacity_ < capacity) {
+            capacity_ <<= 1;
+        }
+        buf_.reset(new char[capacity_]);
+    }
+
+    spsc_byte_ring(spsc_byte_ring& other) = delete;
+
+    /**
+     * Creates a ring on its own cache lines. Plain new doesn't honour the
+     * alignment of head_ and tail_ before C++17, so it's allocated by hand.
+     */
+    static std::shared_ptr<spsc_byte_ring> make(std::size_t capacity) {
+        void* mem = nullptr;
+        if(posix_memalign(&mem, alignof(spsc_byte_ring), sizeof(spsc_byte_ring)) != 0) {
+            throw std::bad_alloc();
+        }
+        spsc_byte_ring* ring;
+        try {
+            ring = new(mem) spsc_byte_ring(capacity);
+        } catch(...) {
+            free(mem);
+            throw;
+        }
+        return std::shared_ptr<spsc_byte_ring>(ring, [](spsc_byte_ring* r) {
+            r->~spsc_byte_ring();
+            free(r);
+        });
+    }
+
+    // Copies as much of buf as fits and returns how much that was
+    std::size_t write_some(const char* buf, std::size_t size) {
+        std::size_t head = head_.load(std::memory_order_relaxed);
+        std::size_t space = capacity_ - (head - tail_.load(std::memory_order_acquire));
+        std::size_t n = std::min(size, space);
+        copy_in(head, buf, n);
+        head_.store(head + n, std::memory_order_release);
+        return n;
+    }
+
+    // Copies up to size bytes into buf and returns how many there were
+    std::size_t read_some(char* buf, std::size_t size) {
+        std::size_t tail = tail_.load(std::memory_order_relaxed);
+        std::size_t avail = head_.load(std::memory_order_acquire) - tail;
+        std::size_t n = std::min(size, avail);
+        copy_out(tail, buf, n);
+        tail_.store(tail + n, std::memory_order_release);
+        return n;
+    }
+
+    void close() { closed_.store(true, std::memory_order_release); }
+    bool closed() const { return closed_.load(std::memory_order_acquire); }
+
+private:
+    std::unique_ptr<char[]> buf_;
+    std::size_t capacity_;
+    alignas(64) std::atomic<std::size_t> head_; // Total bytes ever written
+    alignas(64) std::atomic<std::size_t> tail_; // Total bytes ever read
+    std::atomic<bool> closed_;
+
+    void copy_in(std::size_t pos, const char* src, std::size_t n) {
+        std::size_t off = pos & (capacity_ - 1);
+        std::size_t first = std::min(n, capacity_ - off);
+        std::memcpy(buf_.get() + off, src, first);
+        std::memcpy(buf_.get(), src + first, n - first);
+    }
+
+    void copy_out(std::size_t pos, char* dst, std::size_t n) {
+        std::size_t off = pos & (capacity_ - 1);
+        std::size_t first = std::min(n, capacity_ - off);
+        std::memcpy(dst, buf_.get() + off, first);
+        std::memcpy(dst + first, buf_.get(), n - first);
+    }
+};
+
+/**
+ * One end of an in-process connection. Destroying either end closes the
+ * connection: the other end gets eof once it has read everything, and
+ * reset if it tries to send.
+ */
+class loopback_net_interface : public net_interface {
+public:
+    typedef std::unique_ptr<loopback_net_interface> ptr;
+
+    /**
+     * Creates a connected pair of interfaces.
+     *
+     * @param capacity How many bytes can be in flight in each direction.
+     */
+    static std::pair<ptr, ptr> make_pair(std::size_t capacity = 256 * 1024) {
+        std::shared_ptr<spsc_byte_ring> a = spsc_byte_ring::make(capacity);
+        std::shared_ptr<spsc_byte_ring> b = spsc_byte_ring::make(capacity);
+        return std::make_pair(ptr(new loopback_net_interface(a, b)), ptr(new loopback_net_interface(b, a)));
+    }
+
+    ~loopback_net_interface() {
+        in_->close();
+        out_->close();
+    }
+
+    virtual void send(void* buf, size_t size) {
+        const char* p = (const char*)buf;
+        unsigned idle = 0;
+        while(size) {
+            if(out_->closed()) {
+                throw net_interface::error("loopback connection closed", error_code::reset);
+            }
+
+            std::size_t n = out_->write_some(p, size);
+            p += n;
+            size -= n;
+            idle = n ? 0 : idle + 1;
+            backoff(idle);
+        }
+    }
+
+    virtual void receive(void* buf, size_t size) {
+        char* p = (char*)buf;
+        unsigned idle = 0;
+        while(size) {
+            std::size_t n = in_->read_some(p, size);
+            p += n;
+            size -= n;
+            if(n == 0 && in_->closed()) {
+                // Check again in case the last bytes landed just before the close
+                n = in_->read_some(p, size);
+                if(n == 0) {
+                    throw net_interface::error("loopback connection closed", error_code::eof);
+                }
+                p += n;
+                size -= n;
+                continue;
+            }
+            idle = n ? 0 : idle + 1;
+            backoff(idle);
+        }
+    }
+
+private:
+    std::shared_ptr<spsc_byte_ring> in_;
+    std::shared_ptr<spsc_byte_ring> out_;
+
+    loopback_net_interface(std::shared_ptr<spsc_byte_ring> const& in, std::shared_ptr<spsc_byte_ring> const& out)
+    : in_(in), out_(out) {}
+
+    // Spin briefly while the other side catches up, then start giving up the CPU
+    static void backoff(unsigned idle) {
+        if(idle > 64) {
+            std::this_thread::yield();
+        }
+    }
+};
@@ -0,0 +1,265 @@
+/* ========================================================================
+   $HEADER FILE
+   $File: lz4.hpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/19 $
+   $Description: $
+   $    A compressor and decompressor for the LZ4 block format. Each
+   $    sequence is a token (four bits of literal length, four of match
+   $    length less 4, each extended by bytes of 255 when it's 15), the
+   $    literals, and a two-byte little-endian offset back to the match;
+   $    the last sequence is literals only. The compressor is the greedy
+   $    single-probe hash search of LZ4's fast mode, skipping ahead faster
+   $    the longer it goes without a match so that data that won't
+   $    compress costs little time.
+   $Revisions: $
+   ======================================================================== */
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+class lz4 {
+public:
+    /**
+     * Data that blocks can refer back to without containing it, e.g. a trained
+     * dictionary of what small files usually hold. Its hash table is worked out
+     * once here rather than for every block.
+     */
+    class dictionary {
+    public:
+        dictionary(void const* data, std::size_t size)
+        : table_(1u << HASH_LOG, 0) {
+            // Only the last 64 KiB is in reach of a match
+            unsigned char const* bytes = (unsigned char const*)data;
+            std::size_t keep = size > MAX_OFFSET ? MAX_OFFSET : size;
+            data_.assign(bytes + size - keep, bytes + size);
+            for(std::size_t p = 0; p + MIN_MATCH <= data_.size(); ++p) {
+                table_[hash(read32(&data_[p]))] = (std::uint32_t)p;
+            }
+        }
+
+    private:
+        friend class lz4;
+
+        std::vector<unsigned char> data_;
+        std::vector<std::uint32_t> table_;
+    };
+
+    /**
+     * The most that compress can write for size bytes of input.
+     */
+    static std::size_t bound(std::size_t size) {
+        return size + size / 255 + 16;
+    }
+
+    /**
+     * Compresses size bytes from in into out, which has room for capacity bytes,
+     * optionally with matches into dict (which decompress must then be given too).
+     *
+     * @return the compressed size, or 0 if it wouldn't fit.
+     */
+    static std::size_t compress(void const* in, std::size_t size, void* out, std::size_t capacity,
+                                dictionary const* dict = nullptr) {
+        if(!dict || dict->data_.empty()) {
+            std::vector<std::uint32_t> table(1u << HASH_LOG, 0);
+            return compress_block((unsigned char const*)in, 0, size, table, (unsigned char*)out, capacity);
+        }
+
+        // Matches can run from the dictionary into the input, so they have to be side by side
+        std::vector<unsigned char> joined(dict->data_.size() + size);
+        std::memcpy(joined.data(), dict->data_.data(), dict->data_.size());
+        std::memcpy(joined.data() + dict->data_.size(), in, size);
+        std::vector<std::uint32_t> table(dict->table_);
+        return compress_block(joined.data(), dict->data_.size(), joined.size(), table, (unsigned char*)out, capacity);
+    }
+
+    /**
+     * Decompresses size bytes from in, which must come to exactly out_size bytes, into out.
+     *
+     * @param dict The dictionary it was compressed with, if any.
+     * @return false if in isn't a valid block of that size.
+     */
+    static bool decompress(void const* in, std::size_t size, void* out, std::size_t out_size,
+                           dictionary const* dict = nullptr) {
+        unsigned char const* src = (unsigned char const*)in;
+        unsigned char const* src_end = src + size;
+        unsigned char* dst = (unsigned char*)out;
+        unsigned char* dst_start = dst;
+        unsigned char* dst_end = dst + out_size;
+        std::size_t dict_size = dict ? dict->data_.size() : 0;
+
+        while(src < src_end) {
+            unsigned token = *src++;
+            std::size_t literals = token >> 4;
+            if(literals == 15 && !read_length(src, src_end, literals)) {
+                return false;
+            }
+            if(literals > (std::size_t)(src_end - src) || literals > (std::size_t)(dst_end - dst)) {
+                return false;
+            }
+            std::memcpy(dst, src, literals);
+            src += literals;
+            dst += literals;
+            if(src == src_end) {
+                break;
+            }
+
+            if(src_end - src < 2) {
+                return false;
+            }
+            std::size_t offset = src[0] | (src[1] << 8);
+            src += 2;
+            std::size_t length = token & 15;
+            if(length == 15 && !read_length(src, src_end, length)) {
+                return false;
+            }
+            length += MIN_MATCH;
+            std::size_t produced = dst - dst_start;
+            if(offset == 0 || offset > produced + dict_size || length > (std::size_t)(dst_end - dst)) {
+                return false;
+            }
+
+            unsigned char const* match = dst - offset;
+            if(offset > produced) {
+                // The match starts in the dictionary and may carry on into the output
+                std::size_t back = offset - produced;
+                std::size_t n = back < length ? back : length;
+                std::memcpy(dst, &dict->data_[dict_size - back], n);
+                dst += n;
+                length -= n;
+                match = dst_start;
+            }
+            if(match + length <= dst) {
+                std::memcpy(dst, match, length);
+                dst += length;
+            } else {
+                // Overlapping, e.g. a run of one repeated byte
+                for(std::size_t i = 0; i < length; ++i) {
+                    *dst++ = *match++;
+                }
+            }
+        }
+        return dst == dst_end;
+    }
+
+private:
+    static const unsigned HASH_LOG = 14;
+    static const std::size_t MIN_MATCH = 4;
+    static const std::size_t MAX_OFFSET = 65535;
+    static const std::size_t LAST_LITERALS = 5;     // The format ends with at least this many literals
+    static const std::size_t MATCH_SAFE = 12;       // ...and its last match starts at least this far from the end
+    static const std::size_t MIN_INPUT = 13;
+    static const unsigned SKIP_SHIFT = 6;
+
+    // Compresses src[start, size); src[0, start) is a dictionary already in table
+    static std::size_t compress_block(unsigned char const* src, std::size_t start, std::size_t size,
+                                      std::vector<std::uint32_t>& table, unsigned char* out, std::size_t capacity) {
+        unsigned char* dst = out;
+        unsigned char* dst_end = dst + capacity;
+
+        std::size_t anchor = start;
+        if(size - start > MIN_INPUT) {
+            std::size_t limit = size - MATCH_SAFE;
+            std::size_t ip = start ? start : 1;
+            std::size_t misses = 0;
+            while(ip < limit) {
+                std::uint32_t seq = read32(src + ip);
+                std::uint32_t& slot = table[hash(seq)];
+                std::size_t ref = slot;
+                slot = (std::uint32_t)ip;
+
+                if(ref >= ip || ip - ref > MAX_OFFSET || read32(src + ref) != seq) {
+                    ip += 1 + (misses++ >> SKIP_SHIFT);
+                    continue;
+                }
+                misses = 0;
+
+                // Take in any matching bytes before the ones that were hashed too
+                while(ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+                    --ip;
+                    --ref;
+                }
+                std::size_t length = MIN_MATCH;
+                std::size_t end = size - LAST_LITERALS;
+                while(ip + length < end && src[ref + length] == src[ip + length]) {
+                    ++length;
+                }
+
+                dst = write_sequence(dst, dst_end, src + anchor, ip - anchor, ip - ref, length);
+                if(!dst) {
+                    return 0;
+                }
+                ip += length;
+                anchor = ip;
+                if(ip < limit && ip >= 2) {
+                    table[hash(read32(src + ip - 2))] = (std::uint32_t)(ip - 2);
+                }
+            }
+        }
+
+        dst = write_sequence(dst, dst_end, src + anchor, size - anchor, 0, 0);
+        return dst ? dst - out : 0;
+    }
+
+    static std::uint32_t read32(unsigned char const* p) {
+        std::uint32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    static std::uint32_t hash(std::uint32_t seq) {
+        return (seq * 2654435761u) >> (32 - HASH_LOG);
+    }
+
+    static bool read_length(unsigned char const*& src, unsigned char const* end, std::size_t& length) {
+        unsigned b;
+        do {
+            if(src == end) {
+                return false;
+            }
+            b = *src++;
+            length += b;
+        } while(b == 255);
+        return true;
+    }
+
+    static unsigned char* write_length(unsigned char* dst, std::size_t length) {
+        for(; length >= 255; length -= 255) {
+            *dst++ = 255;
+        }
+        *dst++ = (unsigned char)length;
+        return dst;
+    }
+
+    // Writes literals followed by a match (of length 0 for the last sequence); null if it doesn't fit
+    static unsigned char* write_sequence(unsigned char* dst, unsigned char* end, unsigned char const* literals,
+                                         std::size_t literal_count, std::size_t offset, std::size_t length) {
+        std::size_t worst = 1 + literal_count / 255 + 1 + literal_count + 2 + length / 255 + 1;
+        if(worst > (std::size_t)(end - dst)) {
+            return nullptr;
+        }
+
+        unsigned char* token = dst++;
+        *token = (unsigned char)((literal_count >= 15 ? 15 : literal_count) << 4);
+        if(literal_count >= 15) {
+            dst = write_length(dst, literal_count - 15);
+        }
+        std::memcpy(dst, literals, literal_count);
+        dst += literal_count;
+        if(!length) {
+            return dst;
+        }
+
+        *dst++ = (unsigned char)offset;
+        *dst++ = (unsigned char)(offset >> 8);
+        std::size_t extra = length - MIN_MATCH;
+        *token |= (unsigned char)(extra >= 15 ? 15 : extra);
+        if(extra >= 15) {
+            dst = write_length(dst, extra - 15);
+        }
+        return dst;
+    }
+};
@@ -0,0 +1,337 @@
+/* ========================================================================
+   $HEADER FILE
+   $File: metrics.hpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/04 $
+   $Description: $
+   $    In-process metrics: lock-free counters, gauges and log-linear latency
+   $    histograms, plus a registry that renders them in the Prometheus text
+   $    exposition format.
+   $Revisions: $
+   ======================================================================== */
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+class counter {
+public:
+    counter()
+    : value_(0) {}
+
+    void add(std::uint64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+    std::uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<std::uint64_t> value_;
+};
+
+class gauge {
+public:
+    gauge()
+    : value_(0) {}
+
+    void set(std::int64_t v) { value_.store(v, std::memory_order_relaxed); }
+    void add(std::int64_t n) { value_.fetch_add(n, std::memory_order_relaxed); }
+    std::int64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<std::int64_t> value_;
+};
+
+/**
+ * HDR-style histogram of nanosecond durations. Each power of two is split into
+ * 16 linear sub-buckets, so any recorded value is within ~6% of its bucket.
+ * Values past 2^44ns (about 5 hours) land in the last bucket.
+ */
+class histogram {
+public:
+    static const unsigned SUB_BITS = 4;
+    static const unsigned SUB_COUNT = 1u << SUB_BITS;
+    static const unsigned MAX_SHIFT = 40;
+    static const unsigned BUCKETS = (MAX_SHIFT + 2) * SUB_COUNT;
+
+    histogram()
+    : count_(0), sum_(0), max_(0) {
+        for(auto& b : buckets_) {
+            b.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void record(std::uint64_t ns) {
+        buckets_[index_of(ns)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(ns, std::memory_order_relaxed);
+
+        std::uint64_t prev = max_.load(std::memory_order_relaxed);
+        while(ns > prev && !max_.compare_exchange_weak(prev, ns, std::memory_order_relaxed)) {}
+    }
+
+    std::uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    std::uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+    std::uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+
+    /**
+     * Returns the approximate value (in ns) below which q (0 <= q <= 1) of the samples fall.
+     */
+    std::uint64_t percentile(double q) const {
+        std::uint64_t total = count();
+        if(total == 0) {
+            return 0;
+        }
+
+        std::uint64_t rank = (std::uint64_t)(q * total);
+        if(rank >= total) {
+            rank = total - 1;
+        }
+
+        std::uint64_t seen = 0;
+        for(unsigned i = 0; i < BUCKETS; ++i) {
+            seen += buckets_[i].load(std::memory_order_relaxed);
+            if(seen > rank) {
+                std::uint64_t mid = lower_bound(i) + (width(i) / 2);
+                return mid < max() ? mid : max();
+            }
+        }
+        return max();
+    }
+
+    static unsigned index_of(std::uint64_t v) {
+        if(v < 2 * SUB_COUNT) {
+            return (unsigned)v;
+        }
+
+        unsigned top_bit = 63 - __builtin_clzll(v);
+        unsigned shift = top_bit - SUB_BITS;
+        if(shift > MAX_SHIFT) {
+            return BUCKETS - 1;
+        }
+        return shift * SUB_COUNT + (unsigned)(v >> shift);
+    }
+
+    static std::uint64_t lower_bound(unsigned idx) {
+        if(idx < 2 * SUB_COUNT) {
+            return idx;
+        }
+        unsigned shift = idx / SUB_COUNT - 1;
+        return (std::uint64_t)(idx % SUB_COUNT + SUB_COUNT) << shift;
+    }
+
+    static std::uint64_t width(unsigned idx) {
+        return idx < 2 * SUB_COUNT ? 1 : 1ull << (idx / SUB_COUNT - 1);
+    }
+
+private:
+    std::atomic<std::uint64_t> buckets_[BUCKETS];
+    std::atomic<std::uint64_t> count_;
+    std::atomic<std::uint64_t> sum_;
+    std::atomic<std::uint64_t> max_;
+};
+
+/**
+ * Records the time between construction and destruction into a histogram.
+ */
+class scoped_timer {
+public:
+    explicit scoped_timer(histogram& h)
+    : hist_(h), start_(std::chrono::steady_clock::now()) {}
+
+    ~scoped_timer() {
+        hist_.record((std::uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start_).count());
+    }
+
+    scoped_timer(scoped_timer& other) = delete;
+
+private:
+    histogram& hist_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+/**
+ * Process-wide set of named metrics. Looking a metric up takes a lock, so callers
+ * should do it once and keep the reference; updating a metric never locks.
+ */
+class metrics {
+public:
+    static metrics& instance() {
+        static metrics m;
+        return m;
+    }
+
+    metrics(metrics& other) = delete;
+
+    /**
+     * Returns the metric with the given name and label set (e.g. "op=\"get\""),
+     * creating it if it doesn't exist yet. References stay valid forever.
+     */
+    counter& get_counter(std::string const& name, std::string const& labels, std::string const& help) {
+        return *find_or_add(name, labels, help, entry::COUNTER).c;
+    }
+
+    gauge& get_gauge(std::string const& name, std::string const& labels, std::string const& help) {
+        return *find_or_add(name, labels, help, entry::GAUGE).g;
+    }
+
+    histogram& get_histogram(std::string const& name, std::string const& labels, std::string const& help) {
+        return *find_or_add(name, labels, help, entry::HISTOGRAM).h;
+    }
+
+    /**
+     * Renders every metric in the Prometheus text exposition format. Histograms are
+     * exported as summaries (in seconds) since their native bucket count is huge.
+     */
+    std::string render() {
+        static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::ostringstream oss;
+        std::string last_name;
+        for(auto& e : entries_) {
+            if(e->name != last_name) {
+                static const char* const types[] = {"counter", "gauge", "summary"};
+                oss << "# HELP " << e->name << ' ' << e->help << '\n';
+                oss << "# TYPE " << e->name << ' ' << types[e->type] << '\n';
+                last_name = e->name;
+            }
+
+            std::string sep = e->labels.empty() ? "" : ",";
+            switch(e->type) {
+                case entry::COUNTER:
+                    oss << e->name << braces(e->labels) << ' ' << e->c->value() << '\n';
+                    break;
+                case entry::GAUGE:
+                    oss << e->name << braces(e->labels) << ' ' << e->g->value() << '\n';
+                    break;
+                case entry::HISTOGRAM:
+                    for(double q : quantiles) {
+                        oss << e->name << '{' << e->labels << sep << "quantile=\"" << q << "\"} "
+                            << e->h->percentile(q) / 1e9 << '\n';
+                    }
+                    oss << e->name << "_sum" << braces(e->labels) << ' ' << e->h->sum() / 1e9 << '\n';
+                    oss << e->name << "_count" << braces(e->labels) << ' ' << e->h->count() << '\n';
+                    break;
+            }
+        }
+        return oss.str();
+    }
+
+private:
+    struct entry {
+        enum kind { COUNTER, GAUGE, HISTOGRAM };
+
+        std::string name;
+        std::string labels;
+        std::string help;
+        kind type;
+        std::unique_ptr<counter> c;
+        std::unique_ptr<gauge> g;
+        std::unique_ptr<histogram> h;
+    };
+
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<entry>> entries_; // Kept grouped by name
+
+    metrics() {}
+
+    entry& find_or_add(std::string const& name, std::string const& labels, std::string const& help, entry::kind type) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        auto insert_at = entries_.end();
+        for(auto it = entries_.begin(); it != entries_.end(); ++it) {
+            if((*it)->name == name) {
+                if((*it)->labels == labels) {
+                    return **it;
+                }
+                insert_at = it + 1;
+            }
+        }
+
+        std::unique_ptr<entry> e(new entry);
+        e->name = name;
+        e->labels = labels;
+        e->help = help;
+        e->type = type;
+        switch(type) {
+            case entry::COUNTER: e->c.reset(new counter); break;
+            case entry::GAUGE: e->g.reset(new gauge); break;
+            case entry::HISTOGRAM: e->h.reset(new histogram); break;
+        }
+
+        return **entries_.insert(insert_at, std::move(e));
+    }
+
+    static std::string braces(std::string const& labels) {
+        return labels.empty() ? labels : "{" + labels + "}";
+    }
+};
+
+/**
+ * Periodically writes metrics::render() to a file (e.g. for node_exporter's
+ * textfile collector). The file is replaced atomically so readers never see
+ * a partial dump.
+ */
+class metrics_dumper {
+public:
+    metrics_dumper(std::string const& path, unsigned interval_secs)
+    : path_(path), interval_(interval_secs), running_(true) {
+        thread_ = std::thread([this] { run(); });
+    }
+
+    ~metrics_dumper() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            running_ = false;
+        }
+        wake_.notify_one();
+        thread_.join();
+        dump();
+    }
+
+    metrics_dumper(metrics_dumper& other) = delete;
+
+private:
+    std::string path_;
+    std::chrono::seconds interval_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    bool running_;
+    std::thread thread_;
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while(running_) {
+            wake_.wait_for(lock, interval_);
+            if(running_) {
+                dump();
+            }
+        }
+    }
+
+    void dump() {
+        std::string tmp_path = path_ + ".tmp";
+        FILE* f = std::fopen(tmp_path.c_str(), "w");
+        if(!f) {
+            return;
+        }
+
+        std::string text = metrics::instance().render();
+        bool ok = std::fwrite(text.data(), 1, text.size(), f) == text.size();
+        ok = std::fclose(f) == 0 && ok;
+        if(ok) {
+            std::rename(tmp_path.c_str(), path_.c_str());
+        } else {
+            std::remove(tmp_path.c_str());
+        }
+    }
+};
@@ -0,0 +1,151 @@
+/* ========================================================================
+   $HEADER FILE
+   $File: open_table.hpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/12 $
+   $Description: $
+   $    A hash map that keeps its entries in one flat array (open addressing
+   $    with linear probing), so that a lookup usually touches one or two
+   $    cache lines instead of chasing a bucket list.
+   $Revisions: $
+   ======================================================================== */
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <utility>
+#include <vector>
+
+template<typename K, typename V, typename Hash = std::hash<K>>
+class open_table {
+public:
+    struct slot {
+        std::size_t hash;       // 0 if the slot is empty
+        K key;
+        V value;
+
+        slot() : hash(0), key(), value() {}
+    };
+
+    open_table() : size_(0) {}
+
+    std::size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    V* find(K const& key) {
+        return const_cast<V*>(static_cast<open_table const*>(this)->find(key));
+    }
+
+    V const* find(K const& key) const {
+        if(slots_.empty()) {
+            return nullptr;
+        }
+
+        std::size_t h = hash_of(key);
+        for(std::size_t i = h & mask();; i = (i + 1) & mask()) {
+            slot const& s = slots_[i];
+            if(s.hash == 0) {
+                return nullptr;
+            }
+            if(s.hash == h && s.key == key) {
+                return &s.value;
+            }
+        }
+    }
+
+    /**
+     * Returns the value for key, inserting a default one first if there isn't one.
+     * Inserting can move every entry, so pointers from find() don't survive this.
+     */
+    V& operator[](K const& key) {
+        if((size_ + 1) * 4 > slots_.size() * 3) {
+            grow();
+        }
+
+        std::size_t h = hash_of(key);
+        std::size_t i = h & mask();
+        for(; slots_[i].hash != 0; i = (i + 1) & mask()) {
+            if(slots_[i].hash == h && slots_[i].key == key) {
+                return slots_[i].value;
+            }
+        }
+
+        slots_[i].hash = h;
+        slots_[i].key = key;
+        ++size_;
+        return slots_[i].value;
+    }
+
+    /**
+     * Removes key if it's there. Later entries in the same run are shifted back
+     * rather than leaving a tombstone, so lookups never get slower over time.
+     */
+    bool erase(K const& key) {
+        if(slots_.empty()) {
+            return false;
+        }
+
+        std::size_t h = hash_of(key);
+        std::size_t i = h & mask();
+        for(; slots_[i].hash != h || !(slots_[i].key == key); i = (i + 1) & mask()) {
+            if(slots_[i].hash == 0) {
+                return false;
+            }
+        }
+
+        for(std::size_t j = (i + 1) & mask(); slots_[j].hash != 0; j = (j + 1) & mask()) {
+            // Move j into the hole at i unless its home slot lies cyclically in (i, j]
+            std::size_t home = slots_[j].hash & mask();
+            bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+            if(!stays) {
+                slots_[i] = std::move(slots_[j]);
+                i = j;
+            }
+        }
+        slots_[i] = slot();
+        --size_;
+        return true;
+    }
+
+    /**
+     * Calls f(key, value) for every entry.
+     */
+    template<typename F>
+    void for_each(F f) const {
+        for(auto& s : slots_) {
+            if(s.hash != 0) {
+                f(s.key, s.value);
+            }
+        }
+    }
+
+    // Raw slot access, for callers that sweep the table (e.g. a clock hand for eviction)
+    std::size_t slot_count() const { return slots_.size(); }
+    slot& slot_at(std::size_t i) { return slots_[i]; }
+
+private:
+    std::vector<slot> slots_;   // Size is zero or a power of two
+    std::size_t size_;
+
+    std::size_t mask() const { return slots_.size() - 1; }
+
+    static std::size_t hash_of(K const& key) {
+        std::size_t h = Hash()(key);
+        return h ? h : 1;
+    }
+
+    void grow() {
+        std::vector<slot> old(slots_.empty() ? 16 : slots_.size() * 2);
+        old.swap(slots_);
+        for(auto& s : old) {
+            if(s.hash != 0) {
+                std::size_t i = s.hash & mask();
+                while(slots_[i].hash != 0) {
+                    i = (i + 1) & mask();
+                }
+                slots_[i] = std::move(s);
+            }
+        }
+    }
+};
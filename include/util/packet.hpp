@@ -1,15 +1,41 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
 #include <string>
 #include <cstring>
 #include <stdexcept>
+#include <vector>
 #include <util/net_interface.h>
+#include <util/log.hpp>
 
 enum packet_type : uint32_t {
     GET,
     SEND,
-    ERROR
+    ERROR,
+    STATS,
+    OFFER,
+    CHUNKS,
+    WANT,
+    SIGNATURES,
+    DELTA,
+    HELLO,
+    DICTIONARY
+};
+
+/**
+ * The byte the server sends back on the data channel once it has dealt with an
+ * uploaded file: stored means it's in place (and on disk, if the server was
+ * asked to make uploads durable). It's also the answer to an offer_packet, on
+ * the control channel, where needs data means the client should SEND the file
+ * (or its chunks, see chunks_packet) and needs delta that there's an older
+ * version the client can send the differences from (see delta_packet).
+ */
+enum upload_status : uint8_t {
+    UPLOAD_FAILED,
+    UPLOAD_STORED,
+    UPLOAD_NEEDS_DATA,
+    UPLOAD_NEEDS_DELTA
 };
 
 struct packet {
@@ -32,7 +58,7 @@ struct packet {
         try {
             iface.send(serialised, packet_size);
         } catch(net_interface::error& e) {
-            std::cerr << "Error while sending packet: " << e.what() << std::endl;
+            LOG_ERROR("Error while sending packet: " << e.what());
             ret = false;
         }
         
@@ -48,10 +74,10 @@ struct send_packet : public packet {
     uint32_t name_size;
     char* name;
 
-    uint32_t file_size;
+    uint64_t file_size;
 
     // Constructor for the sending side
-    send_packet(std::string const& f_name, uint32_t f_size)
+    send_packet(std::string const& f_name, uint64_t f_size)
     : packet(SEND), name(new char[f_name.size() + 1]), name_size(f_name.size() + 1), file_size(f_size) {
         std::strcpy(this->name, f_name.c_str());
     }
@@ -65,7 +91,7 @@ struct send_packet : public packet {
         iface.receive(&this->name_size, sizeof(uint32_t));
         this->name = new char[this->name_size];
         iface.receive(this->name, this->name_size);
-        iface.receive(&this->file_size, sizeof(uint32_t));
+        iface.receive(&this->file_size, sizeof(uint64_t));
     }
 
     // Default constructor for the receiving side
@@ -80,7 +106,284 @@ struct send_packet : public packet {
     send_packet(send_packet& other) = delete;
 
     virtual void* serialise(size_t& size) const {
-        size = (sizeof(uint32_t) * 2) + sizeof(packet_type) + name_size;
+        size = sizeof(uint32_t) + sizeof(uint64_t) + sizeof(packet_type) + name_size;
+        unsigned char* buf = (unsigned char*)malloc(size);
+        size_t offset = 0;
+
+        memcpy(buf + offset, &this->p_type, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+        memcpy(buf + offset, &this->name_size, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+        memcpy(buf + offset, this->name, this->name_size);
+        offset += this->name_size;
+        memcpy(buf + offset, &this->file_size, sizeof(uint64_t));
+        return buf;
+    }
+
+};
+
+/**
+ * Packet offering a file to the remote host by its size and BLAKE3 hash. If the
+ * server already has those contents it stores the name without the data.
+ */
+struct offer_packet : public packet {
+    uint32_t name_size;
+    char* name;
+
+    uint64_t file_size;
+    unsigned char hash[32];
+
+    offer_packet(std::string const& f_name, uint64_t f_size, unsigned char const* f_hash)
+    : packet(OFFER), name_size(f_name.size() + 1), name(new char[f_name.size() + 1]), file_size(f_size) {
+        std::strcpy(this->name, f_name.c_str());
+        std::memcpy(this->hash, f_hash, sizeof(this->hash));
+    }
+
+    offer_packet(net_interface& iface)
+    : offer_packet() {
+        iface.receive(&this->name_size, sizeof(uint32_t));
+        this->name = new char[this->name_size];
+        iface.receive(this->name, this->name_size);
+        iface.receive(&this->file_size, sizeof(uint64_t));
+        iface.receive(this->hash, sizeof(this->hash));
+    }
+
+    offer_packet()
+    : packet(OFFER), name(nullptr) {}
+
+    ~offer_packet() {
+        delete[] name;
+    }
+
+    offer_packet(offer_packet& other) = delete;
+
+    virtual void* serialise(size_t& size) const {
+        size = sizeof(uint32_t) + sizeof(uint64_t) + sizeof(packet_type) + name_size + sizeof(hash);
+        unsigned char* buf = (unsigned char*)malloc(size);
+        size_t offset = 0;
+
+        memcpy(buf + offset, &this->p_type, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+        memcpy(buf + offset, &this->name_size, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+        memcpy(buf + offset, this->name, this->name_size);
+        offset += this->name_size;
+        memcpy(buf + offset, &this->file_size, sizeof(uint64_t));
+        offset += sizeof(uint64_t);
+        memcpy(buf + offset, this->hash, sizeof(this->hash));
+        return buf;
+    }
+};
+
+/**
+ * One content-defined chunk of a file (see fastcdc.hpp): its length and BLAKE3 hash.
+ * This is also its layout on the wire.
+ */
+struct chunk_ref {
+    uint32_t size;
+    unsigned char hash[32];
+};
+
+/**
+ * Packet describing a file to be uploaded as the list of its chunks, in order.
+ * The server answers with a want_packet naming the chunks it doesn't already
+ * have, which the client then sends back to back on the data channel.
+ */
+struct chunks_packet : public packet {
+    uint32_t name_size;
+    char* name;
+
+    uint64_t file_size;
+    uint32_t chunk_count;
+    chunk_ref* chunks;
+
+    chunks_packet(std::string const& f_name, uint64_t f_size, chunk_ref const* f_chunks, uint32_t count)
+    : packet(CHUNKS), name_size(f_name.size() + 1), name(new char[f_name.size() + 1]), file_size(f_size),
+      chunk_count(count), chunks(new chunk_ref[count]) {
+        std::strcpy(this->name, f_name.c_str());
+        std::memcpy(this->chunks, f_chunks, count * sizeof(chunk_ref));
+    }
+
+    /**
+     * Reads a packet, unless it lists more chunks than a file of its size could have been cut
+     * into, in which case nothing is allocated for them and the list is left unread.
+     *
+     * @param min_chunk The least a chunk (other than the last) can hold.
+     */
+    chunks_packet(net_interface& iface, uint32_t min_chunk)
+    : chunks_packet() {
+        iface.receive(&this->name_size, sizeof(uint32_t));
+        this->name = new char[this->name_size];
+        iface.receive(this->name, this->name_size);
+        iface.receive(&this->file_size, sizeof(uint64_t));
+        iface.receive(&this->chunk_count, sizeof(uint32_t));
+        if(this->chunk_count > this->file_size / min_chunk + 1) {
+            this->complete = false;
+            return;
+        }
+        this->chunks = new chunk_ref[this->chunk_count];
+        iface.receive(this->chunks, this->chunk_count * sizeof(chunk_ref));
+    }
+
+    chunks_packet()
+    : packet(CHUNKS), name(nullptr), file_size(0), chunk_count(0), chunks(nullptr), complete(true) {}
+
+    // False if the list of chunks was too long to read
+    bool complete;
+
+    ~chunks_packet() {
+        delete[] name;
+        delete[] chunks;
+    }
+
+    chunks_packet(chunks_packet& other) = delete;
+
+    virtual void* serialise(size_t& size) const {
+        size = sizeof(packet_type) + sizeof(uint32_t) + name_size + sizeof(uint64_t) + sizeof(uint32_t)
+               + chunk_count * sizeof(chunk_ref);
+        unsigned char* buf = (unsigned char*)malloc(size);
+        size_t offset = 0;
+
+        memcpy(buf + offset, &this->p_type, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+        memcpy(buf + offset, &this->name_size, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+        memcpy(buf + offset, this->name, this->name_size);
+        offset += this->name_size;
+        memcpy(buf + offset, &this->file_size, sizeof(uint64_t));
+        offset += sizeof(uint64_t);
+        memcpy(buf + offset, &this->chunk_count, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+        memcpy(buf + offset, this->chunks, this->chunk_count * sizeof(chunk_ref));
+        return buf;
+    }
+};
+
+/**
+ * The server's answer to a chunks_packet: the indexes, in increasing order, of
+ * the chunks it needs sent.
+ */
+struct want_packet : public packet {
+    uint32_t count;
+    uint32_t* indexes;
+
+    want_packet(std::vector<uint32_t> const& wanted)
+    : packet(WANT), count(wanted.size()), indexes(new uint32_t[wanted.size()]) {
+        std::copy(wanted.begin(), wanted.end(), this->indexes);
+    }
+
+    want_packet(net_interface& iface)
+    : want_packet() {
+        iface.receive(&this->count, sizeof(uint32_t));
+        this->indexes = new uint32_t[this->count];
+        iface.receive(this->indexes, this->count * sizeof(uint32_t));
+    }
+
+    want_packet()
+    : packet(WANT), count(0), indexes(nullptr) {}
+
+    ~want_packet() {
+        delete[] indexes;
+    }
+
+    want_packet(want_packet& other) = delete;
+
+    virtual void* serialise(size_t& size) const {
+        size = sizeof(packet_type) + sizeof(uint32_t) + count * sizeof(uint32_t);
+        unsigned char* buf = (unsigned char*)malloc(size);
+        size_t offset = 0;
+
+        memcpy(buf + offset, &this->p_type, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+        memcpy(buf + offset, &this->count, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+        memcpy(buf + offset, this->indexes, this->count * sizeof(uint32_t));
+        return buf;
+    }
+};
+
+/**
+ * The signature of one block of a file for delta transfers (see delta.hpp): its
+ * rolling checksum and the start of its BLAKE3 hash. This is also its layout
+ * on the wire.
+ */
+struct block_signature {
+    uint32_t weak;
+    unsigned char strong[16];
+};
+
+/**
+ * Packet carrying the block signatures of the server's version of a file. The
+ * client sends one with just the name to ask for them; the server replies with
+ * the version they're of (no blocks if it doesn't have the file).
+ */
+struct signatures_packet : public packet {
+    uint32_t name_size;
+    char* name;
+
+    uint64_t base_size;
+    int64_t base_mtime_ns;
+    uint32_t block_size;
+    uint32_t count;
+    block_signature* sigs;
+
+    // Constructor for the requesting side
+    signatures_packet(std::string const& f_name)
+    : signatures_packet() {
+        this->name_size = f_name.size() + 1;
+        this->name = new char[this->name_size];
+        std::strcpy(this->name, f_name.c_str());
+    }
+
+    signatures_packet(std::string const& f_name, uint64_t size, int64_t mtime_ns, uint32_t block,
+                      std::vector<block_signature> const& blocks)
+    : signatures_packet(f_name) {
+        this->base_size = size;
+        this->base_mtime_ns = mtime_ns;
+        this->block_size = block;
+        this->count = blocks.size();
+        this->sigs = new block_signature[blocks.size()];
+        std::copy(blocks.begin(), blocks.end(), this->sigs);
+    }
+
+    /**
+     * Reads a packet, unless it has more than max_count signatures, in which case nothing is
+     * allocated for them and they're left unread. A request never has any.
+     */
+    signatures_packet(net_interface& iface, uint32_t max_count = 0xffffffff)
+    : signatures_packet() {
+        iface.receive(&this->name_size, sizeof(uint32_t));
+        this->name = new char[this->name_size];
+        iface.receive(this->name, this->name_size);
+        iface.receive(&this->base_size, sizeof(uint64_t));
+        iface.receive(&this->base_mtime_ns, sizeof(int64_t));
+        iface.receive(&this->block_size, sizeof(uint32_t));
+        iface.receive(&this->count, sizeof(uint32_t));
+        if(this->count > max_count) {
+            this->complete = false;
+            return;
+        }
+        this->sigs = new block_signature[this->count];
+        iface.receive(this->sigs, this->count * sizeof(block_signature));
+    }
+
+    signatures_packet()
+    : packet(SIGNATURES), name_size(0), name(nullptr), base_size(0), base_mtime_ns(0), block_size(0), count(0),
+      sigs(nullptr), complete(true) {}
+
+    // False if there were too many signatures to read
+    bool complete;
+
+    ~signatures_packet() {
+        delete[] name;
+        delete[] sigs;
+    }
+
+    signatures_packet(signatures_packet& other) = delete;
+
+    virtual void* serialise(size_t& size) const {
+        size = sizeof(packet_type) + sizeof(uint32_t) + name_size + sizeof(uint64_t) + sizeof(int64_t)
+               + 2 * sizeof(uint32_t) + count * sizeof(block_signature);
         unsigned char* buf = (unsigned char*)malloc(size);
         size_t offset = 0;
 
@@ -90,21 +393,99 @@ struct send_packet : public packet {
         offset += sizeof(uint32_t);
         memcpy(buf + offset, this->name, this->name_size);
         offset += this->name_size;
-        memcpy(buf + offset, &this->file_size, sizeof(uint32_t));
+        memcpy(buf + offset, &this->base_size, sizeof(uint64_t));
+        offset += sizeof(uint64_t);
+        memcpy(buf + offset, &this->base_mtime_ns, sizeof(int64_t));
+        offset += sizeof(int64_t);
+        memcpy(buf + offset, &this->block_size, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+        memcpy(buf + offset, &this->count, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+        memcpy(buf + offset, this->sigs, this->count * sizeof(block_signature));
         return buf;
     }
+};
+
+/**
+ * Packet announcing a delta from the server's version of a file, which it
+ * names by the size and mtime its signatures_packet gave. The server answers
+ * with an upload_status byte: needs data if it still has that version, so the
+ * delta can follow on the data channel, or failed if not.
+ */
+struct delta_packet : public packet {
+    uint32_t name_size;
+    char* name;
+
+    uint64_t file_size;
+    unsigned char hash[32];         // BLAKE3 of the new version, checked once it's rebuilt
+    uint64_t base_size;
+    int64_t base_mtime_ns;
+
+    delta_packet(std::string const& f_name, uint64_t f_size, unsigned char const* f_hash, uint64_t b_size,
+                 int64_t b_mtime_ns)
+    : packet(DELTA), name_size(f_name.size() + 1), name(new char[f_name.size() + 1]), file_size(f_size),
+      base_size(b_size), base_mtime_ns(b_mtime_ns) {
+        std::strcpy(this->name, f_name.c_str());
+        std::memcpy(this->hash, f_hash, sizeof(this->hash));
+    }
+
+    delta_packet(net_interface& iface)
+    : delta_packet() {
+        iface.receive(&this->name_size, sizeof(uint32_t));
+        this->name = new char[this->name_size];
+        iface.receive(this->name, this->name_size);
+        iface.receive(&this->file_size, sizeof(uint64_t));
+        iface.receive(this->hash, sizeof(this->hash));
+        iface.receive(&this->base_size, sizeof(uint64_t));
+        iface.receive(&this->base_mtime_ns, sizeof(int64_t));
+    }
+
+    delta_packet()
+    : packet(DELTA), name(nullptr) {}
+
+    ~delta_packet() {
+        delete[] name;
+    }
+
+    delta_packet(delta_packet& other) = delete;
+
+    virtual void* serialise(size_t& size) const {
+        size = sizeof(packet_type) + sizeof(uint32_t) + name_size + sizeof(uint64_t) + sizeof(hash)
+               + sizeof(uint64_t) + sizeof(int64_t);
+        unsigned char* buf = (unsigned char*)malloc(size);
+        size_t offset = 0;
 
+        memcpy(buf + offset, &this->p_type, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+        memcpy(buf + offset, &this->name_size, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+        memcpy(buf + offset, this->name, this->name_size);
+        offset += this->name_size;
+        memcpy(buf + offset, &this->file_size, sizeof(uint64_t));
+        offset += sizeof(uint64_t);
+        memcpy(buf + offset, this->hash, sizeof(this->hash));
+        offset += sizeof(this->hash);
+        memcpy(buf + offset, &this->base_size, sizeof(uint64_t));
+        offset += sizeof(uint64_t);
+        memcpy(buf + offset, &this->base_mtime_ns, sizeof(int64_t));
+        return buf;
+    }
 };
 
 /**
- * Packet specifying a file to be retrieved from the remote host.
+ * Packet specifying a file, or a range of it, to be retrieved from the remote host.
+ * A range that runs past the end of the file is cut short.
  */
 struct get_packet : public packet {   
     uint32_t name_size;
     char* name;
+    uint64_t offset;                // Where in the file to start
+    uint64_t length;                // How much of it to send; GET_TO_END for the rest
 
-    get_packet(std::string const& file_name)
-    : packet(GET), name(new char[file_name.size() + 1]), name_size(file_name.size() + 1) {
+    static const uint64_t GET_TO_END = ~uint64_t(0);
+
+    get_packet(std::string const& file_name, uint64_t offset = 0, uint64_t length = GET_TO_END)
+    : packet(GET), name(new char[file_name.size() + 1]), name_size(file_name.size() + 1), offset(offset), length(length) {
         std::strcpy(name, file_name.c_str());
     }
 
@@ -113,10 +494,12 @@ struct get_packet : public packet {
         iface.receive(&this->name_size, sizeof(uint32_t));        
         this->name = new char[this->name_size];
         iface.receive(this->name, this->name_size);
+        iface.receive(&this->offset, sizeof(uint64_t));
+        iface.receive(&this->length, sizeof(uint64_t));
     }
 
     get_packet()
-    : packet(GET), name(nullptr) {}
+    : packet(GET), name(nullptr), offset(0), length(GET_TO_END) {}
 
     ~get_packet() {
         delete[] name;
@@ -125,7 +508,7 @@ struct get_packet : public packet {
     get_packet(get_packet& other) = delete;
 
     virtual void* serialise(size_t& size) const {
-        size = sizeof(uint32_t) + this->name_size + sizeof(this->p_type);
+        size = sizeof(uint32_t) + this->name_size + sizeof(this->p_type) + 2 * sizeof(uint64_t);
 
         size_t offset = 0;
         unsigned char* buf = (unsigned char*)malloc(size);
@@ -134,6 +517,10 @@ struct get_packet : public packet {
         memcpy(buf + offset, &this->name_size, sizeof(uint32_t));
         offset += sizeof(uint32_t);
         memcpy(buf + offset, this->name, this->name_size);
+        offset += this->name_size;
+        memcpy(buf + offset, &this->offset, sizeof(uint64_t));
+        offset += sizeof(uint64_t);
+        memcpy(buf + offset, &this->length, sizeof(uint64_t));
         return buf;
     }
 };
@@ -155,8 +542,9 @@ struct error_packet : public packet {
     error_packet(net_interface& iface)
     : error_packet() {
         iface.receive(&this->err_size, sizeof(uint32_t));
-        this->err = new char[this->err_size];
+        this->err = new char[this->err_size + 1];
         iface.receive(this->err, this->err_size);
+        this->err[this->err_size] = '\0'; // The terminator isn't sent
     }
 
     error_packet()
@@ -181,3 +569,138 @@ struct error_packet : public packet {
         return buf;
     }
 };
+
+/**
+ * Packet carrying server statistics. The client sends one with no text to ask for them;
+ * the server replies with the metrics in the Prometheus text format.
+ */
+struct stats_packet : public packet {
+    uint32_t text_size;
+    char* text;
+
+    stats_packet(std::string const& stats)
+    : packet(STATS), text_size(stats.size()), text(new char[stats.size() + 1]) {
+        std::strcpy(this->text, stats.c_str());
+    }
+
+    stats_packet(net_interface& iface)
+    : stats_packet() {
+        iface.receive(&this->text_size, sizeof(uint32_t));
+        this->text = new char[this->text_size + 1];
+        iface.receive(this->text, this->text_size);
+        this->text[this->text_size] = '\0';
+    }
+
+    // Constructor for the requesting side
+    stats_packet()
+    : packet(STATS), text_size(0), text(nullptr) {}
+
+    ~stats_packet() {
+        delete[] text;
+    }
+
+    stats_packet(stats_packet& other) = delete;
+
+    virtual void* serialise(size_t& size) const {
+        size = sizeof(uint32_t) + text_size + sizeof(this->p_type);
+
+        unsigned char* buf = (unsigned char*)malloc(size);
+        size_t offset = 0;
+        memcpy(buf + offset, &this->p_type, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+        memcpy(buf + offset, &this->text_size, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+        if(this->text_size) {
+            memcpy(buf + offset, this->text, this->text_size);
+        }
+        return buf;
+    }
+};
+
+/**
+ * Packet settling how file contents are compressed on the session's data
+ * channels (see compression.hpp). The client asks for a codec and level; the
+ * server answers with the codec it'll use, which is CODEC_NONE if it won't,
+ * and the version of its current shared dictionary (0 if it has none), which
+ * the client can fetch with a dictionary_packet.
+ */
+struct hello_packet : public packet {
+    uint8_t codec;
+    int8_t level;
+    uint32_t dictionary;
+
+    hello_packet(uint8_t c, int8_t lvl, uint32_t dict = 0)
+    : packet(HELLO), codec(c), level(lvl), dictionary(dict) {}
+
+    hello_packet(net_interface& iface)
+    : packet(HELLO) {
+        iface.receive(&this->codec, sizeof(uint8_t));
+        iface.receive(&this->level, sizeof(int8_t));
+        iface.receive(&this->dictionary, sizeof(uint32_t));
+    }
+
+    virtual void* serialise(size_t& size) const {
+        size = sizeof(packet_type) + sizeof(uint8_t) + sizeof(int8_t) + sizeof(uint32_t);
+        unsigned char* buf = (unsigned char*)malloc(size);
+        size_t offset = 0;
+        memcpy(buf + offset, &this->p_type, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+        memcpy(buf + offset, &this->codec, sizeof(uint8_t));
+        offset += sizeof(uint8_t);
+        memcpy(buf + offset, &this->level, sizeof(int8_t));
+        offset += sizeof(int8_t);
+        memcpy(buf + offset, &this->dictionary, sizeof(uint32_t));
+        return buf;
+    }
+};
+
+/**
+ * Packet carrying one version of the server's shared compression dictionary.
+ * The client sends one with just the version it wants; the server replies
+ * with its contents, which are empty if it doesn't have that version. Once a
+ * session has fetched a dictionary, both sides compress small frames against it.
+ */
+struct dictionary_packet : public packet {
+    uint32_t version;
+    uint32_t size;
+    char* data;
+
+    dictionary_packet(uint32_t v, std::vector<char> const& contents)
+    : packet(DICTIONARY), version(v), size(contents.size()), data(new char[contents.size()]) {
+        std::copy(contents.begin(), contents.end(), this->data);
+    }
+
+    dictionary_packet(net_interface& iface)
+    : packet(DICTIONARY), data(nullptr) {
+        iface.receive(&this->version, sizeof(uint32_t));
+        iface.receive(&this->size, sizeof(uint32_t));
+        this->data = new char[this->size];
+        iface.receive(this->data, this->size);
+    }
+
+    // Constructor for the requesting side
+    explicit dictionary_packet(uint32_t v)
+    : packet(DICTIONARY), version(v), size(0), data(nullptr) {}
+
+    ~dictionary_packet() {
+        delete[] data;
+    }
+
+    dictionary_packet(dictionary_packet& other) = delete;
+
+    virtual void* serialise(size_t& size) const {
+        size = sizeof(packet_type) + 2 * sizeof(uint32_t) + this->size;
+        unsigned char* buf = (unsigned char*)malloc(size);
+        size_t offset = 0;
+        memcpy(buf + offset, &this->p_type, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+        memcpy(buf + offset, &this->version, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+        memcpy(buf + offset, &this->size, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+        if(this->size) {
+            memcpy(buf + offset, this->data, this->size);
+        }
+        return buf;
+    }
+};
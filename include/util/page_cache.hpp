@@ -0,0 +1,139 @@
+/* ========================================================================
+   $HEADER FILE
+   $File: page_cache.hpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/15 $
+   $Description: $
+   $    Page cache hints for transfers: sequential access and readahead for
+   $    files being sent, and write-behind for big uploads so that they go
+   $    to disk and leave the page cache as they arrive instead of pushing
+   $    out the files that GETs keep asking for. Also counts how much of
+   $    what's read was already cached.
+   $Revisions: $
+   ======================================================================== */
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <util/metrics.hpp>
+
+/**
+ * Bytes read from files, by whether they were already in the page cache, and
+ * bytes of uploads dropped from it.
+ */
+struct page_cache_metrics {
+    counter& hit_bytes;
+    counter& miss_bytes;
+    counter& dropped_bytes;
+
+    static page_cache_metrics& get() {
+        static page_cache_metrics m;
+        return m;
+    }
+
+private:
+    page_cache_metrics()
+    : hit_bytes(metrics::instance().get_counter("page_cache_read_bytes_total", "result=\"hit\"",
+                                                "File bytes read, by whether they were already in the page cache.")),
+      miss_bytes(metrics::instance().get_counter("page_cache_read_bytes_total", "result=\"miss\"",
+                                                 "File bytes read, by whether they were already in the page cache.")),
+      dropped_bytes(metrics::instance().get_counter("page_cache_dropped_bytes_total", "",
+                                                    "Uploaded bytes written back and evicted from the page cache as they arrived.")) {}
+};
+
+/**
+ * Tells the kernel the file will be read from start to end, which doubles its
+ * readahead window and lets it drop pages behind the reader sooner.
+ */
+inline void advise_sequential(int fd) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+/**
+ * Starts reading the given range into the page cache in the background.
+ */
+inline void read_ahead(int fd, std::uint64_t offset, std::uint64_t size) {
+    posix_fadvise(fd, offset, size, POSIX_FADV_WILLNEED);
+}
+
+/**
+ * Reads like pread, adding how many of the bytes came straight from the page
+ * cache to hit_bytes and how many had to wait for the disk to miss_bytes. The
+ * cached part is found with a RWF_NOWAIT read, which fails rather than block.
+ */
+inline ssize_t pread_counted(int fd, char* buf, std::size_t size, std::uint64_t offset,
+                             std::uint64_t& hit_bytes, std::uint64_t& miss_bytes) {
+    page_cache_metrics& m = page_cache_metrics::get();
+#ifdef RWF_NOWAIT
+    static std::atomic<bool> nowait_works(true);
+    if(nowait_works.load(std::memory_order_relaxed)) {
+        iovec iov = {buf, size};
+        ssize_t n = preadv2(fd, &iov, 1, offset, RWF_NOWAIT);
+        if(n > 0) {
+            hit_bytes += n;
+            m.hit_bytes.add(n);
+            return n;
+        }
+        if(n < 0 && (errno == EOPNOTSUPP || errno == ENOSYS || errno == EINVAL)) {
+            nowait_works = false;
+        } else if(n == 0) {
+            return 0;
+        }
+    }
+#endif
+    ssize_t n = pread(fd, buf, size, offset);
+    if(n > 0) {
+        miss_bytes += n;
+        m.miss_bytes.add(n);
+    }
+    return n;
+}
+
+/**
+ * Streams an upload out of the page cache as it's written: each WINDOW that's
+ * been written is sent to disk, and once the window before it has finished
+ * going out, that one is evicted. Writeback overlaps with receiving, so the
+ * upload only ever holds about two windows of the page cache.
+ */
+class write_behind {
+public:
+    static const std::uint64_t WINDOW = 8 * 1024 * 1024;
+
+    explicit write_behind(int fd) : fd_(fd), started_(0), dropped_(0) {}
+
+    // Call with the size written so far
+    void wrote(std::uint64_t end) {
+        while(end - started_ >= WINDOW) {
+            sync_file_range(fd_, started_, WINDOW, SYNC_FILE_RANGE_WRITE);
+            started_ += WINDOW;
+            if(started_ - dropped_ > WINDOW) {
+                drop(WINDOW);
+            }
+        }
+    }
+
+    // Writes back and evicts whatever's left; call once the whole file is written
+    void finish(std::uint64_t end) {
+        if(end > dropped_) {
+            drop(end - dropped_);
+        }
+    }
+
+private:
+    int fd_;
+    std::uint64_t started_;     // Writeback has been started up to here
+    std::uint64_t dropped_;     // and everything before this is on disk and out of the cache
+
+    void drop(std::uint64_t size) {
+        sync_file_range(fd_, dropped_, size,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(fd_, dropped_, size, POSIX_FADV_DONTNEED);
+        page_cache_metrics::get().dropped_bytes.add(size);
+        dropped_ += size;
+    }
+};
@@ -0,0 +1,120 @@
+/* ========================================================================
+   $HEADER FILE
+   $File: rcu.hpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/10 $
+   $Description: $
+   $    A read-copy-update cell: readers get lock-free access to an immutable
+   $    snapshot, writers publish a new snapshot and reclaim the old one once
+   $    every reader that might still see it has finished.
+   $Revisions: $
+   ======================================================================== */
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+template<typename T>
+class rcu_cell {
+public:
+    /**
+     * Holds a snapshot for reading. Keep these short-lived: writers wait for
+     * guards on old snapshots to go away before they can free them.
+     */
+    class read_guard {
+    public:
+        read_guard(read_guard&& other)
+        : counter_(other.counter_), value_(other.value_) {
+            other.counter_ = nullptr;
+        }
+
+        ~read_guard() {
+            if(counter_) {
+                counter_->fetch_sub(1, std::memory_order_release);
+            }
+        }
+
+        read_guard(read_guard& other) = delete;
+
+        T const& operator*() const { return *value_; }
+        T const* operator->() const { return value_; }
+
+    private:
+        friend class rcu_cell;
+
+        std::atomic<unsigned>* counter_;
+        T const* value_;
+
+        read_guard(std::atomic<unsigned>* counter, T const* value)
+        : counter_(counter), value_(value) {}
+    };
+
+    rcu_cell() : rcu_cell(std::unique_ptr<T>(new T())) {}
+
+    explicit rcu_cell(std::unique_ptr<T> initial)
+    : current_(initial.release()), epoch_(0) {
+        readers_[0].store(0);
+        readers_[1].store(0);
+    }
+
+    ~rcu_cell() {
+        delete current_.load();
+    }
+
+    rcu_cell(rcu_cell& other) = delete;
+
+    read_guard read() const {
+        // Register as a reader of the current epoch; retry if a writer flipped it in the meantime
+        for(;;) {
+            unsigned e = epoch_.load(std::memory_order_seq_cst);
+            std::atomic<unsigned>& counter = readers_[e & 1];
+            counter.fetch_add(1, std::memory_order_seq_cst);
+            if(epoch_.load(std::memory_order_seq_cst) == e) {
+                return read_guard(&counter, current_.load(std::memory_order_seq_cst));
+            }
+            counter.fetch_sub(1, std::memory_order_release);
+        }
+    }
+
+    /**
+     * Replaces the snapshot. Blocks until no reader can still be using the old
+     * one, then frees it. Writers are serialised against each other.
+     */
+    void publish(std::unique_ptr<T> next) {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        T* old = current_.exchange(next.release(), std::memory_order_seq_cst);
+
+        // Anyone who registered under the old epoch may have the old pointer
+        unsigned e = epoch_.load(std::memory_order_seq_cst);
+        epoch_.store(e + 1, std::memory_order_seq_cst);
+        while(readers_[e & 1].load(std::memory_order_acquire) != 0) {
+            std::this_thread::yield();
+        }
+        delete old;
+    }
+
+    /**
+     * Lets a writer build the next snapshot from the current one without another
+     * writer publishing in between. update gets the current value and returns the next.
+     */
+    template<typename F>
+    void update(F update) {
+        std::lock_guard<std::mutex> lock(update_mutex_);
+        std::unique_ptr<T> next;
+        {
+            read_guard g = read();
+            next = update(*g);
+        }
+        publish(std::move(next));
+    }
+
+private:
+    std::atomic<T*> current_;
+    mutable std::atomic<unsigned> epoch_;
+    mutable std::atomic<unsigned> readers_[2];
+    std::mutex write_mutex_;
+    std::mutex update_mutex_;
+};
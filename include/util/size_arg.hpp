@@ -0,0 +1,43 @@
+/* ========================================================================
+   $HEADER FILE
+   $File: size_arg.hpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/08 $
+   $Description: $
+   $    Byte size units and parsing of size arguments for the tools
+   $Revisions: $
+   ======================================================================== */
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+const std::uint64_t KiB = 1024;
+const std::uint64_t MiB = 1024 * KiB;
+const std::uint64_t GiB = 1024 * MiB;
+
+/**
+ * Parses sizes such as 512, 64K or 4G.
+ *
+ * @param s   A byte count with an optional K, M or G suffix.
+ * @param out Receives the number of bytes.
+ * @return false if s isn't a valid size.
+ */
+inline bool parse_size(std::string const& s, std::uint64_t& out) {
+    char* end;
+    unsigned long long n = std::strtoull(s.c_str(), &end, 10);
+    if(end == s.c_str()) {
+        return false;
+    }
+
+    switch(*end) {
+        case '\0': out = n; return true;
+        case 'K': case 'k': out = n * KiB; break;
+        case 'M': case 'm': out = n * MiB; break;
+        case 'G': case 'g': out = n * GiB; break;
+        default: return false;
+    }
+    return end[1] == '\0';
+}
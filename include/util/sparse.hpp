@@ -0,0 +1,180 @@
+/* ========================================================================
+   $HEADER FILE
+   $File: sparse.hpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/19 $
+   $Description: $
+   $    Holes in file contents. Disk images and the like are mostly long
+   $    runs of zeros (holes in the file, or just zeros that were written)
+   $    which aren't worth sending or storing. A sparse_net_interface sends
+   $    every HOLE_BLOCK-sized block of zeros (aligned to where it is in the
+   $    contents) as part of a hole record rather than as data, and the
+   $    other end hands zeros back in its place. Writers skip such blocks,
+   $    so the file they write has holes there too.
+   $
+   $    On the wire, contents are a series of records, each a uint64 with
+   $    HOLE_FLAG set for a hole and the record's length in the rest,
+   $    followed by that many bytes if it isn't a hole.
+   $Revisions: $
+   ======================================================================== */
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+#include <util/metrics.hpp>
+#include <util/net_interface.h>
+
+// Runs of zeros are sent and stored as holes this many bytes at a time (a filesystem block)
+const std::size_t HOLE_BLOCK = 4096;
+
+/**
+ * Whether size bytes at data are all zero. SSE2 does 64 bytes a step, so
+ * checking is about as fast as memory can be read.
+ */
+inline bool all_zero(void const* data, std::size_t size) {
+    unsigned char const* p = (unsigned char const*)data;
+#if defined(__x86_64__)
+    for(; size >= 64; p += 64, size -= 64) {
+        __m128i v = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((__m128i const*)p), _mm_loadu_si128((__m128i const*)(p + 16))),
+                                 _mm_or_si128(_mm_loadu_si128((__m128i const*)(p + 32)), _mm_loadu_si128((__m128i const*)(p + 48))));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xffff) {
+            return false;
+        }
+    }
+#endif
+    for(; size >= 8; p += 8, size -= 8) {
+        std::uint64_t word;
+        std::memcpy(&word, p, 8);
+        if(word) {
+            return false;
+        }
+    }
+    for(; size; ++p, --size) {
+        if(*p) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Zeros to send in place of holes that are never read.
+ */
+inline char const* zero_block(std::size_t& size) {
+    static const char zeros[64 * 1024] = {};
+    size = sizeof(zeros);
+    return zeros;
+}
+
+struct sparse_metrics {
+    counter& hole_bytes;
+
+    static sparse_metrics& get() {
+        static sparse_metrics m;
+        return m;
+    }
+
+private:
+    sparse_metrics()
+    : hole_bytes(metrics::instance().get_counter("transfer_hole_bytes_total", "",
+                                                 "Bytes of file contents sent as holes rather than data.")) {}
+};
+
+/**
+ * Sends file contents with their runs of zeros as holes, and receives them
+ * with the holes filled back in with zeros.
+ */
+class sparse_net_interface : public net_interface {
+public:
+    static const std::uint64_t HOLE_FLAG = 1ULL << 63;
+
+    explicit sparse_net_interface(net_interface& inner) : inner_(inner), sent_(0), left_(0), hole_(false) {}
+
+    sparse_net_interface(sparse_net_interface& other) = delete;
+
+    virtual void send(void* buf, size_t size) {
+        char* p = (char*)buf;
+        while(size) {
+            // A run of whole zero blocks or of anything else, whichever comes first
+            std::size_t run = 0;
+            bool hole = false;
+            for(bool first = true; run < size; first = false) {
+                std::size_t n = std::min<std::uint64_t>(size - run, HOLE_BLOCK - (sent_ + run) % HOLE_BLOCK);
+                bool zeros = n == HOLE_BLOCK && all_zero(p + run, n);
+                if(first) {
+                    hole = zeros;
+                } else if(zeros != hole) {
+                    break;
+                }
+                run += n;
+            }
+
+            // A short run goes in the same send as its header, so it's not two writes to a socket
+            std::uint64_t header = run | (hole ? HOLE_FLAG : 0);
+            if(hole) {
+                inner_.send(&header, sizeof(header));
+                sparse_metrics::get().hole_bytes.add(run);
+            } else if(run <= MERGE_SIZE) {
+                merged_.resize(sizeof(header) + run);
+                std::memcpy(merged_.data(), &header, sizeof(header));
+                std::memcpy(merged_.data() + sizeof(header), p, run);
+                inner_.send(merged_.data(), merged_.size());
+            } else {
+                inner_.send(&header, sizeof(header));
+                inner_.send(p, run);
+            }
+            p += run;
+            size -= run;
+            sent_ += run;
+        }
+    }
+
+    /**
+     * Sends a record of size bytes of data whose contents the caller sends through the
+     * underlying interface itself.
+     */
+    void send_data_header(std::uint64_t size) {
+        inner_.send(&size, sizeof(size));
+        sent_ += size;
+    }
+
+    virtual void receive(void* buf, size_t size) {
+        char* p = (char*)buf;
+        while(size) {
+            if(!left_) {
+                std::uint64_t header;
+                inner_.receive(&header, sizeof(header));
+                hole_ = (header & HOLE_FLAG) != 0;
+                left_ = header & ~HOLE_FLAG;
+                if(!left_) {
+                    throw net_interface::error("Empty record in sparse contents", net_interface::error_code::other);
+                }
+            }
+            std::size_t n = std::min<std::uint64_t>(size, left_);
+            if(hole_) {
+                std::memset(p, 0, n);
+            } else {
+                inner_.receive(p, n);
+            }
+            p += n;
+            size -= n;
+            left_ -= n;
+        }
+    }
+
+private:
+    // Data runs up to this long are copied in behind their header
+    static const std::size_t MERGE_SIZE = 16 * 1024;
+
+    net_interface& inner_;
+    std::vector<char> merged_;
+    std::uint64_t sent_;        // Bytes of contents sent so far, to find where blocks start
+    std::uint64_t left_;        // Of the record being received
+    bool hole_;
+};
@@ -0,0 +1,269 @@
+/* ========================================================================
+   $HEADER FILE
+   $File: trace.hpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/05 $
+   $Description: $
+   $    Optional span-based tracing. Spans are buffered per thread and
+   $    streamed to a file in the Chrome trace-event JSON format (load it in
+   $    chrome://tracing or Perfetto). When tracing is off, a span costs one
+   $    load and a branch.
+   $Revisions: $
+   ======================================================================== */
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+// Opens a span named name that lasts until the end of the enclosing scope
+#define TRACE_SPAN(var, name, cat) trace_span var((name), (cat))
+
+struct trace_event {
+    const char* name;
+    const char* cat;
+    std::uint64_t start_ns;
+    std::uint64_t dur_ns;
+    std::uint32_t tid;
+    std::string args; // Already-rendered JSON object members, if any
+};
+
+// A template so that the definition can live in this header
+template<typename T = void>
+struct trace_state {
+    static bool enabled;
+    static unsigned sample_every;
+};
+
+template<typename T> bool trace_state<T>::enabled = false;
+template<typename T> unsigned trace_state<T>::sample_every = 64;
+
+class tracer {
+public:
+    static tracer& instance() {
+        static tracer t;
+        return t;
+    }
+
+    tracer(tracer& other) = delete;
+
+    ~tracer() {
+        stop();
+    }
+
+    static bool enabled() {
+        return trace_state<>::enabled;
+    }
+
+    /**
+     * Returns true if the nth chunk of a transfer should get its own events.
+     */
+    static bool sample_chunk(std::uint64_t n) {
+        return enabled() && n % trace_state<>::sample_every == 0;
+    }
+
+    /**
+     * Starts tracing to the file at path. Only call this before any other threads start.
+     *
+     * @param sample_every Emit per-chunk events for every sample_every'th chunk.
+     * @return false if the file couldn't be created.
+     */
+    bool start(std::string const& path, unsigned sample_every) {
+        out_ = std::fopen(path.c_str(), "w");
+        if(!out_) {
+            return false;
+        }
+
+        std::fputs("[\n", out_);
+        first_event_ = true;
+        trace_state<>::sample_every = sample_every ? sample_every : 1;
+        trace_state<>::enabled = true;
+        running_ = true;
+        writer_ = std::thread([this] { run(); });
+        return true;
+    }
+
+    /**
+     * Writes out any buffered events and closes the trace file. A trace cut
+     * short (e.g. by Ctrl + C) is missing its closing bracket, which trace
+     * viewers accept.
+     */
+    void stop() {
+        if(!out_) {
+            return;
+        }
+
+        trace_state<>::enabled = false;
+        {
+            std::lock_guard<std::mutex> lock(wake_mutex_);
+            running_ = false;
+        }
+        wake_.notify_one();
+        writer_.join();
+
+        write_pending();
+        std::fputs("\n]\n", out_);
+        std::fclose(out_);
+        out_ = nullptr;
+    }
+
+    void record(trace_event&& e) {
+        thread_buffer& buf = this_thread_buffer();
+        e.tid = buf.tid;
+        std::lock_guard<std::mutex> lock(buf.mutex);
+        buf.events.push_back(std::move(e));
+    }
+
+    std::uint64_t now_ns() const {
+        return (std::uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - epoch_).count();
+    }
+
+private:
+    struct thread_buffer {
+        std::mutex mutex; // Only contended while the writer swaps the events out
+        std::vector<trace_event> events;
+        std::uint32_t tid;
+    };
+
+    std::chrono::steady_clock::time_point epoch_;
+    FILE* out_;
+    bool first_event_;
+
+    std::mutex buffers_mutex_;
+    std::vector<std::shared_ptr<thread_buffer>> buffers_;
+    std::uint32_t next_tid_;
+
+    std::mutex wake_mutex_;
+    std::condition_variable wake_;
+    bool running_;
+    std::thread writer_;
+
+    tracer()
+    : epoch_(std::chrono::steady_clock::now()), out_(nullptr), first_event_(true), next_tid_(1), running_(false) {}
+
+    thread_buffer& this_thread_buffer() {
+        static thread_local std::shared_ptr<thread_buffer> buf;
+        if(!buf) {
+            buf = std::make_shared<thread_buffer>();
+            std::lock_guard<std::mutex> lock(buffers_mutex_);
+            buf->tid = next_tid_++;
+            buffers_.push_back(buf);
+        }
+        return *buf;
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(wake_mutex_);
+        while(running_) {
+            wake_.wait_for(lock, std::chrono::seconds(1));
+            lock.unlock();
+            write_pending();
+            lock.lock();
+        }
+    }
+
+    void write_pending() {
+        std::vector<std::shared_ptr<thread_buffer>> buffers;
+        {
+            std::lock_guard<std::mutex> lock(buffers_mutex_);
+            buffers = buffers_;
+        }
+
+        int pid = (int)getpid();
+        std::vector<trace_event> events;
+        for(auto& buf : buffers) {
+            {
+                std::lock_guard<std::mutex> lock(buf->mutex);
+                events.swap(buf->events);
+            }
+
+            for(auto& e : events) {
+                std::fputs(first_event_ ? "" : ",\n", out_);
+                first_event_ = false;
+                std::fprintf(out_, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                                   "\"pid\":%d,\"tid\":%u,\"args\":{%s}}",
+                             e.name, e.cat, e.start_ns / 1e3, e.dur_ns / 1e3, pid, e.tid, e.args.c_str());
+            }
+            events.clear();
+        }
+        std::fflush(out_);
+    }
+};
+
+/**
+ * A timed span. Does nothing unless tracing was enabled when it was opened.
+ */
+class trace_span {
+public:
+    trace_span(const char* name, const char* cat)
+    : trace_span(name, cat, tracer::enabled()) {}
+
+    // For sampled spans; active should already take tracer::enabled() into account
+    trace_span(const char* name, const char* cat, bool active)
+    : active_(active) {
+        if(active_) {
+            event_.name = name;
+            event_.cat = cat;
+            event_.start_ns = tracer::instance().now_ns();
+        }
+    }
+
+    ~trace_span() {
+        if(active_) {
+            event_.dur_ns = tracer::instance().now_ns() - event_.start_ns;
+            tracer::instance().record(std::move(event_));
+        }
+    }
+
+    trace_span(trace_span& other) = delete;
+
+    /**
+     * Attaches a key/value pair to the span. Keys must not need escaping.
+     */
+    void arg(const char* key, std::string const& value) {
+        if(!active_) {
+            return;
+        }
+
+        std::string escaped;
+        for(char c : value) {
+            if(c == '"' || c == '\\') {
+                escaped += '\\';
+            }
+            if((unsigned char)c >= 0x20) {
+                escaped += c;
+            }
+        }
+        append_arg(key, "\"" + escaped + "\"");
+    }
+
+    void arg(const char* key, std::uint64_t value) {
+        if(active_) {
+            append_arg(key, std::to_string(value));
+        }
+    }
+
+private:
+    bool active_;
+    trace_event event_;
+
+    void append_arg(const char* key, std::string const& json_value) {
+        if(!event_.args.empty()) {
+            event_.args += ',';
+        }
+        event_.args += '"';
+        event_.args += key;
+        event_.args += "\":";
+        event_.args += json_value;
+    }
+};
@@ -0,0 +1,295 @@
+/* ========================================================================
+   $File: main.cpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/07 $
+   $Description: $
+   $     Loopback benchmark. Runs the server on a background thread and a
+   $     client on the main thread, then measures GET/SEND throughput for a
+   $     range of file sizes and the request rate for small files. Results
+   $     are written as JSON so that builds can be compared.
+   $Revisions: $
+   ======================================================================== */
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+#include <client/client.h>
+#include <server/server.h>
+#include <util/file_transfer.hpp>
+#include <util/log.hpp>
+#include <util/metrics.hpp>
+#include <util/size_arg.hpp>
+
+namespace fs = boost::filesystem;
+
+struct bench_options {
+    std::uint64_t max_size = 256 * MiB;
+    std::uint64_t byte_budget = 1 * GiB; // Roughly how much data to move per size and operation
+    unsigned iterations = 20;
+    double rps_seconds = 3;
+    std::string dir;
+    std::string output;
+    std::string log_path = "/dev/null";
+};
+
+struct run_result {
+    std::string op;
+    std::uint64_t size;
+    unsigned requests;
+    unsigned failures;
+    double seconds;
+    double cpu_seconds;
+    histogram latency;
+};
+
+double cpu_seconds() {
+    rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: make_file $
+   $ Prototype: void make_file(fs::path const& path, std::uint64_t size) { $
+   $ Params:
+   $    path: Where to create the file $
+   $    size: How many bytes to fill it with
+   $ Description:  $
+   $    Creates a file of pseudo-random (incompressible) bytes.
+   ======================================================================== */
+void make_file(fs::path const& path, std::uint64_t size) {
+    std::vector<char> block(MiB);
+    std::uint64_t x = 0x9E3779B97F4A7C15ull ^ size;
+    for(auto& c : block) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        c = (char)x;
+    }
+
+    std::ofstream out(path.c_str(), std::ios::binary);
+    for(std::uint64_t left = size; left > 0;) {
+        std::size_t n = left < block.size() ? (std::size_t)left : block.size();
+        out.write(block.data(), n);
+        left -= n;
+    }
+    if(!out) {
+        throw std::runtime_error("couldn't create " + path.string());
+    }
+}
+
+std::string file_name(const char* op, std::uint64_t size) {
+    std::ostringstream oss;
+    oss << op << '_' << size;
+    return oss.str();
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: run_requests $
+   $ Prototype: void run_requests(client& c, run_result& r, std::string name, unsigned count, double max_seconds) { $
+   $ Params:
+   $    c: The client to issue requests with $
+   $    r: Where to record the results (r.op says which operation to run)
+   $    name: The file to GET or SEND
+   $    count: Stop after this many requests (if nonzero)
+   $    max_seconds: Stop after this long (if nonzero)
+   $ Description:  $
+   $    Issues requests back to back and records their latencies.
+   ======================================================================== */
+void run_requests(client& c, run_result& r, std::string name, unsigned count, double max_seconds) {
+    typedef std::chrono::steady_clock clock;
+
+    bool get = r.op == "get";
+    r.requests = 0;
+    r.failures = 0;
+
+    double cpu_start = cpu_seconds();
+    clock::time_point start = clock::now();
+    clock::time_point deadline = start + std::chrono::microseconds((std::uint64_t)(max_seconds * 1e6));
+    for(;;) {
+        clock::time_point t = clock::now();
+        if((count && r.requests >= count) || (max_seconds > 0 && t >= deadline)) {
+            break;
+        }
+
+        bool ok = get ? c.get(name) : c.send(name);
+        r.latency.record((std::uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - t).count());
+        ++r.requests;
+        if(!ok) {
+            ++r.failures;
+        }
+    }
+    r.seconds = std::chrono::duration<double>(clock::now() - start).count();
+    r.cpu_seconds = cpu_seconds() - cpu_start;
+}
+
+void write_result(std::ostream& out, run_result const& r, bool throughput) {
+    double bytes = (double)r.size * (r.requests - r.failures);
+
+    out << "{\"op\": \"" << r.op << "\", \"size\": " << r.size
+        << ", \"requests\": " << r.requests << ", \"failures\": " << r.failures
+        << ", \"seconds\": " << r.seconds
+        << ", \"requests_per_sec\": " << r.requests / r.seconds;
+    if(throughput) {
+        out << ", \"mib_per_sec\": " << bytes / MiB / r.seconds
+            << ", \"cpu_seconds_per_gib\": " << (bytes > 0 ? r.cpu_seconds / (bytes / GiB) : 0);
+    }
+    out << ", \"latency_us\": {\"p50\": " << r.latency.percentile(0.5) / 1e3
+        << ", \"p99\": " << r.latency.percentile(0.99) / 1e3
+        << ", \"p999\": " << r.latency.percentile(0.999) / 1e3
+        << ", \"max\": " << r.latency.max() / 1e3 << "}}";
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: main $
+   $ Prototype: int main(int argc, char** argv) { $
+   $ Params:
+   $    argc: the number of arguments
+   $    argv: the arguments
+   $ Description:  Runs the benchmarks
+   ======================================================================== */
+int main(int argc, char** argv) {
+    bench_options opts;
+    for(int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        bool ok = true;
+        if(arg.compare(0, 11, "--max-size=") == 0) {
+            ok = parse_size(arg.substr(11), opts.max_size);
+        } else if(arg.compare(0, 14, "--byte-budget=") == 0) {
+            ok = parse_size(arg.substr(14), opts.byte_budget);
+        } else if(arg.compare(0, 13, "--iterations=") == 0) {
+            opts.iterations = std::max(1, std::atoi(arg.c_str() + 13));
+        } else if(arg.compare(0, 14, "--rps-seconds=") == 0) {
+            opts.rps_seconds = std::atof(arg.c_str() + 14);
+        } else if(arg.compare(0, 6, "--dir=") == 0) {
+            opts.dir = arg.substr(6);
+        } else if(arg.compare(0, 9, "--output=") == 0) {
+            opts.output = arg.substr(9);
+        } else if(arg.compare(0, 11, "--log-file=") == 0) {
+            opts.log_path = arg.substr(11);
+        } else {
+            ok = false;
+        }
+
+        if(!ok) {
+            std::cerr << "usage: " << argv[0] << " [--max-size=bytes[K|M|G]] [--byte-budget=bytes[K|M|G]]"
+                      << " [--iterations=n] [--rps-seconds=s] [--dir=path] [--output=path] [--log-file=path]" << std::endl;
+            return 1;
+        }
+    }
+
+    // Per-request logging would swamp the output, so it goes to /dev/null unless asked for
+    logger::instance().open(opts.log_path);
+
+    // Scratch directories for each side
+    bool own_dir = opts.dir.empty();
+    fs::path base = own_dir ? fs::temp_directory_path() / fs::unique_path("bench-%%%%-%%%%") : fs::path(opts.dir);
+    fs::path server_dir = base / "server";
+    fs::path client_dir = base / "client";
+
+    std::vector<std::uint64_t> sizes;
+    for(std::uint64_t size = KiB; size <= opts.max_size; size *= 4) {
+        sizes.push_back(size);
+    }
+
+    std::ostringstream json;
+    int ret = 0;
+    try {
+        fs::create_directories(server_dir);
+        fs::create_directories(client_dir);
+
+        std::cerr << "Creating test files in " << base.c_str() << "..." << std::endl;
+        for(std::uint64_t size : sizes) {
+            make_file(server_dir / file_name("get", size), size);
+            make_file(client_dir / file_name("send", size), size);
+        }
+
+        boost::asio::io_service server_service;
+        std::string server_path(server_dir.string());
+        server s(server_service, server_path);
+        std::thread server_thread([&s] { s.start(); });
+
+        // Stops the server however the run ends, since a joinable thread can't be destroyed
+        struct server_guard {
+            server& s;
+            std::thread& t;
+            ~server_guard() {
+                s.stop();
+                t.join();
+            }
+        } stopper{s, server_thread};
+
+        // A histogram can't be moved, so every result gets its slot up front
+        std::vector<run_result> throughput(sizes.size() * 2);
+        std::size_t next = 0;
+        run_result small_files;
+        {
+            boost::asio::io_service client_service;
+            std::string host("127.0.0.1");
+            std::string client_path(client_dir.string());
+            client c(client_service, host, client_path);
+
+            for(std::uint64_t size : sizes) {
+                unsigned count = (unsigned)std::max<std::uint64_t>(3, std::min<std::uint64_t>(opts.iterations, opts.byte_budget / size));
+                for(const char* op : {"get", "send"}) {
+                    std::string name = file_name(op, size);
+                    std::cerr << op << ' ' << size << " bytes x " << count << "..." << std::endl;
+
+                    // One untimed request to warm the page cache and the connection
+                    run_result warmup;
+                    warmup.op = op;
+                    run_requests(c, warmup, name, 1, 0);
+
+                    run_result& r = throughput[next++];
+                    r.op = op;
+                    r.size = size;
+                    run_requests(c, r, name, count, 0);
+                }
+            }
+
+            std::cerr << "get " << KiB << " bytes for " << opts.rps_seconds << "s..." << std::endl;
+            small_files.op = "get";
+            small_files.size = KiB;
+            run_requests(c, small_files, file_name("get", KiB), 0, opts.rps_seconds);
+        }
+
+        json << "{\n  \"buf_size\": " << BUF_SIZE << ",\n  \"throughput\": [\n";
+        for(std::size_t i = 0; i < throughput.size(); ++i) {
+            json << "    ";
+            write_result(json, throughput[i], true);
+            json << (i + 1 < throughput.size() ? ",\n" : "\n");
+        }
+        json << "  ],\n  \"small_files\": ";
+        write_result(json, small_files, false);
+        json << "\n}\n";
+    } catch(std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        ret = 1;
+    }
+
+    if(own_dir) {
+        boost::system::error_code ec;
+        fs::remove_all(base, ec);
+    }
+
+    if(ret == 0) {
+        if(opts.output.empty()) {
+            std::cout << json.str();
+        } else {
+            std::ofstream(opts.output.c_str()) << json.str();
+        }
+    }
+    return ret;
+}
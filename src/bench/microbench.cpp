@@ -0,0 +1,575 @@
+/* ========================================================================
+   $File: microbench.cpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/09 $
+   $Description: $
+   $     Microbenchmarks of the protocol code with no sockets involved. The
+   $     client and server halves talk over loopback_net_interface pairs, so
+   $     the numbers are the user-space cost of packet encoding, send_file/
+   $     receive_file and request dispatch. Results are written as JSON.
+   $Revisions: $
+   ======================================================================== */
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+#include <server/server.h>
+#include <util/compression.hpp>
+#include <util/delta.hpp>
+#include <util/fastcdc.hpp>
+#include <util/file_transfer.hpp>
+#include <util/integrity.hpp>
+#include <util/log.hpp>
+#include <util/loopback_net_interface.hpp>
+#include <util/packet.hpp>
+#include <util/size_arg.hpp>
+
+namespace fs = boost::filesystem;
+typedef std::chrono::steady_clock steady;
+
+/**
+ * Hands the client's end of each data channel the server opens over to the client thread.
+ */
+class data_channel_handoff {
+public:
+    std::unique_ptr<net_interface> open() {
+        auto ends = loopback_net_interface::make_pair();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_ = std::move(ends.second);
+        }
+        ready_.notify_one();
+        return std::move(ends.first);
+    }
+
+    loopback_net_interface::ptr take() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ready_.wait(lock, [this] { return (bool)pending_; });
+        return std::move(pending_);
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    loopback_net_interface::ptr pending_;
+};
+
+struct result {
+    std::string name;
+    std::uint64_t ops;
+    std::uint64_t bytes_per_op;
+    double seconds;
+    double ratio;       // Output bytes per input byte, for compression; 0 otherwise
+};
+
+void make_file(fs::path const& path, std::uint64_t size) {
+    std::vector<char> block(std::min<std::uint64_t>(size, MiB) + 1, 'x');
+    std::ofstream out(path.c_str(), std::ios::binary);
+    for(std::uint64_t left = size; left > 0;) {
+        std::size_t n = std::min<std::uint64_t>(left, block.size());
+        out.write(block.data(), n);
+        left -= n;
+    }
+}
+
+// Runs op repeatedly for about min_seconds and returns how many times it ran and for how long
+template<typename Op>
+result time_op(std::string const& name, std::uint64_t bytes_per_op, double min_seconds, Op op) {
+    result r{name, 0, bytes_per_op, 0, 0};
+    steady::time_point start = steady::now();
+    do {
+        for(int i = 0; i < 16; ++i) {
+            op();
+        }
+        r.ops += 16;
+        r.seconds = std::chrono::duration<double>(steady::now() - start).count();
+    } while(r.seconds < min_seconds);
+    return r;
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: bench_packets $
+   $ Prototype: void bench_packets(std::vector<result>& results, double seconds) { $
+   $ Params:
+   $    results: Where to add the results $
+   $    seconds: Roughly how long to run each case for
+   $ Description:  $
+   $    Serialises packets into one end of a loopback pair and parses them
+   $    back out of the other on the same thread.
+   ======================================================================== */
+void bench_packets(std::vector<result>& results, double seconds) {
+    auto ends = loopback_net_interface::make_pair();
+    net_interface& a = *ends.first;
+    net_interface& b = *ends.second;
+    std::string name("some_file_name.txt");
+    packet_type pt;
+
+    results.push_back(time_op("get_packet_roundtrip", 0, seconds, [&] {
+        get_packet g{name};
+        g.send(a);
+        b.receive(&pt, sizeof(pt));
+        get_packet parsed{b};
+    }));
+
+    results.push_back(time_op("send_packet_roundtrip", 0, seconds, [&] {
+        send_packet s{name, 123456789};
+        s.send(a);
+        b.receive(&pt, sizeof(pt));
+        send_packet parsed{b};
+    }));
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: bench_chunking $
+   $ Prototype: void bench_chunking(std::vector<result>& results, double seconds) { $
+   $ Params:
+   $    results: Where to add the results $
+   $    seconds: Roughly how long to run each case for
+   $ Description:  $
+   $    Cuts pseudo-random data (so that cut points land where they would
+   $    in real files) into content-defined chunks, with SIMD if there is
+   $    any and a byte at a time, and works out a delta between two
+   $    versions of it.
+   ======================================================================== */
+void bench_chunking(std::vector<result>& results, double seconds) {
+    std::vector<unsigned char> data(16 * MiB);
+    std::uint64_t x = 88172645463325252ULL;
+    for(unsigned char& b : data) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        b = (unsigned char)x;
+    }
+
+    std::size_t chunks = 0;
+    results.push_back(time_op("fastcdc_cut", data.size(), seconds, [&] {
+        for(std::size_t done = 0; done < data.size(); ++chunks) {
+            done += fastcdc::cut(data.data() + done, data.size() - done);
+        }
+    }));
+    results.push_back(time_op("fastcdc_cut_portable", data.size(), seconds, [&] {
+        for(std::size_t done = 0; done < data.size(); ++chunks) {
+            done += fastcdc::cut_portable(data.data() + done, data.size() - done);
+        }
+    }));
+
+    // A delta against the same data with a byte inserted near the start, so that
+    // the window rolls for a block before it lines up with the old blocks again
+    std::uint32_t block_size = delta_block_size(data.size());
+    std::vector<block_signature> sigs;
+    for(std::size_t off = 0; off < data.size(); off += block_size) {
+        block_signature sig;
+        rolling_checksum sum;
+        std::size_t n = std::min<std::size_t>(block_size, data.size() - off);
+        sum.reset(data.data() + off, n);
+        sig.weak = sum.value();
+        delta_strong_hash(data.data() + off, n, sig.strong);
+        sigs.push_back(sig);
+    }
+    std::vector<unsigned char> edited(data);
+    edited.insert(edited.begin() + 100, 'x');
+    std::uint64_t literal_bytes = 0;
+    results.push_back(time_op("delta_encode", edited.size(), seconds, [&] {
+        auto delta = make_delta_encoder(sigs, block_size, data.size(),
+            [&](unsigned char const*, std::size_t n) { literal_bytes += n; },
+            [](std::uint32_t, std::uint32_t) {});
+        for(std::size_t off = 0; off < edited.size(); off += FILE_READ_SIZE) {
+            delta.update(edited.data() + off, std::min<std::size_t>(FILE_READ_SIZE, edited.size() - off));
+        }
+        delta.finish();
+    }));
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: bench_compression $
+   $ Prototype: void bench_compression(std::vector<result>& results, double seconds) { $
+   $ Params:
+   $    results: Where to add the results $
+   $    seconds: Roughly how long to run each case for
+   $ Description:  $
+   $    Compresses and decompresses a frame of log-like text with each
+   $    codec, and tries to compress a frame of random bytes (which is
+   $    what the bypass for incompressible data saves).
+   ======================================================================== */
+void bench_compression(std::vector<result>& results, double seconds) {
+    std::size_t const size = compressed_net_interface::FRAME_SIZE;
+    std::string text;
+    std::uint64_t x = 88172645463325252ULL;
+    for(unsigned line = 0; text.size() < size; ++line) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        text += "2016-10-19 12:00:" + std::to_string(line % 60) + " INFO request " + std::to_string(x % 100000)
+                + (x & 1 ? " GET /files/report.csv 200\n" : " SEND /uploads/backup.tar 201\n");
+    }
+    text.resize(size);
+    std::vector<char> noise(size);
+    for(char& b : noise) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        b = (char)x;
+    }
+
+    std::vector<char> packed, unpacked(size);
+    codec const codecs[] = {CODEC_LZ4, CODEC_DEFLATE};
+    for(codec c : codecs) {
+        int level = c == CODEC_DEFLATE ? Z_DEFAULT_COMPRESSION : 0;
+        std::string name(codec_name(c));
+        results.push_back(time_op(name + "_compress_text", size, seconds, [&] {
+            compress_frame(c, level, text.data(), size, packed);
+        }));
+        compress_frame(c, level, text.data(), size, packed);
+        results.push_back(time_op(name + "_decompress_text", size, seconds, [&] {
+            decompress_frame(c, packed.data(), packed.size(), unpacked.data(), size);
+        }));
+        results.push_back(time_op(name + "_compress_random", size, seconds, [&] {
+            compress_frame(c, level, noise.data(), size, packed);
+        }));
+    }
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: bench_dictionaries $
+   $ Prototype: void bench_dictionaries(std::vector<result>& results, double seconds) { $
+   $ Params:
+   $    results: Where to add the results $
+   $    seconds: Roughly how long to run each case for
+   $ Description:  $
+   $    Compresses a corpus of small JSON documents one by one with each
+   $    codec, on their own and against a dictionary trained on a
+   $    different set of documents like them.
+   ======================================================================== */
+void bench_dictionaries(std::vector<result>& results, double seconds) {
+    static char const* const services[] = {"billing", "search", "auth", "ingest", "reports", "mailer", "cache"};
+    static char const* const regions[] = {"us-east-1", "us-west-2", "eu-west-1", "ap-south-1"};
+    std::uint64_t x = 88172645463325252ULL;
+    auto next = [&x] {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        return x;
+    };
+    auto document = [&] {
+        std::ostringstream doc;
+        doc << "{\n  \"service\": \"" << services[next() % 7] << "\",\n  \"region\": \"" << regions[next() % 4]
+            << "\",\n  \"version\": \"" << next() % 10 << '.' << next() % 20 << '.' << next() % 100
+            << "\",\n  \"replicas\": " << next() % 12 + 1 << ",\n  \"endpoints\": [\n";
+        for(unsigned i = 0, n = next() % 24 + 8; i < n; ++i) {
+            doc << "    {\"name\": \"" << services[next() % 7] << '-' << next() % 1000 << "\", \"port\": "
+                << 8000 + next() % 1000 << ", \"timeout_ms\": " << next() % 5000 << ", \"retries\": " << next() % 5
+                << ", \"tls\": " << (next() & 1 ? "true" : "false") << ", \"id\": \"" << std::hex << next() << std::dec
+                << "\"}" << (i + 1 < n ? "," : "") << "\n";
+        }
+        doc << "  ]\n}\n";
+        std::string text = doc.str();
+        return std::vector<char>(text.begin(), text.end());
+    };
+
+    std::vector<std::vector<char>> training, corpus;
+    std::uint64_t corpus_bytes = 0;
+    for(int i = 0; i < 1000; ++i) {
+        training.push_back(document());
+        corpus.push_back(document());
+        corpus_bytes += corpus.back().size();
+    }
+    dictionary dict(1, train_dictionary(training, DICTIONARY_SIZE));
+
+    std::vector<char> packed;
+    codec const codecs[] = {CODEC_LZ4, CODEC_DEFLATE};
+    for(codec c : codecs) {
+        int level = c == CODEC_DEFLATE ? Z_DEFAULT_COMPRESSION : 0;
+        dictionary const* const dicts[] = {nullptr, &dict};
+        for(dictionary const* d : dicts) {
+            std::uint64_t out = 0;
+            result r = time_op(std::string(codec_name(c)) + (d ? "_dict" : "") + "_small_files", corpus_bytes, seconds, [&] {
+                out = 0;
+                for(std::vector<char> const& doc : corpus) {
+                    out += compress_frame(c, level, doc.data(), doc.size(), packed, d) ? packed.size() : doc.size();
+                }
+            });
+            r.ratio = (double)out / corpus_bytes;
+            results.push_back(r);
+        }
+    }
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: bench_checksums $
+   $ Prototype: void bench_checksums(std::vector<result>& results, double seconds) { $
+   $ Params:
+   $    results: Where to add the results $
+   $    seconds: Roughly how long to run each case for
+   $ Description:  $
+   $    Works out the CRC32C of a block the way transfers are checked, with
+   $    the crc32 instruction (where there is one) and with tables, the
+   $    BLAKE3 hash of a few blocks' worth the way whole files are, and the
+   $    scan for zeros that finds holes.
+   ======================================================================== */
+void bench_checksums(std::vector<result>& results, double seconds) {
+    std::size_t const size = checked_net_interface::BLOCK_SIZE;
+    std::vector<char> block(16 * size);
+    std::uint64_t x = 88172645463325252ULL;
+    for(char& b : block) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        b = (char)x;
+    }
+
+    volatile std::uint32_t crc = 0;
+    if(crc32c::hardware()) {
+        results.push_back(time_op("crc32c_sse42", size, seconds, [&] {
+            crc = crc32c::compute(block.data(), size);
+        }));
+    }
+    results.push_back(time_op("crc32c_tables", size, seconds, [&] {
+        crc = crc32c::extend_portable(0, block.data(), size);
+    }));
+
+    unsigned char hash[blake3_hasher::OUT_LEN];
+    results.push_back(time_op("blake3", block.size(), seconds, [&] {
+        blake3_hasher hasher;
+        hasher.update(block.data(), block.size());
+        hasher.finalize(hash);
+    }));
+
+    // The worst case, where the whole block has to be looked at
+    std::vector<char> zeros(size);
+    volatile bool zero = false;
+    results.push_back(time_op("all_zero", size, seconds, [&] {
+        zero = all_zero(zeros.data(), size);
+    }));
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: bench_transfer $
+   $ Prototype: void bench_transfer(std::vector<result>& results, fs::path const& file, std::uint64_t size, double seconds) { $
+   $ Params:
+   $    results: Where to add the results $
+   $    file: A file of the given size (which should be in the page cache)
+   $    size: The size of the file
+   $    seconds: Roughly how long to run for
+   $ Description:  $
+   $    Streams the file through send_file on one thread and receive_file
+   $    (into /dev/null) on another.
+   ======================================================================== */
+void bench_transfer(std::vector<result>& results, fs::path const& file, std::uint64_t size, double seconds) {
+    std::ofstream sink("/dev/null", std::ios::binary);
+
+    results.push_back(time_op("transfer_" + std::to_string(size), size, seconds, [&] {
+        auto ends = loopback_net_interface::make_pair();
+        net_interface& receiver = *ends.second;
+        std::thread t([&] { receive_file(sink, size, receiver); });
+
+        std::ifstream in(file.c_str(), std::ios::binary);
+        send_file(in, *ends.first);
+        t.join();
+    }));
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: bench_requests $
+   $ Prototype: void bench_requests(std::vector<result>& results, fs::path const& dir, double seconds) { $
+   $ Params:
+   $    results: Where to add the results $
+   $    dir: Scratch directory for the server and client files
+   $    seconds: Roughly how long to run each case for
+   $ Description:  $
+   $    Runs whole GET and SEND requests through server::serve_session.
+   ======================================================================== */
+void bench_requests(std::vector<result>& results, fs::path const& dir, double seconds) {
+    fs::path server_dir = dir / "server";
+    fs::path client_dir = dir / "client";
+    fs::create_directories(server_dir);
+    fs::create_directories(client_dir);
+
+    const std::uint64_t sizes[] = {KiB, MiB};
+    for(std::uint64_t size : sizes) {
+        make_file(server_dir / ("get_" + std::to_string(size)), size);
+        make_file(client_dir / ("send_" + std::to_string(size)), size);
+    }
+
+    boost::asio::io_service service;
+    std::string server_path = server_dir.string();
+    server_options opts;
+    opts.listen = false;
+    server s(service, server_path, opts);
+
+    data_channel_handoff handoff;
+    auto control = loopback_net_interface::make_pair();
+    net_interface& server_end = *control.second;
+    std::thread server_thread([&] {
+        server::session sess{server_end, [&handoff] { return handoff.open(); }};
+        s.serve_session(sess);
+    });
+
+    net_interface& ctrl = *control.first;
+    std::ofstream sink("/dev/null", std::ios::binary);
+    for(std::uint64_t size : sizes) {
+        std::string get_name = "get_" + std::to_string(size);
+        results.push_back(time_op("request_get_" + std::to_string(size), size, seconds, [&] {
+            get_packet g{get_name};
+            g.send(ctrl);
+
+            packet_type pt;
+            ctrl.receive(&pt, sizeof(pt));
+            if(pt != SEND) {
+                throw std::runtime_error("GET failed");
+            }
+            send_packet reply{ctrl};
+            auto data = handoff.take();
+            sparse_net_interface body(*data);
+            blake3_hasher hasher;
+            checked_net_interface checked(body, &hasher);
+            receive_file(sink, reply.file_size, checked);
+            finish_checked_receive(checked, body, *data, [](std::uint64_t, char const*, std::size_t) { return true; });
+            unsigned char hash[blake3_hasher::OUT_LEN];
+            hasher.finalize(hash);
+            check_content_hash(*data, hash, false);
+        }));
+
+        std::string send_name = "send_" + std::to_string(size);
+        fs::path send_path = client_dir / send_name;
+
+        // The server won't store an upload without its hash
+        unsigned char send_hash[blake3_hasher::OUT_LEN];
+        {
+            std::ifstream in(send_path.c_str(), std::ios::binary);
+            std::vector<char> contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            blake3_hasher hasher;
+            hasher.update(contents.data(), contents.size());
+            hasher.finalize(send_hash);
+        }
+        results.push_back(time_op("request_send_" + std::to_string(size), size, seconds, [&] {
+            send_packet request{send_name, size};
+            request.send(ctrl);
+
+            auto data = handoff.take();
+            sparse_net_interface body(*data);
+            checked_net_interface checked(body);
+            int fd = open(send_path.c_str(), O_RDONLY);
+            send_file(fd, size, checked);
+            close(fd);
+            finish_checked_send(checked.crcs(), size, *data, [](std::uint64_t, std::uint64_t) { return false; });
+            send_content_hash(*data, send_hash);
+
+            std::uint8_t status;
+            data->receive(&status, sizeof(status));
+            if(status != UPLOAD_STORED) {
+                throw std::runtime_error("SEND failed");
+            }
+        }));
+    }
+
+    // Hang up so that serve_session returns
+    control.first.reset();
+    server_thread.join();
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: main $
+   $ Prototype: int main(int argc, char** argv) { $
+   $ Params:
+   $    argc: the number of arguments
+   $    argv: the arguments
+   $ Description:  Runs the microbenchmarks
+   ======================================================================== */
+int main(int argc, char** argv) {
+    double seconds = 1;
+    std::string output;
+    for(int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if(arg.compare(0, 10, "--seconds=") == 0) {
+            seconds = std::atof(arg.c_str() + 10);
+        } else if(arg.compare(0, 9, "--output=") == 0) {
+            output = arg.substr(9);
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--seconds=s] [--output=path]" << std::endl;
+            return 1;
+        }
+    }
+
+    // The request benchmarks would otherwise log every request to stderr
+    logger::instance().open("/dev/null");
+
+    fs::path dir = fs::temp_directory_path() / fs::unique_path("microbench-%%%%-%%%%");
+    std::vector<result> results;
+    int ret = 0;
+    try {
+        fs::create_directories(dir);
+
+        std::cerr << "Packets..." << std::endl;
+        bench_packets(results, seconds);
+
+        std::cerr << "Chunking..." << std::endl;
+        bench_chunking(results, seconds);
+
+        std::cerr << "Compression..." << std::endl;
+        bench_compression(results, seconds);
+        bench_dictionaries(results, seconds);
+
+        std::cerr << "Checksums..." << std::endl;
+        bench_checksums(results, seconds);
+
+        std::cerr << "Transfers..." << std::endl;
+        for(std::uint64_t size = 64 * KiB; size <= 64 * MiB; size *= 16) {
+            fs::path file = dir / ("transfer_" + std::to_string(size));
+            make_file(file, size);
+            bench_transfer(results, file, size, seconds);
+        }
+
+        std::cerr << "Requests..." << std::endl;
+        bench_requests(results, dir, seconds);
+    } catch(std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        ret = 1;
+    }
+
+    boost::system::error_code ec;
+    fs::remove_all(dir, ec);
+
+    std::ostringstream json;
+    json << "{\n  \"buf_size\": " << BUF_SIZE << ",\n  \"results\": [\n";
+    for(std::size_t i = 0; i < results.size(); ++i) {
+        result const& r = results[i];
+        json << "    {\"name\": \"" << r.name << "\", \"ops\": " << r.ops
+             << ", \"ns_per_op\": " << r.seconds * 1e9 / r.ops;
+        if(r.bytes_per_op) {
+            json << ", \"ns_per_byte\": " << r.seconds * 1e9 / (r.ops * (double)r.bytes_per_op)
+                 << ", \"mib_per_sec\": " << r.ops * (double)r.bytes_per_op / MiB / r.seconds;
+        }
+        if(r.ratio) {
+            json << ", \"ratio\": " << r.ratio;
+        }
+        json << "}" << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    json << "  ]\n}\n";
+
+    if(output.empty()) {
+        std::cout << json.str();
+    } else {
+        std::ofstream(output.c_str()) << json.str();
+    }
+    return ret;
+}
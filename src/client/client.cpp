@@ -8,26 +8,41 @@
    $Revisions: $
    ======================================================================== */
 #include <iostream>
+#include <sstream>
+#include <vector>
+#include <fcntl.h>
 #include <client/client.h>
 #include <boost/filesystem.hpp>
 #include <util/packet.hpp>
+#include <util/delta.hpp>
+#include <util/fastcdc.hpp>
 #include <util/file_transfer.hpp>
+#include <util/integrity.hpp>
 #include <util/ports.h>
+#include <util/log.hpp>
 
 using boost::asio::io_service;
 using boost::asio::ip::tcp;
 
+// Files at least this big are uploaded in content-defined chunks, so that the parts the
+// server already has (from an earlier version, say) aren't sent again
+static const std::uint64_t CHUNKED_UPLOAD_MIN = 4 * 1024 * 1024;
+
 /* ========================================================================
    $ FUNCTION
    $ Name: client() $
-   $ Prototype: (io_service& service, std::string& host, std::string& storage_path): service_(service), control_socket_(service_), control_interface_(control_socket_), storage_path_(storage_path) { $
+   $ Prototype: (io_service& service, std::string& host, std::string& storage_path, std::string const& local_address) $
    $ Params: 
    $    name: The name of the program $
+   $    local_address: The address to bind to, or empty for any $
    $ Description:  $
    $    The constructor for the client 
    ======================================================================== */
-client::client(io_service& service, std::string& host, std::string& storage_path)
-        : service_(service), control_socket_(service_), control_interface_(control_socket_), storage_path_(storage_path) {
+client::client(io_service& service, std::string& host, std::string& storage_path, std::string const& local_address)
+        : service_(service), control_socket_(service_), control_interface_(control_socket_), storage_path_(storage_path),
+          local_address_(local_address.empty() ? boost::asio::ip::address_v4::any()
+                                                : boost::asio::ip::address_v4::from_string(local_address)),
+          compression_(CODEC_NONE), compression_level_(0) {
 
     // Check whether the path is a directory, and if so, whether we have read-write access to it
     // throw invalid argument exception if either case is false
@@ -45,51 +60,111 @@ client::client(io_service& service, std::string& host, std::string& storage_path
     tcp::resolver resolver{service_};
     tcp::resolver::query query{host.c_str(), oss.str()};
     auto endpoint_iterator = resolver.resolve(query);
-    
-    boost::asio::connect(control_socket_, endpoint_iterator);
 
-    std::cout << "Connected to server on control channel (port " << CONTROL_PORT << ")." << std::endl;
+    // Connect by hand rather than with asio::connect so that the socket can be bound first
+    boost::system::error_code ec = boost::asio::error::host_not_found;
+    for(; ec && endpoint_iterator != tcp::resolver::iterator(); ++endpoint_iterator) {
+        if(endpoint_iterator->endpoint().protocol() != tcp::v4()) {
+            continue;
+        }
+
+        control_socket_.close();
+        control_socket_.open(tcp::v4());
+        if(local_address_ != boost::asio::ip::address_v4::any()) {
+            control_socket_.bind(tcp::endpoint(local_address_, 0));
+        }
+        control_socket_.connect(*endpoint_iterator, ec);
+    }
+    if(ec) {
+        throw boost::system::system_error(ec);
+    }
+
+    LOG_INFO("Connected to server on control channel (port " << CONTROL_PORT << ").");
 }
 
-void client::accept_data_channel_conn(boost::asio::ip::tcp::socket& out) {
-    // Connect the data socket on port 7006
-    boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::tcp::v4(), DATA_PORT);
-    boost::asio::ip::tcp::acceptor a(service_);
+void client::listen_for_data_channel(boost::asio::ip::tcp::acceptor& a) {
+    // Listen on the data port (7006) before making the request so that the
+    // server can't try to connect before we're ready for it
+    boost::asio::ip::tcp::endpoint endpoint(local_address_, DATA_PORT);
 
     a.open(endpoint.protocol());
     a.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
     a.bind(endpoint);
     a.listen();
-    
+}
+
+void client::accept_data_channel_conn(boost::asio::ip::tcp::acceptor& a, boost::asio::ip::tcp::socket& out) {
     a.accept(out);
-    std::cout << "Received connection from server on data channel (port " << DATA_PORT << ")." << std::endl;
+    LOG_INFO("Received connection from server on data channel (port " << DATA_PORT << ").");
+}
+
+std::unique_ptr<compressed_net_interface> client::compress_channel(net_interface& data) {
+    if(compression_ == CODEC_NONE) {
+        return nullptr;
+    }
+    return std::unique_ptr<compressed_net_interface>(
+        new compressed_net_interface(data, compression_, compression_level_, dictionary_, &dictionaries_));
+}
+
+// Says what compressing a transfer's contents achieved and cost
+static void log_compression(compressed_net_interface const& c) {
+    if(!c.raw_bytes()) {
+        return;
+    }
+    LOG_INFO("Compressed " << c.raw_bytes() << " bytes to " << c.wire_bytes() << " ("
+             << c.wire_bytes() * 100 / c.raw_bytes() << "%) using " << c.cpu_ns() / 1000000 << " ms of CPU.");
+}
+
+// Hashes a whole file again, for one that had blocks rewritten after it was received
+static bool hash_file(std::string const& path, unsigned char hash[blake3_hasher::OUT_LEN]) {
+    std::ifstream file(path.c_str(), std::ios::binary);
+    std::vector<char> buf(FILE_READ_SIZE);
+    blake3_hasher hasher;
+    while(file.read(buf.data(), buf.size()) || file.gcount()) {
+        hasher.update(buf.data(), file.gcount());
+    }
+    if(file.bad() || !file.eof()) {
+        return false;
+    }
+    hasher.finalize(hash);
+    return true;
 }
 
 /* ========================================================================
    $ FUNCTION
    $ Name: client::get $
-   $ Prototype: void client::get(std::string& file_name) { $
+   $ Prototype: bool client::get(std::string& file_name, std::uint64_t offset, std::uint64_t length) { $
    $ Params: 
    $    file_name: The name of the file to get from the server $
+   $    offset: Where in it to start $
+   $    length: How much of it to get
    $ Description:  $
-   $   get the file from the server
+   $   get the file (or the range of it) from the server
    ======================================================================== */
-void client::get(std::string& file_name) {
+bool client::get(std::string& file_name, std::uint64_t offset, std::uint64_t length) {
     boost::filesystem::path file_path(storage_path_);
     std::string actual_name(boost::filesystem::path(file_name).filename().c_str());
     file_path /= actual_name;
 
     std::ofstream file(file_path.c_str());
     if(!file) {
-        std::cerr << "Error while creating/opening file " << file_name << std::endl;
-        return;
+        LOG_ERROR("Error while creating/opening file " << file_name);
+        return false;
     }    
 
-    std::cout << "Attempting to retrieve file " << actual_name << '.' << std::endl;
+    LOG_INFO("Attempting to retrieve file " << actual_name << '.');
+
+    boost::asio::ip::tcp::acceptor a(service_);
+    try {
+        listen_for_data_channel(a);
+    } catch(std::exception& e) {
+        LOG_ERROR("Error while listening for server data connection: " << e.what());
+        return false;
+    }
 
     // Try to send a packet requesting the file
-    get_packet g{actual_name};
-    if(!g.send(control_interface_)) return;
+    get_packet g{actual_name, offset, length};
+    if(!g.send(control_interface_)) return false;
 
     packet_type pt;
     control_interface_.receive(&pt, sizeof(packet_type));
@@ -98,74 +173,491 @@ void client::get(std::string& file_name) {
 
         boost::asio::ip::tcp::socket data_sock(service_);
         try {
-            accept_data_channel_conn(data_sock);
+            accept_data_channel_conn(a, data_sock);
         } catch(std::exception& e) {
-            std::cerr << "Error while accepting server data connection: " << e.what() << std::endl;
-            return;
+            LOG_ERROR("Error while accepting server data connection: " << e.what());
+            return false;
         }
         boost_net_interface data_interface(data_sock);
+        std::unique_ptr<compressed_net_interface> compressed = compress_channel(data_interface);
+        sparse_net_interface body(compressed ? *compressed : (net_interface&)data_interface);
 
-        receive_file(file, sp.file_size, data_interface);
-        std::cout << "Successfully retrieved file." << std::endl;
+        // The contents' CRCs follow them, and any blocks that didn't match are sent again. Then
+        // the whole thing is checked against the server's hash of it, if it knows it.
+        blake3_hasher hasher;
+        checked_net_interface checked(body, &hasher);
+        bool received = receive_file(file, sp.file_size, checked);
+        bool repaired = false;
+        auto store = [&](std::uint64_t off, char const* data, std::size_t n) {
+            repaired = true;
+            return (bool)file.seekp(off).write(data, n);
+        };
+        if(!received || !finish_checked_receive(checked, body, data_interface, store) || !file.flush()) {
+            LOG_ERROR("Retrieving file was unsuccessful.");
+            return false;
+        }
+        unsigned char hash[blake3_hasher::OUT_LEN];
+        if(repaired && !hash_file(file_path.string(), hash)) {
+            LOG_ERROR("Couldn't read back the retrieved file.");
+            return false;
+        } else if(!repaired) {
+            hasher.finalize(hash);
+        }
+        if(!check_content_hash(data_interface, hash, false)) {
+            file.close();
+            std::remove(file_path.c_str());
+            LOG_ERROR("Retrieving file was unsuccessful.");
+            return false;
+        }
+        if(compressed) {
+            log_compression(*compressed);
+        }
+        LOG_INFO("Successfully retrieved file.");
+        return true;
     } else if(pt == ERROR) {
         error_packet ep(control_interface_);
-        std::cerr << "Server reported error: " << ep.err << std::endl;
+        LOG_ERROR("Server reported error: " << ep.err);
         std::remove(file_path.c_str());
     }
 
     // Data socket will be closed upon leaving this function.
+    return false;
 }
 
 /* ========================================================================
    $ FUNCTION
    $ Name: client::send $
-   $ Prototype: void client::send(std::string& file_path) { $
+   $ Prototype: bool client::send(std::string& file_path) { $
    $ Params: 
    $    file_path: The path  of the file $
    $ Description:  $
-   $   Send a file to the server
+   $   Send a file to the server, offering it by hash first so that
+   $   contents the server already has aren't sent again. Big files are
+   $   cut into chunks in the same pass as they're hashed, and sent as
+   $   those if the offer is declined. If the server has an older version,
+   $   just the differences from it are sent.
    ======================================================================== */
-void client::send(std::string& file_path) {
+bool client::send(std::string& file_path) {
     boost::filesystem::path path(storage_path_);
     std::string name(boost::filesystem::path(file_path).filename().c_str());
     path /= file_path;
 
     if(!boost::filesystem::exists(path)) {
-        std::cerr << "File \"" << path.c_str() << "\" doesn't exist!" << std::endl;
-        return;
+        LOG_ERROR("File \"" << path.c_str() << "\" doesn't exist!");
+        return false;
     } else if(boost::filesystem::is_directory(path)) {
-        std::cerr << "File \"" << path.c_str() << "\" is a directory!" << std::endl;
-        return;
+        LOG_ERROR("File \"" << path.c_str() << "\" is a directory!");
+        return false;
     }
 
     // Open the file and get ready to send it
     boost::filesystem::ifstream file(path.c_str());
     if(!file) {
-        std::cerr << "Couldn't open file \"" << path.c_str() << "\". Aborting send." << std::endl;
-        return;
+        LOG_ERROR("Couldn't open file \"" << path.c_str() << "\". Aborting send.");
+        return false;
     }
 
-    std::cout << "Attempting to send file " << path.c_str() << '.' << std::endl;
+    LOG_INFO("Attempting to send file " << path.c_str() << '.');
+    uint64_t size = boost::filesystem::file_size(path);
+
+    // Offer it by hash first; if the server already has the contents, that's all it needs
+    std::vector<char> buf(FILE_READ_SIZE);
+    blake3_hasher hasher;
+    std::vector<chunk_ref> chunks;
+    auto cut = make_chunker([&chunks](unsigned char const* data, std::size_t n) {
+        chunk_ref c;
+        c.size = n;
+        blake3_hasher h;
+        h.update(data, n);
+        h.finalize(c.hash);
+        chunks.push_back(c);
+    });
+    bool chunked = size >= CHUNKED_UPLOAD_MIN;
+    while(file.read(buf.data(), buf.size()) || file.gcount()) {
+        hasher.update(buf.data(), file.gcount());
+        if(chunked) {
+            cut.update(buf.data(), file.gcount());
+        }
+    }
+    if(chunked) {
+        cut.finish();
+    }
+    file.clear();
+    file.seekg(0);
+    unsigned char hash[blake3_hasher::OUT_LEN];
+    hasher.finalize(hash);
+
+    offer_packet offer{name, size, hash};
+    if(!offer.send(control_interface_)) {
+        return false;
+    }
+    std::uint8_t status;
+    try {
+        control_interface_.receive(&status, sizeof(status));
+    } catch(net_interface::error& e) {
+        LOG_ERROR("Didn't hear back from the server about the file: " << e.what());
+        return false;
+    }
+    if(status == UPLOAD_STORED) {
+        LOG_INFO("The server already had the file's contents; nothing to send.");
+        return true;
+    } else if(status == UPLOAD_NEEDS_DELTA) {
+        // If the server's version changes before the delta gets there, the whole file is sent after all
+        upload_status delta = send_delta(name, size, hash, file);
+        if(delta != UPLOAD_NEEDS_DATA) {
+            return delta == UPLOAD_STORED;
+        }
+    } else if(status != UPLOAD_NEEDS_DATA) {
+        LOG_ERROR("The server couldn't store the file.");
+        return false;
+    }
+    if(chunked) {
+        return send_chunks(name, size, hash, file, chunks);
+    }
+
+    boost::asio::ip::tcp::acceptor a(service_);
+    try {
+        listen_for_data_channel(a);
+    } catch(std::exception& e) {
+        LOG_ERROR("Error while listening for server data connection: " << e.what());
+        return false;
+    }
 
     // Send a send_packet and the file to the server
-    uint32_t size = (uint32_t)boost::filesystem::file_size(path);
     send_packet s{name, size};
     if(!s.send(control_interface_)) { 
-        return;
+        return false;
     }
 
     boost::asio::ip::tcp::socket data_sock(service_);
     try {
-        accept_data_channel_conn(data_sock);
+        accept_data_channel_conn(a, data_sock);
     } catch(std::exception& e) {
-        std::cerr << "Error while accepting server data connection: " << e.what() << std::endl;
-        return;
+        LOG_ERROR("Error while accepting server data connection: " << e.what());
+        return false;
+    }
+    boost_net_interface data_interface(data_sock);
+    std::unique_ptr<compressed_net_interface> compressed = compress_channel(data_interface);
+    sparse_net_interface body(compressed ? *compressed : (net_interface&)data_interface);
+
+    // Read in big pieces, so that holes in the file aren't read and runs of zeros go as holes
+    checked_net_interface checked(body);
+    int fd = ::open(path.c_str(), O_RDONLY);
+    bool sent = fd >= 0 && send_file(fd, size, checked);
+    if(fd >= 0) {
+        close(fd);
+    }
+    if(!sent || (compressed && !compressed->flush())) {
+        LOG_ERROR("Sending file was unsuccessful.");
+        return false;
+    }
+    std::vector<char> block;
+    auto resend = [&](std::uint64_t off, std::uint64_t n) {
+        block.resize(n);
+        file.clear();
+        return file.seekg(off) && file.read(block.data(), n) && send_memory(block.data(), n, body)
+               && (!compressed || compressed->flush());
+    };
+    if(!finish_checked_send(checked.crcs(), size, data_interface, resend) || !send_content_hash(data_interface, hash)) {
+        LOG_ERROR("Sending file was unsuccessful.");
+        return false;
+    }
+    if(compressed) {
+        log_compression(*compressed);
+    }
+
+    // The server says whether it stored the file once it has (durably, if it's set up that way)
+    try {
+        data_interface.receive(&status, sizeof(status));
+    } catch(net_interface::error& e) {
+        LOG_ERROR("Didn't hear back from the server about the file: " << e.what());
+        return false;
+    }
+    if(status != UPLOAD_STORED) {
+        LOG_ERROR("The server couldn't store the file.");
+        return false;
+    }
+    LOG_INFO("Successfully sent file.");
+    return true;
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: client::send_chunks $
+   $ Prototype: bool client::send_chunks(std::string const& name, std::uint64_t size, unsigned char const* hash, std::ifstream& file, std::vector<chunk_ref> const& chunks) { $
+   $ Params:
+   $    name: The name to store the file as $
+   $    size: Its size $
+   $    hash: Its BLAKE3 hash $
+   $    file: The file, open for reading $
+   $    chunks: Its chunks, in order
+   $ Description:  $
+   $   Describes the file to the server by its chunks, then sends the ones
+   $   the server says it doesn't have, in the order it asked for them,
+   $   and the hash of the whole file for it to check what it put together
+   ======================================================================== */
+bool client::send_chunks(std::string const& name, std::uint64_t size, unsigned char const* hash, std::ifstream& file,
+                         std::vector<chunk_ref> const& chunks) {
+    boost::asio::ip::tcp::acceptor a(service_);
+    try {
+        listen_for_data_channel(a);
+    } catch(std::exception& e) {
+        LOG_ERROR("Error while listening for server data connection: " << e.what());
+        return false;
+    }
+
+    chunks_packet c{name, size, chunks.data(), (std::uint32_t)chunks.size()};
+    if(!c.send(control_interface_)) {
+        return false;
+    }
+
+    packet_type pt;
+    control_interface_.receive(&pt, sizeof(packet_type));
+    if(pt == ERROR) {
+        error_packet ep(control_interface_);
+        LOG_ERROR("Server reported error: " << ep.err);
+        return false;
+    } else if(pt != WANT) {
+        LOG_ERROR("Unexpected reply to the file's chunks.");
+        return false;
+    }
+    want_packet w(control_interface_);
+    LOG_INFO("The server wants " << w.count << " of the file's " << chunks.size() << " chunks.");
+
+    boost::asio::ip::tcp::socket data_sock(service_);
+    try {
+        accept_data_channel_conn(a, data_sock);
+    } catch(std::exception& e) {
+        LOG_ERROR("Error while accepting server data connection: " << e.what());
+        return false;
     }
     boost_net_interface data_interface(data_sock);
+    std::unique_ptr<compressed_net_interface> compressed = compress_channel(data_interface);
+    sparse_net_interface body(compressed ? *compressed : (net_interface&)data_interface);
+
+    std::vector<std::uint64_t> offsets(chunks.size());
+    for(std::size_t i = 1; i < chunks.size(); ++i) {
+        offsets[i] = offsets[i - 1] + chunks[i - 1].size;
+    }
+
+    file.clear();
+    std::vector<char> buf(fastcdc::MAX_SIZE);
+    for(std::uint32_t i = 0; i < w.count; ++i) {
+        std::uint32_t index = w.indexes[i];
+        if(index >= chunks.size()) {
+            LOG_ERROR("The server asked for a chunk that doesn't exist.");
+            return false;
+        }
+        std::uint32_t n = chunks[index].size;
+        if(!file.seekg(offsets[index]) || !file.read(buf.data(), n) || !send_memory(buf.data(), n, body)) {
+            LOG_ERROR("Sending file was unsuccessful.");
+            return false;
+        }
+    }
+    if(compressed) {
+        if(!compressed->flush()) {
+            LOG_ERROR("Sending file was unsuccessful.");
+            return false;
+        }
+        log_compression(*compressed);
+    }
+    if(!send_content_hash(data_interface, hash)) {
+        LOG_ERROR("Sending file was unsuccessful.");
+        return false;
+    }
+
+    std::uint8_t status;
+    try {
+        data_interface.receive(&status, sizeof(status));
+    } catch(net_interface::error& e) {
+        LOG_ERROR("Didn't hear back from the server about the file: " << e.what());
+        return false;
+    }
+    if(status != UPLOAD_STORED) {
+        LOG_ERROR("The server couldn't store the file.");
+        return false;
+    }
+    LOG_INFO("Successfully sent file.");
+    return true;
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: client::send_delta $
+   $ Prototype: upload_status client::send_delta(std::string const& name, std::uint64_t size, unsigned char const* hash, std::ifstream& file) { $
+   $ Params:
+   $    name: The name to store the file as $
+   $    size: Its size $
+   $    hash: Its BLAKE3 hash $
+   $    file: The file, open for reading $
+   $ Description:  $
+   $   Gets the signatures of the server's version of the file and sends
+   $   the differences from it: the bytes in the new version that aren't
+   $   in any of the old version's blocks, and which blocks go in between.
+   $   Returns needs data if the server has no usable old version after all.
+   ======================================================================== */
+upload_status client::send_delta(std::string const& name, std::uint64_t size, unsigned char const* hash,
+                                 std::ifstream& file) {
+    signatures_packet request{name};
+    if(!request.send(control_interface_)) {
+        return UPLOAD_FAILED;
+    }
+    packet_type pt;
+    control_interface_.receive(&pt, sizeof(packet_type));
+    if(pt != SIGNATURES) {
+        LOG_ERROR("Unexpected reply to a request for signatures.");
+        return UPLOAD_FAILED;
+    }
+    signatures_packet reply{control_interface_};
+    if(!reply.count) {
+        return UPLOAD_NEEDS_DATA;
+    }
+
+    boost::asio::ip::tcp::acceptor a(service_);
+    try {
+        listen_for_data_channel(a);
+    } catch(std::exception& e) {
+        LOG_ERROR("Error while listening for server data connection: " << e.what());
+        return UPLOAD_FAILED;
+    }
+
+    delta_packet d{name, size, hash, reply.base_size, reply.base_mtime_ns};
+    if(!d.send(control_interface_)) {
+        return UPLOAD_FAILED;
+    }
+    std::uint8_t status;
+    control_interface_.receive(&status, sizeof(status));
+    if(status != UPLOAD_NEEDS_DATA) {
+        LOG_INFO("The server's version of the file changed; sending all of it.");
+        return UPLOAD_NEEDS_DATA;
+    }
 
-    if(send_file(file, data_interface)) {
-        std::cout << "Successfully sent file." << std::endl;
-    } else {
-        std::cout << "Sending file was unsuccessful." << std::endl;
+    boost::asio::ip::tcp::socket data_sock(service_);
+    try {
+        accept_data_channel_conn(a, data_sock);
+    } catch(std::exception& e) {
+        LOG_ERROR("Error while accepting server data connection: " << e.what());
+        return UPLOAD_FAILED;
+    }
+    boost_net_interface data_interface(data_sock);
+
+    std::vector<block_signature> sigs(reply.sigs, reply.sigs + reply.count);
+    std::uint64_t literal_bytes = 0;
+    try {
+        auto delta = make_delta_encoder(sigs, reply.block_size, reply.base_size,
+            [&](unsigned char const* data, std::size_t n) {
+                std::uint8_t op = DELTA_LITERAL;
+                std::uint32_t len = n;
+                data_interface.send(&op, sizeof(op));
+                data_interface.send(&len, sizeof(len));
+                data_interface.send(const_cast<unsigned char*>(data), n);
+                literal_bytes += n;
+            },
+            [&](std::uint32_t first, std::uint32_t count) {
+                std::uint8_t op = DELTA_COPY;
+                std::uint32_t range[2] = {first, count};
+                data_interface.send(&op, sizeof(op));
+                data_interface.send(range, sizeof(range));
+            });
+
+        file.clear();
+        file.seekg(0);
+        std::vector<char> buf(FILE_READ_SIZE);
+        while(file.read(buf.data(), buf.size()) || file.gcount()) {
+            delta.update(buf.data(), file.gcount());
+        }
+        delta.finish();
+
+        std::uint8_t end = DELTA_END;
+        data_interface.send(&end, sizeof(end));
+        data_interface.receive(&status, sizeof(status));
+    } catch(net_interface::error& e) {
+        LOG_ERROR("Network error while sending delta: " << e.what());
+        return UPLOAD_FAILED;
+    }
+
+    if(status != UPLOAD_STORED) {
+        LOG_ERROR("The server couldn't store the file.");
+        return UPLOAD_FAILED;
+    }
+    LOG_INFO("Successfully sent file as a delta (" << literal_bytes << " of its " << size << " bytes).");
+    return UPLOAD_STORED;
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: client::stats $
+   $ Prototype: void client::stats() { $
+   $ Params: 
+   $ Description:  $
+   $   Requests the server's metrics and prints them
+   ======================================================================== */
+void client::stats() {
+    stats_packet request;
+    if(!request.send(control_interface_)) return;
+
+    packet_type pt;
+    control_interface_.receive(&pt, sizeof(packet_type));
+    if(pt == STATS) {
+        stats_packet reply(control_interface_);
+        std::cout << reply.text;
+    } else if(pt == ERROR) {
+        error_packet ep(control_interface_);
+        LOG_ERROR("Server reported error: " << ep.err);
+    }
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: client::compress $
+   $ Prototype: bool client::compress(codec c, int level) { $
+   $ Params:
+   $    c: The codec to use $
+   $    level: Its level, for CODEC_DEFLATE
+   $ Description:  $
+   $   Asks the server to compress file contents on data channels with the
+   $   given codec, and goes with whatever it answers. If the server has a
+   $   shared dictionary, it's fetched so that small files can be
+   $   compressed against it both ways.
+   ======================================================================== */
+bool client::compress(codec c, int level) {
+    hello_packet request{c, (std::int8_t)level};
+    if(!request.send(control_interface_)) {
+        return false;
+    }
+
+    packet_type pt;
+    control_interface_.receive(&pt, sizeof(packet_type));
+    if(pt != HELLO) {
+        LOG_ERROR("The server didn't answer the request to compress.");
+        return false;
+    }
+    hello_packet reply(control_interface_);
+    compression_ = (codec)reply.codec;
+    compression_level_ = reply.level;
+    if(compression_ != c) {
+        LOG_WARN("The server won't compress with " << codec_name(c) << "; file contents will be sent as they are.");
+        compression_ = CODEC_NONE;
+        return false;
+    }
+    LOG_INFO("File contents will be compressed with " << codec_name(c) << '.');
+
+    if(reply.dictionary) {
+        dictionary_packet want{reply.dictionary};
+        if(!want.send(control_interface_)) {
+            return true;
+        }
+        control_interface_.receive(&pt, sizeof(packet_type));
+        if(pt != DICTIONARY) {
+            LOG_ERROR("The server didn't send its compression dictionary.");
+            return true;
+        }
+        dictionary_packet dict(control_interface_);
+        if(dict.size) {
+            dictionary_ = std::make_shared<dictionary const>(dict.version, std::vector<char>(dict.data, dict.data + dict.size));
+            dictionaries_.add(dictionary_);
+            LOG_INFO("Small files will be compressed against the server's dictionary (version " << dict.version << ").");
+        }
     }
+    return true;
 }
@@ -12,6 +12,7 @@
 #include <vector>
 #include <client/client.h>
 #include <util/packet.hpp>
+#include <util/log.hpp>
 #include <algorithm>
 #include <boost/asio.hpp>
 #include <boost/algorithm/string.hpp>
@@ -19,19 +20,25 @@
 /* ========================================================================
    $ FUNCTION
    $ Name: parse_command $
-   $ Prototype: bool parse_command(std::string& command, packet_type& op, std::string& filename) { $
+   $ Prototype: bool parse_command(std::string& command, packet_type& op, std::string& filename, std::uint64_t& offset, std::uint64_t& length) { $
    $ Params: 
    $    command: The command from the user $
    $    op: The packet type
    $    filename: The name of the file
+   $    offset: Where a GET of a range starts $
+   $    length: How long the range is, or get_packet::GET_TO_END
    $ Description:  $
-   $    Parses commands from the user to send to the client.
+   $    Parses commands from the user to send to the client. A GET can be
+   $    followed by an offset and length to get just that range.
    ======================================================================== */
-bool parse_command(std::string& command, packet_type& op, std::string& filename) {
+bool parse_command(std::string& command, packet_type& op, std::string& filename, std::uint64_t& offset, std::uint64_t& length) {
     std::vector<std::string> command_parts;
     boost::split(command_parts, command, boost::is_any_of(" "));
 
-    if(command_parts.size() < 2 || (command_parts[0] != "GET" && command_parts[0] != "SEND")) {
+    if(command_parts.size() == 1 && command_parts[0] == "STATS") {
+        op = STATS;
+        return true;
+    } else if(command_parts.size() < 2 || (command_parts[0] != "GET" && command_parts[0] != "SEND")) {
         return false;
     } else {
         // Figure out the operation
@@ -39,6 +46,14 @@ bool parse_command(std::string& command, packet_type& op, std::string& filename)
 
         // Remove GET/SEND from the string and copy the remainder of the string into filename
         command_parts.erase(command_parts.begin(), command_parts.begin() + 1);
+        offset = 0;
+        length = get_packet::GET_TO_END;
+        auto is_number = [](std::string const& s) { return !s.empty() && std::all_of(s.begin(), s.end(), ::isdigit); };
+        if(op == GET && command_parts.size() == 3 && is_number(command_parts[1]) && is_number(command_parts[2])) {
+            offset = std::stoull(command_parts[1]);
+            length = std::stoull(command_parts[2]);
+            command_parts.resize(1);
+        }
         filename = boost::algorithm::join(command_parts, "");
 
         return true;
@@ -53,30 +68,51 @@ bool parse_command(std::string& command, packet_type& op, std::string& filename)
    $    argc: The number of inputs from the user $
    $    argv: The inputs from the user
    $ Description:  $
-   $    Starts the client application
+   $    Starts the client application. --compress=lz4|deflate[:level] asks
+   $    the server to compress file contents on the data channel.
    ======================================================================== */
 int main(int argc, char** argv) {
-    if(argc != 3) {
-        std::cerr << "usage: " << argv[0] << " [host name] [file storage path]" << std::endl;
+    std::vector<std::string> args;
+    codec compression = CODEC_NONE;
+    int level = 0;
+    bool valid = true;
+    for(int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if(arg.compare(0, 11, "--compress=") == 0) {
+            valid = valid && parse_codec(arg.substr(11), compression, level);
+        } else {
+            args.push_back(arg);
+        }
+    }
+    if(!valid || args.size() != 2) {
+        std::cerr << "usage: " << argv[0] << " [--compress=lz4|deflate[:level]] [host name] [file storage path]" << std::endl;
         return 1;
     }
 
     boost::asio::io_service service;
-    std::string host_name(argv[1]);
-    std::string storage_path(argv[2]);
+    std::string host_name(args[0]);
+    std::string storage_path(args[1]);
 
     try {
         client c(service, host_name, storage_path);
+        if(compression != CODEC_NONE) {
+            c.compress(compression, level);
+        }
+        logger::instance().flush();
         std::cout << std::endl;
 
         std::cout << "File names are relative to the storage path supplied." << std::endl;
         std::cout << "Type SEND [filename] to send a file to the server." << std::endl;
-        std::cout << "Type GET [filename] to get a file from the server." << std::endl;
+        std::cout << "Type GET [filename] to get a file from the server, or GET [filename] [offset] [length] for part of it." << std::endl;
+        std::cout << "Type STATS to see the server's statistics." << std::endl;
         std::cout << "Type Ctrl + D to quit" << std::endl;
         std::cout << std::endl;
 
         while(true) {
             std::string command;
+
+            // Let the logger catch up so that the last command's output comes before the prompt
+            logger::instance().flush();
             std::cout << "Enter a command: ";
             std::getline(std::cin, command);
 
@@ -87,13 +123,16 @@ int main(int argc, char** argv) {
 
             packet_type op;
             std::string filename;
-            if(!parse_command(command, op, filename)) {
-                std::cout << "Command format: SEND|GET [filename]" << std::endl;
+            std::uint64_t offset, length;
+            if(!parse_command(command, op, filename, offset, length)) {
+                std::cout << "Command format: SEND [filename], GET [filename] [offset length] or STATS" << std::endl;
             } else {
                 if(op == SEND) {
                     c.send(filename);
+                } else if(op == STATS) {
+                    c.stats();
                 } else {
-                    c.get(filename);
+                    c.get(filename, offset, length);
                 }
             }
 
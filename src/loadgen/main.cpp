@@ -0,0 +1,499 @@
+/* ========================================================================
+   $File: main.cpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/08 $
+   $Description: $
+   $     Load generator. Simulates a population of clients, each on its own
+   $     thread and its own loopback address (127.x.y.z) so that they can all
+   $     accept data connections on port 7006, issuing a mix of GETs and
+   $     SENDs against a running server. Reports throughput, latency
+   $     percentiles and error rates as JSON.
+   $Revisions: $
+   ======================================================================== */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+#include <client/client.h>
+#include <util/log.hpp>
+#include <util/metrics.hpp>
+#include <util/size_arg.hpp>
+
+namespace fs = boost::filesystem;
+typedef std::chrono::steady_clock steady;
+
+/**
+ * How file sizes are picked. fixed uses a; uniform picks from [a, b];
+ * lognormal has median a and shape sigma.
+ */
+struct size_distribution {
+    enum kind { FIXED, UNIFORM, LOGNORMAL };
+
+    kind type = FIXED;
+    std::uint64_t a = 64 * KiB;
+    std::uint64_t b = 0;
+    double sigma = 1;
+
+    std::uint64_t sample(std::mt19937_64& rng) const {
+        switch(type) {
+            case UNIFORM:
+                return std::uniform_int_distribution<std::uint64_t>(a, b)(rng);
+            case LOGNORMAL: {
+                double v = std::lognormal_distribution<double>(std::log((double)a), sigma)(rng);
+                return std::max<std::uint64_t>(1, std::min<double>(v, 16.0 * GiB));
+            }
+            default:
+                return a;
+        }
+    }
+};
+
+struct loadgen_options {
+    std::string host = "127.0.0.1";
+    unsigned clients = 100;
+    double duration = 10;            // Seconds
+    double get_ratio = 0.8;          // Fraction of requests that are GETs
+    unsigned files = 100;            // Distinct files in the working set
+    double zipf = 0;                 // Popularity skew for GETs (0 = uniform)
+    size_distribution sizes;
+    double think_ms = 0;             // Mean think time between a client's requests (closed loop)
+    double rate = 0;                 // Total arrivals per second (open loop); 0 means closed loop
+    unsigned requests_per_session = 1; // Reconnect after this many requests; 0 keeps one session
+    std::string dir;
+    std::string output;
+    std::string log_path = "/dev/null";
+};
+
+struct op_stats {
+    histogram latency;
+    counter requests;
+    counter errors;
+    counter bytes;
+};
+
+/**
+ * Picks indices in [0, n) with probability proportional to 1 / (rank + 1)^s.
+ */
+class zipf_picker {
+public:
+    zipf_picker(unsigned n, double s) {
+        double total = 0;
+        for(unsigned i = 0; i < n; ++i) {
+            total += 1 / std::pow(i + 1.0, s);
+            cdf_.push_back(total);
+        }
+        for(auto& c : cdf_) {
+            c /= total;
+        }
+    }
+
+    unsigned pick(std::mt19937_64& rng) const {
+        double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        return (unsigned)(std::lower_bound(cdf_.begin(), cdf_.end(), u) - cdf_.begin());
+    }
+
+private:
+    std::vector<double> cdf_;
+};
+
+/**
+ * Arrival times handed out to idle clients in open-loop mode.
+ */
+class arrival_queue {
+public:
+    arrival_queue()
+    : closed_(false) {}
+
+    void push(steady::time_point t) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            arrivals_.push_back(t);
+        }
+        ready_.notify_one();
+    }
+
+    // Returns false once the queue has been closed
+    bool pop(steady::time_point& t) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ready_.wait(lock, [this] { return closed_ || !arrivals_.empty(); });
+        if(closed_) {
+            return false;
+        }
+        t = arrivals_.front();
+        arrivals_.pop_front();
+        return true;
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+        }
+        ready_.notify_all();
+    }
+
+    std::size_t backlog() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return arrivals_.size();
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<steady::time_point> arrivals_;
+    bool closed_;
+};
+
+std::string client_address(unsigned i) {
+    // 127.1.0.1 onwards, skipping .0 and .255 in each octet
+    std::ostringstream oss;
+    oss << "127." << 1 + i / (254 * 254) << '.' << 1 + (i / 254) % 254 << '.' << 1 + i % 254;
+    return oss.str();
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: parse_sizes $
+   $ Prototype: bool parse_sizes(std::string const& s, size_distribution& out) { $
+   $ Params:
+   $    s: fixed:SIZE, uniform:MIN:MAX or lognormal:MEDIAN:SIGMA $
+   $    out: Receives the distribution
+   $ Description:  $
+   $    Parses a file size distribution.
+   ======================================================================== */
+bool parse_sizes(std::string const& s, size_distribution& out) {
+    std::vector<std::string> parts;
+    std::istringstream iss(s);
+    for(std::string part; std::getline(iss, part, ':');) {
+        parts.push_back(part);
+    }
+
+    if(parts.size() == 2 && parts[0] == "fixed") {
+        out.type = size_distribution::FIXED;
+        return parse_size(parts[1], out.a);
+    } else if(parts.size() == 3 && parts[0] == "uniform") {
+        out.type = size_distribution::UNIFORM;
+        return parse_size(parts[1], out.a) && parse_size(parts[2], out.b) && out.a <= out.b;
+    } else if(parts.size() == 3 && parts[0] == "lognormal") {
+        out.type = size_distribution::LOGNORMAL;
+        out.sigma = std::atof(parts[2].c_str());
+        return parse_size(parts[1], out.a) && out.sigma > 0;
+    }
+    return false;
+}
+
+void make_file(fs::path const& path, std::uint64_t size, std::mt19937_64& rng) {
+    std::vector<char> block(std::min<std::uint64_t>(size, MiB) + 1);
+    for(auto& c : block) {
+        c = (char)rng();
+    }
+
+    std::ofstream out(path.c_str(), std::ios::binary);
+    for(std::uint64_t left = size; left > 0;) {
+        std::size_t n = std::min<std::uint64_t>(left, block.size());
+        out.write(block.data(), n);
+        left -= n;
+    }
+    if(!out) {
+        throw std::runtime_error("couldn't create " + path.string());
+    }
+}
+
+/**
+ * One simulated client. Runs on its own thread until the deadline passes.
+ */
+class sim_client {
+public:
+    sim_client(unsigned id, loadgen_options const& opts, fs::path const& dir, std::vector<std::uint64_t> const& sizes,
+               zipf_picker const& popularity, op_stats& gets, op_stats& sends, arrival_queue* arrivals)
+    : opts_(opts), address_(client_address(id)), dir_(dir), sizes_(sizes), popularity_(popularity),
+      gets_(gets), sends_(sends), arrivals_(arrivals), rng_(id * 0x9E3779B97F4A7C15ull + 1) {}
+
+    void run(steady::time_point deadline) {
+        std::exponential_distribution<double> think(opts_.think_ms > 0 ? 1 / opts_.think_ms : 1);
+        std::unique_ptr<boost::asio::io_service> service;
+        std::unique_ptr<client> c;
+        unsigned session_requests = 0;
+
+        for(;;) {
+            // Closed loop: the request "arrives" as soon as we've finished thinking.
+            // Open loop: it arrived when the schedule said, however long it waited for us.
+            steady::time_point arrival = steady::now();
+            if(arrivals_ && !arrivals_->pop(arrival)) {
+                break;
+            }
+            if(arrival >= deadline) {
+                break;
+            }
+
+            bool get = std::uniform_real_distribution<double>(0, 1)(rng_) < opts_.get_ratio;
+            op_stats& stats = get ? gets_ : sends_;
+            unsigned file = get ? popularity_.pick(rng_) : std::uniform_int_distribution<unsigned>(0, opts_.files - 1)(rng_);
+
+            bool ok = false;
+            try {
+                if(!c) {
+                    service.reset(new boost::asio::io_service);
+                    std::string host = opts_.host;
+                    std::string client_dir = dir_.string();
+                    c.reset(new client(*service, host, client_dir, address_));
+                    session_requests = 0;
+                }
+
+                std::string name;
+                if(get) {
+                    name = "lg_" + std::to_string(file);
+                    ok = c->get(name);
+                } else {
+                    // Uploads come from the shared working set rather than this client's directory
+                    name = "../files/up_" + std::to_string(file);
+                    ok = c->send(name);
+                }
+            } catch(std::exception& e) {
+                LOG_ERROR("Client " << address_ << ": " << e.what());
+                c.reset();
+            }
+
+            stats.latency.record((std::uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(steady::now() - arrival).count());
+            stats.requests.add();
+            if(ok) {
+                stats.bytes.add(sizes_[file]);
+            } else {
+                stats.errors.add();
+                c.reset(); // The session may be in an unknown state
+            }
+
+            if(c && opts_.requests_per_session && ++session_requests >= opts_.requests_per_session) {
+                c.reset();
+            }
+
+            if(!arrivals_ && opts_.think_ms > 0) {
+                std::this_thread::sleep_for(std::chrono::microseconds((std::uint64_t)(think(rng_) * 1000)));
+            }
+            if(steady::now() >= deadline) {
+                break;
+            }
+        }
+    }
+
+private:
+    loadgen_options const& opts_;
+    std::string address_;
+    fs::path dir_;
+    std::vector<std::uint64_t> const& sizes_;
+    zipf_picker const& popularity_;
+    op_stats& gets_;
+    op_stats& sends_;
+    arrival_queue* arrivals_;
+    std::mt19937_64 rng_;
+};
+
+void write_stats(std::ostream& out, const char* op, op_stats const& s, double seconds) {
+    double requests = (double)s.requests.value();
+    out << "\"" << op << "\": {\"requests\": " << s.requests.value()
+        << ", \"errors\": " << s.errors.value()
+        << ", \"error_rate\": " << (requests > 0 ? s.errors.value() / requests : 0)
+        << ", \"requests_per_sec\": " << requests / seconds
+        << ", \"mib_per_sec\": " << s.bytes.value() / (double)MiB / seconds
+        << ", \"latency_ms\": {\"p50\": " << s.latency.percentile(0.5) / 1e6
+        << ", \"p90\": " << s.latency.percentile(0.9) / 1e6
+        << ", \"p99\": " << s.latency.percentile(0.99) / 1e6
+        << ", \"p999\": " << s.latency.percentile(0.999) / 1e6
+        << ", \"max\": " << s.latency.max() / 1e6 << "}}";
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: main $
+   $ Prototype: int main(int argc, char** argv) { $
+   $ Params:
+   $    argc: the number of arguments
+   $    argv: the arguments
+   $ Description:  Generates load against a server
+   ======================================================================== */
+int main(int argc, char** argv) {
+    loadgen_options opts;
+    for(int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        std::size_t eq = arg.find('=');
+        std::string name = arg.substr(0, eq);
+        std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+        bool ok = eq != std::string::npos;
+
+        if(name == "--host") {
+            opts.host = value;
+        } else if(name == "--clients") {
+            opts.clients = std::max(1, std::atoi(value.c_str()));
+        } else if(name == "--duration") {
+            opts.duration = std::atof(value.c_str());
+        } else if(name == "--get-ratio") {
+            opts.get_ratio = std::atof(value.c_str());
+        } else if(name == "--files") {
+            opts.files = std::max(1, std::atoi(value.c_str()));
+        } else if(name == "--zipf") {
+            opts.zipf = std::atof(value.c_str());
+        } else if(name == "--sizes") {
+            ok = parse_sizes(value, opts.sizes);
+        } else if(name == "--think-ms") {
+            opts.think_ms = std::atof(value.c_str());
+        } else if(name == "--rate") {
+            opts.rate = std::atof(value.c_str());
+        } else if(name == "--requests-per-session") {
+            opts.requests_per_session = std::max(0, std::atoi(value.c_str()));
+        } else if(name == "--dir") {
+            opts.dir = value;
+        } else if(name == "--output") {
+            opts.output = value;
+        } else if(name == "--log-file") {
+            opts.log_path = value;
+        } else {
+            ok = false;
+        }
+
+        if(!ok) {
+            std::cerr << "usage: " << argv[0] << " [--host=addr] [--clients=n] [--duration=s] [--get-ratio=0..1]\n"
+                      << "    [--files=n] [--zipf=s] [--sizes=fixed:SIZE|uniform:MIN:MAX|lognormal:MEDIAN:SIGMA]\n"
+                      << "    [--think-ms=ms] [--rate=requests/s] [--requests-per-session=n]\n"
+                      << "    [--dir=path] [--output=path] [--log-file=path]" << std::endl;
+            return 1;
+        }
+    }
+
+    logger::instance().open(opts.log_path);
+
+    bool own_dir = opts.dir.empty();
+    fs::path base = own_dir ? fs::temp_directory_path() / fs::unique_path("loadgen-%%%%-%%%%") : fs::path(opts.dir);
+    fs::path files_dir = base / "files";
+
+    std::ostringstream json;
+    int ret = 0;
+    try {
+        // The working set: lg_N is seeded on the server for GETs, up_N is what gets SENT
+        fs::create_directories(files_dir);
+        std::mt19937_64 rng(42);
+        std::vector<std::uint64_t> sizes;
+        std::uint64_t total = 0;
+        for(unsigned i = 0; i < opts.files; ++i) {
+            sizes.push_back(opts.sizes.sample(rng));
+            total += sizes.back();
+        }
+
+        std::cerr << "Creating " << opts.files * 2 << " files (" << total * 2 / MiB << " MiB) in " << base.c_str() << "..." << std::endl;
+        for(unsigned i = 0; i < opts.files; ++i) {
+            make_file(files_dir / ("lg_" + std::to_string(i)), sizes[i], rng);
+            make_file(files_dir / ("up_" + std::to_string(i)), sizes[i], rng);
+        }
+
+        std::cerr << "Uploading the GET working set..." << std::endl;
+        {
+            boost::asio::io_service service;
+            std::string path = files_dir.string();
+            client seeder(service, opts.host, path, "127.0.0.1");
+            for(unsigned i = 0; i < opts.files; ++i) {
+                std::string name = "lg_" + std::to_string(i);
+                if(!seeder.send(name)) {
+                    throw std::runtime_error("couldn't upload " + name);
+                }
+            }
+
+            // SEND isn't acknowledged and an upload only shows up once the server has all of
+            // it, so wait until every file can be fetched back
+            fs::path check_dir = base / "check";
+            fs::create_directories(check_dir);
+            std::string check_path = check_dir.string();
+            client checker(service, opts.host, check_path, "127.0.0.1");
+            auto deadline = steady::now() + std::chrono::seconds(60);
+            for(unsigned i = 0; i < opts.files; ++i) {
+                std::string name = "lg_" + std::to_string(i);
+                while(!checker.get(name)) {
+                    if(steady::now() > deadline) {
+                        throw std::runtime_error("server never stored " + name);
+                    }
+                    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                }
+            }
+        }
+
+        zipf_picker popularity(opts.files, opts.zipf);
+        op_stats gets, sends;
+        std::unique_ptr<arrival_queue> arrivals(opts.rate > 0 ? new arrival_queue : nullptr);
+
+        std::cerr << "Running " << opts.clients << " clients for " << opts.duration << "s ("
+                  << (arrivals ? "open" : "closed") << " loop)..." << std::endl;
+
+        steady::time_point start = steady::now();
+        steady::time_point deadline = start + std::chrono::microseconds((std::uint64_t)(opts.duration * 1e6));
+
+        std::vector<std::unique_ptr<sim_client>> sims;
+        std::vector<std::thread> threads;
+        for(unsigned i = 0; i < opts.clients; ++i) {
+            fs::path dir = base / ("client_" + std::to_string(i));
+            fs::create_directories(dir);
+            sims.emplace_back(new sim_client(i, opts, dir, sizes, popularity, gets, sends, arrivals.get()));
+            sim_client* sim = sims.back().get();
+            threads.emplace_back([sim, deadline] { sim->run(deadline); });
+        }
+
+        // Open loop: Poisson arrivals at the requested rate, whether or not anyone is free to serve them
+        std::size_t late = 0;
+        if(arrivals) {
+            std::exponential_distribution<double> gap(opts.rate);
+            steady::time_point next = start;
+            while(next < deadline) {
+                std::this_thread::sleep_until(next);
+                arrivals->push(next);
+                next += std::chrono::nanoseconds((std::uint64_t)(gap(rng) * 1e9));
+            }
+            late = arrivals->backlog();
+            arrivals->close();
+        }
+
+        for(auto& t : threads) {
+            t.join();
+        }
+        double seconds = std::chrono::duration<double>(steady::now() - start).count();
+
+        json << "{\n  \"clients\": " << opts.clients << ",\n  \"mode\": \"" << (arrivals ? "open" : "closed") << "\""
+             << ",\n  \"offered_rate\": " << opts.rate << ",\n  \"unserved_arrivals\": " << late
+             << ",\n  \"seconds\": " << seconds
+             << ",\n  \"requests_per_sec\": " << (gets.requests.value() + sends.requests.value()) / seconds
+             << ",\n  ";
+        write_stats(json, "get", gets, seconds);
+        json << ",\n  ";
+        write_stats(json, "send", sends, seconds);
+        json << "\n}\n";
+    } catch(std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        ret = 1;
+    }
+
+    if(own_dir) {
+        boost::system::error_code ec;
+        fs::remove_all(base, ec);
+    }
+
+    if(ret == 0) {
+        if(opts.output.empty()) {
+            std::cout << json.str();
+        } else {
+            std::ofstream(opts.output.c_str()) << json.str();
+        }
+    }
+    return ret;
+}
@@ -0,0 +1,167 @@
+/* ========================================================================
+   $File: main.cpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/13 $
+   $Description: $
+   $     Moves the files in a storage directory from one layout to the other
+   $     (see storage_layout.h). Each file is moved with a single rename(),
+   $     so it's safe to run while the server is serving the directory: a
+   $     GET finds the file in whichever place it is at the time, and the
+   $     server's watcher updates the index as files move.
+   $Revisions: $
+   ======================================================================== */
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include <server/storage_layout.h>
+
+namespace fs = boost::filesystem;
+typedef std::chrono::steady_clock steady;
+
+// Adds the files under dir (relative is its path within the storage directory) in the given layout to found
+static void list_files(fs::path const& dir, std::string const& relative, bool sharded, std::vector<std::string>& found) {
+    for(fs::directory_iterator it(dir); it != fs::directory_iterator(); ++it) {
+        std::string child = relative.empty() ? it->path().filename().string()
+                                             : relative + '/' + it->path().filename().string();
+        if(storage_layout::is_shard_dir(child)) {
+            if(sharded && fs::is_directory(it->status())) {
+                list_files(it->path(), child, sharded, found);
+            }
+        } else if(!relative.empty() == sharded && !storage_layout::is_reserved(child) && fs::is_regular_file(it->status())) {
+            found.push_back(child);
+        }
+    }
+}
+
+// Removes the shard directories under dir that are now empty
+static void remove_empty_shards(fs::path const& dir, std::string const& relative) {
+    for(fs::directory_iterator it(dir); it != fs::directory_iterator(); ++it) {
+        std::string child = relative.empty() ? it->path().filename().string()
+                                             : relative + '/' + it->path().filename().string();
+        if(storage_layout::is_shard_dir(child) && fs::is_directory(it->status())) {
+            remove_empty_shards(it->path(), child);
+        }
+    }
+    if(!relative.empty()) {
+        boost::system::error_code ec;
+        fs::remove(dir, ec);
+    }
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: migrate_file $
+   $ Prototype: bool migrate_file(fs::path const& dir, std::string const& relative, bool to_sharded) { $
+   $ Params:
+   $    dir: The storage directory $
+   $    relative: The file to move, relative to dir $
+   $    to_sharded: Which layout to move it into
+   $ Description:  $
+   $    Moves one file into the other layout. If it's already there too
+   $    (uploaded again since the server switched layouts), the copy in the
+   $    new layout is the newer one, so the old one is just removed.
+   ======================================================================== */
+static bool migrate_file(fs::path const& dir, std::string const& relative, bool to_sharded) {
+    std::string name;
+    bool sharded;
+    if(!storage_layout::parse(relative, name, sharded) || storage_layout::is_reserved(name)) {
+        return false;
+    }
+
+    fs::path from = dir / relative;
+    fs::path to = dir / storage_layout::relative_path(name, to_sharded);
+    if(to_sharded) {
+        boost::system::error_code ec;
+        fs::create_directories(to.parent_path(), ec);
+    }
+
+    if(fs::is_regular_file(to)) {
+        return std::remove(from.c_str()) == 0;
+    }
+    if(std::rename(from.c_str(), to.c_str()) != 0) {
+        std::cerr << "Couldn't move " << from.string() << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: main $
+   $ Prototype: int main(int argc, char** argv) { $
+   $ Params:
+   $    argc: the number of arguments
+   $    argv: the argument received
+   $ Description:  Migrates a storage directory. --to picks the layout to
+   $               move to (sharded by default) and --rate limits how many
+   $               files are moved per second, to leave the disk to the
+   $               server if it's running.
+   ======================================================================== */
+int main(int argc, char** argv) {
+    std::string storage_path;
+    bool to_sharded = true;
+    double rate = 0;
+
+    for(int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if(arg == "--to=sharded" || arg == "--to=flat") {
+            to_sharded = arg == "--to=sharded";
+        } else if(arg.compare(0, 7, "--rate=") == 0) {
+            rate = std::atof(arg.c_str() + 7);
+        } else if(arg.compare(0, 2, "--") != 0 && storage_path.empty()) {
+            storage_path = arg;
+        } else {
+            storage_path.clear();
+            break;
+        }
+    }
+
+    if(storage_path.empty() || !fs::is_directory(storage_path)) {
+        std::cout << "usage: " << argv[0] << " [--to=sharded|flat] [--rate=files per second] [storage directory]"
+                  << std::endl;
+        return 1;
+    }
+
+    std::vector<std::string> files;
+    list_files(storage_path, "", !to_sharded, files);
+    std::cout << "Moving " << files.size() << " files to the " << (to_sharded ? "sharded" : "flat")
+              << " layout." << std::endl;
+
+    std::size_t moved = 0;
+    std::size_t failed = 0;
+    auto start = steady::now();
+    for(std::size_t i = 0; i < files.size(); ++i) {
+        if(migrate_file(storage_path, files[i], to_sharded)) {
+            ++moved;
+        } else {
+            ++failed;
+        }
+
+        if(rate > 0) {
+            std::this_thread::sleep_until(start + std::chrono::duration_cast<steady::duration>(
+                    std::chrono::duration<double>((i + 1) / rate)));
+        }
+        if((i + 1) % 10000 == 0) {
+            std::cout << (i + 1) << " / " << files.size() << std::endl;
+        }
+    }
+
+    if(!to_sharded) {
+        remove_empty_shards(storage_path, "");
+    }
+
+    std::cout << "Moved " << moved << " files";
+    if(failed) {
+        std::cout << "; " << failed << " couldn't be moved";
+    }
+    std::cout << '.' << std::endl;
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,154 @@
+/* ========================================================================
+   $File: chunk_index.cpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/18 $
+   $Description: $ Where the chunks of uploaded files can be found again
+   $Revisions: $
+   ======================================================================== */
+#include <cerrno>
+#include <unistd.h>
+#include <server/chunk_index.h>
+#include <util/log.hpp>
+
+// Each record in the log is one file: this header, its name and then its chunk_refs in order
+struct record_header {
+    std::uint32_t magic;
+    std::uint32_t name_len;
+    std::uint32_t chunk_count;
+    std::uint32_t sharded;
+    std::uint64_t size;
+    std::int64_t mtime_ns;
+    std::uint64_t inode;
+};
+
+static const std::uint32_t RECORD_MAGIC = 0x4b4e4843; // "CHNK"
+
+chunk_index::chunk_index(std::string const& path)
+        : path_(path), log_(nullptr),
+          indexed_chunks_(metrics::instance().get_gauge("server_indexed_chunks", "",
+                                                        "Distinct chunks of stored files that uploads can reuse.")) {}
+
+chunk_index::~chunk_index() {
+    if(log_) {
+        std::fclose(log_);
+    }
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: chunk_index::load $
+   $ Prototype: void chunk_index::load(std::function<bool(std::string const&, file_meta const&)> const& current) { $
+   $ Params:
+   $    current: Whether a file in the log is still the version it was recorded as $
+   $ Description:  $
+   $    Reads records until the end of the log or the first one that's cut
+   $    short (a crash in the middle of an append), copying the current
+   $    ones to a new log that then replaces it. Appends go to the new log.
+   ======================================================================== */
+void chunk_index::load(std::function<bool(std::string const&, file_meta const&)> const& current) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string tmp = path_ + ".tmp";
+    std::FILE* out = std::fopen(tmp.c_str(), "wb");
+    if(!out) {
+        LOG_ERROR("Couldn't create " << tmp << " (errno " << errno << "); uploads won't reuse chunks.");
+        return;
+    }
+
+    std::size_t kept = 0, dropped = 0;
+    bool ok = true;
+    if(std::FILE* in = std::fopen(path_.c_str(), "rb")) {
+        record_header h;
+        std::string name;
+        std::vector<chunk_ref> chunks;
+        while(std::fread(&h, sizeof(h), 1, in) == 1 && h.magic == RECORD_MAGIC) {
+            name.resize(h.name_len);
+            chunks.resize(h.chunk_count);
+            if((h.name_len && std::fread(&name[0], h.name_len, 1, in) != 1)
+               || (h.chunk_count && std::fread(chunks.data(), sizeof(chunk_ref), chunks.size(), in) != chunks.size())) {
+                break;
+            }
+
+            file_meta meta;
+            meta.size = h.size;
+            meta.mtime_ns = h.mtime_ns;
+            meta.inode = h.inode;
+            meta.sharded = h.sharded != 0;
+            if(!current(name, meta)) {
+                ++dropped;
+                continue;
+            }
+            insert(name, meta, chunks);
+            ok = ok && write_record(out, name, meta, chunks);
+            ++kept;
+        }
+        std::fclose(in);
+    }
+
+    ok = ok && std::fflush(out) == 0;
+    if(!ok || std::rename(tmp.c_str(), path_.c_str()) != 0) {
+        LOG_ERROR("Couldn't rewrite chunk index " << path_ << " (errno " << errno << "); uploads won't reuse chunks.");
+        std::fclose(out);
+        std::remove(tmp.c_str());
+        return;
+    }
+    log_ = out;
+    if(kept || dropped) {
+        LOG_INFO("Loaded the chunks of " << kept << " files from " << path_ << " (" << dropped << " out of date).");
+    }
+}
+
+bool chunk_index::find(chunk_ref const& chunk, location& out) const {
+    key k;
+    std::memcpy(k.data(), chunk.hash, k.size());
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = chunks_.find(k);
+    if(it == chunks_.end() || it->second.size != chunk.size) {
+        return false;
+    }
+    out.name = files_[it->second.file].first;
+    out.meta = files_[it->second.file].second;
+    out.offset = it->second.offset;
+    return true;
+}
+
+void chunk_index::add(std::string const& name, file_meta const& meta, std::vector<chunk_ref> const& chunks) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    insert(name, meta, chunks);
+    if(log_ && !(write_record(log_, name, meta, chunks) && std::fflush(log_) == 0)) {
+        LOG_WARN("Couldn't add " << name << " to chunk index " << path_ << " (errno " << errno << ").");
+    }
+}
+
+void chunk_index::insert(std::string const& name, file_meta const& meta, std::vector<chunk_ref> const& chunks) {
+    std::uint32_t file = files_.size();
+    files_.emplace_back(name, meta);
+
+    std::uint64_t offset = 0;
+    for(chunk_ref const& c : chunks) {
+        key k;
+        std::memcpy(k.data(), c.hash, k.size());
+        place& p = chunks_[k];
+        p.file = file;
+        p.size = c.size;
+        p.offset = offset;
+        offset += c.size;
+    }
+    indexed_chunks_.set(chunks_.size());
+}
+
+bool chunk_index::write_record(std::FILE* f, std::string const& name, file_meta const& meta,
+                               std::vector<chunk_ref> const& chunks) {
+    record_header h;
+    std::memset(&h, 0, sizeof(h));
+    h.magic = RECORD_MAGIC;
+    h.name_len = name.size();
+    h.chunk_count = chunks.size();
+    h.sharded = meta.sharded;
+    h.size = meta.size;
+    h.mtime_ns = meta.mtime_ns;
+    h.inode = meta.inode;
+    return std::fwrite(&h, sizeof(h), 1, f) == 1 && std::fwrite(name.data(), 1, name.size(), f) == name.size()
+           && std::fwrite(chunks.data(), sizeof(chunk_ref), chunks.size(), f) == chunks.size();
+}
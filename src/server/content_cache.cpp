@@ -0,0 +1,198 @@
+/* ========================================================================
+   $File: content_cache.cpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/14 $
+   $Description: $ In-memory file contents cache with W-TinyLFU admission
+   $Revisions: $
+   ======================================================================== */
+#include <algorithm>
+#include <functional>
+#include <vector>
+#include <server/content_cache.h>
+
+// The LRU window gets 1% of the cache (but always room for one file); of the rest, 80% is
+// for files that have been hit again since being admitted
+static const std::uint64_t WINDOW_PERCENT = 1;
+static const std::uint64_t PROTECTED_PERCENT = 80;
+
+// Sketch counters per byte of capacity; each file is assumed to be at least 4 KiB
+static const std::uint64_t BYTES_PER_COUNTER = 4 * 1024;
+static const std::size_t MAX_SKETCH_WIDTH = std::size_t(1) << 22;
+
+static std::uint64_t hash_of(std::string const& name) {
+    return std::hash<std::string>()(name);
+}
+
+content_cache::content_cache(std::uint64_t capacity, std::uint64_t max_entry)
+        : capacity_(capacity), max_entry_(std::min(max_entry, capacity)),
+          window_capacity_(std::min(capacity, std::max(capacity * WINDOW_PERCENT / 100, max_entry_))),
+          protected_capacity_((capacity - window_capacity_) * PROTECTED_PERCENT / 100),
+          sketch_((std::size_t)std::min<std::uint64_t>(capacity / BYTES_PER_COUNTER, MAX_SKETCH_WIDTH)),
+          window_bytes_(0), main_bytes_(0), protected_bytes_(0),
+          hits_(metrics::instance().get_counter("server_content_cache_total", "result=\"hit\"",
+                                                "GETs looked up in the in-memory file contents cache.")),
+          misses_(metrics::instance().get_counter("server_content_cache_total", "result=\"miss\"",
+                                                  "GETs looked up in the in-memory file contents cache.")),
+          admitted_(metrics::instance().get_counter("server_content_cache_admissions_total", "result=\"admitted\"",
+                                                    "Files leaving the cache's window, by whether they displaced less popular ones.")),
+          rejected_(metrics::instance().get_counter("server_content_cache_admissions_total", "result=\"rejected\"",
+                                                    "Files leaving the cache's window, by whether they displaced less popular ones.")),
+          bytes_(metrics::instance().get_gauge("server_content_cache_bytes", "", "File bytes held in memory by the contents cache.")),
+          entries_(metrics::instance().get_gauge("server_content_cache_entries", "", "Files held in memory by the contents cache.")) {}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: content_cache::get $
+   $ Prototype: content_cache::ptr content_cache::get(std::string const& name, file_meta const& expected) { $
+   $ Params:
+   $    name: The file being requested $
+   $    expected: The version the index has for it
+   $ Description:  $
+   $    Counts the request in the sketch, then looks the file up. A hit
+   $    moves it up its segment: a file hit while on probation is promoted
+   $    to the protected segment, which pushes that segment's least recently
+   $    used files back down to probation if it's over its share.
+   ======================================================================== */
+content_cache::ptr content_cache::get(std::string const& name, file_meta const& expected) {
+    if(!capacity_) {
+        return ptr();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    sketch_.increment(hash_of(name));
+
+    lru::iterator* found = table_.find(name);
+    if(!found || !(*found)->file->meta.same_version(expected)) {
+        if(found) {
+            erase(*found);
+            update_gauges();
+        }
+        misses_.add();
+        return ptr();
+    }
+
+    lru::iterator it = *found;
+    switch(it->where) {
+        case WINDOW:
+            window_.splice(window_.begin(), window_, it);
+            break;
+        case PROTECTED:
+            protected_.splice(protected_.begin(), protected_, it);
+            break;
+        case PROBATION:
+            protected_.splice(protected_.begin(), probation_, it);
+            it->where = PROTECTED;
+            protected_bytes_ += it->file->meta.size;
+            while(protected_bytes_ > protected_capacity_) {
+                lru::iterator demoted = std::prev(protected_.end());
+                probation_.splice(probation_.begin(), protected_, demoted);
+                demoted->where = PROBATION;
+                protected_bytes_ -= demoted->file->meta.size;
+            }
+            break;
+    }
+    hits_.add();
+    return it->file;
+}
+
+void content_cache::put(std::string const& name, ptr const& file) {
+    if(!cacheable(file->meta.size)) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if(lru::iterator* found = table_.find(name)) {
+        erase(*found);
+    }
+
+    window_.push_front(node{name, file, WINDOW});
+    table_[name] = window_.begin();
+    window_bytes_ += file->meta.size;
+    while(window_bytes_ > window_capacity_) {
+        admit_from_window();
+    }
+    update_gauges();
+}
+
+void content_cache::invalidate(std::string const& name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if(lru::iterator* found = table_.find(name)) {
+        erase(*found);
+        update_gauges();
+    }
+}
+
+content_cache::lru& content_cache::list_of(segment where) {
+    return where == WINDOW ? window_ : where == PROBATION ? probation_ : protected_;
+}
+
+// Drops a file from whichever segment it's in. Call with mutex_ held.
+void content_cache::erase(lru::iterator it) {
+    std::uint64_t size = it->file->meta.size;
+    if(it->where == WINDOW) {
+        window_bytes_ -= size;
+    } else {
+        main_bytes_ -= size;
+        if(it->where == PROTECTED) {
+            protected_bytes_ -= size;
+        }
+    }
+    table_.erase(it->name);
+    list_of(it->where).erase(it);
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: content_cache::admit_from_window $
+   $ Prototype: void content_cache::admit_from_window() { $
+   $ Params: $
+   $ Description:  $
+   $    Moves the window's least recently used file into the main cache if
+   $    there's room. If there isn't, it has to be requested more often
+   $    (per the sketch) than every file it would evict, starting from the
+   $    least recently used on probation; otherwise it's dropped instead.
+   $    Call with mutex_ held.
+   ======================================================================== */
+void content_cache::admit_from_window() {
+    lru::iterator candidate = std::prev(window_.end());
+    std::uint64_t size = candidate->file->meta.size;
+    std::uint64_t main_capacity = capacity_ - window_capacity_;
+
+    if(size > main_capacity) {
+        rejected_.add();
+        erase(candidate);
+        return;
+    }
+
+    std::vector<lru::iterator> victims;
+    std::uint64_t freed = 0;
+    unsigned victim_frequency = 0;
+    for(lru* from : {&probation_, &protected_}) {
+        for(auto it = from->rbegin(); it != from->rend() && main_bytes_ - freed + size > main_capacity; ++it) {
+            victims.push_back(std::prev(it.base()));
+            freed += it->file->meta.size;
+            victim_frequency = std::max(victim_frequency, sketch_.estimate(hash_of(it->name)));
+        }
+    }
+
+    if(!victims.empty() && sketch_.estimate(hash_of(candidate->name)) <= victim_frequency) {
+        rejected_.add();
+        erase(candidate);
+        return;
+    }
+
+    for(auto victim : victims) {
+        erase(victim);
+    }
+    window_bytes_ -= size;
+    main_bytes_ += size;
+    probation_.splice(probation_.begin(), window_, candidate);
+    candidate->where = PROBATION;
+    admitted_.add();
+}
+
+void content_cache::update_gauges() {
+    bytes_.set(window_bytes_ + main_bytes_);
+    entries_.set(table_.size());
+}
@@ -0,0 +1,231 @@
+/* ========================================================================
+   $File: dir_watcher.cpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/10 $
+   $Description: $ inotify-based directory watcher
+   $Revisions: $
+   ======================================================================== */
+#include <cerrno>
+#include <cstdint>
+#include <system_error>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <util/log.hpp>
+#include <server/dir_watcher.h>
+
+// IN_CREATE covers hard links (and linkat() of an O_TMPFILE), which never get a close event
+static const std::uint32_t ADD_EVENTS = IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO;
+static const std::uint32_t REMOVE_EVENTS = IN_DELETE | IN_MOVED_FROM;
+static const std::uint32_t WATCH_MASK = ADD_EVENTS | REMOVE_EVENTS | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+dir_watcher::dir_watcher(std::string const& path, change_handler on_change, rescan_handler on_rescan,
+                         subdir_filter watch_subdir)
+        : path_(path), on_change_(on_change), on_rescan_(on_rescan), watch_subdir_(watch_subdir),
+          inotify_fd_(-1), stop_fd_(-1), root_wd_(-1) {
+    inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(inotify_fd_ < 0) {
+        throw std::system_error(errno, std::system_category(), "inotify_init1");
+    }
+
+    root_wd_ = watch("", nullptr);
+    if(root_wd_ < 0) {
+        int err = errno;
+        close(inotify_fd_);
+        throw std::system_error(err, std::system_category(), "inotify_add_watch " + path);
+    }
+
+    stop_fd_ = eventfd(0, EFD_CLOEXEC);
+    if(stop_fd_ < 0) {
+        int err = errno;
+        close(inotify_fd_);
+        throw std::system_error(err, std::system_category(), "eventfd");
+    }
+}
+
+dir_watcher::~dir_watcher() {
+    if(thread_.joinable()) {
+        std::uint64_t one = 1;
+        if(write(stop_fd_, &one, sizeof(one)) != sizeof(one)) {
+            LOG_ERROR("Couldn't stop the directory watcher thread.");
+        }
+        thread_.join();
+    }
+    close(stop_fd_);
+    close(inotify_fd_);
+}
+
+void dir_watcher::start(std::function<void()> first) {
+    thread_ = std::thread([this, first] { run(first); });
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: dir_watcher::watch $
+   $ Prototype: int dir_watcher::watch(std::string const& relative, std::vector<file_index::change>* found) { $
+   $ Params:
+   $    relative: The directory to watch, relative to path_ $
+   $    found: If not null, receives an ADD for each file already in the watched directories
+   $ Description:  $
+   $    Adds a watch for the directory and recurses into the subdirectories
+   $    that watch_subdir_ accepts. Returns the directory's watch descriptor,
+   $    or -1 (with errno set) if it couldn't be watched. Running out of
+   $    watches is logged rather than thrown, since the rest still work.
+   ======================================================================== */
+int dir_watcher::watch(std::string const& relative, std::vector<file_index::change>* found) {
+    std::string full = relative.empty() ? path_ : path_ + '/' + relative;
+    int wd = inotify_add_watch(inotify_fd_, full.c_str(), WATCH_MASK);
+    if(wd < 0) {
+        if(!relative.empty()) {
+            LOG_WARN("Couldn't watch " << full << " (errno " << errno << "); changes to it won't be noticed.");
+        }
+        return -1;
+    }
+    dirs_[wd] = relative;
+
+    if(!watch_subdir_ && !found) {
+        return wd;
+    }
+
+    DIR* dir = opendir(full.c_str());
+    if(!dir) {
+        return wd;
+    }
+    while(dirent* ent = readdir(dir)) {
+        std::string name(ent->d_name);
+        if(name == "." || name == "..") {
+            continue;
+        }
+
+        std::string child = relative.empty() ? name : relative + '/' + name;
+        if(ent->d_type == DT_DIR) {
+            if(watch_subdir_ && watch_subdir_(child)) {
+                watch(child, found);
+            }
+        } else if(found) {
+            found->push_back(file_index::change{file_index::change::ADD, child, file_meta()});
+        }
+    }
+    closedir(dir);
+    return wd;
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: dir_watcher::run $
+   $ Prototype: void dir_watcher::run(std::function<void()> first) { $
+   $ Params:
+   $    first: Called before any events are delivered (if set) $
+   $ Description:  $
+   $    Waits for inotify events (or the stop signal) and hands each batch
+   $    of events that is ready to the change handler.
+   ======================================================================== */
+void dir_watcher::run(std::function<void()> first) {
+    // Events that arrive meanwhile wait in the inotify queue
+    if(first) {
+        first();
+    }
+
+    pollfd fds[2] = {{inotify_fd_, POLLIN, 0}, {stop_fd_, POLLIN, 0}};
+    std::vector<file_index::change> changes;
+    for(;;) {
+        if(poll(fds, 2, -1) < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            LOG_ERROR("Directory watcher poll failed (errno " << errno << "); the file index will no longer update.");
+            return;
+        }
+        if(fds[1].revents) {
+            return;
+        }
+
+        bool overflowed = false;
+        changes.clear();
+        if(!read_events(changes, overflowed)) {
+            return;
+        }
+
+        if(overflowed) {
+            // Some events were dropped, so nothing short of a full scan is trustworthy. That
+            // includes directory creations, so make sure every directory is watched first.
+            LOG_WARN("inotify queue overflowed; rescanning " << path_);
+            watch("", nullptr);
+            on_rescan_();
+        } else if(!changes.empty()) {
+            on_change_(changes);
+        }
+    }
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: dir_watcher::read_events $
+   $ Prototype: bool dir_watcher::read_events(std::vector<file_index::change>& changes, bool& overflowed) { $
+   $ Params:
+   $    changes: Where to add the changes that were read $
+   $    overflowed: Set if the kernel dropped events (or a whole directory moved away)
+   $ Description:  $
+   $    Reads every event that's queued. Returns false if the watched
+   $    directory itself is gone.
+   ======================================================================== */
+bool dir_watcher::read_events(std::vector<file_index::change>& changes, bool& overflowed) {
+    alignas(inotify_event) char buf[64 * 1024];
+    for(;;) {
+        ssize_t len = read(inotify_fd_, buf, sizeof(buf));
+        if(len < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno != EAGAIN) {
+                LOG_ERROR("Couldn't read inotify events (errno " << errno << ").");
+            }
+            return true;
+        }
+
+        for(char* p = buf; p < buf + len;) {
+            inotify_event* ev = (inotify_event*)p;
+            p += sizeof(inotify_event) + ev->len;
+
+            if(ev->mask & IN_Q_OVERFLOW) {
+                overflowed = true;
+                continue;
+            }
+            if(ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                if(ev->wd == root_wd_) {
+                    LOG_ERROR(path_ << " was removed or moved; the file index will no longer update.");
+                    return false;
+                }
+                if(ev->mask & IN_IGNORED) {
+                    dirs_.erase(ev->wd);
+                }
+                continue;
+            }
+
+            auto dir = dirs_.find(ev->wd);
+            if(dir == dirs_.end() || ev->len == 0) {
+                continue;
+            }
+            std::string path = dir->second.empty() ? std::string(ev->name) : dir->second + '/' + ev->name;
+
+            if(ev->mask & IN_ISDIR) {
+                if(!watch_subdir_ || !watch_subdir_(path)) {
+                    continue;
+                }
+                if(ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    watch(path, &changes);
+                } else if(ev->mask & IN_MOVED_FROM) {
+                    // Everything in it went too, and we don't know what that was
+                    overflowed = true;
+                }
+            } else if(ev->mask & ADD_EVENTS) {
+                changes.push_back(file_index::change{file_index::change::ADD, path, file_meta()});
+            } else if(ev->mask & REMOVE_EVENTS) {
+                changes.push_back(file_index::change{file_index::change::REMOVE, path, file_meta()});
+            }
+        }
+    }
+}
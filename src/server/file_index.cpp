@@ -0,0 +1,206 @@
+/* ========================================================================
+   $File: file_index.cpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/10 $
+   $Description: $ Persistent base plus sharded copy-on-write overlay of stored files
+   $Revisions: $
+   ======================================================================== */
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <server/file_index.h>
+
+file_index::file_index() {}
+
+// Picks the shard from the top bits of the mixed hash; the shard's table probes from the low bits
+unsigned file_index::shard_of(std::string const& name) {
+    std::uint64_t h = std::hash<std::string>()(name);
+    return (unsigned)((h * 0x9E3779B97F4A7C15ull) >> 58) % SHARDS;
+}
+
+bool file_index::lookup(std::string const& name, file_meta* meta) const {
+    {
+        auto overlay = shards_[shard_of(name)].read();
+        overlay_entry const* e = overlay->find(name);
+        if(e) {
+            if(e->present && meta) {
+                *meta = e->meta;
+            }
+            return e->present;
+        }
+    }
+
+    // save() publishes a new base before it drops the overlay entries it covers,
+    // so a name missing from the overlay here is in whichever base we see now
+    return base_.read()->lookup(name, meta);
+}
+
+std::size_t file_index::size() const {
+    auto base = base_.read();
+    std::size_t n = base->size();
+    for(auto& s : shards_) {
+        s.read()->for_each([&](std::string const& name, overlay_entry const& e) {
+            bool in_base = base->lookup(name, nullptr);
+            if(e.present && !in_base) {
+                ++n;
+            } else if(!e.present && in_base) {
+                --n;
+            }
+        });
+    }
+    return n;
+}
+
+std::size_t file_index::overlay_size() const {
+    std::size_t n = 0;
+    for(auto& s : shards_) {
+        n += s.read()->size();
+    }
+    return n;
+}
+
+void file_index::add(std::string const& name, file_meta const& meta) {
+    apply(std::vector<change>{change{change::ADD, name, meta}});
+}
+
+void file_index::remove(std::string const& name) {
+    apply(std::vector<change>{change{change::REMOVE, name, file_meta()}});
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: file_index::apply $
+   $ Prototype: void file_index::apply(std::vector<change> const& changes) { $
+   $ Params:
+   $    changes: The additions and removals to make, oldest first $
+   $ Description:  $
+   $    Copies each overlay shard that the batch touches, applies that
+   $    shard's changes to the copy in order, and publishes it. Readers see
+   $    either the old or the new version of a shard, never a half-updated one.
+   $    Removals are recorded as tombstones so that they hide the base entry.
+   ======================================================================== */
+void file_index::apply(std::vector<change> const& changes) {
+    std::vector<std::vector<change const*>> by_shard(SHARDS);
+    for(auto& c : changes) {
+        by_shard[shard_of(c.name)].push_back(&c);
+    }
+
+    for(unsigned i = 0; i < SHARDS; ++i) {
+        auto const& mine = by_shard[i];
+        if(mine.empty()) {
+            continue;
+        }
+
+        shards_[i].update([&mine](shard const& current) {
+            std::unique_ptr<shard> next(new shard(current));
+            for(auto c : mine) {
+                overlay_entry& e = (*next)[c->name];
+                e.present = c->type == change::ADD;
+                e.meta = e.present ? c->meta : file_meta();
+            }
+            return next;
+        });
+    }
+}
+
+void file_index::for_each(std::function<void(std::string const&, file_meta const&)> const& f) const {
+    // Hold the base for the whole walk; the overlay is copied since it's small
+    auto base = base_.read();
+    shard overlay;
+    for(auto& s : shards_) {
+        s.read()->for_each([&overlay](std::string const& name, overlay_entry const& e) { overlay[name] = e; });
+    }
+
+    base->for_each([&](std::string const& name, file_meta const& meta) {
+        if(!overlay.find(name)) {
+            f(name, meta);
+        }
+    });
+    overlay.for_each([&f](std::string const& name, overlay_entry const& e) {
+        if(e.present) {
+            f(name, e.meta);
+        }
+    });
+}
+
+bool file_index::load(std::string const& path) {
+    std::unique_ptr<persistent_index> base = persistent_index::open(path);
+    if(!base) {
+        return false;
+    }
+    base_.publish(std::move(base));
+    return true;
+}
+
+static bool same_entry(bool present_a, file_meta const& a, bool present_b, file_meta const& b) {
+    if(present_a != present_b) {
+        return false;
+    }
+    return !present_a || (a.same_version(b) && a.sharded == b.sharded && a.hashed == b.hashed && std::memcmp(a.hash, b.hash, sizeof(a.hash)) == 0);
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: file_index::save $
+   $ Prototype: bool file_index::save(std::string const& path) { $
+   $ Params:
+   $    path: Where to write the index $
+   $ Description:  $
+   $    Snapshots the overlay, writes the merged index, maps the result as
+   $    the new base and then drops each overlay entry that is unchanged
+   $    since the snapshot (the base now says the same thing).
+   ======================================================================== */
+bool file_index::save(std::string const& path) {
+    std::lock_guard<std::mutex> lock(save_mutex_);
+
+    std::vector<shard> captured(SHARDS);
+    for(unsigned i = 0; i < SHARDS; ++i) {
+        captured[i] = *shards_[i].read();
+    }
+
+    std::vector<std::pair<std::string, file_meta>> files;
+    {
+        auto base = base_.read();
+        base->for_each([&](std::string const& name, file_meta const& meta) {
+            if(!captured[shard_of(name)].find(name)) {
+                files.push_back(std::make_pair(name, meta));
+            }
+        });
+    }
+    for(auto& s : captured) {
+        s.for_each([&files](std::string const& name, overlay_entry const& e) {
+            if(e.present) {
+                files.push_back(std::make_pair(name, e.meta));
+            }
+        });
+    }
+
+    if(!persistent_index::write(path, files)) {
+        return false;
+    }
+    std::unique_ptr<persistent_index> base = persistent_index::open(path);
+    if(!base) {
+        return false;
+    }
+    base_.publish(std::move(base));
+
+    for(unsigned i = 0; i < SHARDS; ++i) {
+        shard const& old = captured[i];
+        if(old.empty()) {
+            continue;
+        }
+
+        shards_[i].update([&old](shard const& current) {
+            std::unique_ptr<shard> next(new shard());
+            current.for_each([&](std::string const& name, overlay_entry const& e) {
+                overlay_entry const* then = old.find(name);
+                if(!then || !same_entry(then->present, then->meta, e.present, e.meta)) {
+                    (*next)[name] = e;
+                }
+            });
+            return next;
+        });
+    }
+    return true;
+}
@@ -0,0 +1,79 @@
+/* ========================================================================
+   $File: group_commit.cpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/16 $
+   $Description: $ Batched filesystem syncs for durable uploads
+   $Revisions: $
+   ======================================================================== */
+#include <cerrno>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#include <server/group_commit.h>
+#include <util/log.hpp>
+
+group_commit::group_commit(std::string const& dir)
+        : open_(new batch()), syncing_(false),
+          rounds_(metrics::instance().get_counter("server_sync_rounds_total", "",
+                                                  "Filesystem syncs run to make uploads durable.")),
+          uploads_(metrics::instance().get_counter("server_synced_uploads_total", "",
+                                                   "Uploads made durable by the sync rounds.")),
+          duration_(metrics::instance().get_histogram("server_sync_duration", "",
+                                                      "Time taken by each sync round.")) {
+    dir_fd_ = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(dir_fd_ < 0) {
+        throw std::system_error(errno, std::system_category(), "open " + dir);
+    }
+}
+
+group_commit::~group_commit() {
+    close(dir_fd_);
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: group_commit::wait $
+   $ Prototype: bool group_commit::wait() { $
+   $ Params: $
+   $ Description:  $
+   $    Joins the open batch. If no sync is running, the caller runs one
+   $    for that batch (without holding the lock), and anyone who arrives
+   $    meanwhile joins the next batch, which the first of them to wake
+   $    up after it syncs. syncfs covers the new files' directory entries
+   $    as well as their data, which one fdatasync per file wouldn't.
+   ======================================================================== */
+bool group_commit::wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    std::shared_ptr<batch> mine = open_;
+    uploads_.add();
+
+    while(!mine->done) {
+        if(syncing_) {
+            synced_.wait(lock);
+            continue;
+        }
+
+        syncing_ = true;
+        std::shared_ptr<batch> b = open_;
+        open_.reset(new batch());
+        lock.unlock();
+
+        bool ok;
+        {
+            scoped_timer t(duration_);
+            ok = syncfs(dir_fd_) == 0;
+        }
+        if(!ok) {
+            LOG_ERROR("Couldn't sync the storage directory (errno " << errno << ").");
+        }
+        rounds_.add();
+
+        lock.lock();
+        b->done = true;
+        b->ok = ok;
+        syncing_ = false;
+        synced_.notify_all();
+    }
+    return mine->ok;
+}
@@ -7,10 +7,17 @@
    $Revisions: $
    ======================================================================== */
 
+#include <algorithm>
+#include <cstdlib>
 #include <iostream>
+#include <memory>
 #include <boost/filesystem.hpp>
 #include <boost/asio.hpp>
 #include <server/server.h>
+#include <util/log.hpp>
+#include <util/metrics.hpp>
+#include <util/size_arg.hpp>
+#include <util/trace.hpp>
 
 
 /* ========================================================================
@@ -20,23 +27,125 @@
    $ Params: 
    $    argc: the number of arguments
    $    argv: the argument received
-   $ Description:  Starts the server
+   $ Description:  Starts the server. --log-file sends the log to a file
+   $               instead of stderr; --metrics-file periodically writes
+   $               the metrics there in the Prometheus text format;
+   $               --trace-file records Chrome trace events, with one in
+   $               every --trace-sample chunks traced individually;
+   $               --layout=sharded stores new uploads under hash-prefix
+   $               subdirectories instead of directly in the directory;
+   $               --cache-size keeps that many bytes of popular files (no
+   $               bigger than --cache-max-file each) in memory;
+   $               --upload-cache=keep leaves big uploads in the page
+   $               cache instead of dropping them as they're written;
+   $               --durability=file|group makes uploads durable before
+   $               acknowledging them, one file or one batch at a time;
+   $               --pack-max-file packs uploads up to that size together
+   $               into segment files instead of giving each its own;
+   $               --dedup stores each distinct content once and accepts
+   $               uploads offered by hash without their data;
+   $               --compression=off refuses clients' requests to compress
+   $               file contents on the data channel; --compress-at-rest
+   $               stores uploads compressed with that codec.
    ======================================================================== */
 int main(int argc, char** argv) {
-    if(argc != 2) {
-        std::cout << "usage: " << argv[0] << " [storage directory]" << std::endl;
+    std::string storage_path;
+    std::string log_path;
+    std::string metrics_path;
+    unsigned metrics_interval = 10;
+    std::string trace_path;
+    unsigned trace_sample = 64;
+    server_options opts;
+
+    // Options look like --name=value; the one non-option argument is the storage directory
+    for(int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if(arg.compare(0, 11, "--log-file=") == 0) {
+            log_path = arg.substr(11);
+        } else if(arg.compare(0, 15, "--metrics-file=") == 0) {
+            metrics_path = arg.substr(15);
+        } else if(arg.compare(0, 19, "--metrics-interval=") == 0) {
+            metrics_interval = std::max(1, std::atoi(arg.c_str() + 19));
+        } else if(arg.compare(0, 13, "--trace-file=") == 0) {
+            trace_path = arg.substr(13);
+        } else if(arg.compare(0, 15, "--trace-sample=") == 0) {
+            trace_sample = std::max(1, std::atoi(arg.c_str() + 15));
+        } else if(arg.compare(0, 13, "--cache-size=") == 0) {
+            if(!parse_size(arg.substr(13), opts.cache_bytes)) {
+                storage_path.clear();
+                break;
+            }
+        } else if(arg.compare(0, 17, "--cache-max-file=") == 0) {
+            if(!parse_size(arg.substr(17), opts.cache_max_file)) {
+                storage_path.clear();
+                break;
+            }
+        } else if(arg.compare(0, 16, "--pack-max-file=") == 0) {
+            if(!parse_size(arg.substr(16), opts.pack_max_file)) {
+                storage_path.clear();
+                break;
+            }
+        } else if(arg == "--dedup") {
+            opts.dedup = true;
+        } else if(arg.compare(0, 19, "--compress-at-rest=") == 0) {
+            if(!parse_codec(arg.substr(19), opts.at_rest, opts.at_rest_level)) {
+                storage_path.clear();
+                break;
+            }
+        } else if(arg == "--compression=on" || arg == "--compression=off") {
+            opts.compression = arg == "--compression=on";
+        } else if(arg == "--layout=flat" || arg == "--layout=sharded") {
+            opts.sharded = arg == "--layout=sharded";
+        } else if(arg == "--upload-cache=drop" || arg == "--upload-cache=keep") {
+            opts.keep_uploads_cached = arg == "--upload-cache=keep";
+        } else if(arg == "--durability=none") {
+            opts.sync = durability::none;
+        } else if(arg == "--durability=file") {
+            opts.sync = durability::file;
+        } else if(arg == "--durability=group") {
+            opts.sync = durability::group;
+        } else if(arg.compare(0, 2, "--") != 0 && storage_path.empty()) {
+            storage_path = arg;
+        } else {
+            storage_path.clear();
+            break;
+        }
+    }
+
+    if(storage_path.empty()) {
+        std::cout << "usage: " << argv[0] << " [--log-file=path] [--metrics-file=path] [--metrics-interval=seconds]"
+                  << " [--trace-file=path] [--trace-sample=n] [--layout=flat|sharded]"
+                  << " [--cache-size=64M] [--cache-max-file=1M] [--upload-cache=drop|keep]"
+                  << " [--durability=none|file|group] [--pack-max-file=0] [--dedup]"
+                  << " [--compression=on|off] [--compress-at-rest=none|lz4|deflate[:level]]"
+                  << " [storage directory]" << std::endl;
+        return 1;
+    }
+
+    if(!log_path.empty() && !logger::instance().open(log_path)) {
+        std::cerr << "Couldn't open log file " << log_path << std::endl;
         return 1;
     }
 
+    if(!trace_path.empty() && !tracer::instance().start(trace_path, trace_sample)) {
+        std::cerr << "Couldn't open trace file " << trace_path << std::endl;
+        return 1;
+    }
+
+    // Dumps the metrics every metrics_interval seconds for as long as the server runs
+    std::unique_ptr<metrics_dumper> dumper;
+    if(!metrics_path.empty()) {
+        dumper.reset(new metrics_dumper(metrics_path, metrics_interval));
+    }
+
     boost::asio::io_service service;
     
     try {
-        std::string p(argv[1]);
         // Might figure out how to thread this later, but for now just Ctrl + C out of it
-        server s(service, p);
+        server s(service, storage_path, opts);
         s.start();
     } catch(std::exception& e) {
-        std::cerr << "Error: " << e.what() << std::endl;
+        LOG_ERROR("Error: " << e.what());
     }
 
     return 0;
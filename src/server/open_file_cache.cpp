@@ -0,0 +1,162 @@
+/* ========================================================================
+   $File: open_file_cache.cpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/12 $
+   $Description: $ Bounded cache of open file descriptors with CLOCK eviction
+   $Revisions: $
+   ======================================================================== */
+#include <cerrno>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <server/open_file_cache.h>
+#include <server/storage_layout.h>
+#include <util/file_transfer.hpp>
+#include <util/page_cache.hpp>
+
+open_file_cache::handle::~handle() {
+    close(fd);
+}
+
+bool open_file_cache::handle::read(char* buf, std::uint64_t size, std::uint64_t offset) const {
+    if(frames) {
+        return frames->read(fd, buf, size, offset);
+    }
+    return offset <= meta.size && size <= meta.size - offset && read_file(fd, buf, size, meta.offset + offset);
+}
+
+open_file_cache::open_file_cache(std::string const& dir, std::size_t capacity)
+        : capacity_(capacity), hand_(0),
+          hits_(metrics::instance().get_counter("server_open_file_cache_total", "result=\"hit\"",
+                                                "Lookups in the open file descriptor cache.")),
+          misses_(metrics::instance().get_counter("server_open_file_cache_total", "result=\"miss\"",
+                                                  "Lookups in the open file descriptor cache.")),
+          open_(metrics::instance().get_gauge("server_open_file_cache_size", "", "File descriptors held by the cache.")) {
+    dir_fd_ = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(dir_fd_ < 0) {
+        throw std::system_error(errno, std::system_category(), "open " + dir);
+    }
+}
+
+open_file_cache::~open_file_cache() {
+    close(dir_fd_);
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: open_file_cache::open $
+   $ Prototype: open_file_cache::ptr open_file_cache::open(std::string const& name, file_meta const& expected) { $
+   $ Params:
+   $    name: The file's name within the directory $
+   $    expected: The version of the file the caller wants
+   $ Description:  $
+   $    On a hit this is a table lookup and nothing else. On a miss the file
+   $    is opened relative to the directory descriptor (no full path walk)
+   $    and fstat'd to make sure it's the version the index described. If
+   $    it's not where the index says, the other layout's location is tried,
+   $    since a migration may have just moved it. Descriptors are opened
+   $    with a sequential access hint: most GETs read the whole file, and
+   $    a range GET still reads its part of it in order. A packed file's
+   $    handle is a descriptor for its pack segment. A file of its own may
+   $    be stored compressed, which is found out here too.
+   ======================================================================== */
+open_file_cache::ptr open_file_cache::open(std::string const& name, file_meta const& expected) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        entry* e = table_.find(name);
+        if(e && e->file->meta.same_version(expected)) {
+            e->referenced = true;
+            hits_.add();
+            return e->file;
+        }
+    }
+    misses_.add();
+
+    // A packed file is a range of a segment that's never rewritten, so there's nothing to check
+    if(expected.pack) {
+        int fd = openat(dir_fd_, storage_layout::pack_path(expected.pack).c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd < 0) {
+            return ptr();
+        }
+        return insert(name, ptr(new handle(fd, expected)));
+    }
+
+    file_meta meta = expected;
+    int fd = openat(dir_fd_, storage_layout::relative_path(name, meta.sharded).c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0 && errno == ENOENT) {
+        meta.sharded = !meta.sharded;
+        fd = openat(dir_fd_, storage_layout::relative_path(name, meta.sharded).c_str(), O_RDONLY | O_CLOEXEC);
+    }
+    if(fd < 0) {
+        return ptr();
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+        close(fd);
+        return ptr();
+    }
+    meta.size = st.st_size;
+    meta.mtime_ns = (std::int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    meta.inode = st.st_ino;
+
+    // Whole-file and range GETs alike read front to back, so read ahead
+    advise_sequential(fd);
+
+    ptr file(new handle(fd, meta, stored_frames::open(fd, meta.size)));
+    if(!meta.same_version(expected)) {
+        // The index hasn't caught up with the file yet; serve what's there but don't cache it
+        return file;
+    }
+    return insert(name, file);
+}
+
+open_file_cache::ptr open_file_cache::insert(std::string const& name, ptr const& file) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entry* e = table_.find(name);
+    if(!e) {
+        if(table_.size() >= capacity_) {
+            evict_one();
+        }
+        e = &table_[name];
+        open_.add(1);
+    }
+    e->file = file;
+    e->referenced = true;
+    return file;
+}
+
+void open_file_cache::invalidate(std::string const& name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if(table_.erase(name)) {
+        open_.add(-1);
+    }
+}
+
+void open_file_cache::clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    table_ = open_table<std::string, entry>();
+    open_.set(0);
+}
+
+// Sweeps the clock hand over the table, giving referenced entries a second chance. Call with mutex_ held.
+void open_file_cache::evict_one() {
+    for(;;) {
+        hand_ = (hand_ + 1) % table_.slot_count();
+        auto& s = table_.slot_at(hand_);
+        if(s.hash == 0) {
+            continue;
+        }
+        if(s.value.referenced) {
+            s.value.referenced = false;
+            continue;
+        }
+
+        std::string victim = s.key;
+        table_.erase(victim);
+        open_.add(-1);
+        return;
+    }
+}
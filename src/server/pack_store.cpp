@@ -0,0 +1,326 @@
+/* ========================================================================
+   $File: pack_store.cpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/16 $
+   $Description: $ Small files packed into append-only segments
+   $Revisions: $
+   ======================================================================== */
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <boost/filesystem.hpp>
+#include <server/pack_store.h>
+#include <server/storage_layout.h>
+#include <util/blake3.hpp>
+#include <util/file_transfer.hpp>
+#include <util/log.hpp>
+
+namespace fs = boost::filesystem;
+
+struct pack_store::record_header {
+    std::uint32_t magic;
+    std::uint32_t name_len;
+    std::uint64_t size;
+    std::int64_t mtime_ns;
+    unsigned char hash[32];
+};
+
+static const std::uint32_t RECORD_MAGIC = 0x4b434150; // "PACK"
+static const std::uint32_t DEAD_MAGIC = 0x44414544;   // "DEAD"
+
+// Records ending this close to the end of a segment have their contents checked on replay,
+// since that's where a crash can leave a header whose contents never made it to disk
+static const std::uint64_t VERIFY_TAIL = 1024 * 1024;
+
+pack_store::pack_store(std::string const& dir, std::uint64_t segment_size)
+        : dir_((fs::path(dir) / storage_layout::PACK_DIR).string()), segment_size_(segment_size),
+          active_(0), active_fd_(-1), active_inode_(0),
+          records_(metrics::instance().get_counter("server_pack_records_total", "",
+                                                   "Files appended to pack segments, including ones moved by compaction.")),
+          reclaimed_(metrics::instance().get_counter("server_pack_reclaimed_bytes_total", "",
+                                                     "Bytes freed by deleting compacted pack segments.")),
+          segment_count_(metrics::instance().get_gauge("server_pack_segments", "", "Pack segments on disk.")),
+          bytes_(metrics::instance().get_gauge("server_pack_bytes", "", "Bytes in pack segments, live or not.")) {
+    boost::system::error_code ec;
+    for(fs::directory_iterator it(dir_, ec); !ec && it != fs::directory_iterator(); it.increment(ec)) {
+        std::string name = it->path().filename().string();
+        char* end;
+        unsigned long id = std::strtoul(name.c_str(), &end, 10);
+        struct stat st;
+        if(id == 0 || *end != '\0' || id > UINT32_MAX || stat(it->path().c_str(), &st) != 0) {
+            continue;
+        }
+        segments_[(std::uint32_t)id] = st.st_size;
+        bytes_.add(st.st_size);
+    }
+    segment_count_.set(segments_.size());
+}
+
+pack_store::~pack_store() {
+    if(active_fd_ >= 0) {
+        close(active_fd_);
+    }
+}
+
+std::uint64_t pack_store::record_size(std::string const& name, std::uint64_t size) {
+    return sizeof(record_header) + name.size() + size;
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: pack_store::start_segment $
+   $ Prototype: bool pack_store::start_segment() { $
+   $ Params: $
+   $ Description:  $
+   $    Creates the next segment and makes it the active one. A new server
+   $    always starts a new segment rather than appending to the last one,
+   $    so a record cut short by a crash can only ever be at the end of a
+   $    segment. The directory is synced so that the segment's name is as
+   $    durable as anything later written to it.
+   ======================================================================== */
+bool pack_store::start_segment() {
+    if(mkdir(dir_.c_str(), 0755) != 0 && errno != EEXIST) {
+        LOG_ERROR("Couldn't create " << dir_ << " (errno " << errno << ").");
+        return false;
+    }
+
+    std::uint32_t id = segments_.empty() ? 1 : segments_.rbegin()->first + 1;
+    std::string path = dir_ + '/' + std::to_string(id);
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0) {
+        LOG_ERROR("Couldn't create pack segment " << path << " (errno " << errno << ").");
+        if(fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+
+    int dir_fd = open(dir_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    // Sealing the old segment syncs it, so nothing that was moved into it by compaction is lost
+    if(active_fd_ >= 0) {
+        fdatasync(active_fd_);
+        close(active_fd_);
+    }
+    active_ = id;
+    active_fd_ = fd;
+    active_inode_ = st.st_ino;
+    segments_[id] = 0;
+    segment_count_.set(segments_.size());
+    return true;
+}
+
+bool pack_store::append(std::string const& name, char const* data, file_meta& meta, bool sync,
+                        std::function<void(file_meta const&)> const& publish) {
+    record_header h;
+    std::memset(&h, 0, sizeof(h));
+    h.magic = RECORD_MAGIC;
+    h.name_len = (std::uint32_t)name.size();
+    h.size = meta.size;
+    h.mtime_ns = meta.mtime_ns;
+    std::memcpy(h.hash, meta.hash, sizeof(h.hash));
+    std::uint64_t size = record_size(name, meta.size);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if(active_fd_ < 0 || (segments_[active_] > 0 && segments_[active_] + size > segment_size_)) {
+        if(!start_segment()) {
+            return false;
+        }
+    }
+
+    // A failed write leaves the segment's end where it was, so the next record overwrites whatever got written
+    std::uint64_t offset = segments_[active_];
+    iovec iov[3] = {{&h, sizeof(h)}, {const_cast<char*>(name.data()), name.size()}, {const_cast<char*>(data), meta.size}};
+    {
+        scoped_timer t(transfer_metrics::get().disk_write);
+        std::uint64_t done = 0;
+        int first = 0;
+        while(done < size) {
+            ssize_t n = pwritev(active_fd_, iov + first, 3 - first, offset + done);
+            if(n < 0 && errno == EINTR) {
+                continue;
+            } else if(n <= 0) {
+                LOG_ERROR("Couldn't write to pack segment " << active_ << " (errno " << errno << ").");
+                return false;
+            }
+            done += n;
+            for(; first < 3 && (std::size_t)n >= iov[first].iov_len; ++first) {
+                n -= iov[first].iov_len;
+            }
+            if(first < 3) {
+                iov[first].iov_base = (char*)iov[first].iov_base + n;
+                iov[first].iov_len -= n;
+            }
+        }
+    }
+    if(sync && fdatasync(active_fd_) != 0) {
+        LOG_ERROR("Couldn't sync pack segment " << active_ << " (errno " << errno << ").");
+        return false;
+    }
+
+    segments_[active_] = offset + size;
+    bytes_.add((std::int64_t)size);
+    records_.add();
+
+    meta.pack = active_;
+    meta.offset = offset + sizeof(h) + name.size();
+    meta.inode = active_inode_;
+    meta.sharded = false;
+    meta.hashed = true;
+    publish(meta);
+    return true;
+}
+
+void pack_store::retire(std::string const& name, file_meta const& meta) {
+    std::uint64_t record = meta.offset - name.size() - sizeof(record_header);
+    std::string path = dir_ + '/' + std::to_string(meta.pack);
+    int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if(fd < 0) {
+        return;
+    }
+
+    // Only if the header is the one expected, to be safe against a stale meta
+    record_header h;
+    if(read_file(fd, (char*)&h, sizeof(h), record) && h.magic == RECORD_MAGIC && h.name_len == name.size()
+       && h.size == meta.size && h.mtime_ns == meta.mtime_ns) {
+        std::uint32_t dead = DEAD_MAGIC;
+        if(pwrite(fd, &dead, sizeof(dead), record) != sizeof(dead)) {
+            LOG_WARN("Couldn't mark a record in pack segment " << meta.pack << " dead (errno " << errno << ").");
+        }
+    }
+    close(fd);
+}
+
+bool pack_store::sync() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return active_fd_ < 0 || fdatasync(active_fd_) == 0;
+}
+
+void pack_store::replay(std::function<void(std::string const&, file_meta const&)> const& f) {
+    std::map<std::uint32_t, std::uint64_t> segments;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        segments = segments_;
+    }
+    for(auto& s : segments) {
+        replay_segment(s.first, s.second, f);
+    }
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: pack_store::replay_segment $
+   $ Prototype: void pack_store::replay_segment(std::uint32_t pack, std::uint64_t size, std::function<void(std::string const&, file_meta const&)> const& f) { $
+   $ Params:
+   $    pack: The segment's id $
+   $    size: How much of it to read $
+   $    f: Called for each record
+   $ Description:  $
+   $    Walks the record headers, skipping over the contents and dead
+   $    records. The walk stops at anything that isn't a whole record, and
+   $    near the end of the segment the contents are checked against their
+   $    hash too.
+   ======================================================================== */
+void pack_store::replay_segment(std::uint32_t pack, std::uint64_t size,
+                                std::function<void(std::string const&, file_meta const&)> const& f) {
+    std::string path = dir_ + '/' + std::to_string(pack);
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0) {
+        LOG_WARN("Couldn't read pack segment " << path << " (errno " << errno << ").");
+        if(fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    std::string name;
+    std::vector<char> data;
+    for(std::uint64_t offset = 0; offset + sizeof(record_header) <= size;) {
+        record_header h;
+        if(!read_file(fd, (char*)&h, sizeof(h), offset) || (h.magic != RECORD_MAGIC && h.magic != DEAD_MAGIC)
+           || h.name_len > size || h.size > size || offset + record_size(std::string(), h.size) + h.name_len > size) {
+            LOG_WARN("Pack segment " << path << " ends with an incomplete record at offset " << offset << '.');
+            break;
+        }
+
+        if(h.magic == DEAD_MAGIC) {
+            offset += record_size(std::string(), h.size) + h.name_len;
+            continue;
+        }
+
+        name.resize(h.name_len);
+        if(!read_file(fd, &name[0], h.name_len, offset + sizeof(h))) {
+            break;
+        }
+
+        file_meta meta;
+        meta.size = h.size;
+        meta.mtime_ns = h.mtime_ns;
+        meta.inode = st.st_ino;
+        meta.pack = pack;
+        meta.offset = offset + sizeof(h) + h.name_len;
+        meta.hashed = true;
+        std::memcpy(meta.hash, h.hash, sizeof(meta.hash));
+
+        std::uint64_t end = meta.offset + h.size;
+        if(end + VERIFY_TAIL > size) {
+            data.resize(h.size);
+            unsigned char hash[blake3_hasher::OUT_LEN];
+            blake3_hasher hasher;
+            if(!read_file(fd, data.data(), h.size, meta.offset)) {
+                break;
+            }
+            hasher.update(data.data(), h.size);
+            hasher.finalize(hash);
+            if(std::memcmp(hash, h.hash, sizeof(hash)) != 0) {
+                LOG_WARN("Pack segment " << path << " ends with an incomplete record at offset " << offset << '.');
+                break;
+            }
+        }
+
+        f(name, meta);
+        offset = end;
+    }
+    close(fd);
+}
+
+std::vector<std::pair<std::uint32_t, std::uint64_t>> pack_store::sealed() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<std::pair<std::uint32_t, std::uint64_t>> result;
+    for(auto& s : segments_) {
+        if(s.first != active_) {
+            result.push_back(s);
+        }
+    }
+    return result;
+}
+
+void pack_store::remove(std::uint32_t pack) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = segments_.find(pack);
+    if(it == segments_.end() || pack == active_) {
+        return;
+    }
+
+    std::string path = dir_ + '/' + std::to_string(pack);
+    if(unlink(path.c_str()) != 0) {
+        LOG_WARN("Couldn't delete pack segment " << path << " (errno " << errno << ").");
+        return;
+    }
+    reclaimed_.add(it->second);
+    bytes_.add(-(std::int64_t)it->second);
+    segments_.erase(it);
+    segment_count_.set(segments_.size());
+}
@@ -0,0 +1,142 @@
+/* ========================================================================
+   $File: pending_file.cpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/14 $
+   $Description: $ Atomically published uploads
+   $Revisions: $
+   ======================================================================== */
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#include <server/pending_file.h>
+#include <server/storage_layout.h>
+
+pending_file::pending_file(std::string const& path) : path_(path), fd_(-1), committed_(false) {
+    std::size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+
+    fd_ = open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0644);
+    if(fd_ < 0) {
+        // Not every filesystem (or kernel) has O_TMPFILE; a hidden name does the same job,
+        // except that a crash leaves it behind
+        fd_ = create_temp();
+    }
+    if(fd_ < 0) {
+        throw std::system_error(errno, std::system_category(), "create " + path);
+    }
+}
+
+pending_file::~pending_file() {
+    if(!committed_ && !temp_path_.empty()) {
+        unlink(temp_path_.c_str());
+    }
+    if(fd_ >= 0) {
+        close(fd_);
+    }
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: pending_file::commit $
+   $ Prototype: bool pending_file::commit() { $
+   $ Params: $
+   $ Description:  $
+   $    Gives the file its name. An O_TMPFILE is linked straight to path if
+   $    nothing's there; otherwise it's linked to a temporary name first and
+   $    renamed over the old version, since linkat won't replace a file.
+   ======================================================================== */
+bool pending_file::commit() {
+    if(temp_path_.empty()) {
+        // linkat(fd, "", ..., AT_EMPTY_PATH) would need CAP_DAC_READ_SEARCH; this doesn't
+        std::string proc_path = "/proc/self/fd/" + std::to_string(fd_);
+        if(linkat(AT_FDCWD, proc_path.c_str(), AT_FDCWD, path_.c_str(), AT_SYMLINK_FOLLOW) == 0) {
+            committed_ = true;
+            return true;
+        }
+        if(errno != EEXIST) {
+            return false;
+        }
+
+        // Pick a free temporary name the same way create_temp does, but by linking rather than creating
+        for(;;) {
+            temp_path_ = temp_name(path_);
+            if(linkat(AT_FDCWD, proc_path.c_str(), AT_FDCWD, temp_path_.c_str(), AT_SYMLINK_FOLLOW) == 0) {
+                break;
+            }
+            if(errno != EEXIST) {
+                temp_path_.clear();
+                return false;
+            }
+        }
+    }
+
+    if(std::rename(temp_path_.c_str(), path_.c_str()) != 0) {
+        return false;
+    }
+    committed_ = true;
+    return true;
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: pending_file::link $
+   $ Prototype: bool pending_file::link(std::string const& existing, std::string const& path) { $
+   $ Params:
+   $    existing: A file to give another name $
+   $    path: The new name
+   $ Description:  $
+   $    Like commit, but for a file that's already stored somewhere: links
+   $    it straight to path if that's free, otherwise to a temporary name
+   $    that's then renamed over path.
+   ======================================================================== */
+bool pending_file::link(std::string const& existing, std::string const& path) {
+    if(::link(existing.c_str(), path.c_str()) == 0) {
+        return true;
+    }
+    if(errno != EEXIST) {
+        return false;
+    }
+
+    std::string temp;
+    for(;;) {
+        temp = temp_name(path);
+        if(::link(existing.c_str(), temp.c_str()) == 0) {
+            break;
+        }
+        if(errno != EEXIST) {
+            return false;
+        }
+    }
+    if(std::rename(temp.c_str(), path.c_str()) != 0) {
+        int err = errno;
+        unlink(temp.c_str());
+        errno = err;
+        return false;
+    }
+    return true;
+}
+
+std::string pending_file::temp_name(std::string const& path) {
+    static std::atomic<unsigned> next(0);
+
+    std::size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+    return dir + storage_layout::TEMP_PREFIX + std::to_string(getpid()) + '.' + std::to_string(next++);
+}
+
+int pending_file::create_temp() {
+    for(;;) {
+        temp_path_ = temp_name(path_);
+        int fd = open(temp_path_.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if(fd >= 0 || errno != EEXIST) {
+            if(fd < 0) {
+                temp_path_.clear();
+            }
+            return fd;
+        }
+    }
+}
@@ -0,0 +1,251 @@
+/* ========================================================================
+   $File: persistent_index.cpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/11 $
+   $Description: $ Memory-mapped on-disk file metadata index
+   $Revisions: $
+   ======================================================================== */
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <util/log.hpp>
+#include <server/persistent_index.h>
+
+static const std::uint64_t MAGIC = 0x3158444e49454c46ull; // "FLEINDX1"
+static const std::uint32_t VERSION = 3;
+
+struct persistent_index::header {
+    std::uint64_t magic;
+    std::uint32_t version;
+    std::uint32_t bucket_size;      // sizeof(bucket), as a sanity check
+    std::uint64_t bucket_count;     // A power of two
+    std::uint64_t count;
+    std::uint64_t names_offset;
+    std::uint64_t names_size;
+    std::uint64_t reserved[2];
+};
+
+struct persistent_index::bucket {
+    std::uint64_t hash;             // name_hash() of the name, or 0 if the bucket is empty
+    std::uint64_t name_offset;      // Relative to the start of the names
+    std::uint32_t name_len;
+    std::uint32_t flags;
+    std::uint64_t size;
+    std::int64_t mtime_ns;
+    std::uint64_t inode;
+    std::uint64_t offset;
+    std::uint32_t pack;
+    std::uint32_t reserved;
+    unsigned char content_hash[32];
+};
+
+// Bucket flags
+static const std::uint32_t HASHED = 1;
+static const std::uint32_t SHARDED = 2;
+
+persistent_index::persistent_index()
+        : map_(nullptr), map_size_(0), buckets_(nullptr), bucket_mask_(0), names_(nullptr), names_size_(0), count_(0) {}
+
+persistent_index::~persistent_index() {
+    if(map_) {
+        munmap(map_, map_size_);
+    }
+}
+
+// FNV-1a, never 0 so that 0 can mark empty buckets; std::hash isn't stable across builds
+std::uint64_t persistent_index::name_hash(const char* name, std::size_t len) {
+    std::uint64_t h = 0xcbf29ce484222325ull;
+    for(std::size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)name[i];
+        h *= 0x100000001b3ull;
+    }
+    return h ? h : 1;
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: persistent_index::open $
+   $ Prototype: std::unique_ptr<persistent_index> persistent_index::open(std::string const& path) { $
+   $ Params:
+   $    path: The index file $
+   $ Description:  $
+   $    Maps the file read-only after checking that the header agrees with
+   $    the file's size. Lookups bounds-check names, so a corrupt body can't
+   $    make them read outside the mapping.
+   ======================================================================== */
+std::unique_ptr<persistent_index> persistent_index::open(std::string const& path) {
+    std::unique_ptr<persistent_index> index;
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        if(errno != ENOENT) {
+            LOG_WARN("Couldn't open file index " << path << " (errno " << errno << ").");
+        }
+        return index;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (std::size_t)st.st_size < sizeof(header)) {
+        LOG_WARN("File index " << path << " is truncated; ignoring it.");
+        close(fd);
+        return index;
+    }
+
+    void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        LOG_WARN("Couldn't map file index " << path << " (errno " << errno << ").");
+        return index;
+    }
+
+    index.reset(new persistent_index());
+    index->map_ = map;
+    index->map_size_ = st.st_size;
+
+    header const* h = (header const*)map;
+    std::uint64_t buckets_end = sizeof(header) + h->bucket_count * sizeof(bucket);
+    if(h->magic != MAGIC || h->version != VERSION || h->bucket_size != sizeof(bucket) ||
+       h->bucket_count == 0 || (h->bucket_count & (h->bucket_count - 1)) != 0 ||
+       h->bucket_count > (std::uint64_t)st.st_size / sizeof(bucket) ||
+       h->names_offset < buckets_end || h->names_offset + h->names_size != (std::uint64_t)st.st_size) {
+        LOG_WARN("File index " << path << " is corrupt or from another version; ignoring it.");
+        index.reset();
+        return index;
+    }
+
+    index->buckets_ = (bucket const*)((const char*)map + sizeof(header));
+    index->bucket_mask_ = h->bucket_count - 1;
+    index->names_ = (const char*)map + h->names_offset;
+    index->names_size_ = h->names_size;
+    index->count_ = h->count;
+    return index;
+}
+
+bool persistent_index::lookup(std::string const& name, file_meta* meta) const {
+    if(!buckets_) {
+        return false;
+    }
+
+    std::uint64_t h = name_hash(name.data(), name.size());
+    for(std::uint64_t i = h & bucket_mask_, probes = 0; probes <= bucket_mask_; i = (i + 1) & bucket_mask_, ++probes) {
+        bucket const& b = buckets_[i];
+        if(b.hash == 0) {
+            return false;
+        }
+        if(b.hash == h && b.name_len == name.size() && b.name_offset <= names_size_ &&
+           b.name_len <= names_size_ - b.name_offset && std::memcmp(names_ + b.name_offset, name.data(), b.name_len) == 0) {
+            if(meta) {
+                meta->size = b.size;
+                meta->mtime_ns = b.mtime_ns;
+                meta->inode = b.inode;
+                meta->pack = b.pack;
+                meta->offset = b.offset;
+                meta->sharded = (b.flags & SHARDED) != 0;
+                meta->hashed = (b.flags & HASHED) != 0;
+                std::memcpy(meta->hash, b.content_hash, sizeof(meta->hash));
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+void persistent_index::for_each(std::function<void(std::string const&, file_meta const&)> const& f) const {
+    if(!buckets_) {
+        return;
+    }
+
+    std::string name;
+    file_meta meta;
+    for(std::uint64_t i = 0; i <= bucket_mask_; ++i) {
+        bucket const& b = buckets_[i];
+        if(b.hash == 0 || b.name_offset > names_size_ || b.name_len > names_size_ - b.name_offset) {
+            continue;
+        }
+        name.assign(names_ + b.name_offset, b.name_len);
+        meta.size = b.size;
+        meta.mtime_ns = b.mtime_ns;
+        meta.inode = b.inode;
+        meta.pack = b.pack;
+        meta.offset = b.offset;
+        meta.sharded = (b.flags & SHARDED) != 0;
+        meta.hashed = (b.flags & HASHED) != 0;
+        std::memcpy(meta.hash, b.content_hash, sizeof(meta.hash));
+        f(name, meta);
+    }
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: persistent_index::write $
+   $ Prototype: bool persistent_index::write(std::string const& path, std::vector<std::pair<std::string, file_meta>> const& files) { $
+   $ Params:
+   $    path: Where to write the index $
+   $    files: The names and metadata to store (names must be unique)
+   $ Description:  $
+   $    Builds the table at a load factor of at most 1/2 in a temporary
+   $    file, syncs it and renames it over path, so a crash leaves either
+   $    the old index or the new one.
+   ======================================================================== */
+bool persistent_index::write(std::string const& path, std::vector<std::pair<std::string, file_meta>> const& files) {
+    std::uint64_t bucket_count = 16;
+    while(bucket_count < files.size() * 2) {
+        bucket_count <<= 1;
+    }
+
+    std::vector<bucket> buckets(bucket_count);
+    std::memset(buckets.data(), 0, buckets.size() * sizeof(bucket));
+    std::string names;
+    for(auto& f : files) {
+        std::uint64_t h = name_hash(f.first.data(), f.first.size());
+        std::uint64_t i = h & (bucket_count - 1);
+        while(buckets[i].hash != 0) {
+            i = (i + 1) & (bucket_count - 1);
+        }
+
+        bucket& b = buckets[i];
+        b.hash = h;
+        b.name_offset = names.size();
+        b.name_len = (std::uint32_t)f.first.size();
+        b.flags = (f.second.hashed ? HASHED : 0) | (f.second.sharded ? SHARDED : 0);
+        b.size = f.second.size;
+        b.mtime_ns = f.second.mtime_ns;
+        b.inode = f.second.inode;
+        b.pack = f.second.pack;
+        b.offset = f.second.offset;
+        std::memcpy(b.content_hash, f.second.hash, sizeof(b.content_hash));
+        names += f.first;
+    }
+
+    header h;
+    std::memset(&h, 0, sizeof(h));
+    h.magic = MAGIC;
+    h.version = VERSION;
+    h.bucket_size = sizeof(bucket);
+    h.bucket_count = bucket_count;
+    h.count = files.size();
+    h.names_offset = sizeof(header) + bucket_count * sizeof(bucket);
+    h.names_size = names.size();
+
+    std::string tmp = path + ".tmp";
+    FILE* out = std::fopen(tmp.c_str(), "wb");
+    if(!out) {
+        LOG_ERROR("Couldn't create " << tmp << " (errno " << errno << ").");
+        return false;
+    }
+    bool ok = std::fwrite(&h, sizeof(h), 1, out) == 1 &&
+              std::fwrite(buckets.data(), sizeof(bucket), buckets.size(), out) == buckets.size() &&
+              std::fwrite(names.data(), 1, names.size(), out) == names.size() &&
+              std::fflush(out) == 0 && fsync(fileno(out)) == 0;
+    ok = std::fclose(out) == 0 && ok;
+    if(!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+        LOG_ERROR("Couldn't write file index " << path << " (errno " << errno << ").");
+        std::remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,211 @@
+/* ========================================================================
+   $File: read_coalescer.cpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/15 $
+   $Description: $ Shared sequential reads for concurrent GETs of one file
+   $Revisions: $
+   ======================================================================== */
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <util/file_transfer.hpp>
+#include <util/page_cache.hpp>
+#include <server/read_coalescer.h>
+
+// How far ahead of the current read the kernel is asked to fetch a big file
+static const std::uint64_t READAHEAD_BYTES = 4 * 1024 * 1024;
+
+read_coalescer::read_coalescer(std::size_t chunk_size, std::uint64_t retain)
+        : chunk_size_(chunk_size), retain_(retain),
+          disk_chunks_(metrics::instance().get_counter("server_get_chunks_total", "source=\"disk\"",
+                                                       "Chunks sent for GETs, by whether the session read them or shared another's read.")),
+          shared_chunks_(metrics::instance().get_counter("server_get_chunks_total", "source=\"shared\"",
+                                                         "Chunks sent for GETs, by whether the session read them or shared another's read.")),
+          active_(metrics::instance().get_gauge("server_get_flights", "", "Files currently being read for GETs.")) {}
+
+std::unique_ptr<read_coalescer::stream> read_coalescer::join(std::string const& name, open_file_cache::ptr const& file) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    std::shared_ptr<flight>* found = flights_.find(name);
+    std::shared_ptr<flight> f;
+    if(found && (*found)->file->meta.same_version(file->meta)) {
+        f = *found;
+    } else {
+        // A new version replaces the entry; anyone still reading the old one keeps their flight
+        f.reset(new flight());
+        f->name = name;
+        f->file = file;
+        f->chunks.resize((file->meta.size + chunk_size_ - 1) / chunk_size_);
+        f->read_upto = 0;
+        f->dropped_upto = 0;
+        f->held_bytes = 0;
+        f->reading = false;
+        f->failed = false;
+        f->readers = 0;
+        flights_[name] = f;
+        active_.set(flights_.size());
+    }
+    return std::unique_ptr<stream>(new stream(*this, f));
+}
+
+// Reads one chunk, counting page cache hits against reader; null if it couldn't be read in full
+read_coalescer::chunk read_coalescer::read_chunk(flight& f, std::size_t index, stream& reader) {
+    std::uint64_t offset = (std::uint64_t)index * chunk_size_;
+    std::uint64_t file_size = f.file->meta.size;
+    std::size_t size = (std::size_t)std::min<std::uint64_t>(chunk_size_, file_size - offset);
+    std::shared_ptr<std::vector<char>> buf(new std::vector<char>(size));
+
+    // Packed files start part way into their segment
+    std::uint64_t base = f.file->meta.offset;
+
+    // Each time the reader crosses into a new window, start fetching the one after it
+    if(offset % READAHEAD_BYTES == 0 && offset + READAHEAD_BYTES < file_size) {
+        read_ahead(f.file->fd, base + offset + READAHEAD_BYTES, READAHEAD_BYTES);
+    }
+
+    scoped_timer t(transfer_metrics::get().disk_read);
+    for(std::size_t done = 0; done < size;) {
+        ssize_t n = pread_counted(f.file->fd, buf->data() + done, size - done, base + offset + done,
+                                  reader.hit_bytes_, reader.miss_bytes_);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        } else if(n <= 0) {
+            LOG_ERROR("Error while reading file " << f.name);
+            return chunk();
+        }
+        done += n;
+    }
+    disk_chunks_.add();
+    return buf;
+}
+
+void read_coalescer::leave(stream& s) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::lock_guard<std::mutex> flight_lock(s.flight_->mutex);
+
+    if(--s.flight_->readers == 0) {
+        std::shared_ptr<flight>* found = flights_.find(s.flight_->name);
+        if(found && *found == s.flight_) {
+            flights_.erase(s.flight_->name);
+            active_.set(flights_.size());
+        }
+    }
+}
+
+read_coalescer::stream::stream(read_coalescer& owner, std::shared_ptr<flight> const& f)
+        : owner_(owner), flight_(f), next_(0), hit_bytes_(0), miss_bytes_(0) {
+    std::lock_guard<std::mutex> lock(f->mutex);
+    ++f->readers;
+}
+
+read_coalescer::stream::~stream() {
+    owner_.leave(*this);
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: read_coalescer::stream::next $
+   $ Prototype: read_coalescer::chunk read_coalescer::stream::next() { $
+   $ Params: $
+   $ Description:  $
+   $    Takes the next chunk from memory if someone has read it. Otherwise,
+   $    if no one is reading it right now, reads it (without holding the
+   $    lock) and hands it to everyone waiting for it; if someone is, waits
+   $    for them. Chunks dropped to keep the flight's memory bounded are
+   $    read again privately. Once the flight holds more than the retain
+   $    limit, the oldest chunks are dropped.
+   ======================================================================== */
+read_coalescer::chunk read_coalescer::stream::next() {
+    flight& f = *flight_;
+    std::unique_lock<std::mutex> lock(f.mutex);
+    std::size_t index = next_;
+
+    chunk c;
+    for(;;) {
+        if(index < f.read_upto) {
+            c = f.chunks[index];
+            if(c) {
+                owner_.shared_chunks_.add();
+            } else {
+                lock.unlock();
+                c = owner_.read_chunk(f, index, *this);
+                lock.lock();
+            }
+            break;
+        }
+        if(f.failed) {
+            return chunk();
+        }
+        if(!f.reading) {
+            f.reading = true;
+            lock.unlock();
+            c = owner_.read_chunk(f, index, *this);
+            lock.lock();
+
+            f.reading = false;
+            if(c) {
+                f.chunks[index] = c;
+                f.held_bytes += c->size();
+                ++f.read_upto;
+            } else {
+                f.failed = true;
+            }
+            f.chunk_read.notify_all();
+            break;
+        }
+        f.chunk_read.wait(lock);
+    }
+    if(!c) {
+        return c;
+    }
+
+    ++next_;
+    for(; f.held_bytes > owner_.retain_ && f.dropped_upto < f.read_upto; ++f.dropped_upto) {
+        if(f.chunks[f.dropped_upto]) {
+            f.held_bytes -= f.chunks[f.dropped_upto]->size();
+            f.chunks[f.dropped_upto].reset();
+        }
+    }
+    return c;
+}
+
+bool read_coalescer::stream::send(net_interface& iface) {
+    transfer_metrics& m = transfer_metrics::get();
+    std::uint64_t chunk_count = flight_->chunks.size();
+
+    TRACE_SPAN(span, "send_file", "transfer");
+    span.arg("bytes", flight_->file->meta.size);
+
+    while(next_ < chunk_count) {
+        chunk c = next();
+        if(!c) {
+            return false;
+        }
+
+        try {
+            scoped_timer t(m.net_send);
+            iface.send(const_cast<char*>(c->data()), c->size());
+        } catch(net_interface::error& e) {
+            LOG_ERROR("Network error while sending file: " << e.what());
+            return false;
+        }
+        m.bytes_sent.add(c->size());
+    }
+    span.arg("page_cache_hit_bytes", hit_bytes_);
+    span.arg("page_cache_miss_bytes", miss_bytes_);
+    return true;
+}
+
+bool read_coalescer::stream::copy_to(char* out) const {
+    std::lock_guard<std::mutex> lock(flight_->mutex);
+    for(auto& c : flight_->chunks) {
+        if(!c) {
+            return false;
+        }
+        std::memcpy(out, c->data(), c->size());
+        out += c->size();
+    }
+    return true;
+}
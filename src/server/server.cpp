@@ -6,11 +6,31 @@
    $Description: $ Server program
    $Revisions: $
    ======================================================================== */
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
 #include <stdexcept>
-#include <iostream>
+#include <system_error>
+#include <thread>
+#include <cstring>
+#include <unordered_map>
+#include <unordered_set>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <util/blake3.hpp>
+#include <util/delta.hpp>
+#include <util/fastcdc.hpp>
+#include <sstream>
+#include <util/log.hpp>
+#include <util/trace.hpp>
 #include <util/file_transfer.hpp>
+#include <util/integrity.hpp>
 #include <util/packet.hpp>
 #include <server/server.h>
+#include <server/pending_file.h>
+#include <server/storage_layout.h>
 #include <util/ports.h>
 #include <util/boost_net_interface.hpp>
 
@@ -18,168 +38,1939 @@ namespace fs = boost::filesystem;
 using namespace boost::asio::ip;
 using namespace boost;
 
+// The saved file index (storage_layout::is_reserved keeps it from being treated as a stored file)
+static const char INDEX_FILE[] = ".file_index";
+
+// ...and likewise the chunk index
+static const char CHUNK_INDEX_FILE[] = ".chunk_index";
+
+// How many file descriptors the server keeps open for GETs
+static const std::size_t OPEN_FILE_CACHE_SIZE = 1024;
+
+// How much of a file concurrent GETs keep in memory for each other
+static const std::uint64_t FLIGHT_RETAIN_BYTES = 16 * 1024 * 1024;
+
+// Pack segments are sealed at about this size, and checked for dead space this often
+static const std::uint64_t PACK_SEGMENT_SIZE = 64 * 1024 * 1024;
+static const std::chrono::seconds COMPACT_INTERVAL(30);
+
+// A dictionary is trained from up to DICTIONARY_MAX_SAMPLES small files once there are
+// DICTIONARY_MIN_SAMPLES of them, and retrained whenever their number doubles
+static const std::size_t DICTIONARY_MIN_SAMPLES = 32;
+static const std::size_t DICTIONARY_MAX_SAMPLES = 1000;
+
+// Whether name is one of the server's own files, which are neither indexed nor writable by clients
+static bool is_reserved_name(std::string const& name) {
+    return storage_layout::is_reserved(name);
+}
+
+// Fills in the size and mtime of a regular file; returns false if it doesn't exist or isn't one
+static bool stat_file(fs::path const& path, file_meta& meta) {
+    struct stat st;
+    if(stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+    meta.size = st.st_size;
+    meta.mtime_ns = (std::int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    meta.inode = st.st_ino;
+    meta.hashed = false;
+    return true;
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: server() $
+   $ Prototype: server(asio::io_service& service, std::string& storage_path, server_options const& opts) $
+   $ Params: 
+   $    name: Server constructor $
+   $    opts: Whether to listen, which layout to store files in, etc. $
+   $ Description:  $
+   ======================================================================== */
+server::server(asio::io_service& service, std::string& storage_path, server_options const& opts):
+        service_(service), storage_path_(storage_path), opts_(opts), index_path_((fs::path(storage_path) / INDEX_FILE).string()),
+        closing_(false), open_files_(storage_path, OPEN_FILE_CACHE_SIZE),
+        contents_(opts.cache_bytes, opts.cache_max_file), reads_(FILE_READ_SIZE, FLIGHT_RETAIN_BYTES),
+        syncs_(storage_path), packs_(storage_path, PACK_SEGMENT_SIZE), acceptor_(service), stopping_(false),
+        get_metrics_("get"), send_metrics_("send"), stats_metrics_("stats"),
+        data_channel_setup_(metrics::instance().get_histogram("server_data_channel_setup_seconds", "",
+                                                              "Time taken to resolve and connect to a client's data port.")),
+        sessions_(metrics::instance().get_counter("server_sessions_total", "", "Control connections accepted.")),
+        active_sessions_gauge_(metrics::instance().get_gauge("server_active_sessions", "", "Clients currently connected.")),
+        active_sessions_(0),
+        indexed_files_(metrics::instance().get_gauge("server_indexed_files", "", "Files in the storage directory index.")),
+        offers_accepted_(metrics::instance().get_counter("server_offers_total", "result=\"accepted\"",
+                                                         "Uploads offered by hash, by whether the contents were already stored.")),
+        offers_declined_(metrics::instance().get_counter("server_offers_total", "result=\"declined\"",
+                                                         "Uploads offered by hash, by whether the contents were already stored.")),
+        deduped_bytes_(metrics::instance().get_counter("server_deduplicated_bytes_total", "",
+                                                       "Bytes of uploads stored as links to contents that were already there.")),
+        chunks_((fs::path(storage_path) / CHUNK_INDEX_FILE).string()),
+        reused_chunk_bytes_(metrics::instance().get_counter("server_chunk_bytes_total", "source=\"reused\"",
+                                                            "Bytes of chunked uploads, by whether they were copied from stored files or sent.")),
+        received_chunk_bytes_(metrics::instance().get_counter("server_chunk_bytes_total", "source=\"received\"",
+                                                              "Bytes of chunked uploads, by whether they were copied from stored files or sent.")),
+        delta_copied_bytes_(metrics::instance().get_counter("server_delta_bytes_total", "source=\"copied\"",
+                                                            "Bytes of uploads sent as deltas, by whether they were copied from the old version or sent.")),
+        delta_literal_bytes_(metrics::instance().get_counter("server_delta_bytes_total", "source=\"literal\"",
+                                                             "Bytes of uploads sent as deltas, by whether they were copied from the old version or sent.")),
+        stored_raw_bytes_(metrics::instance().get_counter("server_stored_compressed_bytes_total", "size=\"raw\"",
+                                                          "Uploads stored compressed, by their size and their size on disk.")),
+        stored_compressed_bytes_(metrics::instance().get_counter("server_stored_compressed_bytes_total", "size=\"stored\"",
+                                                                 "Uploads stored compressed, by their size and their size on disk.")),
+        stored_frames_passed_bytes_(metrics::instance().get_counter("server_stored_frames_passed_bytes_total", "",
+                                                                    "Bytes of compressed files sent to GETs as they were stored.")),
+        dictionary_samples_(0),
+        dictionary_version_(metrics::instance().get_gauge("server_dictionary_version", "",
+                                                          "The latest version of the shared compression dictionary (0 if none).")) {
+    // Make sure the path is a directory
+    if(!fs::is_directory(storage_path)) {
+        throw std::invalid_argument("storage path isn't a directory");
+    }
+    
+    // Make sure that we can read/write from/to the directory
+    if(!dir_is_read_write(storage_path)) {
+        throw std::invalid_argument("can't read from and/or write to directory");
+    }
+
+    // Start watching before looking at the directory so that nothing that happens in between is missed
+    try {
+        watcher_.reset(new dir_watcher(storage_path,
+            [this](std::vector<file_index::change> const& changes) { on_directory_changes(changes); },
+            [this] { rescan(); },
+            storage_layout::is_shard_dir));
+    } catch(std::system_error& e) {
+        LOG_WARN("Can't watch " << storage_path << " (" << e.what() << "); files added or removed by other processes won't be noticed.");
+    }
+
+    // With a saved index we can serve straight away and check it against the directory in the
+    // background; otherwise list the directory now and leave only the hashing for later
+    bool synced = false;
+    if(files_.load(index_path_)) {
+        LOG_INFO("Loaded file index " << index_path_ << '.');
+    }
+    if(!files_.size() || !watcher_) {
+        sync_index();
+        replay_packs();
+        synced = true;
+    }
+    indexed_files_.set(files_.size());
+
+    load_dictionaries();
+
+    // Chunks of files that have changed since they were recorded are no use
+    chunks_.load([this](std::string const& name, file_meta const& recorded) {
+        file_meta meta;
+        return files_.lookup(name, &meta) && meta.same_version(recorded);
+    });
+
+    if(watcher_) {
+        watcher_->start([this, synced] {
+            if(!synced) {
+                sync_index();
+                replay_packs();
+            }
+            std::vector<std::string> unhashed;
+            files_.for_each([&unhashed](std::string const& name, file_meta const& meta) {
+                if(!meta.hashed) {
+                    unhashed.push_back(name);
+                }
+            });
+            hash_files(unhashed);
+            save_index();
+        });
+    }
+
+    if(opts_.listen) {
+        // Initialise the acceptor
+        tcp::endpoint endpoint(tcp::v4(), CONTROL_PORT);
+        acceptor_.open(endpoint.protocol());
+        acceptor_.set_option(tcp::acceptor::reuse_address(true));
+        acceptor_.bind(endpoint);
+        acceptor_.listen();
+    }
+
+    // Started last, since a thread that's still running would stop the constructor from throwing
+    if(opts_.pack_max_file || !packs_.sealed().empty() || opts_.dedup || opts_.compression
+       || fs::exists(storage_path_ / storage_layout::OBJECT_DIR)) {
+        compactor_ = std::thread(&server::run_compactor, this);
+    }
+}
+
+server::~server() {
+    // Stop the watcher and compactor first since their threads use the index
+    {
+        std::lock_guard<std::mutex> lock(compactor_mutex_);
+        closing_ = true;
+    }
+    compactor_wake_.notify_all();
+    if(compactor_.joinable()) {
+        compactor_.join();
+    }
+    watcher_.reset();
+    if(files_.overlay_size()) {
+        save_index();
+    }
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: server::rescan $
+   $ Prototype: void server::rescan() { $
+   $ Params: $
+   $ Description:  $
+   $    Brings the file index up to date with the storage directory after
+   $    the watcher lost track of it, then hashes anything new and saves it.
+   ======================================================================== */
+void server::rescan() {
+    sync_index();
+    replay_packs();
+
+    std::vector<std::string> unhashed;
+    files_.for_each([&unhashed](std::string const& name, file_meta const& meta) {
+        if(!meta.hashed) {
+            unhashed.push_back(name);
+        }
+    });
+    hash_files(unhashed);
+    save_index();
+}
+
+fs::path server::physical_path(std::string const& name, bool sharded) const {
+    return storage_path_ / storage_layout::relative_path(name, sharded);
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: server::locate $
+   $ Prototype: bool server::locate(std::string const& name, file_meta& meta) const { $
+   $ Params:
+   $    name: The file to look for $
+   $    meta: Receives the file's metadata and placement
+   $ Description:  $
+   $    Finds a stored file in either layout. If it's in both (it was
+   $    uploaded again while a migration was moving it), the copy in the
+   $    layout new uploads go to is the newer one.
+   ======================================================================== */
+bool server::locate(std::string const& name, file_meta& meta) const {
+    for(bool sharded : {opts_.sharded, !opts_.sharded}) {
+        if(stat_file(physical_path(name, sharded), meta)) {
+            meta.sharded = sharded;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: server::sync_index $
+   $ Prototype: void server::sync_index() { $
+   $ Params: $
+   $ Description:  $
+   $    Stats every file in the storage directory and its shard directories,
+   $    adding the ones that are new or have changed to the index, then
+   $    removes index entries for files that no longer exist. Changes are
+   $    applied in batches so that they show up while a big directory is
+   $    still being scanned.
+   ======================================================================== */
+void server::sync_index() {
+    static const std::size_t BATCH = 4096;
+
+    std::unordered_map<std::string, file_meta> seen;
+    std::vector<file_index::change> batch;
+    auto found = [&](std::string const& relative, fs::path const& path) {
+        std::string name;
+        bool sharded;
+        file_meta meta;
+        if(!storage_layout::parse(relative, name, sharded) || is_reserved_name(name) || !stat_file(path, meta)) {
+            return;
+        }
+        meta.sharded = sharded;
+
+        // If it's in both layouts, the one new uploads go to has the newer copy
+        auto it = seen.find(name);
+        if(it != seen.end() && it->second.sharded == opts_.sharded) {
+            return;
+        }
+        seen[name] = meta;
+
+        file_meta known;
+        bool indexed = files_.lookup(name, &known);
+        if(!indexed || !known.same_version(meta) || known.sharded != meta.sharded) {
+            batch.push_back(file_index::change{file_index::change::ADD, name, meta});
+            forget_cached(name);
+            if(indexed && known.pack) {
+                packs_.retire(name, known);
+            }
+        }
+        if(batch.size() >= BATCH) {
+            files_.apply(batch);
+            batch.clear();
+        }
+    };
+
+    // Files are either at the top level or three directories down, in .shards/xx/yy
+    std::function<void(fs::path const&, std::string const&)> walk = [&](fs::path const& dir, std::string const& relative) {
+        for(fs::directory_iterator it(dir); it != fs::directory_iterator() && !closing_; ++it) {
+            std::string child = relative.empty() ? it->path().filename().string()
+                                                 : relative + '/' + it->path().filename().string();
+            if(!storage_layout::is_shard_dir(child)) {
+                found(child, it->path());
+            } else if(fs::is_directory(it->status())) {
+                walk(it->path(), child);
+            }
+        }
+    };
+    walk(storage_path_, "");
+    if(closing_) {
+        return;
+    }
+
+    // Packed files aren't in the directory listing
+    files_.for_each([&](std::string const& name, file_meta const& meta) {
+        if(!meta.pack && seen.find(name) == seen.end()) {
+            batch.push_back(file_index::change{file_index::change::REMOVE, name, file_meta()});
+            forget_cached(name);
+        }
+    });
+    files_.apply(batch);
+    indexed_files_.set(files_.size());
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: server::hash_files $
+   $ Prototype: void server::hash_files(std::vector<std::string> const& names) { $
+   $ Params:
+   $    names: The files to hash $
+   $ Description:  $
+   $    Hashes each file and records the hash, unless the file's size or
+   $    mtime changed while it was being read (its new version will be
+   $    hashed when the watcher reports it).
+   ======================================================================== */
+void server::hash_files(std::vector<std::string> const& names) {
+    std::vector<char> buf(64 * 1024);
+    for(auto& name : names) {
+        if(closing_) {
+            return;
+        }
+
+        // Packed files are hashed as they're uploaded
+        file_meta known;
+        if(!files_.lookup(name, &known) || known.pack) {
+            continue;
+        }
+        fs::path path = physical_path(name, known.sharded);
+        file_meta before;
+        if(!stat_file(path, before) || (known.hashed && known.same_version(before))) {
+            continue;
+        }
+
+        // A file stored compressed is hashed by its contents
+        blake3_hasher hasher;
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd < 0) {
+            continue;
+        }
+        open_file_cache::handle file(fd, before, stored_frames::open(fd, before.size));
+        bool ok = true;
+        for(std::uint64_t off = 0; ok && off < file.size(); off += buf.size()) {
+            std::uint64_t n = std::min<std::uint64_t>(buf.size(), file.size() - off);
+            ok = file.read(buf.data(), n, off);
+            hasher.update(buf.data(), n);
+        }
+
+        file_meta after;
+        if(!ok || !stat_file(path, after) || !after.same_version(before)) {
+            continue;
+        }
+        after.sharded = known.sharded;
+        after.hashed = true;
+        hasher.finalize(after.hash);
+        files_.add(name, after);
+    }
+}
+
+void server::forget_cached(std::string const& name) {
+    open_files_.invalidate(name);
+    contents_.invalidate(name);
+}
+
+void server::save_index() {
+    if(!files_.save(index_path_)) {
+        LOG_WARN("Couldn't save the file index; the next startup will have to rebuild it.");
+    }
+}
+
+// Whether packed version a is newer than b. A compaction copy keeps its original's mtime, so the
+// later of two records with the same mtime is the copy.
+static bool newer_record(file_meta const& a, file_meta const& b) {
+    if(a.mtime_ns != b.mtime_ns) {
+        return a.mtime_ns > b.mtime_ns;
+    }
+    return a.pack != b.pack ? a.pack > b.pack : a.offset > b.offset;
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: server::replay_packs $
+   $ Prototype: void server::replay_packs() { $
+   $ Params: $
+   $ Description:  $
+   $    Finds the newest record of each name in the pack segments and
+   $    points the index at it, unless the index already has something
+   $    newer: a later record, or a file of its own that was stored after
+   $    the record was written. A file of its own that the record replaced
+   $    is deleted. This is how uploads packed since the index was last
+   $    saved are recovered after a crash.
+   ======================================================================== */
+void server::replay_packs() {
+    std::unordered_map<std::string, file_meta> latest;
+    packs_.replay([&latest](std::string const& name, file_meta const& meta) {
+        auto it = latest.find(name);
+        if(it == latest.end()) {
+            latest.emplace(name, meta);
+        } else if(newer_record(meta, it->second)) {
+            it->second = meta;
+        }
+    });
+
+    std::vector<file_index::change> batch;
+    for(auto& r : latest) {
+        file_meta known;
+        if(files_.lookup(r.first, &known)) {
+            if(known.pack ? !newer_record(r.second, known) : known.mtime_ns >= r.second.mtime_ns) {
+                continue;
+            }
+            if(!known.pack) {
+                std::remove(physical_path(r.first, known.sharded).c_str());
+            }
+        }
+        batch.push_back(file_index::change{file_index::change::ADD, r.first, r.second});
+        forget_cached(r.first);
+    }
+    files_.apply(batch);
+    indexed_files_.set(files_.size());
+}
+
+void server::run_compactor() {
+    std::unique_lock<std::mutex> lock(compactor_mutex_);
+    while(!closing_) {
+        compactor_wake_.wait_for(lock, COMPACT_INTERVAL);
+        if(closing_) {
+            break;
+        }
+        lock.unlock();
+        compact_packs();
+        collect_objects();
+        if(opts_.compression) {
+            retrain_dictionary();
+        }
+        lock.lock();
+    }
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: server::compact_packs $
+   $ Prototype: void server::compact_packs() { $
+   $ Params: $
+   $ Description:  $
+   $    Adds up how much of each sealed segment the index still points at.
+   $    Segments with nothing live left are deleted (after saving the index,
+   $    so that the saved one never points into a missing segment). In
+   $    segments that are at least half dead, the live files are appended
+   $    again to the active segment and the index is pointed at the copies,
+   $    unless a file was replaced meanwhile; the emptied segments are then
+   $    deleted by the next pass, by which time any GET that looked one of
+   $    them up before it moved has long since opened it.
+   ======================================================================== */
+void server::compact_packs() {
+    auto sealed = packs_.sealed();
+    if(sealed.empty()) {
+        return;
+    }
+
+    std::unordered_map<std::uint32_t, std::uint64_t> live;
+    files_.for_each([&live](std::string const& name, file_meta const& meta) {
+        if(meta.pack) {
+            live[meta.pack] += pack_store::record_size(name, meta.size);
+        }
+    });
+
+    std::vector<std::uint32_t> empty;
+    std::unordered_set<std::uint32_t> victims;
+    for(auto& seg : sealed) {
+        std::uint64_t used = live.count(seg.first) ? live[seg.first] : 0;
+        if(used == 0) {
+            empty.push_back(seg.first);
+        } else if(used * 2 <= seg.second) {
+            victims.insert(seg.first);
+        }
+    }
+
+    if(!empty.empty()) {
+        save_index();
+        for(std::uint32_t pack : empty) {
+            packs_.remove(pack);
+        }
+    }
+    if(victims.empty()) {
+        return;
+    }
+
+    std::vector<std::pair<std::string, file_meta>> moving;
+    files_.for_each([&](std::string const& name, file_meta const& meta) {
+        if(meta.pack && victims.count(meta.pack)) {
+            moving.emplace_back(name, meta);
+        }
+    });
+    std::sort(moving.begin(), moving.end(), [](std::pair<std::string, file_meta> const& a, std::pair<std::string, file_meta> const& b) {
+        return a.second.pack != b.second.pack ? a.second.pack < b.second.pack : a.second.offset < b.second.offset;
+    });
+
+    std::vector<char> buf;
+    int fd = -1;
+    std::uint32_t open_pack = 0;
+    std::size_t moved = 0;
+    for(auto& m : moving) {
+        if(closing_) {
+            break;
+        }
+        if(m.second.pack != open_pack) {
+            if(fd >= 0) {
+                close(fd);
+            }
+            open_pack = m.second.pack;
+            fd = open((storage_path_ / storage_layout::pack_path(open_pack)).c_str(), O_RDONLY | O_CLOEXEC);
+        }
+        buf.resize(m.second.size);
+        if(fd < 0 || !read_file(fd, buf.data(), m.second.size, m.second.offset)) {
+            continue;
+        }
+
+        file_meta copy = m.second;
+        packs_.append(m.first, buf.data(), copy, false, [&](file_meta const& stored) {
+            file_meta current;
+            if(files_.lookup(m.first, &current) && current.same_version(m.second)) {
+                files_.add(m.first, stored);
+                forget_cached(m.first);
+                packs_.retire(m.first, m.second);
+                ++moved;
+            }
+        });
+    }
+    if(fd >= 0) {
+        close(fd);
+    }
+
+    // The old copies go on the next pass; these have to be on disk by then
+    packs_.sync();
+    LOG_INFO("Compacted " << victims.size() << " pack segment(s), moving " << moved << " file(s).");
+}
+
+void server::collect_objects() {
+    static counter& collected_bytes = metrics::instance().get_counter("server_objects_collected_bytes_total", "",
+                                                                      "Bytes of content objects deleted once nothing linked to them.");
+
+    // An object whose only link is its own isn't any stored file's contents any more
+    std::size_t collected = 0;
+    boost::system::error_code ec;
+    fs::path root = storage_path_ / storage_layout::OBJECT_DIR;
+    for(fs::directory_iterator dir(root, ec); !ec && dir != fs::directory_iterator() && !closing_; dir.increment(ec)) {
+        boost::system::error_code dir_ec;
+        for(fs::directory_iterator it(dir->path(), dir_ec); !dir_ec && it != fs::directory_iterator(); it.increment(dir_ec)) {
+            struct stat st;
+            if(lstat(it->path().c_str(), &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink == 1 && unlink(it->path().c_str()) == 0) {
+                collected_bytes.add(st.st_size);
+                ++collected;
+            }
+        }
+    }
+    if(collected) {
+        LOG_INFO("Deleted " << collected << " content object(s) that nothing links to.");
+    }
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: server::on_directory_changes $
+   $ Prototype: void server::on_directory_changes(std::vector<file_index::change> const& changes) { $
+   $ Params:
+   $    changes: Files that appeared in or disappeared from the storage directory or its shards $
+   $ Description:  $
+   $    Looks up where each changed file is now, updates the index, then
+   $    hashes the new files. Saves the index once enough changes have
+   $    built up.
+   ======================================================================== */
+void server::on_directory_changes(std::vector<file_index::change> const& changes) {
+    static const std::size_t SAVE_AFTER = 64 * 1024;
+
+    // Whatever the event was, the index should end up saying what's on disk now. That also
+    // copes with a file moving between layouts, whatever order its events arrive in.
+    std::unordered_set<std::string> done;
+    std::vector<file_index::change> batch;
+    std::vector<std::string> added;
+    for(auto& c : changes) {
+        std::string name;
+        bool sharded;
+        if(!storage_layout::parse(c.name, name, sharded) || is_reserved_name(name) || !done.insert(name).second) {
+            continue;
+        }
+
+        file_meta meta;
+        file_meta known;
+        bool indexed = files_.lookup(name, &known);
+        if(!locate(name, meta)) {
+            // A packed file has no file of its own to disappear (the one that did was its old version)
+            if(indexed && !known.pack) {
+                batch.push_back(file_index::change{file_index::change::REMOVE, name, file_meta()});
+                forget_cached(name);
+            }
+            continue;
+        }
+        if(indexed && known.same_version(meta) && known.sharded == meta.sharded) {
+            continue;
+        }
+
+        // Let go of the old version now rather than when it's next requested
+        forget_cached(name);
+        if(indexed && known.pack) {
+            packs_.retire(name, known);
+        }
+        if(indexed && known.same_version(meta)) {
+            // Only moved, so the hash still holds
+            meta.hashed = known.hashed;
+            std::memcpy(meta.hash, known.hash, sizeof(meta.hash));
+        } else {
+            added.push_back(name);
+        }
+        batch.push_back(file_index::change{file_index::change::ADD, name, meta});
+    }
+
+    files_.apply(batch);
+    indexed_files_.set(files_.size());
+    hash_files(added);
+
+    if(files_.overlay_size() >= SAVE_AFTER) {
+        save_index();
+    }
+}
+
+server::request_metrics::request_metrics(const char* op)
+        : requests(metrics::instance().get_counter("server_requests_total", std::string("op=\"") + op + '"', "Requests handled.")),
+          errors(metrics::instance().get_counter("server_request_errors_total", std::string("op=\"") + op + '"', "Requests that failed.")),
+          duration(metrics::instance().get_histogram("server_request_duration_seconds", std::string("op=\"") + op + '"',
+                                                     "Time taken to handle a request from start to finish.")) {}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: connect_to_data_channel $
+   $ Prototype: void server::connect_to_data_channel(const boost::asio::ip::tcp::socket& control_socket, boost::asio::ip::tcp::socket& out) { $
+   $ Params: 
+   $    control_socket: control socket $
+   $    out: data channel socket
+   $ Description:  $ allows for the secondary contorl socket to connect
+   ======================================================================== */
+void server::connect_to_data_channel(const boost::asio::ip::tcp::socket& control_socket, boost::asio::ip::tcp::socket& out) {
+        scoped_timer t(data_channel_setup_);
+        TRACE_SPAN(span, "data_channel_setup", "request");
+
+        // Connect to the client's data port (7006)
+        std::ostringstream oss;
+        oss << DATA_PORT;
+
+        tcp::endpoint remote_end = control_socket.remote_endpoint();
+        std::string address = remote_end.address().to_string();
+
+        // Open a connection on port 7006 to the client to send off the file
+        tcp::resolver resolver{service_};
+        tcp::resolver::query query{remote_end.address().to_string(), oss.str()};
+        tcp::resolver::iterator endpoint_iterator;
+        {
+            TRACE_SPAN(resolve_span, "resolve", "request");
+            endpoint_iterator = resolver.resolve(query);
+        }
+        
+        TRACE_SPAN(connect_span, "connect", "request");
+        asio::connect(out, endpoint_iterator);
+        LOG_INFO("Connected to client on data channel (port " << DATA_PORT << ").");
+}
+
+// Makes the directory's entries (e.g. a file just linked into it) durable
+static bool sync_dir(fs::path const& dir) {
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0) {
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: server::load_dictionaries $
+   $ Prototype: void server::load_dictionaries() { $
+   $ Params:
+   $ Description:  $
+   $    Reads every saved version of the compression dictionary, so that the
+   $    latest is offered to clients and data compressed against older ones
+   $    can still be read. A version that was being written when the server
+   $    stopped is still named .tmp and is ignored.
+   ======================================================================== */
+void server::load_dictionaries() {
+    boost::system::error_code ec;
+    fs::path root = storage_path_ / storage_layout::DICTIONARY_DIR;
+    for(fs::directory_iterator it(root, ec); !ec && it != fs::directory_iterator(); it.increment(ec)) {
+        std::string name = it->path().filename().string();
+        char* end;
+        unsigned long version = std::strtoul(name.c_str(), &end, 10);
+        if(!version || *end) {
+            continue;
+        }
+        std::ifstream in(it->path().c_str(), std::ios::binary);
+        std::vector<char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        if(in.bad() || data.empty()) {
+            LOG_WARN("Couldn't read compression dictionary " << it->path().c_str() << '.');
+            continue;
+        }
+        dictionaries_.add(std::make_shared<dictionary const>(version, data));
+    }
+
+    if(std::shared_ptr<dictionary const> latest = dictionaries_.latest()) {
+        LOG_INFO("Loaded compression dictionaries up to version " << latest->version << '.');
+        dictionary_version_.set(latest->version);
+    }
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: server::retrain_dictionary $
+   $ Prototype: void server::retrain_dictionary() { $
+   $ Params:
+   $ Description:  $
+   $    Trains a new version of the compression dictionary from an even
+   $    spread of the stored small files once there are enough of them and
+   $    twice as many as the last version was trained on. It's synced to
+   $    disk before it's offered to anyone, since data compressed against
+   $    it can only be read with it.
+   ======================================================================== */
+void server::retrain_dictionary() {
+    std::vector<std::pair<std::string, file_meta>> small;
+    files_.for_each([&small](std::string const& name, file_meta const& meta) {
+        if(meta.size && meta.size <= compressed_net_interface::DICTIONARY_FRAME_MAX) {
+            small.emplace_back(name, meta);
+        }
+    });
+
+    // A version that was there at startup was trained on what was there then, as far as anyone knows
+    std::shared_ptr<dictionary const> latest = dictionaries_.latest();
+    if(latest && !dictionary_samples_) {
+        dictionary_samples_ = small.size();
+    }
+    if(small.size() < DICTIONARY_MIN_SAMPLES || (latest && small.size() < 2 * dictionary_samples_)) {
+        return;
+    }
+
+    TRACE_SPAN(span, "train_dictionary", "maintenance");
+    std::vector<std::vector<char>> samples;
+    std::size_t stride = small.size() / DICTIONARY_MAX_SAMPLES + 1;
+    for(std::size_t i = 0; i < small.size() && !closing_; i += stride) {
+        open_file_cache::ptr file = open_files_.open(small[i].first, small[i].second);
+        if(!file || file->size() > compressed_net_interface::DICTIONARY_FRAME_MAX) {
+            continue;
+        }
+        std::vector<char> data(file->size());
+        if(file->read(data.data(), data.size(), 0)) {
+            samples.push_back(std::move(data));
+        }
+    }
+    span.arg("samples", samples.size());
+    std::vector<char> trained = train_dictionary(samples, DICTIONARY_SIZE);
+    dictionary_samples_ = small.size();
+    if(trained.empty()) {
+        return;
+    }
+
+    std::uint32_t version = latest ? latest->version + 1 : 1;
+    fs::path path = storage_path_ / storage_layout::dictionary_path(version);
+    std::string tmp = path.string() + ".tmp";
+    boost::system::error_code ec;
+    fs::create_directories(path.parent_path(), ec);
+    std::FILE* out = std::fopen(tmp.c_str(), "wb");
+    bool ok = out && std::fwrite(trained.data(), 1, trained.size(), out) == trained.size() && std::fflush(out) == 0
+              && fdatasync(fileno(out)) == 0;
+    if(out) {
+        std::fclose(out);
+    }
+    if(!ok || std::rename(tmp.c_str(), path.c_str()) != 0 || !sync_dir(path.parent_path())) {
+        LOG_ERROR("Couldn't save compression dictionary " << path.c_str() << " (errno " << errno << ").");
+        std::remove(tmp.c_str());
+        return;
+    }
+
+    dictionaries_.add(std::make_shared<dictionary const>(version, trained));
+    dictionary_version_.set(version);
+    LOG_INFO("Trained compression dictionary version " << version << " (" << trained.size() << " bytes) from "
+             << samples.size() << " small files.");
+}
+
+// Tells the client how its upload went; it may have hung up already
+static void reply_upload(net_interface& data, upload_status status) {
+    std::uint8_t b = status;
+    try {
+        data.send(&b, sizeof(b));
+    } catch(net_interface::error& e) {
+        LOG_WARN("Couldn't tell the client whether its file was stored: " << e.what());
+    }
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: server::handle_send_request $
+   $ Prototype: void server::handle_send_request(session& sess) { $
+   $ Params: 
+   $    sess: The client's control channel and data channel opener $
+   $ Description:  $ handles the send request from the client
+   ======================================================================== */
+void server::handle_send_request(session& sess) {
+    scoped_timer t(send_metrics_.duration);
+    send_metrics_.requests.add();
+
+    TRACE_SPAN(span, "SEND", "request");
+
+    send_packet s{sess.control};
+    span.arg("file", s.name);
+    span.arg("size", s.file_size);
+
+    LOG_INFO("Client is sending file " << s.name);
+
+    bool valid_name = !is_reserved_name(s.name) && !std::strchr(s.name, '/');
+    if(valid_name && opts_.pack_max_file && s.file_size <= opts_.pack_max_file) {
+        handle_packed_send(sess, s.name, s.file_size);
+        return;
+    }
+
+    // The upload stays invisible until it's complete, so GETs meanwhile get the old version
+    fs::path file_path = physical_path(s.name, opts_.sharded);
+    std::unique_ptr<pending_file> file;
+    if(valid_name) {
+        TRACE_SPAN(open_span, "open_file", "request");
+        boost::system::error_code ec;
+        fs::create_directories(file_path.parent_path(), ec);
+        try {
+            file.reset(new pending_file(file_path.string()));
+        } catch(std::system_error& e) {
+            LOG_ERROR(e.what());
+        }
+    }
+    if(!file) {
+        std::string err("Couldn't open file for writing.");
+        error_packet ep{err};
+        ep.send(sess.control);
+        LOG_ERROR(err);
+        send_metrics_.errors.add();
+        return;
+    }
+
+    std::unique_ptr<net_interface> data_interface;
+    try {
+        data_interface = sess.open_data_channel();
+    } catch(std::exception& e) {
+        LOG_ERROR("Error while initiating connection to client on data port.");
+        send_metrics_.errors.add();
+        return;
+    }
+
+    // Big uploads are mostly backups that no one reads soon, so unless told otherwise they're
+    // written back and dropped from the page cache as they arrive rather than evicting the files
+    // GETs are reading. One that's going to be compressed is read again straight away, though.
+    blake3_hasher hasher;
+    std::unique_ptr<write_behind> behind;
+    if(!opts_.keep_uploads_cached && opts_.at_rest == CODEC_NONE && s.file_size >= write_behind::WINDOW) {
+        behind.reset(new write_behind(file->fd()));
+    }
+    std::unique_ptr<compressed_net_interface> compressed = compress_channel(sess, *data_interface);
+    sparse_net_interface body(compressed ? *compressed : *data_interface);
+    checked_net_interface checked(body);
+    if(!receive_file(file->fd(), s.file_size, checked, &hasher, behind.get())) {
+        LOG_INFO("File was not stored.");
+        send_metrics_.errors.add();
+        refuse_checked_transfer(*data_interface);
+        return;
+    }
+
+    // Blocks that arrived corrupt are written again over the bad ones, and the file is hashed again
+    bool repaired = false;
+    auto store = [&](std::uint64_t off, char const* data, std::size_t n) {
+        repaired = true;
+        return write_file(file->fd(), data, n, off);
+    };
+    if(!finish_checked_receive(checked, body, *data_interface, store)) {
+        LOG_INFO("File was not stored.");
+        send_metrics_.errors.add();
+        return;
+    }
+    if(behind) {
+        behind->finish(s.file_size);
+    }
+
+    unsigned char hash[blake3_hasher::OUT_LEN];
+    if(repaired) {
+        hasher = blake3_hasher();
+        std::unique_ptr<char[]> block(new char[FILE_READ_SIZE]);
+        for(std::uint64_t off = 0; off < s.file_size; off += FILE_READ_SIZE) {
+            std::uint64_t n = std::min<std::uint64_t>(FILE_READ_SIZE, s.file_size - off);
+            if(!read_file(file->fd(), block.get(), n, off)) {
+                send_metrics_.errors.add();
+                reply_upload(*data_interface, UPLOAD_FAILED);
+                return;
+            }
+            hasher.update(block.get(), n);
+        }
+    }
+    hasher.finalize(hash);
+
+    // Nothing's published unless it's what the client had
+    if(!check_content_hash(*data_interface, hash, true)) {
+        LOG_INFO("File was not stored.");
+        send_metrics_.errors.add();
+        reply_upload(*data_interface, UPLOAD_FAILED);
+        return;
+    }
+    bool stored = store_upload(s.name, file_path, *file, hash);
+    if(stored) {
+        LOG_INFO("Successfully received file and stored at " << file_path.c_str() << '.');
+    } else {
+        send_metrics_.errors.add();
+    }
+    reply_upload(*data_interface, stored ? UPLOAD_STORED : UPLOAD_FAILED);
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: server::compress_stored $
+   $ Prototype: bool server::compress_stored(fs::path const& path, pending_file& file, std::unique_ptr<pending_file>& compressed) { $
+   $ Params:
+   $    path: Where the upload goes $
+   $    file: Its contents, complete $
+   $    compressed: Set to the compressed copy, if there's to be one
+   $ Description:  $
+   $    Compresses the upload into a pending file of its own for the same
+   $    path, which replaces it if it's smaller. An upload that would be
+   $    mistaken for a compressed file is stored compressed regardless,
+   $    even with compression at rest off (with lz4, then), since every
+   $    stored file is read back as compressed if it looks it.
+   ======================================================================== */
+bool server::compress_stored(fs::path const& path, pending_file& file, std::unique_ptr<pending_file>& compressed) {
+    struct stat st;
+    if(fstat(file.fd(), &st) != 0) {
+        LOG_ERROR("Couldn't stat the upload for " << path.c_str() << " (errno " << errno << ").");
+        return false;
+    } else if(st.st_size == 0) {
+        return true;
+    }
+    char head[4];
+    bool wrap = st.st_size >= (off_t)sizeof(head) && read_file(file.fd(), head, sizeof(head))
+                && stored_frames::must_wrap(head, sizeof(head));
+    if(opts_.at_rest == CODEC_NONE && !wrap) {
+        return true;
+    }
+    TRACE_SPAN(span, "compress_stored", "request");
+
+    // Only an upload that has to be wrapped fails to store if it can't be
+    codec c = opts_.at_rest == CODEC_NONE ? CODEC_LZ4 : opts_.at_rest;
+    std::unique_ptr<pending_file> copy;
+    std::uint64_t size = 0;
+    try {
+        copy.reset(new pending_file(path.string()));
+    } catch(std::system_error& e) {
+        LOG_ERROR(e.what());
+        return !wrap;
+    }
+    if(!stored_frames::write(file.fd(), st.st_size, copy->fd(), c, opts_.at_rest_level, size)) {
+        if(wrap) {
+            LOG_ERROR("Couldn't store " << path.c_str() << " in frames, which it has to be.");
+            return false;
+        }
+        LOG_WARN("Couldn't compress " << path.c_str() << "; storing it as it is.");
+        return true;
+    }
+    span.arg("stored", size);
+    if(size >= (std::uint64_t)st.st_size && !wrap) {
+        return true;
+    }
+    stored_raw_bytes_.add(st.st_size);
+    stored_compressed_bytes_.add(size);
+    compressed = std::move(copy);
+    return true;
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: server::store_upload $
+   $ Prototype: bool server::store_upload(std::string const& name, fs::path const& path, pending_file& file, unsigned char const* hash) { $
+   $ Params:
+   $    name: The uploaded file's name $
+   $    path: Where it goes $
+   $    file: Its contents, complete $
+   $    hash: Their BLAKE3 hash
+   $ Description:  $
+   $    Commits an upload that's been received in full (or a compressed
+   $    copy of it), shares its contents if deduplication is on and
+   $    publishes it. With durability::file the data has to be on disk
+   $    before the name can point at it.
+   ======================================================================== */
+bool server::store_upload(std::string const& name, fs::path const& path, pending_file& file, unsigned char const* hash) {
+    std::unique_ptr<pending_file> compressed;
+    if(!compress_stored(path, file, compressed)) {
+        return false;
+    }
+    pending_file& stored = compressed ? *compressed : file;
+
+    struct stat st;
+    bool data_synced = opts_.sync != durability::file || fdatasync(stored.fd()) == 0;
+    if(!data_synced || fstat(stored.fd(), &st) != 0 || !stored.commit()) {
+        LOG_ERROR("Couldn't store " << path.c_str() << " (errno " << errno << ").");
+        return false;
+    }
+    if(opts_.dedup) {
+        share_object(path, hash, st);
+    }
+    return publish_stored(name, path, st, hash);
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: server::publish_stored $
+   $ Prototype: bool server::publish_stored(std::string const& name, fs::path const& path, struct stat const& st, unsigned char const* hash) { $
+   $ Params:
+   $    name: The stored file's name $
+   $    path: Where it was stored $
+   $    st: Its stat $
+   $    hash: Its BLAKE3 hash
+   $ Description:  $
+   $    The watcher will see the new file too, but the client may ask for it
+   $    back before then, so it goes into the index straight away. A packed
+   $    version it replaced is marked dead so that a replay after a crash
+   $    doesn't bring it back. Only once it's as durable as it was asked to
+   $    be does this return, so that the client can be told.
+   ======================================================================== */
+bool server::publish_stored(std::string const& name, fs::path const& path, struct stat const& st, unsigned char const* hash) {
+    // Don't leave an older copy behind in the other layout
+    std::remove(physical_path(name, !opts_.sharded).c_str());
+    forget_cached(name);
+
+    file_meta meta;
+    meta.size = st.st_size;
+    meta.mtime_ns = (std::int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    meta.inode = st.st_ino;
+    meta.sharded = opts_.sharded;
+    meta.hashed = true;
+    std::memcpy(meta.hash, hash, sizeof(meta.hash));
+    file_meta replaced;
+    if(files_.lookup(name, &replaced) && replaced.pack) {
+        packs_.retire(name, replaced);
+    }
+    files_.add(name, meta);
+
+    bool durable = true;
+    if(opts_.sync == durability::file) {
+        TRACE_SPAN(sync_span, "sync_dir", "request");
+        durable = sync_dir(path.parent_path());
+    } else if(opts_.sync == durability::group) {
+        TRACE_SPAN(sync_span, "group_commit", "request");
+        durable = syncs_.wait();
+    }
+    if(!durable) {
+        LOG_ERROR("Couldn't make sure " << path.c_str() << " is on disk (errno " << errno << ").");
+    }
+    return durable;
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: server::share_object $
+   $ Prototype: void server::share_object(fs::path const& path, unsigned char const* hash, struct stat& st) { $
+   $ Params:
+   $    path: A file that's just been stored $
+   $    hash: Its BLAKE3 hash $
+   $    st: Its stat, updated if the file is replaced
+   $ Description:  $
+   $    Links the file in as its contents' object. If there's already an
+   $    object with those contents, the file is replaced by a link to it
+   $    instead and the upload's copy goes away with the last reference
+   $    to it. Failures just leave the file unshared.
+   ======================================================================== */
+void server::share_object(fs::path const& path, unsigned char const* hash, struct stat& st) {
+    fs::path object = storage_path_ / storage_layout::object_path(hash);
+    boost::system::error_code ec;
+    fs::create_directories(object.parent_path(), ec);
+    if(link(path.c_str(), object.c_str()) == 0 || errno != EEXIST) {
+        return;
+    }
+
+    struct stat existing;
+    if(stat(object.c_str(), &existing) != 0 || existing.st_size != st.st_size || existing.st_ino == st.st_ino) {
+        return;
+    }
+    if(pending_file::link(object.string(), path.string()) && stat(path.c_str(), &st) == 0) {
+        deduped_bytes_.add(st.st_size);
+    }
+}
+
+// The size of a stored file's contents, which for one stored compressed isn't its size on disk
+static std::uint64_t content_size(fs::path const& path, struct stat const& st) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return st.st_size;
+    }
+    file_meta meta;
+    meta.size = st.st_size;
+    open_file_cache::handle file(fd, meta, stored_frames::open(fd, meta.size));
+    return file.size();
+}
+
 /* ========================================================================
    $ FUNCTION
-   $ Name: server() $
-   $ Prototype: server(asio::io_service& service, std::string& storage_path): service_(service), storage_path_(storage_path), files_{}, acceptor_(service) { $
-   $ Params: 
-   $    name: Server constructor $
+   $ Name: server::handle_offer_request $
+   $ Prototype: void server::handle_offer_request(session& sess) { $
+   $ Params:
+   $    sess: The client's control channel and data channel opener $
    $ Description:  $
+   $    Answers an upload offered by size and hash. If deduplication is on
+   $    and an object with those contents exists, the name is linked to it
+   $    and the client is told it's stored; otherwise it's told to SEND the
+   $    file as usual, or to send a delta if there's an older version.
    ======================================================================== */
-server::server(asio::io_service& service, std::string& storage_path):
-        service_(service), storage_path_(storage_path), files_{}, acceptor_(service) {
-    // Make sure the path is a directory
-    if(!fs::is_directory(storage_path)) {
-        throw std::invalid_argument("storage path isn't a directory");
+void server::handle_offer_request(session& sess) {
+    scoped_timer t(send_metrics_.duration);
+    send_metrics_.requests.add();
+
+    TRACE_SPAN(span, "OFFER", "request");
+
+    offer_packet o{sess.control};
+    std::string name(o.name, strnlen(o.name, o.name_size));
+    span.arg("file", name);
+    span.arg("size", o.file_size);
+
+    upload_status status = UPLOAD_NEEDS_DATA;
+    fs::path object = storage_path_ / storage_layout::object_path(o.hash);
+    struct stat st;
+    if(opts_.dedup && !is_reserved_name(name) && name.find('/') == std::string::npos
+       && stat(object.c_str(), &st) == 0 && content_size(object, st) == o.file_size) {
+        fs::path file_path = physical_path(name, opts_.sharded);
+        boost::system::error_code ec;
+        fs::create_directories(file_path.parent_path(), ec);
+        if(pending_file::link(object.string(), file_path.string()) && stat(file_path.c_str(), &st) == 0) {
+            LOG_INFO("Stored " << name << " as a link to contents that were already there.");
+            deduped_bytes_.add(st.st_size);
+            status = publish_stored(name, file_path, st, o.hash) ? UPLOAD_STORED : UPLOAD_FAILED;
+        }
+        // If the object went away meanwhile, the client can still send the data
     }
-    
-    // Make sure that we can read/write from/to the directory
-    if(!dir_is_read_write(storage_path)) {
-        throw std::invalid_argument("can't read from and/or write to directory");
+
+    // A file that's being replaced (and won't be packed) can be sent as the differences from what's here
+    file_meta current;
+    if(status == UPLOAD_NEEDS_DATA && !is_reserved_name(name) && name.find('/') == std::string::npos
+       && files_.lookup(name, &current) && current.size && !(opts_.pack_max_file && o.file_size <= opts_.pack_max_file)) {
+        status = UPLOAD_NEEDS_DELTA;
+    }
+    (status == UPLOAD_NEEDS_DATA || status == UPLOAD_NEEDS_DELTA ? offers_declined_ : offers_accepted_).add();
+    if(status == UPLOAD_FAILED) {
+        send_metrics_.errors.add();
     }
 
-    fs::directory_iterator it(storage_path);
-    if(!fs::is_empty(storage_path)) {
-        for(; it != fs::directory_iterator(); ++it) {
-            fs::path p = it->path();
-            files_.emplace(p.filename().c_str());
+    std::uint8_t b = status;
+    try {
+        sess.control.send(&b, sizeof(b));
+    } catch(net_interface::error& e) {
+        LOG_WARN("Couldn't answer an offer: " << e.what());
+    }
+}
+
+// Copies size bytes between two files at the given offsets, in the kernel (or by sharing the
+// extents, on filesystems that can) where possible and through a buffer where not. The range
+// of to has to read as zeros to start with, since zeros are skipped when they're copied by hand.
+static bool copy_range(int from, std::uint64_t from_offset, int to, std::uint64_t to_offset, std::uint64_t size) {
+    loff_t in = from_offset, out = to_offset;
+    std::uint64_t done = 0;
+    while(done < size) {
+        ssize_t n = copy_file_range(from, &in, to, &out, size - done, 0);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        } else if(n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    if(done == size) {
+        return true;
+    }
+
+    std::vector<char> buf(std::min<std::uint64_t>(size - done, 1024 * 1024));
+    while(done < size) {
+        std::uint64_t n = std::min<std::uint64_t>(size - done, buf.size());
+        if(!read_file(from, buf.data(), n, from_offset + done) || !write_sparse(to, buf.data(), n, to_offset + done)) {
+            return false;
         }
+        done += n;
     }
+    return true;
+}
 
-    // Initialise the acceptor
-    tcp::endpoint endpoint(tcp::v4(), CONTROL_PORT);
-    acceptor_.open(endpoint.protocol());
-    acceptor_.set_option(tcp::acceptor::reuse_address(true));
-    acceptor_.bind(endpoint);
+// Copies size bytes of a stored file's contents, starting at offset, to a file at to_offset
+// (whose range reads as zeros, as for copy_range). Contents stored compressed have to be
+// decompressed on the way.
+static bool copy_contents(open_file_cache::handle const& from, std::uint64_t offset, int to, std::uint64_t to_offset,
+                          std::uint64_t size) {
+    if(!from.frames) {
+        return copy_range(from.fd, from.meta.offset + offset, to, to_offset, size);
+    }
+    std::vector<char> buf(std::min<std::uint64_t>(size, 1024 * 1024));
+    for(std::uint64_t done = 0; done < size; done += buf.size()) {
+        std::uint64_t n = std::min<std::uint64_t>(size - done, buf.size());
+        if(!from.read(buf.data(), n, offset + done) || !write_sparse(to, buf.data(), n, to_offset + done)) {
+            return false;
+        }
+    }
+    return true;
 }
 
 /* ========================================================================
    $ FUNCTION
-   $ Name: connect_to_data_channel $
-   $ Prototype: void server::connect_to_data_channel(const boost::asio::ip::tcp::socket& control_socket, boost::asio::ip::tcp::socket& out) { $
-   $ Params: 
-   $    control_socket: control socket $
-   $    out: data channel socket
-   $ Description:  $ allows for the secondary contorl socket to connect
+   $ Name: server::handle_chunks_request $
+   $ Prototype: void server::handle_chunks_request(session& sess) { $
+   $ Params:
+   $    sess: The client's control channel and data channel opener $
+   $ Description:  $
+   $    Stores a file that the client described as a list of chunks. The
+   $    ones chunks_ knows where to find are copied from the stored files
+   $    that have them, runs of neighbours at a time, and the client is
+   $    asked for the rest, which are checked against their hashes as they
+   $    arrive. The whole file's hash is worked out from the assembled file,
+   $    since the client's word for it can't be taken when it's used to
+   $    share contents between files.
    ======================================================================== */
-void server::connect_to_data_channel(const boost::asio::ip::tcp::socket& control_socket, boost::asio::ip::tcp::socket& out) {
-        // Connect to the client's data port (7006)
-        std::ostringstream oss;
-        oss << DATA_PORT;
+void server::handle_chunks_request(session& sess) {
+    scoped_timer t(send_metrics_.duration);
+    send_metrics_.requests.add();
 
-        tcp::endpoint remote_end = control_socket.remote_endpoint();
-        std::string address = remote_end.address().to_string();
+    TRACE_SPAN(span, "CHUNKS", "request");
 
-        // Open a connection on port 7006 to the client to send off the file
-        tcp::resolver resolver{service_};
-        tcp::resolver::query query{remote_end.address().to_string(), oss.str()};
-        auto endpoint_iterator = resolver.resolve(query);
-        
-        asio::connect(out, endpoint_iterator);
-        std::cout << "Connected to client on data channel (port " << DATA_PORT << ")." << std::endl;
+    // A list longer than the file could have been cut into isn't read, and since the rest of it is
+    // still on the control channel, the client is dropped
+    chunks_packet c{sess.control, (std::uint32_t)fastcdc::MIN_SIZE};
+    if(!c.complete) {
+        error_packet ep{"Too many chunks for the file's size."};
+        ep.send(sess.control);
+        send_metrics_.errors.add();
+        throw net_interface::error("A client listed " + std::to_string(c.chunk_count) + " chunks for a file of "
+                                   + std::to_string(c.file_size) + " bytes", net_interface::error_code::other);
+    }
+    std::string name(c.name, strnlen(c.name, c.name_size));
+    span.arg("file", name);
+    span.arg("size", c.file_size);
+    span.arg("chunks", c.chunk_count);
+
+    LOG_INFO("Client is sending file " << name << " as " << c.chunk_count << " chunks");
+
+    // The chunks have to add up to the file, and none can be bigger than the chunker makes them
+    bool valid = !is_reserved_name(name) && name.find('/') == std::string::npos;
+    std::vector<std::uint64_t> offsets(c.chunk_count);
+    std::uint64_t total = 0;
+    for(std::uint32_t i = 0; i < c.chunk_count; ++i) {
+        valid = valid && c.chunks[i].size && c.chunks[i].size <= fastcdc::MAX_SIZE;
+        offsets[i] = total;
+        total += c.chunks[i].size;
+    }
+    valid = valid && total == c.file_size;
+
+    fs::path file_path = physical_path(name, opts_.sharded);
+    std::unique_ptr<pending_file> file;
+    if(valid) {
+        boost::system::error_code ec;
+        fs::create_directories(file_path.parent_path(), ec);
+        try {
+            file.reset(new pending_file(file_path.string()));
+        } catch(std::system_error& e) {
+            LOG_ERROR(e.what());
+        }
+    }
+    if(!file || ftruncate(file->fd(), c.file_size) != 0) {
+        std::string err("Couldn't open file for writing.");
+        error_packet ep{err};
+        ep.send(sess.control);
+        LOG_ERROR(err);
+        send_metrics_.errors.add();
+        return;
+    }
+
+    // Copy what's already here. A run is a series of chunks that follow each other in
+    // both the same stored file and the upload; if it can't be copied, it's asked for.
+    std::vector<std::uint32_t> wanted;
+    std::uint64_t reused = 0;
+    {
+        TRACE_SPAN(reuse_span, "reuse_chunks", "request");
+        open_file_cache::ptr run;
+        std::uint32_t run_first = 0, run_end = 0;
+        std::uint64_t run_from = 0;
+        auto copy_run = [&] {
+            std::uint64_t size = offsets[run_end - 1] + c.chunks[run_end - 1].size - offsets[run_first];
+            if(copy_contents(*run, run_from, file->fd(), offsets[run_first], size)) {
+                reused += size;
+            } else {
+                for(std::uint32_t j = run_first; j < run_end; ++j) {
+                    wanted.push_back(j);
+                }
+            }
+            run.reset();
+        };
+
+        for(std::uint32_t i = 0; i < c.chunk_count; ++i) {
+            chunk_index::location loc;
+            file_meta current;
+            open_file_cache::ptr src;
+            if(chunks_.find(c.chunks[i], loc) && files_.lookup(loc.name, &current) && current.same_version(loc.meta)) {
+                src = open_files_.open(loc.name, current);
+            }
+            if(!src) {
+                wanted.push_back(i);
+                continue;
+            }
+
+            std::uint64_t from = loc.offset;
+            if(run && (run != src || run_end != i
+                       || run_from + (offsets[i] - offsets[run_first]) != from)) {
+                copy_run();
+            }
+            if(!run) {
+                run = src;
+                run_first = i;
+                run_from = from;
+            }
+            run_end = i + 1;
+        }
+        if(run) {
+            copy_run();
+        }
+        std::sort(wanted.begin(), wanted.end());
+        reuse_span.arg("bytes", reused);
+    }
+    reused_chunk_bytes_.add(reused);
+    span.arg("wanted", wanted.size());
+
+    want_packet w{wanted};
+    if(!w.send(sess.control)) {
+        send_metrics_.errors.add();
+        return;
+    }
+
+    std::unique_ptr<net_interface> data_interface;
+    try {
+        data_interface = sess.open_data_channel();
+    } catch(std::exception& e) {
+        LOG_ERROR("Error while initiating connection to client on data port.");
+        send_metrics_.errors.add();
+        return;
+    }
+
+    std::unique_ptr<compressed_net_interface> compressed = compress_channel(sess, *data_interface);
+    sparse_net_interface body(compressed ? *compressed : *data_interface);
+    std::unique_ptr<char[]> buf(new char[fastcdc::MAX_SIZE]);
+    for(std::uint32_t i : wanted) {
+        chunk_ref const& chunk = c.chunks[i];
+        blake3_hasher hasher;
+        unsigned char hash[blake3_hasher::OUT_LEN];
+        bool ok = receive_memory(buf.get(), chunk.size, body, &hasher);
+        if(ok) {
+            hasher.finalize(hash);
+            ok = std::memcmp(hash, chunk.hash, sizeof(hash)) == 0;
+            if(!ok) {
+                LOG_ERROR("Chunk " << i << " of " << name << " doesn't match its hash.");
+            }
+        }
+        if(!ok || !write_sparse(file->fd(), buf.get(), chunk.size, offsets[i])) {
+            LOG_INFO("File was not stored.");
+            send_metrics_.errors.add();
+            reply_upload(*data_interface, UPLOAD_FAILED);
+            return;
+        }
+        received_chunk_bytes_.add(chunk.size);
+    }
+
+    unsigned char hash[blake3_hasher::OUT_LEN];
+    {
+        TRACE_SPAN(hash_span, "hash_file", "request");
+        blake3_hasher hasher;
+        std::unique_ptr<char[]> block(new char[FILE_READ_SIZE]);
+        bool ok = true;
+        for(std::uint64_t off = 0; ok && off < c.file_size; off += FILE_READ_SIZE) {
+            std::uint64_t n = std::min<std::uint64_t>(FILE_READ_SIZE, c.file_size - off);
+            ok = read_file(file->fd(), block.get(), n, off);
+            hasher.update(block.get(), n);
+        }
+        if(!ok) {
+            send_metrics_.errors.add();
+            reply_upload(*data_interface, UPLOAD_FAILED);
+            return;
+        }
+        hasher.finalize(hash);
+    }
+    if(!check_content_hash(*data_interface, hash, true)) {
+        LOG_INFO("File was not stored.");
+        send_metrics_.errors.add();
+        reply_upload(*data_interface, UPLOAD_FAILED);
+        return;
+    }
+
+    bool stored = store_upload(name, file_path, *file, hash);
+    file_meta meta;
+    if(stored && files_.lookup(name, &meta)) {
+        LOG_INFO("Stored " << file_path.c_str() << ", reusing " << reused << " of its " << c.file_size << " bytes.");
+        chunks_.add(name, meta, std::vector<chunk_ref>(c.chunks, c.chunks + c.chunk_count));
+    }
+    if(!stored) {
+        send_metrics_.errors.add();
+    }
+    reply_upload(*data_interface, stored ? UPLOAD_STORED : UPLOAD_FAILED);
 }
 
 /* ========================================================================
    $ FUNCTION
-   $ Name: server::handle_send_request $
-   $ Prototype: void server::handle_send_request(net_interface& control_interface) { $
-   $ Params: 
-   $    control_interface: The packet information$
-   $ Description:  $ handles the send request from the client
+   $ Name: server::handle_signatures_request $
+   $ Prototype: void server::handle_signatures_request(session& sess) { $
+   $ Params:
+   $    sess: The client's control channel and data channel opener $
+   $ Description:  $
+   $    Sends the block signatures of the stored version of a file, so that
+   $    the client can work out a delta from it, along with its size and
+   $    mtime to name that version by. There are no blocks if there's no
+   $    such file (or it can't be read).
+   ======================================================================== */
+void server::handle_signatures_request(session& sess) {
+    TRACE_SPAN(span, "SIGNATURES", "request");
+
+    // A request has no signatures of its own; one that claims some is refused unread, as for CHUNKS
+    signatures_packet request{sess.control, 0};
+    if(!request.complete) {
+        error_packet ep{"A request for signatures can't carry any."};
+        ep.send(sess.control);
+        throw net_interface::error("A client sent " + std::to_string(request.count) + " signatures with a request",
+                                   net_interface::error_code::other);
+    }
+    std::string name(request.name, strnlen(request.name, request.name_size));
+    span.arg("file", name);
+
+    file_meta meta;
+    open_file_cache::ptr base;
+    if(!is_reserved_name(name) && files_.lookup(name, &meta)) {
+        base = open_files_.open(name, meta);
+    }
+
+    // The version is named by its size as the client sees it, since that's what the delta's made from
+    std::vector<block_signature> sigs;
+    std::uint64_t size = base ? base->size() : meta.size;
+    std::uint32_t block_size = delta_block_size(size);
+    if(base) {
+        std::vector<char> buf(std::max<std::uint32_t>(block_size, 1024 * 1024) / block_size * block_size);
+        for(std::uint64_t off = 0; off < size; off += buf.size()) {
+            std::uint64_t n = std::min<std::uint64_t>(buf.size(), size - off);
+            if(!base->read(buf.data(), n, off)) {
+                sigs.clear();
+                break;
+            }
+            for(std::uint64_t b = 0; b < n; b += block_size) {
+                std::uint32_t len = std::min<std::uint64_t>(block_size, n - b);
+                block_signature sig;
+                rolling_checksum sum;
+                sum.reset((unsigned char const*)buf.data() + b, len);
+                sig.weak = sum.value();
+                delta_strong_hash(buf.data() + b, len, sig.strong);
+                sigs.push_back(sig);
+            }
+        }
+    }
+    span.arg("blocks", sigs.size());
+
+    signatures_packet reply{name, size, meta.mtime_ns, block_size, sigs};
+    reply.send(sess.control);
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: server::handle_delta_request $
+   $ Prototype: void server::handle_delta_request(session& sess) { $
+   $ Params:
+   $    sess: The client's control channel and data channel opener $
+   $ Description:  $
+   $    Rebuilds a file from the stored version the client's signatures
+   $    were of and the delta it sends on the data channel: literals are
+   $    written as they arrive and copies read from the old version, in
+   $    order, so the new version is hashed as it's put together and
+   $    checked against the hash the client gave before it's stored. If
+   $    the old version has changed since, the client is told to send the
+   $    whole file instead.
    ======================================================================== */
-void server::handle_send_request(net_interface& control_interface) {
-    send_packet s{control_interface};
-    fs::path file_path(storage_path_);
+void server::handle_delta_request(session& sess) {
+    scoped_timer t(send_metrics_.duration);
+    send_metrics_.requests.add();
+
+    TRACE_SPAN(span, "DELTA", "request");
+
+    delta_packet d{sess.control};
+    std::string name(d.name, strnlen(d.name, d.name_size));
+    span.arg("file", name);
+    span.arg("size", d.file_size);
+
+    LOG_INFO("Client is sending file " << name << " as a delta");
+
+    file_meta meta;
+    open_file_cache::ptr base;
+    if(!is_reserved_name(name) && name.find('/') == std::string::npos && files_.lookup(name, &meta)
+       && meta.mtime_ns == d.base_mtime_ns) {
+        base = open_files_.open(name, meta);
+        if(base && base->size() != d.base_size) {
+            base.reset();
+        }
+    }
 
-    std::cout << "Client is sending file " << s.name << std::endl;
+    fs::path file_path = physical_path(name, opts_.sharded);
+    std::unique_ptr<pending_file> file;
+    if(base) {
+        boost::system::error_code ec;
+        fs::create_directories(file_path.parent_path(), ec);
+        try {
+            file.reset(new pending_file(file_path.string()));
+        } catch(std::system_error& e) {
+            LOG_ERROR(e.what());
+        }
+    }
 
-    file_path /= s.name;
-    std::ofstream file(file_path.c_str());
+    std::uint8_t go_ahead = file ? UPLOAD_NEEDS_DATA : UPLOAD_FAILED;
+    try {
+        sess.control.send(&go_ahead, sizeof(go_ahead));
+    } catch(net_interface::error& e) {
+        LOG_WARN("Couldn't answer a delta: " << e.what());
+        return;
+    }
     if(!file) {
-        std::string err("Couldn't open file for writing.");
-        error_packet ep{err};
-        ep.send(control_interface);
-        std::cerr << err << std::endl;
+        LOG_INFO("The version the delta is from has changed; the client will send the whole file.");
         return;
     }
 
-    tcp::socket data_sock(service_);
+    std::unique_ptr<net_interface> data_interface;
     try {
-        connect_to_data_channel(((boost_net_interface*)&control_interface)->get_socket(), data_sock);
+        data_interface = sess.open_data_channel();
     } catch(std::exception& e) {
-        std::cerr << "Error while initiating connection to client on data port." << std::endl;
+        LOG_ERROR("Error while initiating connection to client on data port.");
+        send_metrics_.errors.add();
         return;
     }
 
-    boost_net_interface data_interface(data_sock);
+    std::uint32_t block_size = delta_block_size(d.base_size);
+    std::uint64_t blocks = (d.base_size + block_size - 1) / block_size;
+    std::uint64_t written = 0, copied = 0;
+    blake3_hasher hasher;
+    std::vector<char> buf(std::max<std::uint32_t>(DELTA_MAX_LITERAL, 1024 * 1024));
+    bool ok = true;
+    try {
+        for(;;) {
+            std::uint8_t op;
+            data_interface->receive(&op, sizeof(op));
+            if(op == DELTA_END) {
+                break;
+            } else if(op == DELTA_LITERAL) {
+                std::uint32_t size;
+                data_interface->receive(&size, sizeof(size));
+                ok = size <= DELTA_MAX_LITERAL && size <= d.file_size - written
+                     && receive_memory(buf.data(), size, *data_interface, &hasher)
+                     && write_file(file->fd(), buf.data(), size, written);
+                written += size;
+            } else if(op == DELTA_COPY) {
+                std::uint32_t range[2];
+                data_interface->receive(range, sizeof(range));
+                ok = range[0] < blocks && range[1] <= blocks - range[0];
+                std::uint64_t from = (std::uint64_t)range[0] * block_size;
+                std::uint64_t size = ok ? std::min<std::uint64_t>((std::uint64_t)range[1] * block_size, d.base_size - from) : 0;
+                ok = ok && size <= d.file_size - written;
+                for(std::uint64_t done = 0; ok && done < size; done += buf.size()) {
+                    std::uint64_t n = std::min<std::uint64_t>(buf.size(), size - done);
+                    ok = base->read(buf.data(), n, from + done)
+                         && write_file(file->fd(), buf.data(), n, written + done);
+                    hasher.update(buf.data(), n);
+                }
+                written += size;
+                copied += size;
+            } else {
+                ok = false;
+            }
+            if(!ok) {
+                break;
+            }
+        }
+    } catch(net_interface::error& e) {
+        LOG_ERROR("Network error while receiving delta: " << e.what());
+        ok = false;
+    }
+    delta_copied_bytes_.add(copied);
+    delta_literal_bytes_.add(written - copied);
+    span.arg("copied", copied);
 
-    if(!receive_file(file, s.file_size, data_interface)) {
-        file.close();
-        std::remove(file_path.c_str());
-        std::cout << "File was not stored." << std::endl;
+    unsigned char hash[blake3_hasher::OUT_LEN];
+    hasher.finalize(hash);
+    if(ok && (written != d.file_size || std::memcmp(hash, d.hash, sizeof(hash)) != 0)) {
+        LOG_ERROR("The file rebuilt from the delta for " << name << " isn't what the client has.");
+        ok = false;
+    }
+    ok = ok && store_upload(name, file_path, *file, hash);
+    if(ok) {
+        LOG_INFO("Stored " << file_path.c_str() << ", copying " << copied << " of its " << d.file_size
+                 << " bytes from the old version.");
     } else {
-        file.close();
-        std::cout << "Successfully received file and stored at " << file_path.c_str() << '.' << std::endl;
-        files_.emplace(s.name);
+        send_metrics_.errors.add();
+    }
+    reply_upload(*data_interface, ok ? UPLOAD_STORED : UPLOAD_FAILED);
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: server::handle_packed_send $
+   $ Prototype: void server::handle_packed_send(session& sess, std::string const& name, std::uint64_t size) { $
+   $ Params:
+   $    sess: The client's control channel and data channel opener $
+   $    name: The file being uploaded $
+   $    size: Its size, which is no more than opts_.pack_max_file
+   $ Description:  $
+   $    Receives a small upload into memory and appends it to the active
+   $    pack segment, publishing it in the index as part of the append. Any
+   $    file of its own that the name had is deleted afterwards, so GETs see
+   $    one version or the other throughout.
+   ======================================================================== */
+void server::handle_packed_send(session& sess, std::string const& name, std::uint64_t size) {
+    std::unique_ptr<net_interface> data_interface;
+    try {
+        data_interface = sess.open_data_channel();
+    } catch(std::exception& e) {
+        LOG_ERROR("Error while initiating connection to client on data port.");
+        send_metrics_.errors.add();
+        return;
+    }
+
+    std::unique_ptr<char[]> data(new char[size ? size : 1]);
+    blake3_hasher hasher;
+    std::unique_ptr<compressed_net_interface> compressed = compress_channel(sess, *data_interface);
+    sparse_net_interface body(compressed ? *compressed : *data_interface);
+    checked_net_interface checked(body);
+    if(!receive_memory(data.get(), size, checked, &hasher)) {
+        LOG_INFO("File was not stored.");
+        send_metrics_.errors.add();
+        refuse_checked_transfer(*data_interface);
+        return;
+    }
+    bool repaired = false;
+    auto store = [&](std::uint64_t off, char const* block, std::size_t n) {
+        repaired = true;
+        std::memcpy(data.get() + off, block, n);
+        return true;
+    };
+    if(!finish_checked_receive(checked, body, *data_interface, store)) {
+        LOG_INFO("File was not stored.");
+        send_metrics_.errors.add();
+        return;
+    }
+
+    file_meta meta;
+    meta.size = size;
+    meta.mtime_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::system_clock::now().time_since_epoch()).count();
+    if(repaired) {
+        hasher = blake3_hasher();
+        hasher.update(data.get(), size);
+    }
+    hasher.finalize(meta.hash);
+    if(!check_content_hash(*data_interface, meta.hash, true)) {
+        LOG_INFO("File was not stored.");
+        send_metrics_.errors.add();
+        reply_upload(*data_interface, UPLOAD_FAILED);
+        return;
+    }
+
+    bool stored;
+    {
+        TRACE_SPAN(pack_span, "pack_append", "request");
+        stored = packs_.append(name, data.get(), meta, opts_.sync == durability::file, [&](file_meta const& packed) {
+            files_.add(name, packed);
+            forget_cached(name);
+        });
+    }
+    if(!stored) {
+        send_metrics_.errors.add();
+        reply_upload(*data_interface, UPLOAD_FAILED);
+        return;
+    }
+    LOG_INFO("Successfully received file and packed it into segment " << meta.pack << '.');
+
+    for(bool sharded : {false, true}) {
+        std::remove(physical_path(name, sharded).c_str());
     }
+
+    bool durable = true;
+    if(opts_.sync == durability::group) {
+        TRACE_SPAN(sync_span, "group_commit", "request");
+        durable = syncs_.wait();
+    }
+    if(!durable) {
+        LOG_ERROR("Couldn't make sure " << name << " is on disk (errno " << errno << ").");
+        send_metrics_.errors.add();
+    }
+    reply_upload(*data_interface, durable ? UPLOAD_STORED : UPLOAD_FAILED);
 }
 
 /* ========================================================================
    $ FUNCTION
    $ Name: server::handle_get_request $
-   $ Prototype: void server::handle_get_request(net_interface& control_interface) { $
+   $ Prototype: void server::handle_get_request(session& sess) { $
    $ Params: 
-   $    control_interface:  $
+   $    sess: The client's control channel and data channel opener $
    $ Description:  $ 
    $       handles the get request from the client
    ======================================================================== */
-void server::handle_get_request(net_interface& control_interface) {
-    get_packet g{control_interface};
-    
-    auto it = files_.find(g.name);
+void server::handle_get_request(session& sess) {
+    scoped_timer t(get_metrics_.duration);
+    get_metrics_.requests.add();
+
+    TRACE_SPAN(span, "GET", "request");
+
+    get_packet g{sess.control};
+    span.arg("file", g.name);
     
-    std::cout << "Attempting to send file " << g.name << "..." << std::endl;
+    LOG_INFO("Attempting to send file " << g.name << "...");
+
+    // Check whether the file exists; if not, send back an error packet. A hot file is
+    // answered from the index and memory (or at least an open descriptor) without
+    // touching the file system.
+    file_meta meta;
+    content_cache::ptr cached;
+    open_file_cache::ptr file;
+    if(files_.lookup(g.name, &meta)) {
+        cached = contents_.get(g.name, meta);
+        if(!cached) {
+            TRACE_SPAN(open_span, "open_file", "request");
+            file = open_files_.open(g.name, meta);
+        }
+    }
 
-    // Check whether the file exists; if not, send back an error packet
-    if(it == files_.end()) {
+    if(!cached && !file) {
         std::ostringstream oss;
         oss << "Couldn't find file " << g.name << '.';
         error_packet e{oss.str()};
         
-        std::cout << oss.str() << std::endl;
+        LOG_INFO(oss.str());
+        get_metrics_.errors.add();
 
-        if(!e.send(control_interface)) {
-            std::cerr << "Transmission of error packet failed." << std::endl;
+        if(!e.send(sess.control)) {
+            LOG_ERROR("Transmission of error packet failed.");
         }
         
     } else {
         fs::path file_path(storage_path_);
         file_path /= g.name;
 
-        // Send back a send_packet so that the client knows we're sending the file
-        std::uint32_t size = fs::file_size(file_path);
+        // Send back a send_packet so that the client knows we're sending the file (or as much of
+        // the range it asked for as there is)
+        std::uint64_t total = cached ? cached->meta.size : file->size();
+        std::uint64_t offset = std::min(g.offset, total);
+        std::uint64_t size = std::min(g.length, total - offset);
+        bool whole = size == total;
         send_packet s{std::string(file_path.c_str()), size};
-        s.send(control_interface);
-        
-        std::ifstream file(file_path.c_str());
+        s.send(sess.control);
+        span.arg("size", size);
         
-        tcp::socket data_sock(service_);
+        std::unique_ptr<net_interface> data_interface;
         try {
-            connect_to_data_channel(((boost_net_interface*)&control_interface)->get_socket(), data_sock);
+            data_interface = sess.open_data_channel();
         } catch(std::exception& e) {
-            std::cerr << "Error while initiating connection to client on data port." << std::endl;
+            LOG_ERROR("Error while initiating connection to client on data port.");
+            get_metrics_.errors.add();
             return;
         }
 
-        boost_net_interface data_interface(data_sock);
+        // A miss shares its disk reads with anyone else sending the same version right now,
+        // and a small enough file is then offered to the cache. A file stored compressed is
+        // decompressed as it's sent, unless it can go as it is because the channel would
+        // have compressed it the same way, in which case so can the CRCs it was stored with.
+        std::unique_ptr<compressed_net_interface> compressed = compress_channel(sess, *data_interface);
+        sparse_net_interface body(compressed ? *compressed : *data_interface);
 
-        try {
-            send_file(file, data_interface);
-            std::cout << "Successfully sent file." << std::endl;
-        } catch(net_interface::error& e) {
-            std::cerr << "File was not sent successfully. Error: " << e.what() << std::endl;
+        // The client checks a whole file against the hash it was indexed with, or one worked out
+        // as it's sent if it hasn't been hashed yet or what's there is newer than the index knows
+        // (unless it's sent as stored frames)
+        blake3_hasher hasher;
+        bool indexed = meta.hashed && (cached ? cached->meta : file->meta).same_version(meta);
+        bool hashing = whole && !indexed;
+        checked_net_interface checked(body, hashing ? &hasher : nullptr);
+        std::vector<std::uint32_t> const* crcs = &checked.crcs();
+        bool sent;
+        if(cached) {
+            sent = send_memory(cached->data.get() + offset, size, checked);
+        } else if(file->frames && whole && compressed && file->frames->stored_codec() == sess.compression) {
+            // The frames go as one run of data, holes and all
+            try {
+                if(size) {
+                    body.send_data_header(size);
+                }
+                sent = file->frames->send_frames(file->fd, *compressed);
+            } catch(net_interface::error& e) {
+                LOG_ERROR("Network error while sending file: " << e.what());
+                sent = false;
+            }
+            crcs = &file->frames->crcs();
+            hashing = false;
+            stored_frames_passed_bytes_.add(file->meta.size);
+        } else if(file->frames) {
+            sent = file->frames->send(file->fd, offset, size, checked);
+        } else if(!whole) {
+            sent = send_file(file->fd, size, checked, file->meta.offset + offset);
+        } else {
+            auto stream = reads_.join(g.name, file);
+            sent = stream->send(checked);
+
+            std::uint64_t hit = stream->page_cache_hit_bytes(), miss = stream->page_cache_miss_bytes();
+            if(hit + miss > 0) {
+                LOG_INFO("Read " << hit + miss << " bytes of " << g.name << " from disk, "
+                         << hit * 100 / (hit + miss) << "% from the page cache.");
+            }
+            if(sent && contents_.cacheable(size) && file->meta.same_version(meta)) {
+                std::shared_ptr<content_cache::contents> contents(new content_cache::contents(file->meta));
+                if(stream->copy_to(contents->data.get())) {
+                    contents_.put(g.name, contents);
+                }
+            }
+        }
+
+        sent = sent && (!compressed || compressed->flush());
+
+        // The client checks what arrived against the CRCs and asks for any blocks that didn't match again
+        std::vector<char> block;
+        auto resend = [&](std::uint64_t off, std::uint64_t n) {
+            bool read = true;
+            if(cached) {
+                block.assign(cached->data.get() + offset + off, cached->data.get() + offset + off + n);
+            } else {
+                block.resize(n);
+                read = file->read(block.data(), n, offset + off);
+            }
+            return read && send_memory(block.data(), n, body) && (!compressed || compressed->flush());
+        };
+        sent = sent && finish_checked_send(*crcs, size, *data_interface, resend);
+        unsigned char hash[blake3_hasher::OUT_LEN];
+        unsigned char const* known = nullptr;
+        if(whole && indexed) {
+            known = meta.hash;
+        } else if(hashing) {
+            hasher.finalize(hash);
+            known = hash;
         }
+        sent = sent && send_content_hash(*data_interface, known);
+        if(sent) {
+            LOG_INFO("Successfully sent file.");
+        } else {
+            LOG_ERROR("File was not sent successfully.");
+            get_metrics_.errors.add();
+        }
+    }
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: server::handle_stats_request $
+   $ Prototype: void server::handle_stats_request(session& sess) { $
+   $ Params: 
+   $    sess: The client's control channel and data channel opener $
+   $ Description:  $ 
+   $       replies to a STATS request with the current metrics
+   ======================================================================== */
+void server::handle_stats_request(session& sess) {
+    scoped_timer t(stats_metrics_.duration);
+    stats_metrics_.requests.add();
+
+    TRACE_SPAN(span, "STATS", "request");
+
+    stats_packet request{sess.control};
+    stats_packet reply{metrics::instance().render()};
+    if(!reply.send(sess.control)) {
+        stats_metrics_.errors.add();
+    }
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: server::handle_hello_request $
+   $ Prototype: void server::handle_hello_request(session& sess) { $
+   $ Params:
+   $    sess: The client's control channel and data channel opener $
+   $ Description:  $
+   $       Settles the codec for file contents on the session's data
+   $       channels: the one the client asked for, unless compression is
+   $       off or the codec is one this server doesn't know
+   ======================================================================== */
+void server::handle_hello_request(session& sess) {
+    hello_packet h{sess.control};
+    codec accepted = CODEC_NONE;
+    if(opts_.compression && (h.codec == CODEC_LZ4 || h.codec == CODEC_DEFLATE)) {
+        accepted = (codec)h.codec;
+    }
+    sess.compression = accepted;
+    sess.compression_level = accepted == CODEC_DEFLATE && h.level >= 1 && h.level <= 9 ? h.level : Z_DEFAULT_COMPRESSION;
+    LOG_INFO("Compressing file contents on this session's data channels with " << codec_name(accepted) << '.');
+
+    std::shared_ptr<dictionary const> latest = dictionaries_.latest();
+    hello_packet reply{accepted, (std::int8_t)sess.compression_level,
+                       accepted != CODEC_NONE && latest ? latest->version : 0};
+    reply.send(sess.control);
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: server::handle_dictionary_request $
+   $ Prototype: void server::handle_dictionary_request(session& sess) { $
+   $ Params:
+   $    sess: The client's control channel and data channel opener $
+   $ Description:  $
+   $       Sends the client a version of the compression dictionary. Small
+   $       files on the session's data channels are compressed against it
+   $       from then on, since the client can now read them.
+   ======================================================================== */
+void server::handle_dictionary_request(session& sess) {
+    dictionary_packet request{sess.control};
+    std::shared_ptr<dictionary const> dict = dictionaries_.find(request.version);
+    if(dict && sess.compression != CODEC_NONE) {
+        sess.dictionary = dict->version;
     }
+    dictionary_packet reply{request.version, dict ? dict->data : std::vector<char>()};
+    reply.send(sess.control);
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: server::compress_channel $
+   $ Prototype: std::unique_ptr<compressed_net_interface> server::compress_channel(session const& sess, net_interface& data) { $
+   $ Params:
+   $    sess: The session the data channel belongs to $
+   $    data: The data channel
+   $ Description:  $
+   $       Wraps the channel for a file's contents if the session asked for
+   $       them to be compressed. Status bytes still go on data itself.
+   ======================================================================== */
+std::unique_ptr<compressed_net_interface> server::compress_channel(session const& sess, net_interface& data) {
+    if(sess.compression == CODEC_NONE) {
+        return nullptr;
+    }
+    return std::unique_ptr<compressed_net_interface>(
+        new compressed_net_interface(data, sess.compression, sess.compression_level,
+                                     dictionaries_.find(sess.dictionary), &dictionaries_));
 }
 
 /* ========================================================================
@@ -188,51 +1979,154 @@ void server::handle_get_request(net_interface& control_interface) {
    $ Prototype: void server::start() { $
    $ Params: 
    $ Description:  $
-   $     Starts the server by setting up the contorl sockets,
-   $     and handles the client commands
+   $     Starts the server by setting up the contorl sockets, and serves
+   $     each client that connects on a thread of its own so that one slow
+   $     transfer doesn't hold up everyone else. Returns once stop() has
+   $     been called and every client has disconnected.
    ======================================================================== */
 void server::start() {
-    for(;;) {
+    while(!stopping_) {
         // Accept client's connection on control port (7005)
-        tcp::socket control_sock(service_);
-        acceptor_.listen();
-        acceptor_.accept(control_sock);      
+        std::shared_ptr<tcp::socket> control_sock(new tcp::socket(service_));
+        acceptor_.accept(*control_sock);
+        if(stopping_) {
+            break;
+        }
+
+        sessions_.add();
+        {
+            std::lock_guard<std::mutex> lock(sessions_mutex_);
+            ++active_sessions_;
+        }
+        active_sessions_gauge_.add(1);
+        std::thread(&server::run_session, this, std::move(control_sock)).detach();
+    }
+
+    std::unique_lock<std::mutex> lock(sessions_mutex_);
+    sessions_done_.wait(lock, [this] { return active_sessions_ == 0; });
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: server::run_session $
+   $ Prototype: void server::run_session(std::shared_ptr<boost::asio::ip::tcp::socket> control_sock) { $
+   $ Params: 
+   $    control_sock: The client's control connection $
+   $ Description:  $
+   $     Serves one client accepted by start(), on its own thread.
+   ======================================================================== */
+void server::run_session(std::shared_ptr<tcp::socket> control_sock) {
+    {
+        TRACE_SPAN(span, "session", "session");
+        system::error_code ec;
+        std::string client = control_sock->remote_endpoint(ec).address().to_string();
+        span.arg("client", client);
+        LOG_INFO("Accepted connection from " << client << " on control channel (port " << CONTROL_PORT << ").");
 
-        std::cout << "Accepted connection from " << control_sock.remote_endpoint().address().to_string() << " on control channel (port " << CONTROL_PORT << ")." << std::endl;
-        
         // Wrap the socket objects in a net_interface; we'll later swap this out for an
         // interface that performs additional packetizing for the final project
-        boost_net_interface control_interface(control_sock);
+        boost_net_interface control_interface(*control_sock);
+        session sess{control_interface, [this, &control_sock] {
+            std::unique_ptr<socket_net_interface> data(new socket_net_interface(service_));
+            connect_to_data_channel(*control_sock, data->socket());
+            return std::unique_ptr<net_interface>(std::move(data));
+        }};
 
-        // Read packets from the control socket until the client disconnects
-        packet_type pt;
-        bool connected = true;
-        while(connected) {
-            try {
-                control_interface.receive(&pt, sizeof(packet_type));
-                switch(pt) {
-                    case SEND:
-                        handle_send_request(control_interface);
-                        break;
-                    case GET:
-                        handle_get_request(control_interface);
-                        break;
-                    default:
-                        break;
-                }
-            } catch(net_interface::error& err) {
-                // Client disconnected
-                if(net_interface::error_code::eof == err.code() ||
-                   net_interface::error_code::reset == err.code()) {
-                    std::cout << "Client disconnected. Waiting for new client..." << std::endl;
-                    connected = false;
-                } else {
-                    std::cerr << "Error while reading from socket: " << err.what() << std::endl;
-                    std::cerr << "Exiting..." << std::endl;
-                    return;
-                }
-                    
+        if(serve_session(sess)) {
+            LOG_INFO("Client " << client << " disconnected.");
+        } else {
+            LOG_ERROR("Dropped client " << client << " after an unexpected error.");
+        }
+        control_sock.reset();
+    }
+
+    // start() may return (and the server go away) as soon as this is done
+    active_sessions_gauge_.add(-1);
+    std::lock_guard<std::mutex> lock(sessions_mutex_);
+    if(--active_sessions_ == 0) {
+        sessions_done_.notify_all();
+    }
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: server::serve_session $
+   $ Prototype: bool server::serve_session(session& sess) { $
+   $ Params: 
+   $    sess: The client's control channel and data channel opener $
+   $ Description:  $
+   $     Reads requests from the control channel and handles them until
+   $     the client disconnects
+   ======================================================================== */
+bool server::serve_session(session& sess) {
+    // Read packets from the control socket until the client disconnects
+    packet_type pt;
+    for(;;) {
+        try {
+            sess.control.receive(&pt, sizeof(packet_type));
+            switch(pt) {
+                case SEND:
+                    handle_send_request(sess);
+                    break;
+                case GET:
+                    handle_get_request(sess);
+                    break;
+                case STATS:
+                    handle_stats_request(sess);
+                    break;
+                case OFFER:
+                    handle_offer_request(sess);
+                    break;
+                case CHUNKS:
+                    handle_chunks_request(sess);
+                    break;
+                case SIGNATURES:
+                    handle_signatures_request(sess);
+                    break;
+                case DELTA:
+                    handle_delta_request(sess);
+                    break;
+                case HELLO:
+                    handle_hello_request(sess);
+                    break;
+                case DICTIONARY:
+                    handle_dictionary_request(sess);
+                    break;
+                default:
+                    break;
             }
+        } catch(net_interface::error& err) {
+            // Client disconnected
+            if(net_interface::error_code::eof == err.code() ||
+               net_interface::error_code::reset == err.code()) {
+                return true;
+            } else {
+                LOG_ERROR("Error while reading from socket: " << err.what());
+                return false;
+            }
+        } catch(std::exception& e) {
+            // Anything else a request throws (running out of memory, say) ends just this session
+            LOG_ERROR("Error while handling a request: " << e.what());
+            return false;
         }
     }
 }
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: server::stop $
+   $ Prototype: void server::stop() { $
+   $ Params: 
+   $ Description:  $
+   $     Makes start() stop accepting clients and return once the current
+   $     ones disconnect. Safe to call from another thread.
+   ======================================================================== */
+void server::stop() {
+    stopping_ = true;
+
+    // Wake up the accept() call in start() with a throwaway connection
+    asio::io_service service;
+    tcp::socket sock(service);
+    system::error_code ec;
+    sock.connect(tcp::endpoint(address_v4::loopback(), CONTROL_PORT), ec);
+}
@@ -0,0 +1,104 @@
+/* ========================================================================
+   $File: storage_layout.cpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/13 $
+   $Description: $ Flat and hash-prefix sharded file placement
+   $Revisions: $
+   ======================================================================== */
+#include <util/blake3.hpp>
+#include <server/storage_layout.h>
+
+// The server saves its file index as INDEX_FILE (and INDEX_FILE + ".tmp" while writing it)
+static const char INDEX_FILE[] = ".file_index";
+
+// ...and the chunk index (see chunk_index) as CHUNK_INDEX_FILE, similarly
+static const char CHUNK_INDEX_FILE[] = ".chunk_index";
+
+const char storage_layout::TEMP_PREFIX[] = ".upload.";
+
+// Every shard directory is under this one
+static const std::string SHARD_ROOT = ".shards";
+
+const char storage_layout::PACK_DIR[] = ".packs";
+const char storage_layout::OBJECT_DIR[] = ".objects";
+const char storage_layout::DICTIONARY_DIR[] = ".dictionaries";
+
+// Whether s has two lowercase hex digits at pos
+static bool is_hex_pair(std::string const& s, std::size_t pos) {
+    for(std::size_t i = pos; i < pos + 2; ++i) {
+        char c = s[i];
+        if(!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string storage_layout::shard_dir(std::string const& name) {
+    blake3_hasher hasher;
+    hasher.update(name.data(), name.size());
+    unsigned char hash[blake3_hasher::OUT_LEN];
+    hasher.finalize(hash);
+
+    std::string hex = blake3_hasher::to_hex(hash);
+    return SHARD_ROOT + '/' + hex.substr(0, 2) + '/' + hex.substr(2, 2);
+}
+
+std::string storage_layout::relative_path(std::string const& name, bool sharded) {
+    return sharded ? shard_dir(name) + '/' + name : name;
+}
+
+std::string storage_layout::pack_path(std::uint32_t pack) {
+    return std::string(PACK_DIR) + '/' + std::to_string(pack);
+}
+
+std::string storage_layout::dictionary_path(std::uint32_t version) {
+    return std::string(DICTIONARY_DIR) + '/' + std::to_string(version);
+}
+
+std::string storage_layout::object_path(unsigned char const* hash) {
+    std::string hex = blake3_hasher::to_hex(hash);
+    return std::string(OBJECT_DIR) + '/' + hex.substr(0, 2) + '/' + hex;
+}
+
+bool storage_layout::parse(std::string const& relative, std::string& name, bool& sharded) {
+    std::size_t slash = relative.find('/');
+    if(slash == std::string::npos) {
+        name = relative;
+        sharded = false;
+        return !name.empty();
+    }
+
+    // Must be exactly .shards/xx/yy/name, and xx/yy must be name's shard
+    std::size_t prefix = SHARD_ROOT.size() + 7;
+    if(relative.size() <= prefix || !is_shard_dir(relative.substr(0, prefix - 1)) || relative[prefix - 1] != '/'
+       || relative.find('/', prefix) != std::string::npos) {
+        return false;
+    }
+    name = relative.substr(prefix);
+    sharded = true;
+    return relative.compare(0, prefix - 1, shard_dir(name)) == 0;
+}
+
+bool storage_layout::is_shard_dir(std::string const& relative) {
+    std::size_t n = SHARD_ROOT.size();
+    if(relative.compare(0, n, SHARD_ROOT) != 0) {
+        return false;
+    }
+    if(relative.size() == n) {
+        return true;
+    }
+    if(relative.size() == n + 3) {
+        return relative[n] == '/' && is_hex_pair(relative, n + 1);
+    }
+    return relative.size() == n + 6 && relative[n] == '/' && relative[n + 3] == '/'
+           && is_hex_pair(relative, n + 1) && is_hex_pair(relative, n + 4);
+}
+
+bool storage_layout::is_reserved(std::string const& name) {
+    return name.compare(0, sizeof(INDEX_FILE) - 1, INDEX_FILE) == 0
+           || name.compare(0, sizeof(CHUNK_INDEX_FILE) - 1, CHUNK_INDEX_FILE) == 0 || name == SHARD_ROOT || name == PACK_DIR
+           || name == OBJECT_DIR || name == DICTIONARY_DIR
+           || name.compare(0, sizeof(TEMP_PREFIX) - 1, TEMP_PREFIX) == 0;
+}
@@ -0,0 +1,304 @@
+/* ========================================================================
+   $File: stored_frames.cpp $
+   $Program: $
+   $Developer: Shane Spoor $
+   $Created On: 2016/10/19 $
+   $Description: $ Files stored compressed in independently readable frames
+   $Revisions: $
+   ======================================================================== */
+#include <algorithm>
+#include <cstring>
+#include <server/stored_frames.h>
+#include <util/file_transfer.hpp>
+#include <util/log.hpp>
+
+struct file_header {
+    std::uint32_t magic;
+    std::uint8_t codec;         // What the frames were compressed with (some may not be)
+    std::uint8_t reserved[3];
+    std::uint64_t size;         // Of the contents
+};
+
+// The index has one of these for each frame
+struct index_entry {
+    std::uint64_t offset;
+    std::uint32_t crc;          // Of the frame's contents
+    std::uint32_t reserved;
+};
+
+// After the index
+struct file_trailer {
+    std::uint64_t index;        // Where the index starts
+    std::uint32_t frames;
+    std::uint32_t magic;
+};
+
+const std::size_t stored_frames::FRAME_SIZE;
+
+static_assert(compressed_net_interface::FRAME_SIZE == checked_net_interface::BLOCK_SIZE,
+              "Stored frames' CRCs have to be those of checked_net_interface's blocks");
+
+static const std::uint32_t FILE_MAGIC = 0x4d52465a; // "ZFRM"
+
+// Frames are read from disk this many bytes at a time (or a frame at a time if they're bigger)
+static const std::uint64_t READ_BATCH = 1024 * 1024;
+
+// Writes what's sent to it to a file, one after the other, noting where each send started
+class file_sink : public net_interface {
+public:
+    file_sink(int fd, std::uint64_t pos) : fd_(fd), pos_(pos) {}
+
+    virtual void send(void* buf, size_t size) {
+        starts_.push_back(pos_);
+        if(!write_file(fd_, (char const*)buf, size, pos_)) {
+            throw net_interface::error("Couldn't write a compressed file", net_interface::error_code::other);
+        }
+        pos_ += size;
+    }
+
+    virtual void receive(void*, size_t) {
+        throw net_interface::error("A compressed file is only written", net_interface::error_code::other);
+    }
+
+    std::uint64_t position() const { return pos_; }
+    std::vector<std::uint64_t> const& starts() const { return starts_; }
+
+private:
+    int fd_;
+    std::uint64_t pos_;
+    std::vector<std::uint64_t> starts_;
+};
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: stored_frames::write $
+   $ Prototype: bool stored_frames::write(int from, std::uint64_t size, int to, codec c, int level, std::uint64_t& stored) { $
+   $ Params:
+   $    from: The contents $
+   $    size: Their size $
+   $    to: An empty file to write the compressed version to $
+   $    c: The codec $
+   $    level: Its level, for CODEC_DEFLATE $
+   $    stored: Set to the compressed file's size
+   $ Description:  $
+   $    The frames are made by a compressed_net_interface writing to the
+   $    file, so they're compressed on the same pool, skip what won't
+   $    shrink the same way and are exactly what it would send.
+   ======================================================================== */
+bool stored_frames::write(int from, std::uint64_t size, int to, codec c, int level, std::uint64_t& stored) {
+    file_header h;
+    std::memset(&h, 0, sizeof(h));
+    h.magic = FILE_MAGIC;
+    h.codec = c;
+    h.size = size;
+    if(!write_file(to, (char const*)&h, sizeof(h), 0)) {
+        return false;
+    }
+
+    file_sink sink(to, sizeof(h));
+    std::vector<std::uint32_t> crcs;
+    {
+        compressed_net_interface frames(sink, c, level);
+        std::vector<char> buf(std::min<std::uint64_t>(READ_BATCH, std::max<std::uint64_t>(size, 1)));
+        try {
+            for(std::uint64_t off = 0; off < size; off += buf.size()) {
+                std::uint64_t n = std::min<std::uint64_t>(buf.size(), size - off);
+                if(!read_file(from, buf.data(), n, off)) {
+                    return false;
+                }
+                for(std::uint64_t b = 0; b < n; b += FRAME_SIZE) {
+                    crcs.push_back(crc32c::compute(buf.data() + b, std::min<std::uint64_t>(FRAME_SIZE, n - b)));
+                }
+                frames.send(buf.data(), n);
+            }
+        } catch(net_interface::error& e) {
+            LOG_ERROR(e.what());
+            return false;
+        }
+        if(!frames.flush()) {
+            return false;
+        }
+    }
+
+    file_trailer t;
+    std::memset(&t, 0, sizeof(t));
+    t.index = sink.position();
+    t.frames = sink.starts().size();
+    t.magic = FILE_MAGIC;
+    if(crcs.size() != t.frames) {
+        LOG_ERROR("A compressed file came out with " << t.frames << " frames rather than " << crcs.size() << '.');
+        return false;
+    }
+    std::vector<index_entry> index(t.frames);
+    for(std::size_t i = 0; i < index.size(); ++i) {
+        index[i].offset = sink.starts()[i];
+        index[i].crc = crcs[i];
+        index[i].reserved = 0;
+    }
+    std::uint64_t index_size = index.size() * sizeof(index_entry);
+    if(!write_file(to, (char const*)index.data(), index_size, t.index)
+       || !write_file(to, (char const*)&t, sizeof(t), t.index + index_size)) {
+        return false;
+    }
+    stored = t.index + index_size + sizeof(t);
+    return true;
+}
+
+bool stored_frames::must_wrap(char const* head, std::size_t size) {
+    std::uint32_t magic = FILE_MAGIC;
+    return size >= sizeof(magic) && std::memcmp(head, &magic, sizeof(magic)) == 0;
+}
+
+/* ========================================================================
+   $ FUNCTION
+   $ Name: stored_frames::open $
+   $ Prototype: std::shared_ptr<stored_frames const> stored_frames::open(int fd, std::uint64_t size) { $
+   $ Params:
+   $    fd: A stored file $
+   $    size: Its size
+   $ Description:  $
+   $    A plain file costs one small read to tell apart. The index has to
+   $    account for the whole file and every frame, in order, for the file
+   $    to count as compressed.
+   ======================================================================== */
+std::shared_ptr<stored_frames const> stored_frames::open(int fd, std::uint64_t size) {
+    file_header h;
+    file_trailer t;
+    if(size < sizeof(h) + sizeof(t) || !read_file(fd, (char*)&h, sizeof(h), 0) || h.magic != FILE_MAGIC
+       || !read_file(fd, (char*)&t, sizeof(t), size - sizeof(t)) || t.magic != FILE_MAGIC) {
+        return nullptr;
+    }
+    std::uint64_t frames = (h.size + FRAME_SIZE - 1) / FRAME_SIZE;
+    if(t.frames != frames || t.index < sizeof(h) || t.index + frames * sizeof(index_entry) + sizeof(t) != size) {
+        return nullptr;
+    }
+
+    std::vector<index_entry> index(frames);
+    if(!read_file(fd, (char*)index.data(), frames * sizeof(index_entry), t.index)) {
+        return nullptr;
+    }
+    std::shared_ptr<stored_frames> f(new stored_frames());
+    f->size_ = h.size;
+    f->codec_ = (codec)h.codec;
+    f->offsets_.resize(frames + 1);
+    f->crcs_.resize(frames);
+    for(std::uint64_t i = 0; i < frames; ++i) {
+        f->offsets_[i] = index[i].offset;
+        f->crcs_[i] = index[i].crc;
+    }
+    f->offsets_[frames] = t.index;
+    std::uint64_t expected = sizeof(h);
+    std::uint64_t header = sizeof(compressed_net_interface::frame_header);
+    for(std::uint64_t i = 0; i < frames; ++i) {
+        if(f->offsets_[i] != expected || f->offsets_[i + 1] < expected + header
+           || f->offsets_[i + 1] - expected > header + lz4::bound(FRAME_SIZE)) {
+            return nullptr;
+        }
+        expected = f->offsets_[i + 1];
+    }
+    return f;
+}
+
+bool stored_frames::read_frame(int fd, std::size_t i, std::vector<char>& stored, std::vector<char>& out) const {
+    compressed_net_interface::frame_header h;
+    stored.resize(offsets_[i + 1] - offsets_[i]);
+    if(!read_file(fd, stored.data(), stored.size(), offsets_[i])) {
+        return false;
+    }
+    std::memcpy(&h, stored.data(), sizeof(h));
+    std::uint64_t raw = std::min<std::uint64_t>(FRAME_SIZE, size_ - i * FRAME_SIZE);
+    if(h.raw_size != raw || h.stored_size != stored.size() - sizeof(h) || h.dictionary
+       || (h.codec == CODEC_NONE && h.stored_size != raw)) {
+        LOG_ERROR("Frame " << i << " of a compressed file is malformed.");
+        return false;
+    }
+
+    out.resize(raw);
+    bool ok = true;
+    if(h.codec == CODEC_NONE) {
+        std::memcpy(out.data(), stored.data() + sizeof(h), raw);
+    } else {
+        std::uint64_t start = thread_cpu_ns();
+        ok = decompress_frame((codec)h.codec, stored.data() + sizeof(h), h.stored_size, out.data(), raw);
+        compression_metrics::get().decompress_cpu.record(thread_cpu_ns() - start);
+    }
+    if(!ok || crc32c::compute(out.data(), raw) != crcs_[i]) {
+        LOG_ERROR("Frame " << i << " of a compressed file is corrupt.");
+        return false;
+    }
+    return true;
+}
+
+bool stored_frames::read(int fd, char* buf, std::uint64_t size, std::uint64_t offset) const {
+    if(offset > size_ || size > size_ - offset) {
+        return false;
+    }
+    std::vector<char> stored, raw;
+    while(size) {
+        std::uint64_t skip = offset % FRAME_SIZE;
+        if(!read_frame(fd, offset / FRAME_SIZE, stored, raw)) {
+            return false;
+        }
+        std::uint64_t n = std::min<std::uint64_t>(size, raw.size() - skip);
+        std::memcpy(buf, raw.data() + skip, n);
+        buf += n;
+        offset += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool stored_frames::send(int fd, std::uint64_t offset, std::uint64_t size, net_interface& out) const {
+    if(offset > size_ || size > size_ - offset) {
+        return false;
+    }
+    TRACE_SPAN(span, "send_stored_frames", "transfer");
+    span.arg("bytes", size);
+
+    std::vector<char> stored, raw;
+    while(size) {
+        std::uint64_t skip = offset % FRAME_SIZE;
+        if(!read_frame(fd, offset / FRAME_SIZE, stored, raw)) {
+            return false;
+        }
+        std::uint64_t n = std::min<std::uint64_t>(size, raw.size() - skip);
+        if(!send_memory(raw.data() + skip, n, out)) {
+            return false;
+        }
+        offset += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool stored_frames::send_frames(int fd, compressed_net_interface& out) const {
+    TRACE_SPAN(span, "pass_stored_frames", "transfer");
+    span.arg("bytes", offsets_.back() - offsets_.front());
+
+    std::vector<char> buf;
+    transfer_metrics& m = transfer_metrics::get();
+    std::size_t frames = offsets_.size() - 1;
+    for(std::size_t i = 0; i < frames;) {
+        // As many whole frames as fit in a batch, and at least one
+        std::size_t end = i + 1;
+        while(end < frames && offsets_[end + 1] - offsets_[i] <= READ_BATCH) {
+            ++end;
+        }
+        buf.resize(offsets_[end] - offsets_[i]);
+        if(!read_file(fd, buf.data(), buf.size(), offsets_[i])) {
+            return false;
+        }
+        try {
+            scoped_timer t(m.net_send);
+            for(std::size_t j = i; j < end; ++j) {
+                out.send_stored(buf.data() + (offsets_[j] - offsets_[i]), offsets_[j + 1] - offsets_[j]);
+            }
+        } catch(net_interface::error& e) {
+            LOG_ERROR("Network error while sending file: " << e.what());
+            return false;
+        }
+        m.bytes_sent.add(buf.size());
+        i = end;
+    }
+    return true;
+}